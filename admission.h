@@ -0,0 +1,209 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+// Per-peer admission control for the echo server (server11 -A, -a).
+//
+// Each peer (source address, or address and port with -p) gets a token bucket
+// in GCRA form: one "theoretical arrival time" that advances by the peer's
+// interval for every datagram admitted and may run at most the bucket's
+// capacity ahead of the clock. A check is a hash, a probe over 32-byte entries
+// and one compare-and-swap on the peer's own entry, so workers sharing a
+// socket need no lock and only contend on a peer they both receive from.
+//
+// The table never shrinks: an entry whose bucket has been full for
+// ADMIT_IDLE_NS (or whose unlimited peer has been silent at least that long)
+// may be taken over by a new peer. A peer that finds no entry within
+// ADMIT_PROBE slots shares one overflow bucket at the default limit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+
+#define ADMIT_BITS 16
+#define ADMIT_SLOTS (1u << ADMIT_BITS)
+#define ADMIT_PROBE 16                      // Slots tried before a peer falls back to the overflow bucket
+#define ADMIT_IDLE_NS 10000000000ull        // A bucket full this long frees its entry for another peer
+#define ADMIT_MAX_RULES 64
+#define ADMIT_KEY_USED (1ull << 48)         // Set in every key, so 0 always means a free entry
+
+// One peer's bucket
+struct admit_entry {
+    _Atomic uint64_t key;    // ADMIT_KEY_USED | address << 16 | port (0 unless keyed by port); 0 = free
+    _Atomic uint64_t tat;    // Theoretical arrival time, CLOCK_MONOTONIC ns
+    uint64_t interval_ns;    // Time one datagram costs; 0 = unlimited
+    uint64_t capacity_ns;    // How far 'tat' may run ahead of now: burst * interval
+};
+
+// A limit for one peer (-a); port 0 matches every port of the address
+struct admit_rule {
+    uint32_t addr;           // Network byte order
+    uint16_t port;           // Network byte order
+    uint64_t interval_ns;
+    uint64_t capacity_ns;
+};
+
+static struct {
+    struct admit_entry *table;  // NULL = admission control off
+    struct admit_entry overflow;
+    uint64_t interval_ns;       // Default limit
+    uint64_t capacity_ns;
+    int by_port;                // Key on address and port instead of address alone
+    int deprioritize;           // Echo over-limit datagrams while the receive queue is idle
+    struct admit_rule rules[ADMIT_MAX_RULES];
+    int num_rules;
+} admission;
+
+// Parse "rate[:burst]" (datagrams per second, datagrams; burst defaults to a
+// tenth of a second's worth). A rate of 0 means unlimited.
+static inline int admission_parse_limit(const char *text, uint64_t *interval_ns, uint64_t *capacity_ns) {
+    char *end;
+    double rate = strtod(text, &end);
+    double burst = rate / 10;
+    if (end == text || rate < 0) {
+        return -1;
+    }
+    if (*end == ':') {
+        const char *b = end + 1;
+        burst = strtod(b, &end);
+        if (end == b || burst < 1) {
+            return -1;
+        }
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    if (burst < 1) {
+        burst = 1;
+    }
+    *interval_ns = rate > 0 ? (uint64_t)(1e9 / rate) : 0;
+    if (rate > 0 && *interval_ns == 0) {
+        *interval_ns = 1;  // Above 10^9 per second: as good as unlimited
+    }
+    *capacity_ns = (uint64_t)(burst * *interval_ns);
+    return 0;
+}
+
+// Parse and add "address[:port]=rate[:burst]"
+static inline int admission_add_rule(const char *text) {
+    char peer[INET_ADDRSTRLEN + 6];  // "a.b.c.d:port"
+    const char *eq = strchr(text, '=');
+    if (eq == NULL || admission.num_rules == ADMIT_MAX_RULES) {
+        return -1;
+    }
+    size_t len = (size_t)(eq - text);
+    if (len == 0 || len >= sizeof(peer)) {
+        return -1;
+    }
+    memcpy(peer, text, len);
+    peer[len] = '\0';
+
+    struct admit_rule *r = &admission.rules[admission.num_rules];
+    char *colon = strchr(peer, ':');
+    long port = 0;
+    if (colon != NULL) {
+        char *end;
+        *colon = '\0';
+        port = strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end != '\0' || port < 1 || port > 65535) {
+            return -1;
+        }
+    }
+    if (inet_pton(AF_INET, peer, &r->addr) != 1 ||
+        admission_parse_limit(eq + 1, &r->interval_ns, &r->capacity_ns) < 0) {
+        return -1;
+    }
+    r->port = htons((uint16_t)port);
+    admission.num_rules++;
+    return 0;
+}
+
+// The limit of a new peer: an address-and-port rule, else an address rule, else the default
+static inline void admission_limit_of(uint64_t key, uint64_t *interval_ns, uint64_t *capacity_ns) {
+    uint32_t addr = (uint32_t)(key >> 16);
+    uint16_t port = (uint16_t)key;
+    const struct admit_rule *match = NULL;
+    for (int i = 0; i < admission.num_rules; i++) {
+        const struct admit_rule *r = &admission.rules[i];
+        if (r->addr == addr && (r->port == port || (r->port == 0 && match == NULL))) {
+            match = r;
+        }
+    }
+    *interval_ns = match != NULL ? match->interval_ns : admission.interval_ns;
+    *capacity_ns = match != NULL ? match->capacity_ns : admission.capacity_ns;
+}
+
+// The peer's entry, claiming a free or idle one on its first datagram.
+// *overflow is set when the table had no room near the peer's home slot.
+static inline struct admit_entry *admission_entry(uint64_t key, uint64_t now_ns, int *overflow) {
+    unsigned int i = (unsigned int)((key * 0x9E3779B97F4A7C15ull) >> (64 - ADMIT_BITS));
+    for (unsigned int probe = 0; probe < ADMIT_PROBE; probe++, i = (i + 1) & (ADMIT_SLOTS - 1)) {
+        struct admit_entry *e = &admission.table[i];
+        uint64_t k = atomic_load_explicit(&e->key, memory_order_acquire);
+        if (k == key) {
+            return e;
+        }
+        if (k != 0 && atomic_load_explicit(&e->tat, memory_order_relaxed) + ADMIT_IDLE_NS > now_ns) {
+            continue;
+        }
+        // Free or idle: claim it. A racing peer may read the old limit for a datagram or two.
+        if (atomic_compare_exchange_strong_explicit(&e->key, &k, key, memory_order_acq_rel, memory_order_acquire)) {
+            admission_limit_of(key, &e->interval_ns, &e->capacity_ns);
+            atomic_store_explicit(&e->tat, now_ns, memory_order_relaxed);
+            return e;
+        }
+        if (k == key) {
+            return e;  // Another thread inserted this peer first
+        }
+    }
+    *overflow = 1;
+    return &admission.overflow;
+}
+
+// Whether 'count' datagrams from peer_addr:peer_port (network byte order) fit
+// the peer's bucket at 'now_ns'; takes their tokens if so
+static inline int admission_check(uint32_t peer_addr, uint16_t peer_port, unsigned int count, uint64_t now_ns,
+                                  int *overflow) {
+    uint64_t key = ADMIT_KEY_USED | (uint64_t)peer_addr << 16 | (admission.by_port ? peer_port : 0);
+    struct admit_entry *e = admission_entry(key, now_ns, overflow);
+    if (e->interval_ns == 0) {
+        // Unlimited peers never spend 'tat'; move it up now and then so an active
+        // one never looks idle and loses its entry (and its rule) to a newcomer
+        if (atomic_load_explicit(&e->tat, memory_order_relaxed) + ADMIT_IDLE_NS / 2 < now_ns) {
+            atomic_store_explicit(&e->tat, now_ns, memory_order_relaxed);
+        }
+        return 1;
+    }
+    uint64_t cost = count * e->interval_ns;
+    uint64_t tat = atomic_load_explicit(&e->tat, memory_order_relaxed);
+    while (1) {
+        uint64_t base = tat > now_ns ? tat : now_ns;
+        if (base + cost - now_ns > e->capacity_ns) {
+            return 0;
+        }
+        if (atomic_compare_exchange_weak_explicit(&e->tat, &tat, base + cost, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            return 1;
+        }
+    }
+}
+
+// Enable admission control with the default limit already parsed into
+// admission.interval_ns / capacity_ns and any rules added
+static inline int admission_start(int by_port, int deprioritize) {
+    admission.table = aligned_alloc(64, ADMIT_SLOTS * sizeof(struct admit_entry));
+    if (admission.table == NULL) {
+        perror("aligned_alloc failed");
+        return -1;
+    }
+    memset(admission.table, 0, ADMIT_SLOTS * sizeof(struct admit_entry));
+    admission.by_port = by_port;
+    admission.deprioritize = deprioritize;
+    admission.overflow.interval_ns = admission.interval_ns;
+    admission.overflow.capacity_ns = admission.capacity_ns;
+    return 0;
+}
+
+#endif // ADMISSION_H
@@ -0,0 +1,227 @@
+#!/usr/bin/env python3
+"""Loopback benchmark harness for server11 and server12.
+
+Each profile in bench_profiles.json starts a server on 127.0.0.1, runs one
+client against it and stops the server. The client reports throughput and
+latency percentiles as JSON (client11c -J, client12 -J). The server's CPU time
+and context switches come from wait4() once it exits. Results are written as a
+JSON baseline. With --baseline, each metric is compared with an earlier run,
+and the harness exits with status 1 if any metric got worse by more than
+--threshold percent.
+
+Everything runs locally; no network access is needed.
+"""
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+ECHO_PORT = 10010
+CALC_PORT = 10020
+READY_TIMEOUT = 5.0
+CLIENT_TIMEOUT = 300
+
+# Metric name -> True if a larger value is better
+METRICS = {
+    "throughput": True,
+    "p50_us": False,
+    "p99_us": False,
+    "p99_9_us": False,
+    "server_cpu_ns_per_op": False,
+    "server_ctx_switches_per_op": False,
+}
+
+
+def wait_ready(server, profile):
+    """Wait until the server accepts TCP connections, or give a UDP server a moment to bind."""
+    deadline = time.monotonic() + READY_TIMEOUT
+    if os.path.basename(profile["server"][0]).startswith("server12"):
+        while time.monotonic() < deadline:
+            if server.poll() is not None:
+                break
+            try:
+                socket.create_connection(("127.0.0.1", CALC_PORT), timeout=0.2).close()
+                return True
+            except OSError:
+                time.sleep(0.05)
+    else:
+        time.sleep(0.3)
+    return server.poll() is None
+
+
+def stop_server(server):
+    """Terminate the server and return its resource usage."""
+    if server.poll() is None:
+        server.send_signal(signal.SIGTERM)
+    _, status, usage = os.wait4(server.pid, 0)
+    server.returncode = status
+    return usage
+
+
+def echo_results(report):
+    """Metrics from a client11c -J report."""
+    rtt = report["rtt_ns"]
+    sent = report["sent"] or 1
+    return [("", {
+        "ops": report["received"],
+        "throughput": report["achieved_rate"] * report["received"] / sent,
+        "p50_us": rtt["p50"] / 1e3,
+        "p99_us": rtt["p99"] / 1e3,
+        "p99_9_us": rtt["p99_9"] / 1e3,
+        "max_us": rtt["max"] / 1e3,
+        "lost": report["missing"],
+        "errors": 0,
+    })]
+
+
+def calc_results(report):
+    """Metrics from a client12 -J report, one entry per run of a sweep."""
+    runs = report["runs"]
+    results = []
+    for run in runs:
+        latency = run["latency_ns"]
+        suffix = "" if len(runs) == 1 else "/c%d" % run["connections"]
+        results.append((suffix, {
+            "ops": run["completed"],
+            "throughput": run["throughput"],
+            "p50_us": latency["p50"] / 1e3,
+            "p99_us": latency["p99"] / 1e3,
+            "p99_9_us": latency["p99_9"] / 1e3,
+            "max_us": latency["max"] / 1e3,
+            "lost": run["sent"] - run["completed"],
+            "errors": run["mismatched"] + run["errors"],
+        }))
+    return results
+
+
+def run_profile(profile, workdir):
+    json_path = os.path.join(workdir, profile["name"] + ".json")
+    client_cmd = [json_path if arg == "{json}" else arg for arg in profile["client"]]
+
+    server = subprocess.Popen(profile["server"], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        if not wait_ready(server, profile):
+            raise RuntimeError("server did not start: %s" % " ".join(profile["server"]))
+        client = subprocess.run(client_cmd, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+                                timeout=CLIENT_TIMEOUT, check=False)
+    finally:
+        usage = stop_server(server)
+
+    if not os.path.exists(json_path):
+        raise RuntimeError("client wrote no report (exit %d): %s" % (client.returncode, client.stderr.decode().strip()))
+    with open(json_path) as f:
+        report = json.load(f)
+    results = calc_results(report) if "runs" in report else echo_results(report)
+
+    # Server cost is shared out over every operation the profile completed
+    total_ops = sum(metrics["ops"] for _, metrics in results) or 1
+    cpu_ns = (usage.ru_utime + usage.ru_stime) * 1e9
+    switches = usage.ru_nvcsw + usage.ru_nivcsw
+    for _, metrics in results:
+        metrics["server_cpu_ns_per_op"] = cpu_ns / total_ops
+        metrics["server_ctx_switches_per_op"] = switches / total_ops
+        metrics["server_voluntary_ctx_switches"] = usage.ru_nvcsw
+        metrics["server_involuntary_ctx_switches"] = usage.ru_nivcsw
+        metrics["client_exit"] = client.returncode
+    return results
+
+
+def git_revision():
+    try:
+        return subprocess.run(["git", "rev-parse", "--short", "HEAD"], capture_output=True, text=True,
+                              check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def compare(current, baseline, threshold):
+    """Print a comparison table; return the number of regressions beyond 'threshold' percent."""
+    regressions = 0
+    print("\n%-32s %-28s %14s %14s %9s" % ("profile", "metric", "baseline", "current", "change"))
+    for name, metrics in current.items():
+        old = baseline.get(name)
+        if old is None:
+            print("%-32s (no baseline)" % name)
+            continue
+        for metric, higher_is_better in METRICS.items():
+            if metric not in metrics or metric not in old or old[metric] == 0:
+                continue
+            change = (metrics[metric] - old[metric]) / old[metric] * 100
+            worse = -change if higher_is_better else change
+            flag = ""
+            if worse > threshold:
+                flag = "  REGRESSION"
+                regressions += 1
+            print("%-32s %-28s %14.2f %14.2f %+8.1f%%%s" % (name, metric, old[metric], metrics[metric], change, flag))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--profiles", default="bench_profiles.json", help="load profiles to run")
+    parser.add_argument("--only", action="append", help="run only the named profile (repeatable)")
+    parser.add_argument("--out", default="bench-results.json", help="where to write this run's results")
+    parser.add_argument("--baseline", help="earlier results to compare against")
+    parser.add_argument("--threshold", type=float, default=10.0, help="regression threshold in percent")
+    args = parser.parse_args()
+
+    with open(args.profiles) as f:
+        profiles = json.load(f)["profiles"]
+    if args.only:
+        profiles = [p for p in profiles if p["name"] in args.only]
+
+    results = {}
+    failures = 0
+    with tempfile.TemporaryDirectory(prefix="bench-") as workdir:
+        for profile in profiles:
+            print("Running %s ..." % profile["name"], flush=True)
+            try:
+                for suffix, metrics in run_profile(profile, workdir):
+                    name = profile["name"] + suffix
+                    results[name] = metrics
+                    print("  %-30s %10.0f ops/s  p50 %8.1f us  p99 %8.1f us  %7.0f ns CPU/op  %.3f cs/op"
+                          % (name, metrics["throughput"], metrics["p50_us"], metrics["p99_us"],
+                             metrics["server_cpu_ns_per_op"], metrics["server_ctx_switches_per_op"]))
+                    if metrics["errors"] or metrics["client_exit"]:
+                        print("  %s: client reported errors" % name)
+                        failures += 1
+            except (RuntimeError, subprocess.TimeoutExpired, OSError, ValueError, KeyError) as e:
+                print("  %s failed: %s" % (profile["name"], e))
+                failures += 1
+
+    output = {
+        "version": 1,
+        "date": datetime.datetime.now(datetime.timezone.utc).isoformat(timespec="seconds"),
+        "git": git_revision(),
+        "host": {
+            "kernel": platform.release(),
+            "machine": platform.machine(),
+            "cpus": os.cpu_count(),
+        },
+        "profiles": results,
+    }
+    with open(args.out, "w") as f:
+        json.dump(output, f, indent=2, sort_keys=True)
+        f.write("\n")
+    print("Wrote %s" % args.out)
+
+    regressions = 0
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)["profiles"]
+        regressions = compare(results, baseline, args.threshold)
+        print("\n%d regression(s) beyond %.1f%%" % (regressions, args.threshold))
+
+    return 1 if regressions or failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
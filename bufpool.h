@@ -0,0 +1,169 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+// Fixed-size packet buffer pool for the servers' data paths.
+//
+// A pool is one preallocated region of cache-line-aligned slots, optionally
+// backed by explicit huge pages (falling back to transparent ones). It belongs
+// to the thread that created it: that thread takes and returns slots through a
+// plain LIFO free list with no atomics. Any other thread may return a slot too;
+// such returns go onto a lock-free stack that the owner collects in one
+// exchange once its own list runs dry. Creating the pool on a worker that is
+// already pinned places every page on that worker's NUMA node (first touch).
+//
+// A free slot's first four bytes link it to the next free slot by index.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#define BUFPOOL_ALIGN 64               // Slot alignment and size granularity (one cache line)
+#define BUFPOOL_HUGE_PAGE (2ul << 20)  // Explicit huge page size assumed for MAP_HUGETLB
+#define BUFPOOL_NONE UINT32_MAX        // End of a free list
+
+#define BUFPOOL_HUGEPAGES 1  // bufpool_create flag: try MAP_HUGETLB first
+
+struct bufpool {
+    unsigned char *base;
+    size_t slot_size;      // Requested size rounded up to BUFPOOL_ALIGN
+    size_t map_len;
+    uint32_t slots;
+    uint32_t free_head;    // Owner's free list
+    uint32_t in_use;       // Slots handed out and not yet back on the owner's list
+    uint32_t high_water;   // Most slots ever in use at once
+    uint64_t exhausted;    // bufpool_get calls that found no free slot
+    pthread_t owner;
+    int huge;              // Backed by explicit huge pages
+
+    // Slots returned by other threads; on its own line so returns do not
+    // invalidate the owner's fields
+    _Alignas(BUFPOOL_ALIGN) _Atomic uint32_t remote_head;
+};
+
+static inline unsigned char *bufpool_slot(const struct bufpool *p, uint32_t index) {
+    return p->base + (size_t)index * p->slot_size;
+}
+
+static inline uint32_t bufpool_index(const struct bufpool *p, const void *buf) {
+    return (uint32_t)(((const unsigned char *)buf - p->base) / p->slot_size);
+}
+
+static inline uint32_t bufpool_next(const struct bufpool *p, uint32_t index) {
+    uint32_t next;
+    memcpy(&next, bufpool_slot(p, index), sizeof(next));
+    return next;
+}
+
+static inline void bufpool_link(struct bufpool *p, uint32_t index, uint32_t next) {
+    memcpy(bufpool_slot(p, index), &next, sizeof(next));
+}
+
+// Create a pool of 'slots' buffers of at least 'slot_size' bytes, owned by the
+// calling thread. Every page is touched here, so the data path never faults.
+static inline struct bufpool *bufpool_create(uint32_t slots, size_t slot_size, int flags) {
+    static _Atomic int warned;
+    struct bufpool *p = aligned_alloc(BUFPOOL_ALIGN, sizeof(*p));
+    if (p == NULL || slots == 0 || slots == BUFPOOL_NONE) {
+        free(p);
+        return NULL;
+    }
+    memset(p, 0, sizeof(*p));
+    p->slot_size = (slot_size + BUFPOOL_ALIGN - 1) & ~(size_t)(BUFPOOL_ALIGN - 1);
+    p->slots = slots;
+    p->owner = pthread_self();
+    size_t len = p->slot_size * slots;
+
+    p->base = MAP_FAILED;
+    if (flags & BUFPOOL_HUGEPAGES) {
+        p->map_len = (len + BUFPOOL_HUGE_PAGE - 1) & ~(BUFPOOL_HUGE_PAGE - 1);
+        p->base = mmap(NULL, p->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p->base == MAP_FAILED && !atomic_exchange(&warned, 1)) {
+            perror("mmap(MAP_HUGETLB) failed, using transparent huge pages (reserve some in /proc/sys/vm/nr_hugepages)");
+        }
+        p->huge = p->base != MAP_FAILED;
+    }
+    if (p->base == MAP_FAILED) {
+        p->map_len = len;
+        p->base = mmap(NULL, p->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p->base == MAP_FAILED) {
+            perror("mmap failed");
+            free(p);
+            return NULL;
+        }
+        if (flags & BUFPOOL_HUGEPAGES) {
+            madvise(p->base, p->map_len, MADV_HUGEPAGE);
+        }
+    }
+
+    // Thread every slot onto the free list in address order; this touches each one
+    memset(p->base, 0, len);
+    for (uint32_t i = 0; i < slots; i++) {
+        bufpool_link(p, i, i + 1 < slots ? i + 1 : BUFPOOL_NONE);
+    }
+    p->free_head = 0;
+    atomic_init(&p->remote_head, BUFPOOL_NONE);
+    return p;
+}
+
+static inline void bufpool_destroy(struct bufpool *p) {
+    if (p != NULL) {
+        munmap(p->base, p->map_len);
+        free(p);
+    }
+}
+
+// Move every slot other threads returned onto the owner's (empty) free list
+static inline void bufpool_collect(struct bufpool *p) {
+    uint32_t head = atomic_exchange_explicit(&p->remote_head, BUFPOOL_NONE, memory_order_acquire);
+    uint32_t n = 0;
+    for (uint32_t i = head; i != BUFPOOL_NONE; i = bufpool_next(p, i)) {
+        n++;
+    }
+    p->free_head = head;
+    p->in_use -= n;
+}
+
+// Take a slot; owner thread only. Returns NULL when every slot is in use.
+static inline void *bufpool_get(struct bufpool *p) {
+    if (p->free_head == BUFPOOL_NONE) {
+        bufpool_collect(p);
+        if (p->free_head == BUFPOOL_NONE) {
+            p->exhausted++;
+            return NULL;
+        }
+    }
+    uint32_t index = p->free_head;
+    p->free_head = bufpool_next(p, index);
+    if (++p->in_use > p->high_water) {
+        p->high_water = p->in_use;
+    }
+    return bufpool_slot(p, index);
+}
+
+// Return a slot from any thread
+static inline void bufpool_put(struct bufpool *p, void *buf) {
+    uint32_t index = bufpool_index(p, buf);
+    if (pthread_equal(pthread_self(), p->owner)) {
+        bufpool_link(p, index, p->free_head);
+        p->free_head = index;
+        p->in_use--;
+        return;
+    }
+    uint32_t head = atomic_load_explicit(&p->remote_head, memory_order_relaxed);
+    do {
+        bufpool_link(p, index, head);
+    } while (!atomic_compare_exchange_weak_explicit(&p->remote_head, &head, index,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+// Whether 'buf' is one of this pool's slots
+static inline int bufpool_owns(const struct bufpool *p, const void *buf) {
+    const unsigned char *b = buf;
+    return b >= p->base && b < p->base + p->slot_size * p->slots;
+}
+
+#endif // BUFPOOL_H
@@ -0,0 +1,281 @@
+#ifndef CALC_H
+#define CALC_H
+
+// Calculator arithmetic for server12. calc_one() is the reference for a single
+// request; the batch kernels evaluate many operations at once with SSE2 or AVX2
+// and must reproduce its overflow and divide-by-zero rules bit for bit.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CALC_X86 1
+#endif
+
+#define CALC_UNKNOWN 0  // Validity byte for an unknown operator (batch entries only)
+#define CALC_VALID 1
+#define CALC_INVALID 2  // Overflow or division by zero; the result is 0
+
+#define CALC_CHUNK 256  // Operations deinterleaved per kernel call
+
+// Apply operator to the operands with the server's overflow rules.
+// Returns the validity byte (1 valid, 2 invalid) or 0 for an unknown operator.
+static inline unsigned char calc_one(char operator, unsigned int operandA, unsigned int operandB, unsigned int *result) {
+    unsigned char is_valid = CALC_VALID;  // Validity of the answer
+
+    // Perform the operation with overflow detection
+    switch (operator) {
+        case '+':
+            if (operandA > (UINT_MAX - operandB)) {
+                *result = 0;  // Overflow occurred
+                is_valid = CALC_INVALID;  // Set answer as invalid
+            } else {
+                *result = operandA + operandB;
+            }
+            break;
+        case '-':
+            *result = operandA - operandB;
+            break;
+        case 'x':
+            if (operandA > 0 && operandB > 0 && operandA > (UINT_MAX / operandB)) {
+                *result = 0;  // Overflow occurred
+                is_valid = CALC_INVALID;  // Set answer as invalid
+            } else {
+                *result = operandA * operandB;
+            }
+            break;
+        case '/':
+            if (operandB == 0) {
+                *result = 0;  // Set result to 0 in case of invalid operation
+                is_valid = CALC_INVALID;  // Invalid result
+            } else {
+                *result = operandA / operandB;
+            }
+            break;
+        default:
+            *result = 0;
+            return CALC_UNKNOWN;
+    }
+
+    return is_valid;
+}
+
+// Evaluate n operations. If op is non-zero every entry uses it; otherwise entry i
+// uses ops[i]. Results are stored as unaligned 32-bit values in r, validity bytes in v.
+typedef void (*calc_kernel_fn)(char op, const uint8_t *ops, const uint32_t *a, const uint32_t *b,
+                               unsigned char *r, uint8_t *v, size_t n);
+
+static inline void calc_kernel_scalar(char op, const uint8_t *ops, const uint32_t *a, const uint32_t *b,
+                                      unsigned char *r, uint8_t *v, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        unsigned int result;
+        v[i] = calc_one(op ? op : (char)ops[i], a[i], b[i], &result);
+        memcpy(r + i * 4, &result, 4);
+    }
+}
+
+#ifdef CALC_X86
+
+// Unsigned 32-bit division through double precision. For operands below 2^32
+// the rounding error of the quotient is smaller than its distance to the next
+// integer, so truncation gives the exact integer quotient.
+
+__attribute__((target("sse2")))
+static inline __m128i calc_sse2_div(__m128i a, __m128i b) {
+    const __m128i sign = _mm_set1_epi32((int)0x80000000);
+    const __m128d bias = _mm_set1_pd(2147483648.0);
+
+    // Convert unsigned lanes to double: flip the sign bit, convert as signed, add 2^31
+    __m128d a_lo = _mm_add_pd(_mm_cvtepi32_pd(_mm_xor_si128(a, sign)), bias);
+    __m128d a_hi = _mm_add_pd(_mm_cvtepi32_pd(_mm_xor_si128(_mm_srli_si128(a, 8), sign)), bias);
+    __m128d b_lo = _mm_add_pd(_mm_cvtepi32_pd(_mm_xor_si128(b, sign)), bias);
+    __m128d b_hi = _mm_add_pd(_mm_cvtepi32_pd(_mm_xor_si128(_mm_srli_si128(b, 8), sign)), bias);
+    __m128d q_lo = _mm_div_pd(a_lo, b_lo);
+    __m128d q_hi = _mm_div_pd(a_hi, b_hi);
+
+    // Quotients of 2^31 or more (only possible for b == 1) are shifted into signed range first
+    __m128d big_lo = _mm_cmpge_pd(q_lo, bias);
+    __m128d big_hi = _mm_cmpge_pd(q_hi, bias);
+    q_lo = _mm_sub_pd(q_lo, _mm_and_pd(big_lo, bias));
+    q_hi = _mm_sub_pd(q_hi, _mm_and_pd(big_hi, bias));
+    __m128i i = _mm_unpacklo_epi64(_mm_cvttpd_epi32(q_lo), _mm_cvttpd_epi32(q_hi));
+    __m128i big = _mm_unpacklo_epi64(_mm_shuffle_epi32(_mm_castpd_si128(big_lo), _MM_SHUFFLE(3, 3, 2, 0)),
+                                     _mm_shuffle_epi32(_mm_castpd_si128(big_hi), _MM_SHUFFLE(3, 3, 2, 0)));
+    return _mm_xor_si128(i, _mm_and_si128(big, sign));
+}
+
+// Four operations per step; the tail is handled by the scalar reference
+__attribute__((target("sse2")))
+static inline void calc_kernel_sse2(char op, const uint8_t *ops, const uint32_t *a, const uint32_t *b,
+                                    unsigned char *r, uint8_t *v, size_t n) {
+    const __m128i sign = _mm_set1_epi32((int)0x80000000);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    __m128i opv = _mm_set1_epi32((unsigned char)op);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        if (op == 0) {
+            int32_t packed;
+            memcpy(&packed, ops + i, 4);
+            opv = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+        }
+        __m128i is_add = _mm_cmpeq_epi32(opv, _mm_set1_epi32('+'));
+        __m128i is_sub = _mm_cmpeq_epi32(opv, _mm_set1_epi32('-'));
+        __m128i is_mul = _mm_cmpeq_epi32(opv, _mm_set1_epi32('x'));
+        __m128i is_div = _mm_cmpeq_epi32(opv, _mm_set1_epi32('/'));
+
+        // a + b overflows exactly when the sum wraps below a
+        __m128i sum = _mm_add_epi32(va, vb);
+        __m128i add_ovf = _mm_cmpgt_epi32(_mm_xor_si128(va, sign), _mm_xor_si128(sum, sign));
+
+        __m128i diff = _mm_sub_epi32(va, vb);
+
+        // a * b overflows exactly when the high half of the 64-bit product is non-zero,
+        // which matches a > UINT_MAX / b for non-zero operands
+        __m128i even = _mm_mul_epu32(va, vb);
+        __m128i odd = _mm_mul_epu32(_mm_srli_epi64(va, 32), _mm_srli_epi64(vb, 32));
+        __m128i prod = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                                          _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+        __m128i prod_hi = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 3, 1)),
+                                             _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 3, 1)));
+        __m128i mul_ovf = _mm_xor_si128(_mm_cmpeq_epi32(prod_hi, zero), _mm_set1_epi32(-1));
+
+        __m128i div_zero = _mm_cmpeq_epi32(vb, zero);
+        __m128i quot = _mm_setzero_si128();
+        if (op == 0 || op == '/') {
+            quot = calc_sse2_div(va, vb);
+        }
+
+        __m128i res = _mm_or_si128(_mm_or_si128(_mm_and_si128(is_add, sum), _mm_and_si128(is_sub, diff)),
+                                   _mm_or_si128(_mm_and_si128(is_mul, prod), _mm_and_si128(is_div, quot)));
+        __m128i invalid = _mm_or_si128(_mm_or_si128(_mm_and_si128(is_add, add_ovf), _mm_and_si128(is_mul, mul_ovf)),
+                                       _mm_and_si128(is_div, div_zero));
+        __m128i known = _mm_or_si128(_mm_or_si128(is_add, is_sub), _mm_or_si128(is_mul, is_div));
+        res = _mm_andnot_si128(invalid, res);
+        _mm_storeu_si128((__m128i *)(r + i * 4), res);
+
+        // Validity: 0 unknown, 1 valid, 2 invalid
+        __m128i valid = _mm_add_epi32(_mm_and_si128(known, one), _mm_and_si128(invalid, one));
+        __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(valid, zero), zero);
+        int32_t packed_valid = _mm_cvtsi128_si32(bytes);
+        memcpy(v + i, &packed_valid, 4);
+    }
+
+    calc_kernel_scalar(op, ops ? ops + i : NULL, a + i, b + i, r + i * 4, v + i, n - i);
+}
+
+// Truncated unsigned division of eight lanes through two four-lane double halves
+__attribute__((target("avx2")))
+static inline __m256i calc_avx2_div(__m256i a, __m256i b) {
+    const __m128i sign = _mm_set1_epi32((int)0x80000000);
+    const __m256d bias = _mm256_set1_pd(2147483648.0);
+    __m128i halves[2];
+
+    for (int h = 0; h < 2; h++) {
+        __m128i ah = h ? _mm256_extracti128_si256(a, 1) : _mm256_castsi256_si128(a);
+        __m128i bh = h ? _mm256_extracti128_si256(b, 1) : _mm256_castsi256_si128(b);
+        __m256d ad = _mm256_add_pd(_mm256_cvtepi32_pd(_mm_xor_si128(ah, sign)), bias);
+        __m256d bd = _mm256_add_pd(_mm256_cvtepi32_pd(_mm_xor_si128(bh, sign)), bias);
+        __m256d q = _mm256_round_pd(_mm256_div_pd(ad, bd), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        // q is now an exact integer in [0, 2^32): shift to signed range, convert, flip back
+        halves[h] = _mm_xor_si128(_mm256_cvttpd_epi32(_mm256_sub_pd(q, bias)), sign);
+    }
+    return _mm256_set_m128i(halves[1], halves[0]);
+}
+
+// Eight operations per step; the tail falls through to the SSE2 kernel
+__attribute__((target("avx2")))
+static inline void calc_kernel_avx2(char op, const uint8_t *ops, const uint32_t *a, const uint32_t *b,
+                                    unsigned char *r, uint8_t *v, size_t n) {
+    const __m256i sign = _mm256_set1_epi32((int)0x80000000);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    __m256i opv = _mm256_set1_epi32((unsigned char)op);
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        if (op == 0) {
+            opv = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(ops + i)));
+        }
+        __m256i is_add = _mm256_cmpeq_epi32(opv, _mm256_set1_epi32('+'));
+        __m256i is_sub = _mm256_cmpeq_epi32(opv, _mm256_set1_epi32('-'));
+        __m256i is_mul = _mm256_cmpeq_epi32(opv, _mm256_set1_epi32('x'));
+        __m256i is_div = _mm256_cmpeq_epi32(opv, _mm256_set1_epi32('/'));
+
+        __m256i sum = _mm256_add_epi32(va, vb);
+        __m256i add_ovf = _mm256_cmpgt_epi32(_mm256_xor_si256(va, sign), _mm256_xor_si256(sum, sign));
+
+        __m256i diff = _mm256_sub_epi32(va, vb);
+
+        __m256i even = _mm256_mul_epu32(va, vb);
+        __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(va, 32), _mm256_srli_epi64(vb, 32));
+        __m256i prod = _mm256_unpacklo_epi32(_mm256_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                                             _mm256_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+        __m256i prod_hi = _mm256_unpacklo_epi32(_mm256_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 3, 1)),
+                                                _mm256_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 3, 1)));
+        __m256i mul_ovf = _mm256_xor_si256(_mm256_cmpeq_epi32(prod_hi, zero), _mm256_set1_epi32(-1));
+
+        __m256i div_zero = _mm256_cmpeq_epi32(vb, zero);
+        __m256i quot = _mm256_setzero_si256();
+        if (op == 0 || op == '/') {
+            quot = calc_avx2_div(va, vb);
+        }
+
+        __m256i res = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(is_add, sum), _mm256_and_si256(is_sub, diff)),
+                                      _mm256_or_si256(_mm256_and_si256(is_mul, prod), _mm256_and_si256(is_div, quot)));
+        __m256i invalid = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(is_add, add_ovf), _mm256_and_si256(is_mul, mul_ovf)),
+                                          _mm256_and_si256(is_div, div_zero));
+        __m256i known = _mm256_or_si256(_mm256_or_si256(is_add, is_sub), _mm256_or_si256(is_mul, is_div));
+        res = _mm256_andnot_si256(invalid, res);
+        _mm256_storeu_si256((__m256i *)(r + i * 4), res);
+
+        __m256i valid = _mm256_add_epi32(_mm256_and_si256(known, one), _mm256_and_si256(invalid, one));
+        __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(valid), _mm256_extracti128_si256(valid, 1));
+        _mm_storel_epi64((__m128i *)(v + i), _mm_packus_epi16(words, _mm_setzero_si128()));
+    }
+
+    calc_kernel_sse2(op, ops ? ops + i : NULL, a + i, b + i, r + i * 4, v + i, n - i);
+}
+
+#endif // CALC_X86
+
+// Kernel by name ("scalar", "sse2", "avx2"), or NULL if unknown or unsupported here
+static inline calc_kernel_fn calc_kernel_by_name(const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        return calc_kernel_scalar;
+    }
+#ifdef CALC_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        return calc_kernel_sse2;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        return calc_kernel_avx2;
+    }
+#endif
+    return NULL;
+}
+
+// Widest kernel the running CPU supports
+static inline calc_kernel_fn calc_kernel_select(const char **name) {
+    static const char *const order[] = { "avx2", "sse2", "scalar" };
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+        calc_kernel_fn fn = calc_kernel_by_name(order[i]);
+        if (fn != NULL) {
+            if (name != NULL) {
+                *name = order[i];
+            }
+            return fn;
+        }
+    }
+    return calc_kernel_scalar;
+}
+
+#endif // CALC_H
@@ -0,0 +1,264 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+// Full traffic capture for server11 (-K), replayed with capture_replay.
+//
+// Every thread that captures appends to its own memory-mapped segment file, so
+// the data path never takes a lock, makes a system call or shares a cache
+// line: a record is a timestamp, the peer and the datagram, copied straight
+// into the mapping. Segments are allocated at full size up front, so a full
+// disk fails the rotation instead of raising SIGBUS on a store. When one is
+// full the thread truncates it to its contents and moves on to the next;
+// with a keep count the oldest segments are deleted as new ones are opened.
+//
+// Each segment's header holds the number of record bytes written so far,
+// published after every record. The pages belong to the page cache, so a
+// capture stays readable up to its last record even if the server is killed.
+//
+// Files are named <prefix>.<thread>.<segment>; the records of one thread are in
+// arrival order, and all threads share CLOCK_MONOTONIC. When a thread exits its
+// segment is closed and trimmed, and the next thread to capture carries on with
+// the same thread number from the following segment.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CAPTURE_MAGIC "ECHOCAP1"
+#define CAPTURE_VERSION 1
+#define CAPTURE_ALIGN 8                              // Records start on 8-byte boundaries
+#define CAPTURE_DEFAULT_SEGMENT (64ull << 20)
+#define CAPTURE_PATH_MAX 4096
+
+// Start of every segment file
+struct capture_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t thread;              // Capturing thread, numbered from 0 in order of first packet
+    uint32_t segment;             // Index in that thread's sequence
+    uint32_t header_size;         // Records start here
+    uint64_t size;                // Allocated size of the file
+    _Atomic uint64_t committed;   // Record bytes after the header that are complete
+    uint64_t realtime_offset_ns;  // CLOCK_REALTIME - CLOCK_MONOTONIC when the segment was opened
+    uint8_t reserved[16];
+};
+
+// One captured datagram, followed by 'length' payload bytes padded to CAPTURE_ALIGN
+struct capture_record {
+    uint64_t time_ns;    // CLOCK_MONOTONIC on arrival
+    uint32_t peer_addr;  // Network byte order
+    uint16_t peer_port;  // Network byte order
+    uint16_t length;
+};
+
+struct capture_writer {
+    unsigned char *base;
+    struct capture_header *header;
+    uint64_t used;     // Bytes of the segment in use, header included
+    uint32_t thread;
+    uint32_t segment;
+    int fd;
+    struct capture_writer *next;  // On the released list
+};
+
+static struct {
+    const char *prefix;           // NULL = capture off
+    uint64_t segment_bytes;
+    unsigned int keep;            // Segments kept per thread; 0 = all
+    _Atomic uint32_t threads;
+    _Atomic uint64_t dropped;     // Datagrams not captured because no segment could be opened
+    pthread_mutex_t lock;         // Guards the released list
+    struct capture_writer *released;  // Writers of exited threads, waiting for a new owner
+    pthread_key_t key;            // Releases a thread's writer when it exits
+} capture = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread struct capture_writer *capture_thread_writer;
+static __thread int capture_thread_failed;  // This thread could not open its first segment
+
+static inline uint64_t capture_record_size(uint32_t length) {
+    return (sizeof(struct capture_record) + length + CAPTURE_ALIGN - 1) & ~(uint64_t)(CAPTURE_ALIGN - 1);
+}
+
+static inline void capture_path(char *path, uint32_t thread, uint32_t segment) {
+    snprintf(path, CAPTURE_PATH_MAX, "%s.%02u.%06u", capture.prefix, thread, segment);
+}
+
+// Close the writer's current segment, trimming it to what was written
+static inline void capture_close_segment(struct capture_writer *w) {
+    if (w->base == NULL) {
+        return;
+    }
+    munmap(w->base, capture.segment_bytes);
+    if (ftruncate(w->fd, (off_t)w->used) < 0) {
+        perror("ftruncate capture segment failed");
+    }
+    close(w->fd);
+    w->base = NULL;
+}
+
+// Open segment 'segment' of the writer's thread
+static inline int capture_open_segment(struct capture_writer *w, uint32_t segment) {
+    char path[CAPTURE_PATH_MAX];
+    capture_path(path, w->thread, segment);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open capture segment failed");
+        return -1;
+    }
+    int err = posix_fallocate(fd, 0, (off_t)capture.segment_bytes);
+    if (err != 0) {
+        fprintf(stderr, "Cannot allocate capture segment %s: %s\n", path, strerror(err));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    unsigned char *base = mmap(NULL, capture.segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap capture segment failed");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    madvise(base, capture.segment_bytes, MADV_SEQUENTIAL);
+
+    struct timespec mono, real;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    struct capture_header *h = (struct capture_header *)base;
+    memcpy(h->magic, CAPTURE_MAGIC, sizeof(h->magic));
+    h->version = CAPTURE_VERSION;
+    h->thread = w->thread;
+    h->segment = segment;
+    h->header_size = sizeof(*h);
+    h->size = capture.segment_bytes;
+    h->realtime_offset_ns = ((uint64_t)real.tv_sec - (uint64_t)mono.tv_sec) * 1000000000ull +
+                            (uint64_t)real.tv_nsec - (uint64_t)mono.tv_nsec;
+    atomic_store_explicit(&h->committed, 0, memory_order_release);
+
+    w->base = base;
+    w->header = h;
+    w->fd = fd;
+    w->segment = segment;
+    w->used = sizeof(*h);
+
+    if (capture.keep > 0 && segment >= capture.keep) {
+        capture_path(path, w->thread, segment - capture.keep);
+        unlink(path);
+    }
+    return 0;
+}
+
+static inline void capture_put_released(struct capture_writer *w) {
+    pthread_mutex_lock(&capture.lock);
+    w->next = capture.released;
+    capture.released = w;
+    pthread_mutex_unlock(&capture.lock);
+}
+
+// Thread exit: trim the thread's segment and leave its writer to the next thread
+static void capture_release_thread(void *arg) {
+    struct capture_writer *w = arg;
+    capture_close_segment(w);
+    capture_put_released(w);
+}
+
+// Slow path: give this thread an exited thread's writer and its next segment,
+// or a new number and its first segment
+static inline struct capture_writer *capture_register_thread(void) {
+    pthread_mutex_lock(&capture.lock);
+    struct capture_writer *w = capture.released;
+    if (w != NULL) {
+        capture.released = w->next;
+    }
+    pthread_mutex_unlock(&capture.lock);
+
+    uint32_t segment = 0;
+    if (w != NULL) {
+        segment = w->segment + 1;
+    } else if ((w = calloc(1, sizeof(*w))) != NULL) {
+        w->thread = atomic_fetch_add(&capture.threads, 1);
+    } else {
+        return NULL;
+    }
+    if (capture_open_segment(w, segment) < 0) {
+        capture_put_released(w);  // Keeps its number for the next attempt
+        return NULL;
+    }
+    capture_thread_writer = w;
+    pthread_setspecific(capture.key, w);
+    return w;
+}
+
+// Append one received datagram. Costs a clock read and a copy; a rotation
+// (once per segment) costs an open, an allocation and an mmap.
+static inline void capture_write(const void *data, uint32_t length, uint32_t peer_addr, uint16_t peer_port) {
+    if (capture.prefix == NULL) {
+        return;
+    }
+
+    struct capture_writer *w = capture_thread_writer;
+    if (__builtin_expect(w == NULL, 0)) {
+        if (capture_thread_failed || (w = capture_register_thread()) == NULL) {
+            capture_thread_failed = 1;
+            atomic_fetch_add_explicit(&capture.dropped, 1, memory_order_relaxed);
+            return;
+        }
+    }
+
+    uint64_t size = capture_record_size(length);
+    if (w->used + size > capture.segment_bytes) {
+        capture_close_segment(w);
+        if (capture_open_segment(w, w->segment + 1) < 0) {
+            atomic_fetch_add_explicit(&capture.dropped, 1, memory_order_relaxed);
+            return;  // Retried with the next datagram
+        }
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    struct capture_record *r = (struct capture_record *)(w->base + w->used);
+    r->time_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    r->peer_addr = peer_addr;
+    r->peer_port = peer_port;
+    r->length = (uint16_t)length;
+    memcpy(r + 1, data, length);
+    w->used += size;
+    atomic_store_explicit(&w->header->committed, w->used - sizeof(struct capture_header), memory_order_release);
+}
+
+// Enable capture to <prefix>.<thread>.<segment> files of 'segment_bytes' each,
+// keeping the newest 'keep' per thread (0 = all)
+static inline int capture_start(const char *prefix, uint64_t segment_bytes, unsigned int keep) {
+    uint64_t smallest = sizeof(struct capture_header) + capture_record_size(UINT16_MAX);
+    if (segment_bytes < smallest) {
+        fprintf(stderr, "Capture segments must hold at least %lu bytes\n", (unsigned long)smallest);
+        return -1;
+    }
+    // Fail now rather than on every thread's first datagram
+    char dir[CAPTURE_PATH_MAX];
+    const char *slash = strrchr(prefix, '/');
+    snprintf(dir, sizeof(dir), "%.*s", slash == NULL ? 1 : (int)(slash - prefix + 1), slash == NULL ? "." : prefix);
+    if (access(dir, W_OK) < 0) {
+        perror("Capture directory is not writable");
+        return -1;
+    }
+    int err = pthread_key_create(&capture.key, capture_release_thread);
+    if (err != 0) {
+        fprintf(stderr, "pthread_key_create failed: %s\n", strerror(err));
+        return -1;
+    }
+    capture.segment_bytes = segment_bytes;
+    capture.keep = keep;
+    capture.prefix = prefix;
+    return 0;
+}
+
+#endif // CAPTURE_H
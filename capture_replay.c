@@ -0,0 +1,555 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "capture.h"
+#include "histogram.h"
+#include "lowlat.h"
+#include "wire.h"
+
+// Replays a server11 capture (-K) against a server, keeping the original
+// inter-arrival times (or scaling them with -x), or prints it with -d.
+//
+// Segments are mapped one at a time per capturing thread and released as the
+// replay passes them, so a capture of any size streams from the page cache
+// in constant memory. The records of all capturing threads are merged by
+// arrival time. Every replay thread walks the merged stream and sends the
+// records of its share of the original peers, so each peer's datagrams keep
+// their order and all go out of the same socket. Datagrams that fall due
+// together go out in one sendmmsg per socket. The thread sleeps until shortly
+// before the next one is due and spins for the rest, and the report gives how
+// late each datagram left.
+
+#define PORT 10010
+#define MAX_SEGMENTS 65536
+#define MAX_STREAMS 1024          // Capturing threads
+#define MAX_THREADS 64
+#define MAX_SOCKETS 256           // Per replay thread
+#define MAX_BATCH 64
+#define SPIN_THRESHOLD_NS 50000   // Spin instead of sleeping when the next datagram is this close
+#define START_DELAY_NS 20000000ull  // Lead time for every thread to be ready at the common start
+#define RELEASE_BYTES (8u << 20)  // Drop consumed pages from the mapping in steps of this much
+#define FRAME_MAX 65536           // Largest datagram a record can hold
+
+struct segment {
+    const char *path;
+    uint32_t thread;
+    uint32_t index;
+};
+
+// The records of one capturing thread, across its segments in order
+struct stream {
+    struct segment *segments;
+    int num_segments;
+    int current;           // Segment mapped now; num_segments once exhausted
+    unsigned char *map;
+    size_t map_len;
+    uint64_t offset;       // Next record
+    uint64_t end;          // End of the committed records
+    uint64_t released;     // Mapping released up to here
+};
+
+struct replay_thread {
+    int id;
+    pthread_t thread;
+    struct stream streams[MAX_STREAMS];
+    int num_streams;
+    int sockets[MAX_SOCKETS];
+    long sent;
+    long send_errors;
+    uint64_t last_ns;            // Latest arrival in the capture
+    struct histogram *lateness;  // Send time minus scheduled time, nanoseconds
+};
+
+static struct segment segments[MAX_SEGMENTS];
+static int num_segments;
+static struct segment *stream_start[MAX_STREAMS];
+static int stream_len[MAX_STREAMS];
+static int num_streams;
+
+static struct sockaddr_in server_addr;
+static int num_threads = 1;
+static int num_sockets = 1;
+static int batch_size = MAX_BATCH;
+static double speed = 1.0;  // 0 = as fast as possible
+static int pin_cpus[CPU_SETSIZE];
+static int num_pin_cpus = 0;
+static uint64_t first_ns;   // Earliest arrival in the capture
+static uint64_t start_ns;   // When that arrival is replayed
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Sleep until an absolute CLOCK_MONOTONIC deadline; spin for the last stretch
+// because timer slack would otherwise cost tens of microseconds
+static void wait_until(uint64_t deadline_ns) {
+    uint64_t now = now_ns();
+    if (deadline_ns > now + SPIN_THRESHOLD_NS) {
+        uint64_t wake = deadline_ns - SPIN_THRESHOLD_NS;
+        struct timespec ts = { .tv_sec = wake / 1000000000ull, .tv_nsec = wake % 1000000000ull };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        }
+    }
+    while (now_ns() < deadline_ns) {
+        lowlat_relax();
+    }
+}
+
+static int segment_compare(const void *a, const void *b) {
+    const struct segment *x = a, *y = b;
+    if (x->thread != y->thread) {
+        return x->thread < y->thread ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Read and check a segment's header
+static int segment_probe(struct segment *seg) {
+    struct capture_header h;
+    int fd = open(seg->path, O_RDONLY);
+    if (fd < 0) {
+        perror(seg->path);
+        return -1;
+    }
+    ssize_t n = pread(fd, &h, sizeof(h), 0);
+    close(fd);
+    if (n != (ssize_t)sizeof(h) || memcmp(h.magic, CAPTURE_MAGIC, sizeof(h.magic)) != 0) {
+        fprintf(stderr, "Not a capture segment: %s\n", seg->path);
+        return -1;
+    }
+    if (h.version != CAPTURE_VERSION || h.header_size < sizeof(h)) {
+        fprintf(stderr, "Unsupported capture version %u: %s\n", h.version, seg->path);
+        return -1;
+    }
+    seg->thread = h.thread;
+    seg->index = h.segment;
+    return 0;
+}
+
+static void stream_unmap(struct stream *st) {
+    if (st->map != NULL) {
+        munmap(st->map, st->map_len);
+        st->map = NULL;
+    }
+}
+
+// Map the stream's current segment; skips segments that cannot be read
+static void stream_map(struct stream *st) {
+    while (st->current < st->num_segments) {
+        const struct segment *seg = &st->segments[st->current];
+        int fd = open(seg->path, O_RDONLY);
+        struct stat sb;
+        if (fd < 0 || fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(struct capture_header)) {
+            perror(seg->path);
+            if (fd >= 0) {
+                close(fd);
+            }
+            st->current++;
+            continue;
+        }
+        st->map_len = (size_t)sb.st_size;
+        st->map = mmap(NULL, st->map_len, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (st->map == MAP_FAILED) {
+            perror(seg->path);
+            st->map = NULL;
+            st->current++;
+            continue;
+        }
+        madvise(st->map, st->map_len, MADV_SEQUENTIAL);
+
+        // A capture still being written (or cut short) ends at its last complete record
+        const struct capture_header *h = (const struct capture_header *)st->map;
+        uint64_t committed = atomic_load_explicit(&((struct capture_header *)st->map)->committed, memory_order_acquire);
+        st->offset = h->header_size;
+        st->end = st->offset + committed;
+        if (st->end > st->map_len) {
+            st->end = st->map_len;
+        }
+        st->released = 0;
+        return;
+    }
+}
+
+static void stream_open(struct stream *st, struct segment *segs, int count) {
+    memset(st, 0, sizeof(*st));
+    st->segments = segs;
+    st->num_segments = count;
+    stream_map(st);
+}
+
+// The stream's next record, or NULL at its end
+static const struct capture_record *stream_peek(struct stream *st) {
+    while (st->current < st->num_segments) {
+        if (st->offset + sizeof(struct capture_record) <= st->end) {
+            const struct capture_record *r = (const struct capture_record *)(st->map + st->offset);
+            if (st->offset + capture_record_size(r->length) <= st->end) {
+                return r;
+            }
+        }
+        stream_unmap(st);
+        st->current++;
+        stream_map(st);
+    }
+    return NULL;
+}
+
+static void stream_next(struct stream *st) {
+    const struct capture_record *r = (const struct capture_record *)(st->map + st->offset);
+    st->offset += capture_record_size(r->length);
+
+    // Give back what is behind us, so the replay's footprint stays constant
+    if (st->offset - st->released >= 2 * RELEASE_BYTES) {
+        uint64_t upto = (st->offset - RELEASE_BYTES) & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+        madvise(st->map + st->released, upto - st->released, MADV_DONTNEED);
+        st->released = upto;
+    }
+}
+
+// The earliest next record over all streams, and its stream
+static const struct capture_record *merged_peek(struct stream *streams, int count, int *which) {
+    const struct capture_record *best = NULL;
+    for (int i = 0; i < count; i++) {
+        const struct capture_record *r = stream_peek(&streams[i]);
+        if (r != NULL && (best == NULL || r->time_ns < best->time_ns)) {
+            best = r;
+            *which = i;
+        }
+    }
+    return best;
+}
+
+static unsigned int peer_hash(const struct capture_record *r) {
+    return (r->peer_addr * 2654435761u) ^ (r->peer_port * 40503u);
+}
+
+// Per-socket batch of datagrams that are due. They are copied out of the
+// capture, whose segments are unmapped as soon as the walk leaves them.
+struct batch {
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iovs[MAX_BATCH];
+    uint64_t due[MAX_BATCH];
+    int count;
+};
+
+static void batch_flush(struct replay_thread *t, int sockfd, struct batch *b) {
+    int done = 0;
+    while (done < b->count) {
+        int n = sendmmsg(sockfd, b->msgs + done, b->count - done, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            t->send_errors++;  // e.g. ECONNREFUSED from an earlier ICMP error; skip one datagram
+            done++;
+            continue;
+        }
+        uint64_t now = now_ns();
+        for (int i = done; i < done + n; i++) {
+            hist_record(t->lateness, now > b->due[i] ? now - b->due[i] : 0);
+        }
+        done += n;
+        t->sent += n;
+    }
+    b->count = 0;
+}
+
+static void flush_all(struct replay_thread *t, struct batch *batches) {
+    for (int s = 0; s < num_sockets; s++) {
+        if (batches[s].count > 0) {
+            batch_flush(t, t->sockets[s], &batches[s]);
+        }
+    }
+}
+
+void *replay_main(void *arg) {
+    struct replay_thread *t = arg;
+    struct batch *batches = calloc(num_sockets, sizeof(*batches));
+    unsigned char *frames = malloc((size_t)batch_size * FRAME_MAX);  // One per queued datagram
+    if (batches == NULL || frames == NULL) {
+        perror("malloc failed");
+        free(batches);
+        free(frames);
+        return NULL;
+    }
+    if (num_pin_cpus > 0) {
+        lowlat_pin(pin_cpus[t->id % num_pin_cpus]);
+    }
+    for (int s = 0; s < num_sockets; s++) {
+        for (int i = 0; i < MAX_BATCH; i++) {
+            batches[s].msgs[i].msg_hdr.msg_iov = &batches[s].iovs[i];
+            batches[s].msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    int pending = 0;  // Datagrams queued over all batches
+    int which;
+    const struct capture_record *r;
+    while ((r = merged_peek(t->streams, t->num_streams, &which)) != NULL) {
+        unsigned int hash = peer_hash(r);
+        t->last_ns = r->time_ns;
+        if ((int)(hash % num_threads) != t->id) {
+            stream_next(&t->streams[which]);
+            continue;
+        }
+        uint64_t due = speed > 0 ? start_ns + (uint64_t)((r->time_ns - first_ns) / speed) : 0;
+        if (due > now_ns()) {
+            flush_all(t, batches);  // Everything due so far goes out before waiting for the next one
+            pending = 0;
+            wait_until(due);
+        }
+        if (due == 0) {
+            due = now_ns();
+        }
+
+        struct batch *b = &batches[(hash / num_threads) % num_sockets];
+        unsigned char *frame = frames + (size_t)pending * FRAME_MAX;
+        memcpy(frame, r + 1, r->length);
+        b->iovs[b->count].iov_base = frame;
+        b->iovs[b->count].iov_len = r->length;
+        b->due[b->count] = due;
+        b->count++;
+        stream_next(&t->streams[which]);
+        if (++pending == batch_size) {
+            flush_all(t, batches);
+            pending = 0;
+        }
+    }
+    flush_all(t, batches);
+    for (int i = 0; i < t->num_streams; i++) {
+        stream_unmap(&t->streams[i]);
+    }
+    free(frames);
+    free(batches);
+    return NULL;
+}
+
+// -d: print every record in arrival order
+static void dump(void) {
+    static struct stream streams[MAX_STREAMS];
+    for (int i = 0; i < num_streams; i++) {
+        stream_open(&streams[i], stream_start[i], stream_len[i]);
+    }
+    int which;
+    const struct capture_record *r;
+    char peer[INET_ADDRSTRLEN];
+    unsigned long count = 0;
+    while ((r = merged_peek(streams, num_streams, &which)) != NULL) {
+        // A short record may end its segment's mapping: decode from a padded copy
+        const unsigned char *payload = (const unsigned char *)(r + 1);
+        unsigned char head[WIRE_ECHO_MIN_BUFFER] = { 0 };
+        if (r->length < WIRE_ECHO_MIN_BUFFER) {
+            memcpy(head, payload, r->length);
+            payload = head;
+        }
+        struct wire_echo m = wire_echo_decode(payload, r->length);
+        struct in_addr addr = { .s_addr = r->peer_addr };
+        inet_ntop(AF_INET, &addr, peer, sizeof(peer));
+        printf("+%.6f thread=%u peer=%s:%u length=%u", (r->time_ns - first_ns) / 1e9,
+               streams[which].segments[0].thread, peer, ntohs(r->peer_port), r->length);
+        if (m.valid) {
+            printf(" seq=%u timestamp=%lu%s", m.sequence, (unsigned long)m.timestamp, m.end ? " END" : "");
+        }
+        printf("\n");
+        stream_next(&streams[which]);
+        count++;
+    }
+    fprintf(stderr, "Decoded %lu records\n", count);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-x speed] [-t threads] [-f sockets] [-b batch] [-c cpus] [-p port] <server_ip> <segment>...\n"
+                    "       %s -d <segment>...\n", prog, prog);
+    fprintf(stderr, "  -x speed    Replay 'speed' times faster than captured (default 1; 0 = as fast as possible)\n");
+    fprintf(stderr, "  -t threads  Replay threads; each sends the datagrams of its share of the peers (1-%d)\n", MAX_THREADS);
+    fprintf(stderr, "  -f sockets  Source sockets per thread; each original peer keeps one (1-%d, default 1)\n", MAX_SOCKETS);
+    fprintf(stderr, "  -b batch    Most datagrams per sendmmsg call (1-%d, default %d)\n", MAX_BATCH, MAX_BATCH);
+    fprintf(stderr, "  -c cpus     Pin the threads round-robin to these CPUs, e.g. 2,3 or 4-7\n");
+    fprintf(stderr, "  -p port     Server port (default %d)\n", PORT);
+    fprintf(stderr, "  -d          Print the records instead of sending them\n");
+    fprintf(stderr, "Segments are server11 -K files, e.g. 'capture.*'; their order on the command line does not matter.\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int port = PORT;
+    int print = 0;
+
+    while ((opt = getopt(argc, argv, "x:t:f:b:c:p:dh")) != -1) {
+        switch (opt) {
+            case 'x':
+                speed = atof(optarg);
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                break;
+            case 'f':
+                num_sockets = atoi(optarg);
+                break;
+            case 'b':
+                batch_size = atoi(optarg);
+                break;
+            case 'c':
+                num_pin_cpus = lowlat_parse_cpus(optarg, pin_cpus, CPU_SETSIZE);
+                if (num_pin_cpus < 1) {
+                    fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'd':
+                print = 1;
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    int first_file = optind + (print ? 0 : 1);
+    if (first_file >= argc || speed < 0 || num_threads < 1 || num_threads > MAX_THREADS || num_sockets < 1 ||
+        num_sockets > MAX_SOCKETS || batch_size < 1 || batch_size > MAX_BATCH || port < 1 || port > 65535) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (!print) {
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, argv[optind], &server_addr.sin_addr) != 1) {
+            fprintf(stderr, "Invalid server address: %s\n", argv[optind]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Group the segments by capturing thread, each group in segment order
+    for (int i = first_file; i < argc; i++) {
+        if (num_segments == MAX_SEGMENTS) {
+            fprintf(stderr, "Too many segments (at most %d)\n", MAX_SEGMENTS);
+            exit(EXIT_FAILURE);
+        }
+        segments[num_segments].path = argv[i];
+        if (segment_probe(&segments[num_segments]) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        num_segments++;
+    }
+    qsort(segments, num_segments, sizeof(segments[0]), segment_compare);
+    for (int i = 0; i < num_segments; i++) {
+        if (i == 0 || segments[i].thread != segments[i - 1].thread) {
+            if (num_streams == MAX_STREAMS) {
+                fprintf(stderr, "Too many capturing threads (at most %d)\n", MAX_STREAMS);
+                exit(EXIT_FAILURE);
+            }
+            stream_start[num_streams++] = &segments[i];
+        }
+        stream_len[num_streams - 1]++;
+    }
+
+    // The replay clock starts at the earliest record of any stream
+    first_ns = UINT64_MAX;
+    for (int i = 0; i < num_streams; i++) {
+        struct stream st;
+        stream_open(&st, stream_start[i], stream_len[i]);
+        const struct capture_record *r = stream_peek(&st);
+        if (r != NULL && r->time_ns < first_ns) {
+            first_ns = r->time_ns;
+        }
+        stream_unmap(&st);
+    }
+    if (first_ns == UINT64_MAX) {
+        fprintf(stderr, "The capture holds no records\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (print) {
+        dump();
+        return 0;
+    }
+
+    struct replay_thread *threads = calloc(num_threads, sizeof(*threads));
+    if (threads == NULL) {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        struct replay_thread *t = &threads[i];
+        t->id = i;
+        t->lateness = hist_create();
+        if (t->lateness == NULL) {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        t->num_streams = num_streams;
+        for (int j = 0; j < num_streams; j++) {
+            stream_open(&t->streams[j], stream_start[j], stream_len[j]);
+        }
+        for (int s = 0; s < num_sockets; s++) {
+            t->sockets[s] = socket(AF_INET, SOCK_DGRAM, 0);
+            if (t->sockets[s] < 0 ||
+                connect(t->sockets[s], (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+                perror("socket failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    start_ns = now_ns() + START_DELAY_NS;
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i].thread, NULL, replay_main, &threads[i]) != 0) {
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    long sent = 0, send_errors = 0;
+    uint64_t last_ns = 0;
+    struct histogram *lateness = hist_create();
+    if (lateness == NULL) {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        sent += threads[i].sent;
+        send_errors += threads[i].send_errors;
+        hist_merge(lateness, threads[i].lateness);
+        if (threads[i].last_ns > last_ns) {
+            last_ns = threads[i].last_ns;
+        }
+    }
+    uint64_t end_ns = now_ns();
+    double seconds = end_ns > start_ns ? (end_ns - start_ns) / 1e9 : 0;
+
+    printf("Replayed %ld datagrams from %d segments of %d capturing threads in %.3f s (captured over %.3f s, speed %s%.2f)\n",
+           sent, num_segments, num_streams, seconds, (last_ns - first_ns) / 1e9, speed > 0 ? "" : "unpaced, ",
+           speed);
+    printf("Rate: %.0f pps, %ld send errors\n", seconds > 0 ? sent / seconds : 0.0, send_errors);
+    if (lateness->total > 0 && speed > 0) {
+        printf("Send lateness: p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+               hist_percentile(lateness, 50) / 1e3, hist_percentile(lateness, 90) / 1e3,
+               hist_percentile(lateness, 99) / 1e3, hist_percentile(lateness, 99.9) / 1e3, lateness->max / 1e3);
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        for (int s = 0; s < num_sockets; s++) {
+            close(threads[i].sockets[s]);
+        }
+        free(threads[i].lateness);
+    }
+    free(threads);
+    free(lateness);
+    return 0;
+}
@@ -1,26 +1,52 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include "histogram.h"
+#include "lowlat.h"
+#include "shmring.h"
+#include "wire.h"
 
 #define PORT 10010
 #define BUFFER_SIZE 1038 // Maximum size: 2 + 4 + 8 + 1024 bytes
+#define MAX_PAYLOAD (BUFFER_SIZE - WIRE_ECHO_HEADER_SIZE)
+#define DEFAULT_INTERVAL_US 1000
+#define DEFAULT_PAYLOAD 32
+#define PING_TIMEOUT_NS 1000000000ull  // A reply later than this counts as lost
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <server_ip>\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
+static struct sockaddr_in server_addr;
+static volatile sig_atomic_t stop;
+
+// Ping mode settings
+static int spin = 0;            // -Y: poll with MSG_DONTWAIT instead of blocking
+static int busy_poll_usec = 0;  // -y: SO_BUSY_POLL for the blocking receive
+static const char *shm_name;    // -Z: ping over the shared-memory transport instead of UDP
+static struct shm_client shm;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
+static void handle_stop(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+// Send one message typed by the user and print the echo and its round-trip time
+static int interactive(void) {
     int sockfd;
-    struct sockaddr_in server_addr;
-    char string_message[1024];
-    unsigned char buffer[BUFFER_SIZE];
+    unsigned char buffer[BUFFER_SIZE + 1];  // +1 for the terminator fgets writes
+    char *string_message = (char *)buffer + WIRE_ECHO_HEADER_SIZE;  // Read straight into the payload
     socklen_t addr_len = sizeof(server_addr);
     struct timeval start, end;
-    uint16_t total_length;
     uint32_t sequence_number = 1;  // Initialize sequence number
     uint64_t timestamp;
 
@@ -28,45 +54,31 @@ int main(int argc, char *argv[]) {
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
         perror("socket failed");
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    // Configure server address
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    inet_pton(AF_INET, argv[1], &server_addr.sin_addr);
-
     // Prompt user to enter a message
     printf("Enter a message to send (up to 1024 characters): ");
-    fgets(string_message, sizeof(string_message), stdin);
-    string_message[strcspn(string_message, "\n")] = '\0';  // Remove newline character
+    if (fgets(string_message, BUFFER_SIZE - WIRE_ECHO_HEADER_SIZE + 1, stdin) == NULL) {
+        string_message[0] = '\0';
+    }
+    size_t message_length = strcspn(string_message, "\n");  // Length without the newline
 
     // Get current time for the timestamp
     gettimeofday(&start, NULL);
     timestamp = (uint64_t)(start.tv_sec) * 1000 + (start.tv_usec / 1000);  // Timestamp in milliseconds
 
-    // Construct the message to send (total message length, sequence number, timestamp, and string)
-    total_length = 14 + strlen(string_message);  // 2 + 4 + 8 + length of the string
-
-    // Convert fields to network byte order
-    total_length = htons(total_length);
-    
     // Wrap sequence number at 2^32-1 (4294967295)
     sequence_number = (sequence_number == 4294967295) ? 1 : sequence_number + 1;
-    sequence_number = htonl(sequence_number);
-    timestamp = htobe64(timestamp);  // Special function to convert 64-bit integer to network byte order
 
-    // Pack the buffer
-    memcpy(buffer, &total_length, 2);           // 2 bytes for total length
-    memcpy(buffer + 2, &sequence_number, 4);    // 4 bytes for sequence number
-    memcpy(buffer + 6, &timestamp, 8);          // 8 bytes for timestamp
-    memcpy(buffer + 14, string_message, strlen(string_message));  // Variable-length string
+    // Write the header (total message length, sequence number, timestamp) in front of the string
+    size_t total_length = wire_echo_encode(buffer, sequence_number, timestamp, message_length);
 
     // Send the message to the server
-    if (sendto(sockfd, buffer, 14 + strlen(string_message), 0, (struct sockaddr *)&server_addr, addr_len) < 0) {
+    if (sendto(sockfd, buffer, total_length, 0, (struct sockaddr *)&server_addr, addr_len) < 0) {
         perror("sendto failed");
         close(sockfd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // Receive the response from the server
@@ -74,7 +86,7 @@ int main(int argc, char *argv[]) {
     if (bytes_received < 0) {
         perror("recvfrom failed");
         close(sockfd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // Record the time after receiving
@@ -85,9 +97,315 @@ int main(int argc, char *argv[]) {
 
     // Null-terminate the received string and print the response
     buffer[bytes_received] = '\0';
-    printf("Received from server: %s\n", buffer + 14);  // Skipping the first 14 bytes (headers)
+    struct wire_echo reply = wire_echo_decode(buffer, bytes_received);
+    if (!reply.valid) {
+        fprintf(stderr, "Malformed reply (%zd bytes)\n", bytes_received);
+    }
+    printf("Received from server: %s\n", buffer + WIRE_ECHO_HEADER_SIZE);  // Skipping the header
     printf("Round-trip time: %ld ms\n", rtt);
 
     close(sockfd);
     return 0;
 }
+
+// Wait for the echo of 'sequence' until 'deadline_ns'. Returns its length, 0 on
+// timeout or interruption, or -1 on error. Echoes of earlier pings that arrive
+// after their own timeout are counted in 'late' and skipped.
+static ssize_t ping_receive(int sockfd, unsigned char *buffer, uint32_t sequence, uint64_t deadline_ns, long *late) {
+    while (!stop) {
+        ssize_t n = recv(sockfd, buffer, BUFFER_SIZE, spin ? MSG_DONTWAIT : 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                if (now_ns() >= deadline_ns) {
+                    return 0;
+                }
+                if (spin) {
+                    lowlat_relax();
+                }
+                continue;
+            }
+            perror("recv failed");
+            return -1;
+        }
+        struct wire_echo reply = wire_echo_decode(buffer, n);
+        if (reply.valid && reply.sequence == sequence) {
+            return n;
+        }
+        (*late)++;
+    }
+    return 0;
+}
+
+// ping_receive for the shared-memory transport: the echo is decoded in the ring
+// and only its length is returned
+static ssize_t ping_receive_shm(uint32_t sequence, uint64_t deadline_ns, long *late) {
+    struct shm_ring *ring = &shm.slot->echoes;
+    while (!stop) {
+        struct shm_frame *frame = shm_ring_peek(ring);
+        if (frame == NULL) {
+            uint64_t now = now_ns();
+            if (now >= deadline_ns) {
+                return 0;
+            }
+            if (spin) {
+                lowlat_relax();
+            } else {
+                shm_ring_wait_data(ring, deadline_ns - now);
+            }
+            continue;
+        }
+        uint32_t len = frame->len < SHM_FRAME_MAX ? frame->len : SHM_FRAME_MAX;
+        struct wire_echo reply = wire_echo_decode(frame->data, len);
+        shm_client_consume(&shm);
+        if (reply.valid && reply.sequence == sequence) {
+            return len;
+        }
+        (*late)++;
+    }
+    return 0;
+}
+
+// Connected UDP socket for ping mode, set up for the chosen receive style
+static int open_ping_socket(void) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        perror("socket failed");
+        return -1;
+    }
+    // Connected, so the kernel filters other senders and skips the route lookup per send
+    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("connect failed");
+        close(sockfd);
+        return -1;
+    }
+    // A blocking receive wakes up at the timeout to count the ping as lost
+    struct timeval tv = { .tv_sec = PING_TIMEOUT_NS / 1000000000ull, .tv_usec = 0 };
+    if (!spin && setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        perror("setsockopt(SO_RCVTIMEO) failed");
+    }
+    if (busy_poll_usec > 0 && lowlat_busy_poll(sockfd, busy_poll_usec) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// Ping the server every 'interval_us' on an absolute schedule and report the
+// RTT distribution in microseconds; count 0 pings until interrupted
+static int ping(long count, long interval_us, int payload) {
+    unsigned char buffer[BUFFER_SIZE];
+    unsigned char reply[BUFFER_SIZE];
+    struct histogram *rtt = hist_create();
+    long sent = 0, received = 0, lost = 0, late = 0;
+    int sockfd = -1;
+    const char *peer = shm_name != NULL ? shm_name : inet_ntoa(server_addr.sin_addr);
+
+    if (rtt == NULL) {
+        perror("malloc failed");
+        return -1;
+    }
+    // Over shared memory, registering assigns this client a ring pair
+    if (shm_name != NULL ? shm_client_attach(shm_name, &shm) < 0 : (sockfd = open_ping_socket()) < 0) {
+        free(rtt);
+        return -1;
+    }
+
+    memset(buffer + WIRE_ECHO_HEADER_SIZE, 'x', payload);
+    lowlat_prefault(buffer, sizeof(buffer));
+    lowlat_prefault(reply, sizeof(reply));
+    lowlat_prefault(rtt, sizeof(*rtt));
+
+    if (shm_name != NULL) {
+        printf("PING /dev/shm/%s slot %u: %d payload bytes every %ld us, %s receive\n", shm_name, shm.index,
+               payload, interval_us, spin ? "spinning" : "futex");
+    } else {
+        printf("PING %s:%d: %d payload bytes every %ld us, %s receive%s\n", peer, PORT, payload, interval_us,
+               spin ? "spinning" : "blocking", busy_poll_usec > 0 ? " with SO_BUSY_POLL" : "");
+    }
+    fflush(stdout);
+
+    uint64_t start_ns = now_ns();
+    uint64_t next_ns = start_ns;
+    for (uint32_t sequence = 1; !stop && (count == 0 || sent < count); sequence++) {
+        // Keep to the schedule: spinning mode never gives up the core
+        uint64_t now = now_ns();
+        while (now < next_ns && !stop) {
+            if (spin) {
+                lowlat_relax();
+            } else {
+                struct timespec ts = { .tv_sec = next_ns / 1000000000ull, .tv_nsec = next_ns % 1000000000ull };
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            }
+            now = now_ns();
+        }
+        if (stop) {
+            break;
+        }
+        next_ns += (uint64_t)interval_us * 1000;
+
+        size_t len = wire_echo_encode(buffer, sequence, now, payload);
+        uint64_t send_ns = now_ns();
+        if (shm_name != NULL ? shm_client_send(&shm, buffer, len, spin) < 0 : send(sockfd, buffer, len, 0) < 0) {
+            perror("send failed");
+            break;
+        }
+        sent++;
+
+        ssize_t n = shm_name != NULL ? ping_receive_shm(sequence, send_ns + PING_TIMEOUT_NS, &late)
+                                     : ping_receive(sockfd, reply, sequence, send_ns + PING_TIMEOUT_NS, &late);
+        if (n < 0) {
+            break;
+        }
+        if (n == 0) {
+            if (!stop) {
+                lost++;
+            } else {
+                sent--;  // Interrupted before the reply could arrive
+            }
+            continue;
+        }
+        hist_record(rtt, now_ns() - send_ns);
+        received++;
+    }
+    double seconds = (now_ns() - start_ns) / 1e9;
+
+    printf("--- %s ping statistics ---\n", peer);
+    printf("%ld sent, %ld received, %ld lost (%.2f%%), %ld late replies, %.3f s\n", sent, received, lost,
+           sent > 0 ? 100.0 * lost / sent : 0.0, late, seconds);
+    if (received > 0) {
+        printf("Min RTT: %.1f us\n", rtt->min / 1e3);
+        printf("p50 RTT: %.1f us\n", hist_percentile(rtt, 50) / 1e3);
+        printf("p90 RTT: %.1f us\n", hist_percentile(rtt, 90) / 1e3);
+        printf("p99 RTT: %.1f us\n", hist_percentile(rtt, 99) / 1e3);
+        printf("p99.9 RTT: %.1f us\n", hist_percentile(rtt, 99.9) / 1e3);
+        printf("Max RTT: %.1f us\n", rtt->max / 1e3);
+        printf("Average RTT: %.1f us\n", hist_mean(rtt) / 1e3);
+    }
+
+    if (shm_name != NULL) {
+        shm_client_detach(&shm);
+    } else {
+        close(sockfd);
+    }
+    free(rtt);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-p count] [-i interval_us] [-s size] [-Y] [-y usec] [-c cpu] [-M] [-F priority] <server_ip>\n"
+                    "       %s -p count -Z name [options] (same-host server11 -Z, no address)\n", prog, prog);
+    fprintf(stderr, "  Without -p, send one message read from stdin and print the echo\n");
+    fprintf(stderr, "  -p count     Ping mode: send 'count' pings (0 = until interrupted) and report RTT in us\n");
+    fprintf(stderr, "  -i us        Interval between pings (default %d us)\n", DEFAULT_INTERVAL_US);
+    fprintf(stderr, "  -s size      Ping payload size (0-%d, default %d bytes)\n", MAX_PAYLOAD, DEFAULT_PAYLOAD);
+    fprintf(stderr, "  -Z name      Ping over the shared-memory rings in /dev/shm/'name' instead of UDP\n");
+    fprintf(stderr, "  -Y           Spin: poll for the reply with MSG_DONTWAIT (or the ring) instead of blocking\n");
+    fprintf(stderr, "  -y usec      Busy-poll the device queue in the blocking receive (SO_BUSY_POLL)\n");
+    fprintf(stderr, "  -c cpu       Pin the client to this CPU (ideally an isolated core)\n");
+    fprintf(stderr, "  -M           Lock all memory (mlockall)\n");
+    fprintf(stderr, "  -F priority  Run as SCHED_FIFO at 'priority' (1-99; needs CAP_SYS_NICE)\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    long count = -1;  // -1 = interactive mode
+    long interval_us = DEFAULT_INTERVAL_US;
+    int payload = DEFAULT_PAYLOAD;
+    int cpu = -1;
+    int lock_memory = 0;
+    int fifo_priority = 0;
+
+    while ((opt = getopt(argc, argv, "p:i:s:Z:Yy:c:MF:h")) != -1) {
+        switch (opt) {
+            case 'p':
+                count = atol(optarg);
+                if (count < 0) {
+                    fprintf(stderr, "Invalid ping count: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'i':
+                interval_us = atol(optarg);
+                if (interval_us < 0) {
+                    fprintf(stderr, "Invalid interval: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                payload = atoi(optarg);
+                if (payload < 0 || payload > MAX_PAYLOAD) {
+                    fprintf(stderr, "Invalid payload size: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'Z':
+                shm_name = optarg;
+                break;
+            case 'Y':
+                spin = 1;
+                break;
+            case 'y':
+                busy_poll_usec = atoi(optarg);
+                if (busy_poll_usec < 1) {
+                    fprintf(stderr, "Invalid busy-poll time: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                cpu = atoi(optarg);
+                if (cpu < 0 || cpu >= CPU_SETSIZE) {
+                    fprintf(stderr, "Invalid CPU: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'M':
+                lock_memory = 1;
+                break;
+            case 'F':
+                fifo_priority = atoi(optarg);
+                if (fifo_priority < 1 || fifo_priority > 99) {
+                    fprintf(stderr, "Invalid SCHED_FIFO priority: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - (shm_name != NULL ? 0 : 1) || (shm_name != NULL && count < 0)) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Configure server address
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(PORT);
+    if (shm_name == NULL && inet_pton(AF_INET, argv[optind], &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid server address: %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (count < 0) {
+        return interactive() < 0 ? EXIT_FAILURE : 0;
+    }
+
+    if (cpu >= 0 && lowlat_pin(cpu) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (lock_memory && lowlat_lock_memory() < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (fifo_priority > 0 && lowlat_fifo(fifo_priority) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // No SA_RESTART: Ctrl-C must interrupt a blocking receive and print the statistics
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    return ping(count, interval_us, payload) < 0 ? EXIT_FAILURE : 0;
+}
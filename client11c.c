@@ -1,168 +1,1324 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include <arpa/inet.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #include <sys/time.h>
-#include <sys/wait.h>
+#include <limits.h>
+#include "histogram.h"
+#include "lowlat.h"
+#include "reliable.h"
+#include "shmring.h"
+#include "wire.h"
 
 #define PORT 10010
 #define BUFFER_SIZE 1038  // 2 + 4 + 8 + 1024 (max string length)
 #define NUM_MESSAGES 10000
+#define MAX_PAYLOAD 1024
+#define DEFAULT_RATE 1000        // Packets per second across all threads
+#define MAX_THREADS 64
+#define MAX_FLOWS 4096
+#define MAX_BATCH 64             // Datagrams per sendmmsg/recvmmsg call
+#define RECV_TIMEOUT_MS 20000    // Receiver gives up after this long without a datagram
+#define SPIN_THRESHOLD_NS 50000  // Spin instead of sleeping when the next send is this close
+#define DEFAULT_INTERVAL_MS 1000 // Width of one time-series interval
+#define OFFLOAD_BUFFER_SIZE 65536 // One UDP_GRO receive: up to 64 KB of coalesced echoes
+#define GSO_MAX_BYTES 65507       // Largest UDP payload one GSO send may carry
+#define SHM_POLL_NS 50000         // Longest sleep on one ring of a receiver that watches several
+#define MAX_WINDOW 65536          // Largest -A window per flow
+#define PROBE_MAX_SIZES 16        // Payload sizes one -P run may probe
+#define PROBE_MAX_STEPS 64        // Steps per payload size before the probe gives up converging
+#define PROBE_DRAIN_MS 500        // A probe step's receivers give up on lost echoes this soon
+#define PROBE_SETTLE_MS 100       // Pause between steps so the server's queues drain
+#define PROBE_MIN_ACHIEVED 0.95   // A step the client could not offer at this share of its rate is void
+#define PROBE_P99_INFLATION 4.0   // p99 above this multiple of the best p99 so far counts as congestion
+#define PROBE_DECREASE 0.75       // Multiplicative decrease after a congested step
+#define PROBE_CONVERGED 0.01      // Stop once the additive step is below this share of the rate
 
-// Sender process: Sends numbers to the server
-void sender(const char *server_ip, int sockfd, struct sockaddr_in *server_addr, socklen_t addr_len) {
-    char buffer[BUFFER_SIZE];
-    uint16_t total_length;
-    uint32_t sequence_number = 1;
-    uint64_t timestamp;
-    struct timeval start;
-
-    for (int i = 1; i <= NUM_MESSAGES; i++) {
-        // Get current time for the timestamp
-        gettimeofday(&start, NULL);
-        timestamp = (uint64_t)(start.tv_sec) * 1000 + (start.tv_usec / 1000);  // Timestamp in milliseconds
-
-        // Wrap sequence number at 2^32-1 (4294967295)
-        sequence_number = (sequence_number == 4294967295) ? 1 : sequence_number + 1;
-
-        // Convert fields to network byte order
-        sequence_number = htonl(sequence_number);
-        timestamp = htobe64(timestamp);
-
-        // Create the message to send
-        snprintf(buffer + 14, BUFFER_SIZE - 14, "%d", i);  // Place the message after the first 14 bytes
-
-        total_length = htons(14 + strlen(buffer + 14));  // Message length = 2 (length) + 4 (sequence) + 8 (timestamp) + message length
-        memcpy(buffer, &total_length, 2);               // 2 bytes for total message length
-        memcpy(buffer + 2, &sequence_number, 4);        // 4 bytes for sequence number
-        memcpy(buffer + 6, &timestamp, 8);              // 8 bytes for timestamp
-
-        // Send the message to the server
-        if (sendto(sockfd, buffer, ntohs(total_length), 0, (struct sockaddr *)server_addr, addr_len) < 0) {
-            perror("sendto failed");
-            close(sockfd);
-            exit(EXIT_FAILURE);
+// One flow: a connected socket with its own source port and sequence space,
+// or with -Z a shared-memory ring pair
+struct flow {
+    int sockfd;
+    struct shm_client shm;
+    uint32_t sequence_number;
+    int end_received;
+};
+
+// One load thread pair: a paced sender and a receiver over the same flows
+struct worker {
+    int id;
+    pthread_t sender_thread;
+    pthread_t receiver_thread;
+    struct flow *flows;
+    int num_flows;
+    long first_message;  // Messages are numbered first_message + 1 ..
+    long num_messages;
+    double rate;         // Packets per second for this worker; 0 = unpaced
+    long sent;
+    long send_errors;
+    uint64_t send_start_ns;
+    uint64_t send_end_ns;
+    long received;
+    struct histogram *rtt;           // Whole-run RTT in nanoseconds
+    struct histogram *interval_rtt;  // RTTs of the current interval, not yet merged
+    long current_slot;               // Interval being filled; LONG_MAX once the receiver exits
+    struct rel_stats rel;            // -A: reliability counters
+    uint64_t delivered_bytes;        // -A: payload bytes acknowledged
+    uint64_t shim_dropped;           // Packets the impairment shim dropped
+    uint64_t shim_reordered;         // Packets it held back
+};
+
+// One time-series interval. Receivers merge into 'rtt' until every receiver has
+// moved past the interval, then the percentiles are frozen and the histogram freed.
+struct interval {
+    struct histogram *rtt;
+    int final;
+    uint64_t received;
+    uint64_t p50, p90, p99, p999, max;
+};
+
+static struct sockaddr_in server_addr;
+static long num_messages = NUM_MESSAGES;
+static double target_rate = DEFAULT_RATE;
+static int num_threads = 1;
+static int num_flows = 1;
+static int payload_size = 0;  // 0 = just the decimal message number
+static int batch_size = 1;
+static int offload = 0;              // -g: GSO sends and GRO receives
+static _Atomic int offload_gso = 1;  // Cleared when the kernel refuses UDP_SEGMENT
+static uint16_t segment_size;        // Every datagram's size in offload mode
+static const char *shm_name;         // -Z: shared-memory transport instead of UDP
+static int spin = 0;                 // -Y: poll the shared-memory rings instead of sleeping
+static uint32_t rel_window = 0;      // -A: reliable delivery with this many messages in flight per flow
+static double loss_rate = 0;         // -L: impairment shim drop probability, each direction
+static double reorder_rate = 0;      // -O: impairment shim reorder probability
+static long loopback_rtt_us = -1;    // -X: no server; the shim echoes after this round trip
+static _Atomic unsigned char *received_map;  // One flag per message number of the current run
+static long message_base;            // Numbers of the current run start after this (-P steps never overlap)
+static int recv_timeout_ms = RECV_TIMEOUT_MS;
+static int probing = 0;              // -P: runs are probe steps, and timeouts are expected
+static uint64_t interval_ns = DEFAULT_INTERVAL_MS * 1000000ull;
+static uint64_t run_start_ns;
+
+static struct worker *workers;
+static pthread_mutex_t series_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct interval *series;
+static long series_len;  // Intervals reported (one past the last with samples)
+static long series_cap;  // Intervals allocated
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Sleep until an absolute CLOCK_MONOTONIC deadline; spin for the last stretch
+// because timer slack would otherwise cap the achievable rate
+static void wait_until(uint64_t deadline_ns) {
+    uint64_t now = now_ns();
+    if (deadline_ns > now + SPIN_THRESHOLD_NS) {
+        uint64_t wake = deadline_ns - SPIN_THRESHOLD_NS;
+        struct timespec ts = { .tv_sec = wake / 1000000000ull, .tv_nsec = wake % 1000000000ull };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
         }
+    }
+    while (now_ns() < deadline_ns) {
+    }
+}
 
-        usleep(1000);  // Sleep for 1 millisecond between sends
+// Build one message in place: the header followed by the decimal message number,
+// padded with spaces to 'pad' bytes. The timestamp is CLOCK_MONOTONIC nanoseconds,
+// echoed back unchanged by the server.
+static size_t pack_message(unsigned char *buffer, uint32_t sequence_number, uint64_t timestamp, long number, int pad) {
+    char *text = (char *)buffer + WIRE_ECHO_HEADER_SIZE;
+    size_t text_len = (size_t)snprintf(text, BUFFER_SIZE - WIRE_ECHO_HEADER_SIZE, "%ld", number);
+    if ((int)text_len < pad) {
+        memset(text + text_len, ' ', pad - text_len);  // parse_number stops at the padding
+        text_len = pad;
     }
+    return wire_echo_encode(buffer, sequence_number, timestamp, text_len);
+}
 
-    // Send termination signal
-    snprintf(buffer + 14, BUFFER_SIZE - 14, "END");
-    total_length = htons(14 + strlen(buffer + 14));
-    memcpy(buffer, &total_length, 2);               // 2 bytes for total message length
-    memcpy(buffer + 2, &sequence_number, 4);        // 4 bytes for sequence number
-    memcpy(buffer + 6, &timestamp, 8);              // 8 bytes for timestamp
+// Message number at the start of a payload of 'len' bytes; 0 if there is none
+static long parse_number(const unsigned char *payload, size_t len) {
+    long number = 0;
+    for (size_t i = 0; i < len && i < 19 && payload[i] >= '0' && payload[i] <= '9'; i++) {
+        number = number * 10 + (payload[i] - '0');
+    }
+    return number;
+}
 
-    sendto(sockfd, buffer, ntohs(total_length), 0, (struct sockaddr *)server_addr, addr_len);
-    printf("Sender finished sending messages\n");
+static uint32_t next_sequence(struct flow *f) {
+    // Wrap sequence number at 2^32-1 (4294967295)
+    f->sequence_number = (f->sequence_number == 4294967295u) ? 1 : f->sequence_number + 1;
+    return f->sequence_number;
+}
+
+// Sender: open-loop schedule. Batch k is due at start + k * batch / rate regardless
+// of how late earlier batches went out, so a stall does not lower the offered load.
+void *sender(void *arg) {
+    struct worker *w = (struct worker *)arg;
+    static __thread unsigned char buffers[MAX_BATCH][BUFFER_SIZE];
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iovs[MAX_BATCH];
+    long next = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < batch_size; i++) {
+        iovs[i].iov_base = buffers[i];
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    w->send_start_ns = now_ns();
+    for (long batch_index = 0; next < w->num_messages; batch_index++) {
+        struct flow *f = &w->flows[batch_index % w->num_flows];
+        int count = 0;
+
+        // Stamp paced messages with their scheduled time, so RTT includes any sender lag
+        uint64_t timestamp;
+        if (w->rate > 0) {
+            timestamp = w->send_start_ns + (uint64_t)(next * 1e9 / w->rate);
+            wait_until(timestamp);
+        } else {
+            timestamp = now_ns();
+        }
+
+        // Shared memory: build each message straight in the request ring and
+        // wake the server once per batch
+        if (shm_name != NULL) {
+            struct shm_ring *ring = &f->shm.slot->requests;
+            while (count < batch_size && next < w->num_messages) {
+                struct shm_frame *frame = shm_ring_reserve(ring);
+                if (frame == NULL) {
+                    shm_notify_server(f->shm.seg);
+                    if (spin) {
+                        sched_yield();
+                    } else {
+                        shm_ring_wait_space(ring, 0);
+                    }
+                    continue;
+                }
+                size_t len = pack_message(frame->data, next_sequence(f), timestamp, w->first_message + next + 1, payload_size);
+                shm_ring_publish(ring, (uint32_t)len);
+                count++;
+                next++;
+            }
+            shm_notify_server(f->shm.seg);
+            w->sent += count;
+            continue;
+        }
+
+        while (count < batch_size && next < w->num_messages) {
+            iovs[count].iov_len = pack_message(buffers[count], next_sequence(f), timestamp, w->first_message + next + 1, payload_size);
+            count++;
+            next++;
+        }
+
+        // Offload: the batch goes out as one GSO send that the kernel splits into
+        // 'count' datagrams of segment_size bytes each
+        if (offload && atomic_load_explicit(&offload_gso, memory_order_relaxed)) {
+            union {
+                struct cmsghdr align;
+                unsigned char buf[CMSG_SPACE(sizeof(uint16_t))];
+            } control;
+            struct msghdr msg = { .msg_iov = iovs, .msg_iovlen = count, .msg_control = control.buf,
+                                  .msg_controllen = sizeof(control.buf) };
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+
+            ssize_t n;
+            while ((n = sendmsg(f->sockfd, &msg, 0)) < 0 && errno == EINTR) {
+            }
+            if (n >= 0) {
+                w->sent += count;
+                continue;
+            }
+            if (errno != EIO && errno != EINVAL && errno != ENOPROTOOPT) {
+                w->send_errors += count;
+                continue;
+            }
+            if (atomic_exchange(&offload_gso, 0)) {
+                fprintf(stderr, "UDP_SEGMENT send failed (%s), using sendmmsg\n", strerror(errno));
+            }
+        }
+
+        int done = 0;
+        while (done < count) {
+            int n = sendmmsg(f->sockfd, msgs + done, count - done, 0);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                w->send_errors++;  // e.g. ECONNREFUSED from an earlier ICMP error; skip one datagram
+                done++;
+                continue;
+            }
+            done += n;
+            w->sent += n;
+        }
+    }
+    w->send_end_ns = now_ns();
+
+    // Send termination signal on every flow
+    for (int i = 0; i < w->num_flows; i++) {
+        unsigned char buffer[BUFFER_SIZE];
+        size_t len = wire_echo_encode_end(buffer, next_sequence(&w->flows[i]), now_ns());
+        if (shm_name != NULL) {
+            shm_client_send(&w->flows[i].shm, buffer, len, spin);
+        } else {
+            send(w->flows[i].sockfd, buffer, len, 0);
+        }
+    }
+    return NULL;
 }
 
-// Receiver process: Receives messages from the server and prints statistics
-void receiver(int sockfd) {
-    struct sockaddr_in server_addr;
-    socklen_t addr_len = sizeof(server_addr);
-    char buffer[BUFFER_SIZE];
-    int missing[NUM_MESSAGES] = {0};
-    int received_count = 0;
-    long min_rtt = 100000, max_rtt = 0, total_rtt = 0;
+static void interval_finalize(struct interval *iv) {
+    if (iv->final) {
+        return;
+    }
+    if (iv->rtt != NULL) {
+        iv->received = iv->rtt->total;
+        iv->p50 = hist_percentile(iv->rtt, 50);
+        iv->p90 = hist_percentile(iv->rtt, 90);
+        iv->p99 = hist_percentile(iv->rtt, 99);
+        iv->p999 = hist_percentile(iv->rtt, 99.9);
+        iv->max = iv->rtt->total ? iv->rtt->max : 0;
+        free(iv->rtt);
+        iv->rtt = NULL;
+    }
+    iv->final = 1;
+}
 
-    struct timeval start, end;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &(struct timeval){20, 0}, sizeof(struct timeval));
+// Merge the worker's pending interval into the series and move it to new_slot.
+// Intervals every receiver has left behind are finalized so memory stays bounded.
+static void series_advance(struct worker *w, long new_slot) {
+    pthread_mutex_lock(&series_lock);
 
-    while (received_count < NUM_MESSAGES) {
-        gettimeofday(&start, NULL);
+    long slot = w->current_slot;
+    if (w->interval_rtt->total > 0) {
+        if (slot >= series_cap) {
+            long new_cap = series_cap ? series_cap : 64;
+            while (new_cap <= slot) {
+                new_cap *= 2;
+            }
+            struct interval *grown = realloc(series, new_cap * sizeof(*series));
+            if (grown == NULL) {
+                pthread_mutex_unlock(&series_lock);
+                hist_reset(w->interval_rtt);  // Drop this interval rather than the run
+                w->current_slot = new_slot;
+                return;
+            }
+            memset(grown + series_cap, 0, (new_cap - series_cap) * sizeof(*series));
+            series = grown;
+            series_cap = new_cap;
+        }
+        if (slot >= series_len) {
+            series_len = slot + 1;
+        }
+        struct interval *iv = &series[slot];
+        if (iv->rtt == NULL && !iv->final) {
+            iv->rtt = hist_create();
+        }
+        if (iv->rtt != NULL) {
+            hist_merge(iv->rtt, w->interval_rtt);
+        }
+        hist_reset(w->interval_rtt);
+    }
+    w->current_slot = new_slot;
+
+    long oldest = LONG_MAX;
+    for (int i = 0; i < num_threads; i++) {
+        if (workers[i].current_slot < oldest) {
+            oldest = workers[i].current_slot;
+        }
+    }
+    for (long i = 0; i < series_len && i < oldest; i++) {
+        interval_finalize(&series[i]);
+    }
+
+    pthread_mutex_unlock(&series_lock);
+}
 
-        ssize_t bytes_received = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&server_addr, &addr_len);
-        if (bytes_received < 0) {
-            perror("recvfrom failed or timed out");
+// Account one echoed datagram received at 'now'
+static void receive_echo(struct worker *w, struct flow *f, const unsigned char *buffer, unsigned int len,
+                         uint64_t now, int *ends) {
+    struct wire_echo m = wire_echo_decode(buffer, len);
+    if (!m.valid) {
+        return;  // Truncated or corrupted echo
+    }
+
+    // Check if the received message contains the "END" signal
+    if (m.end) {
+        if (!f->end_received) {
+            f->end_received = 1;
+            (*ends)++;
+        }
+        return;
+    }
+
+    // Extract the number part from the message
+    long received_number = parse_number(buffer + WIRE_ECHO_HEADER_SIZE, len - WIRE_ECHO_HEADER_SIZE);
+    if (received_number <= message_base || received_number > message_base + num_messages) {
+        return;  // Not this run's: garbled, or a late echo from an earlier probe step
+    }
+    if (atomic_exchange_explicit(&received_map[received_number - message_base - 1], 1, memory_order_relaxed)) {
+        return;  // Duplicate
+    }
+    w->received++;
+
+    uint64_t rtt = now > m.timestamp ? now - m.timestamp : 0;
+    hist_record(w->rtt, rtt);
+    hist_record(w->interval_rtt, rtt);
+}
+
+// Segment size of a UDP_GRO receive, or 0 if the kernel did not coalesce it
+static unsigned int gro_segment_size(struct msghdr *msg) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            return size > 0 ? (unsigned int)size : 0;
+        }
+    }
+    return 0;
+}
+
+// Shared-memory receiver: drains the echo ring of every flow of its worker.
+// With one flow it sleeps on that ring; with several it sleeps on each in
+// turn for at most SHM_POLL_NS, as a ring has nothing like epoll.
+static void receive_shm(struct worker *w) {
+    int ends = 0;
+    uint64_t last_ns = now_ns();
+    int turn = 0;
+
+    while (ends < w->num_flows) {
+        int got = 0;
+        uint64_t now = now_ns();
+        long slot = (long)((now - run_start_ns) / interval_ns);
+        if (slot != w->current_slot) {
+            series_advance(w, slot);
+        }
+        for (int i = 0; i < w->num_flows; i++) {
+            struct flow *f = &w->flows[i];
+            struct shm_frame *frame;
+            int drained = 0;
+            while ((frame = shm_ring_peek(&f->shm.slot->echoes)) != NULL) {
+                uint32_t len = frame->len < SHM_FRAME_MAX ? frame->len : SHM_FRAME_MAX;
+                receive_echo(w, f, frame->data, len, now, &ends);
+                shm_ring_consume(&f->shm.slot->echoes);
+                drained++;
+            }
+            got += drained;
+            if (drained) {
+                shm_notify_server(f->shm.seg);  // The server holds requests back while this ring is full
+            }
+        }
+        if (got) {
+            last_ns = now;
+            continue;
+        }
+
+        if (now - last_ns >= recv_timeout_ms * 1000000ull) {
+            if (!probing) {
+                fprintf(stderr, "Shared-memory receive timed out: no echo for %d ms\n", recv_timeout_ms);
+            }
             break;
         }
+        if (spin) {
+            lowlat_relax();
+        } else if (w->num_flows == 1) {
+            shm_ring_wait_data(&w->flows[0].shm.slot->echoes, recv_timeout_ms * 1000000ull);
+        } else {
+            shm_ring_wait_data(&w->flows[turn++ % w->num_flows].shm.slot->echoes, SHM_POLL_NS);
+        }
+    }
+}
 
-        buffer[bytes_received] = '\0';
+// Receiver: drains every flow of its worker until each has echoed END or it times out
+void *receiver(void *arg) {
+    struct worker *w = (struct worker *)arg;
+    static __thread unsigned char buffers[MAX_BATCH][BUFFER_SIZE];
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iovs[MAX_BATCH];
+    union {
+        struct cmsghdr align;
+        unsigned char buf[CMSG_SPACE(sizeof(int))];
+    } controls[MAX_BATCH];
+    struct epoll_event events[64];
+    int ends = 0;
 
-        // Extract message length, sequence number, and timestamp
-        uint16_t total_length;
-        uint32_t sequence_number;
-        uint64_t timestamp;
-        memcpy(&total_length, buffer, 2);
-        memcpy(&sequence_number, buffer + 2, 4);
-        memcpy(&timestamp, buffer + 6, 8);
+    if (shm_name != NULL) {
+        receive_shm(w);
+        series_advance(w, LONG_MAX);
+        return NULL;
+    }
 
-        // Convert fields from network byte order to host byte order
-        total_length = ntohs(total_length);
-        sequence_number = ntohl(sequence_number);
-        timestamp = be64toh(timestamp);
+    // Offload mode receives whole GRO runs, which need 64 KB buffers
+    unsigned char *gro_buffers = NULL;
+    size_t buffer_size = BUFFER_SIZE;
+    if (offload) {
+        gro_buffers = malloc((size_t)MAX_BATCH * OFFLOAD_BUFFER_SIZE);
+        if (gro_buffers == NULL) {
+            perror("malloc failed");
+            return NULL;
+        }
+        buffer_size = OFFLOAD_BUFFER_SIZE;
+    }
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1 failed");
+        free(gro_buffers);
+        return NULL;
+    }
+    for (int i = 0; i < w->num_flows; i++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &w->flows[i] };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, w->flows[i].sockfd, &ev);
+    }
 
-        // Check if the received message contains the "END" signal
-        if (strcmp(buffer + 14, "END") == 0) {
+    while (ends < w->num_flows) {
+        int n = epoll_wait(epfd, events, 64, recv_timeout_ms);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            break;
+        }
+        if (n == 0) {
+            if (!probing) {
+                fprintf(stderr, "recvfrom failed or timed out: no reply for %d ms\n", recv_timeout_ms);
+            }
             break;
         }
 
-        int received_number = atoi(buffer + 14);  // Extract the number part from the message
+        for (int e = 0; e < n; e++) {
+            struct flow *f = events[e].data.ptr;
+
+            for (int i = 0; i < MAX_BATCH; i++) {
+                iovs[i].iov_base = offload ? gro_buffers + (size_t)i * OFFLOAD_BUFFER_SIZE : buffers[i];
+                iovs[i].iov_len = buffer_size;
+                memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                if (offload) {
+                    msgs[i].msg_hdr.msg_control = controls[i].buf;
+                    msgs[i].msg_hdr.msg_controllen = sizeof(controls[i].buf);
+                }
+            }
+            int received = recvmmsg(f->sockfd, msgs, MAX_BATCH, MSG_DONTWAIT, NULL);
+            if (received < 0) {
+                continue;  // EAGAIN, or an ICMP error queued on the socket
+            }
 
-        if (received_number >= 1 && received_number <= NUM_MESSAGES) {
-            missing[received_number - 1] = 1;
-            received_count++;
+            uint64_t now = now_ns();
+            long slot = (long)((now - run_start_ns) / interval_ns);
+            if (slot != w->current_slot) {
+                series_advance(w, slot);
+            }
 
-            gettimeofday(&end, NULL);
-            long rtt = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
-            total_rtt += rtt;
-            if (rtt < min_rtt) min_rtt = rtt;
-            if (rtt > max_rtt) max_rtt = rtt;
+            for (int i = 0; i < received; i++) {
+                unsigned char *data = iovs[i].iov_base;
+                unsigned int len = msgs[i].msg_len;
+                unsigned int step = offload ? gro_segment_size(&msgs[i].msg_hdr) : 0;
+                if (step == 0) {
+                    step = len ? len : 1;
+                }
+                // A GRO run is split back into the datagrams the server echoed
+                for (unsigned int off = 0; off < len; off += step) {
+                    receive_echo(w, f, data + off, len - off < step ? len - off : step, now, &ends);
+                }
+            }
         }
     }
 
-    // Summary report
-    int missing_count = 0;
-    for (int i = 0; i < NUM_MESSAGES; i++) {
-        if (missing[i] == 0) {
-            missing_count++;
+    series_advance(w, LONG_MAX);
+    close(epfd);
+    free(gro_buffers);
+    return NULL;
+}
+
+// Reliable mode state of one worker thread, which both sends and receives
+struct reliable {
+    struct worker *w;
+    struct rel_sender *rel;
+    struct rel_shim *shim;  // NULL without -L, -O or -X
+};
+
+// Put one message on the wire, through the impairment shim if there is one
+static void reliable_transmit(struct reliable *r, uint32_t flow, const unsigned char *buf, size_t len, uint64_t now) {
+    if (r->shim != NULL && !rel_shim_out(r->shim, flow, buf, len, now)) {
+        return;
+    }
+    while (send(r->w->flows[flow].sockfd, buf, len, 0) < 0 && errno == EINTR) {
+    }
+}
+
+// Account one echo: the first one of each message is its delivery
+static void reliable_receive(struct reliable *r, uint32_t flow, const unsigned char *buf, unsigned int len, uint64_t now) {
+    struct worker *w = r->w;
+    struct wire_echo m = wire_echo_decode(buf, len);
+    if (!m.valid || m.end) {
+        return;
+    }
+    long number = parse_number(buf + WIRE_ECHO_HEADER_SIZE, len - WIRE_ECHO_HEADER_SIZE);
+    uint64_t first_ns;
+    if (rel_ack(r->rel, flow, m.sequence, (uint64_t)number, m.timestamp, now, &first_ns) != REL_ACK_NEW) {
+        return;
+    }
+    atomic_store_explicit(&received_map[number - message_base - 1], 1, memory_order_relaxed);
+    w->received++;
+    w->delivered_bytes += len - WIRE_ECHO_HEADER_SIZE;
+
+    // Delivery latency: from when the message was due to its first echo, retransmissions included
+    uint64_t latency = now > first_ns ? now - first_ns : 0;
+    hist_record(w->rtt, latency);
+    hist_record(w->interval_rtt, latency);
+}
+
+// Reliable mode (-A): one thread per worker keeps a sliding window per flow,
+// retransmits on timeouts and gaps, and stops once every message is
+// acknowledged or abandoned, so loss costs retransmissions rather than data
+// and never a receive timeout
+void *reliable_worker(void *arg) {
+    struct worker *w = (struct worker *)arg;
+    static __thread unsigned char buffers[MAX_BATCH][BUFFER_SIZE];
+    unsigned char buffer[BUFFER_SIZE];
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iovs[MAX_BATCH];
+    struct rel_shim_packet held;
+    struct reliable r = { .w = w };
+    int loopback = loopback_rtt_us >= 0;
+    long next = 0;
+    uint32_t next_flow = 0;
+
+    struct pollfd *pfds = calloc(w->num_flows, sizeof(*pfds));
+    w->send_start_ns = now_ns();
+    r.rel = rel_create(w->num_flows, rel_window, w->send_start_ns);
+    if (loss_rate > 0 || reorder_rate > 0 || loopback) {
+        r.shim = rel_shim_create(loss_rate, reorder_rate, loopback, (uint64_t)loopback_rtt_us * 1000,
+                                 0x9E3779B97F4A7C15ull * (w->id + 1));
+    }
+    if (pfds == NULL || r.rel == NULL || (r.shim == NULL && (loss_rate > 0 || reorder_rate > 0 || loopback))) {
+        perror("malloc failed");
+        free(pfds);
+        rel_destroy(r.rel);
+        rel_shim_destroy(r.shim);
+        return NULL;
+    }
+    for (int i = 0; i < w->num_flows; i++) {
+        pfds[i].fd = w->flows[i].sockfd;
+        pfds[i].events = POLLIN;
+    }
+
+    while (1) {
+        uint64_t now = now_ns();
+        long slot = (long)((now - run_start_ns) / interval_ns);
+        if (slot != w->current_slot) {
+            series_advance(w, slot);
+        }
+
+        // Packets the shim held back: delayed requests go out, echoes come in
+        while (r.shim != NULL && rel_shim_due(r.shim, now, &held)) {
+            if (held.kind == REL_SHIM_SEND) {
+                send(w->flows[held.flow].sockfd, held.data, held.len, 0);
+            } else if (held.kind == REL_SHIM_DELIVER || rel_shim_in(r.shim, held.flow, held.data, held.len, now)) {
+                reliable_receive(&r, held.flow, held.data, held.len, now);
+            }
+        }
+
+        for (int i = 0; !loopback && i < w->num_flows; i++) {
+            for (int j = 0; j < MAX_BATCH; j++) {
+                iovs[j].iov_base = buffers[j];
+                iovs[j].iov_len = BUFFER_SIZE;
+                memset(&msgs[j].msg_hdr, 0, sizeof(msgs[j].msg_hdr));
+                msgs[j].msg_hdr.msg_iov = &iovs[j];
+                msgs[j].msg_hdr.msg_iovlen = 1;
+            }
+            int received = recvmmsg(w->flows[i].sockfd, msgs, MAX_BATCH, MSG_DONTWAIT, NULL);
+            for (int j = 0; j < received; j++) {
+                if (r.shim == NULL || rel_shim_in(r.shim, i, buffers[j], msgs[j].msg_len, now)) {
+                    reliable_receive(&r, i, buffers[j], msgs[j].msg_len, now);
+                }
+            }
+        }
+
+        // Timeouts and gaps; a retransmission carries the current time so its echo is a clean RTT sample
+        uint32_t flow, sequence;
+        uint64_t number;
+        int action;
+        while ((action = rel_next_expired(r.rel, now, &flow, &sequence, &number)) != 0) {
+            if (action == REL_RESEND) {
+                size_t len = pack_message(buffer, sequence, now, (long)number, payload_size);
+                reliable_transmit(&r, flow, buffer, len, now);
+            }
+        }
+
+        // New messages keep to the open-loop schedule while the window has room
+        uint64_t due_ns = now;
+        while (next < w->num_messages) {
+            due_ns = w->rate > 0 ? w->send_start_ns + (uint64_t)(next * 1e9 / w->rate) : now;
+            if (due_ns > now || !rel_can_send(r.rel, next_flow)) {
+                break;
+            }
+            long number = w->first_message + next + 1;
+            uint32_t sequence = rel_send(r.rel, next_flow, (uint64_t)number, due_ns, now);
+            w->flows[next_flow].sequence_number = sequence;
+            size_t len = pack_message(buffer, sequence, now, number, payload_size);
+            reliable_transmit(&r, next_flow, buffer, len, now);
+            w->sent++;
+            next++;
+            next_flow = (next_flow + 1) % w->num_flows;
+        }
+        if (next == w->num_messages && rel_idle(r.rel)) {
+            break;
+        }
+
+        // Sleep until an echo arrives, the next message is due (if the window
+        // has room), the next timer tick, or the shim releases a packet
+        uint64_t wake = rel_next_deadline(r.rel);
+        if (next < w->num_messages && rel_can_send(r.rel, next_flow) && due_ns < wake) {
+            wake = due_ns;
+        }
+        if (r.shim != NULL && rel_shim_next_ns(r.shim) < wake) {
+            wake = rel_shim_next_ns(r.shim);
+        }
+        now = now_ns();
+        if (wake > now) {
+            uint64_t wait = wake - now;
+            struct timespec ts = { .tv_sec = wait / 1000000000ull, .tv_nsec = wait % 1000000000ull };
+            ppoll(pfds, loopback ? 0 : w->num_flows, wake == UINT64_MAX ? NULL : &ts, NULL);
         }
     }
+    w->send_end_ns = now_ns();
 
+    // END goes out once, unimpaired; the server only uses it for its session report
+    for (int i = 0; !loopback && i < w->num_flows; i++) {
+        size_t len = wire_echo_encode_end(buffer, next_sequence(&w->flows[i]), now_ns());
+        send(w->flows[i].sockfd, buffer, len, 0);
+    }
+
+    w->rel = r.rel->stats;
+    if (r.shim != NULL) {
+        w->shim_dropped = r.shim->dropped;
+        w->shim_reordered = r.shim->reordered;
+    }
+    series_advance(w, LONG_MAX);
+    rel_destroy(r.rel);
+    rel_shim_destroy(r.shim);
+    free(pfds);
+    return NULL;
+}
+
+static int open_flow(struct flow *f) {
+    f->sequence_number = 0;
+    f->end_received = 0;
+    if (shm_name != NULL) {
+        f->sockfd = -1;
+        return shm_client_attach(shm_name, &f->shm);  // Registering assigns the flow a ring pair
+    }
+    if (loopback_rtt_us >= 0) {
+        f->sockfd = -1;  // The impairment shim plays the server
+        return 0;
+    }
+
+    f->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (f->sockfd < 0) {
+        perror("socket failed");
+        return -1;
+    }
+
+    // Connecting fixes the peer and gives the flow its own ephemeral source port
+    if (connect(f->sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("connect failed");
+        close(f->sockfd);
+        return -1;
+    }
+
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(f->sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    // Without UDP_GRO the kernel splits coalesced echoes again, which only costs speed
+    int on = 1;
+    if (offload && setsockopt(f->sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+        static int warned;
+        if (!warned++) {
+            perror("setsockopt(UDP_GRO) failed, receiving echoes one by one");
+        }
+    }
+    return 0;
+}
+
+// Aggregate results of a run, shared by the text, JSON and CSV reports
+struct report {
+    long sent;
+    long send_errors;
+    double send_seconds;
+    long received;
+    long missing;
+    struct histogram *rtt;
+    struct rel_stats rel;      // -A only
+    uint64_t delivered_bytes;
+    uint64_t shim_dropped;
+    uint64_t shim_reordered;
+};
+
+static void write_json(FILE *out, const struct report *r) {
+    const struct histogram *h = r->rtt;
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\"messages\": %ld, \"target_rate\": %.0f, \"threads\": %d, \"flows\": %d, "
+                 "\"payload\": %d, \"batch\": %d, \"interval_ms\": %lu},\n",
+            num_messages, target_rate, num_threads, num_flows, payload_size, batch_size,
+            (unsigned long)(interval_ns / 1000000));
+    fprintf(out, "  \"sent\": %ld,\n  \"send_errors\": %ld,\n  \"achieved_rate\": %.0f,\n",
+            r->sent, r->send_errors, r->send_seconds > 0 ? r->sent / r->send_seconds : 0.0);
+    fprintf(out, "  \"received\": %ld,\n  \"missing\": %ld,\n", r->received, r->missing);
+    fprintf(out, "  \"rtt_ns\": {\"min\": %lu, \"mean\": %.0f, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, "
+                 "\"p99_9\": %lu, \"max\": %lu},\n",
+            (unsigned long)(h->total ? h->min : 0), hist_mean(h),
+            (unsigned long)hist_percentile(h, 50), (unsigned long)hist_percentile(h, 90),
+            (unsigned long)hist_percentile(h, 99), (unsigned long)hist_percentile(h, 99.9),
+            (unsigned long)(h->total ? h->max : 0));
+    if (rel_window > 0) {
+        fprintf(out, "  \"reliable\": {\"window\": %u, \"delivered\": %lu, \"goodput_bytes_per_s\": %.0f, "
+                     "\"retransmits\": %lu, \"fast_retransmits\": %lu, \"timeouts\": %lu, \"duplicates\": %lu, "
+                     "\"stray\": %lu, \"abandoned\": %lu, \"shim_dropped\": %lu, \"shim_reordered\": %lu},\n",
+                rel_window, (unsigned long)r->rel.delivered,
+                r->send_seconds > 0 ? r->delivered_bytes / r->send_seconds : 0.0,
+                (unsigned long)r->rel.retransmits, (unsigned long)r->rel.fast_retransmits,
+                (unsigned long)r->rel.timeouts, (unsigned long)r->rel.duplicates, (unsigned long)r->rel.stray,
+                (unsigned long)r->rel.abandoned, (unsigned long)r->shim_dropped, (unsigned long)r->shim_reordered);
+    }
+    fprintf(out, "  \"series\": [");
+    for (long i = 0; i < series_len; i++) {
+        const struct interval *iv = &series[i];
+        fprintf(out, "%s\n    {\"t\": %.3f, \"received\": %lu, \"rate\": %.0f, \"p50\": %lu, \"p90\": %lu, "
+                     "\"p99\": %lu, \"p99_9\": %lu, \"max\": %lu}",
+                i ? "," : "", i * interval_ns / 1e9, (unsigned long)iv->received, iv->received / (interval_ns / 1e9),
+                (unsigned long)iv->p50, (unsigned long)iv->p90, (unsigned long)iv->p99,
+                (unsigned long)iv->p999, (unsigned long)iv->max);
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+static void write_csv(FILE *out) {
+    fprintf(out, "interval_start_s,received,rate_pps,p50_ns,p90_ns,p99_ns,p99_9_ns,max_ns\n");
+    for (long i = 0; i < series_len; i++) {
+        const struct interval *iv = &series[i];
+        fprintf(out, "%.3f,%lu,%.0f,%lu,%lu,%lu,%lu,%lu\n",
+                i * interval_ns / 1e9, (unsigned long)iv->received, iv->received / (interval_ns / 1e9),
+                (unsigned long)iv->p50, (unsigned long)iv->p90, (unsigned long)iv->p99,
+                (unsigned long)iv->p999, (unsigned long)iv->max);
+    }
+}
+
+// Write the JSON (or CSV) report to 'path'; "-" means stdout
+static void write_report_file(const char *path, const struct report *r, int json) {
+    FILE *out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (out == NULL) {
+        perror("fopen report failed");
+        return;
+    }
+    if (json) {
+        write_json(out, r);
+    } else {
+        write_csv(out);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+}
+
+// One run: num_messages at target_rate, numbered after message_base, split
+// as evenly as possible over the workers. Fills 'r' (whose rtt histogram is
+// reset) and leaves the time series of the run in 'series'.
+static void run_load(struct report *r) {
+    free((void *)received_map);
+    received_map = calloc(num_messages, 1);
+    if (received_map == NULL) {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < series_len; i++) {
+        free(series[i].rtt);
+    }
+    free(series);
+    series = NULL;
+    series_len = series_cap = 0;
+
+    long first = message_base;
+    for (int i = 0; i < num_threads; i++) {
+        struct worker *w = &workers[i];
+        w->num_messages = num_messages / num_threads + (i < num_messages % num_threads);
+        w->first_message = first;
+        w->rate = target_rate * w->num_messages / num_messages;
+        w->sent = w->send_errors = w->received = 0;
+        w->current_slot = 0;
+        hist_reset(w->rtt);
+        hist_reset(w->interval_rtt);
+        for (int j = 0; j < w->num_flows; j++) {
+            w->flows[j].end_received = 0;
+        }
+        first += w->num_messages;
+    }
+
+    run_start_ns = now_ns();
+    for (int i = 0; i < num_threads; i++) {
+        if (rel_window > 0) {
+            if (pthread_create(&workers[i].sender_thread, NULL, reliable_worker, &workers[i]) != 0) {
+                perror("pthread_create failed");
+                exit(EXIT_FAILURE);
+            }
+        } else if (pthread_create(&workers[i].receiver_thread, NULL, receiver, &workers[i]) != 0 ||
+                   pthread_create(&workers[i].sender_thread, NULL, sender, &workers[i]) != 0) {
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct histogram *rtt = r->rtt;
+    memset(r, 0, sizeof(*r));
+    r->rtt = rtt;
+    hist_reset(r->rtt);
+    uint64_t send_start = UINT64_MAX, send_end = 0;
+    for (int i = 0; i < num_threads; i++) {
+        struct worker *w = &workers[i];
+        pthread_join(w->sender_thread, NULL);
+        if (rel_window == 0) {
+            pthread_join(w->receiver_thread, NULL);
+        }
+        r->sent += w->sent;
+        r->send_errors += w->send_errors;
+        r->received += w->received;
+        hist_merge(r->rtt, w->rtt);
+        r->rel.sent += w->rel.sent;
+        r->rel.retransmits += w->rel.retransmits;
+        r->rel.fast_retransmits += w->rel.fast_retransmits;
+        r->rel.timeouts += w->rel.timeouts;
+        r->rel.delivered += w->rel.delivered;
+        r->rel.duplicates += w->rel.duplicates;
+        r->rel.stray += w->rel.stray;
+        r->rel.abandoned += w->rel.abandoned;
+        r->delivered_bytes += w->delivered_bytes;
+        r->shim_dropped += w->shim_dropped;
+        r->shim_reordered += w->shim_reordered;
+        if (w->send_start_ns < send_start) send_start = w->send_start_ns;
+        if (w->send_end_ns > send_end) send_end = w->send_end_ns;
+    }
+
+    for (long i = 0; i < series_len; i++) {
+        interval_finalize(&series[i]);
+    }
+    r->send_seconds = (send_end - send_start) / 1e9;
+    r->missing = num_messages - r->received;
+}
+
+static void print_report(const struct report *report) {
+    long sent = report->sent, send_errors = report->send_errors, received_count = report->received;
+    long missing_count = report->missing;
+    double send_seconds = report->send_seconds;
+
+    printf("Sender finished sending messages\n");
     printf("Summary Report:\n");
-    printf("Total messages received: %d\n", received_count);
-    printf("Missing messages: %d\n", missing_count);
+    printf("Threads: %d, flows: %d, payload: %d bytes, batch: %d%s\n", num_threads, num_flows, payload_size, batch_size,
+           shm_name != NULL ? (spin ? ", shared memory (spinning)" : ", shared memory") :
+           !offload ? "" : offload_gso ? ", GSO/GRO offload" : ", GRO offload (GSO unavailable)");
+    if (target_rate > 0) {
+        printf("Target rate: %.0f pps\n", target_rate);
+    } else {
+        printf("Target rate: unpaced\n");
+    }
+    printf("Achieved rate: %.0f pps (%ld sent in %.3f s, %ld send errors)\n",
+           send_seconds > 0 ? sent / send_seconds : 0.0, sent, send_seconds, send_errors);
+    printf("Total messages received: %ld\n", received_count);
+    printf("Missing messages: %ld\n", missing_count);
+    if (rel_window > 0) {
+        const struct rel_stats *rs = &report->rel;
+        printf("Reliable delivery: window %u per flow%s\n", rel_window,
+               loopback_rtt_us >= 0 ? ", offline loopback" : "");
+        printf("Goodput: %.0f msg/s, %.2f MB/s\n", send_seconds > 0 ? rs->delivered / send_seconds : 0.0,
+               send_seconds > 0 ? report->delivered_bytes / send_seconds / 1e6 : 0.0);
+        printf("Retransmits: %lu (%.2f%% of first sends; %lu fast, %lu timeouts), abandoned: %lu\n",
+               (unsigned long)rs->retransmits, rs->sent ? 100.0 * rs->retransmits / rs->sent : 0.0,
+               (unsigned long)rs->fast_retransmits, (unsigned long)rs->timeouts, (unsigned long)rs->abandoned);
+        printf("Duplicate echoes: %lu, stray: %lu\n", (unsigned long)rs->duplicates, (unsigned long)rs->stray);
+        if (loss_rate > 0 || reorder_rate > 0) {
+            printf("Impairment: %.1f%% loss, %.1f%% reorder; %lu packets dropped, %lu held back\n",
+                   loss_rate * 100, reorder_rate * 100, (unsigned long)report->shim_dropped,
+                   (unsigned long)report->shim_reordered);
+        }
+        printf("Latencies below are delivery latencies: from when a message was due to its first echo\n");
+    }
     if (received_count > 0) {
-        printf("Min RTT: %ld ms\n", min_rtt);
-        printf("Max RTT: %ld ms\n", max_rtt);
-        printf("Average RTT: %ld ms\n", total_rtt / received_count);
+        printf("Min RTT: %.1f us\n", report->rtt->min / 1e3);
+        printf("p50 RTT: %.1f us\n", hist_percentile(report->rtt, 50) / 1e3);
+        printf("p90 RTT: %.1f us\n", hist_percentile(report->rtt, 90) / 1e3);
+        printf("p99 RTT: %.1f us\n", hist_percentile(report->rtt, 99) / 1e3);
+        printf("p99.9 RTT: %.1f us\n", hist_percentile(report->rtt, 99.9) / 1e3);
+        printf("Max RTT: %.1f us\n", report->rtt->max / 1e3);
+        printf("Average RTT: %.1f us\n", hist_mean(report->rtt) / 1e3);
     }
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <server_ip>\n", argv[0]);
-        exit(EXIT_FAILURE);
+// Outcome of one probe for one payload size
+struct probe_result {
+    int payload;
+    double max_rate;  // Highest achieved rate of a clean step; 0 if none was clean
+    uint64_t p50_ns;  // Latency of that step
+    uint64_t p99_ns;
+    int steps;
+};
+
+// Find the highest rate the server sustains for one payload size, AIMD style:
+// each step is a run of one interval (-i) at a fixed rate. A clean step (no
+// loss, p99 within PROBE_P99_INFLATION of the best so far, and the client
+// able to offer the rate) raises the rate; any other step lowers it by
+// PROBE_DECREASE once a repeat at the same rate confirms it (one scheduling
+// hiccup easily spoils a single p99). Until the first congestion the rate
+// doubles, as in slow start, so the knee is found in a logarithmic number of
+// steps; after that it grows additively, and every further backoff halves the
+// increment so the sawtooth narrows onto the knee.
+static struct probe_result probe_size(int payload, double start_rate, struct report *r) {
+    struct probe_result result = { .payload = payload };
+    double step_seconds = interval_ns / 1e9;
+    double rate = start_rate;
+    double increase = 0;  // 0 while in slow start
+    uint64_t best_p99 = UINT64_MAX;
+    int confirming = 0;   // This step repeats a congested one
+
+    payload_size = payload;
+    printf("Payload %d bytes:\n", payload);
+    while (result.steps < PROBE_MAX_STEPS && rate >= 1) {
+        target_rate = rate;
+        num_messages = (long)(rate * step_seconds);
+        if (num_messages < num_threads) {
+            num_messages = num_threads;
+        }
+        run_load(r);
+        message_base += num_messages;
+        result.steps++;
+
+        double achieved = r->send_seconds > 0 ? r->sent / r->send_seconds : 0.0;
+        uint64_t p50 = hist_percentile(r->rtt, 50);
+        uint64_t p99 = hist_percentile(r->rtt, 99);
+        const char *verdict = "ok";
+        if (r->missing > 0 || r->send_errors > 0) {
+            verdict = "loss";
+        } else if (achieved < PROBE_MIN_ACHIEVED * rate) {
+            verdict = "client limited";
+        } else if (best_p99 != UINT64_MAX && p99 > PROBE_P99_INFLATION * best_p99) {
+            verdict = "rtt inflation";
+        }
+        int ok = strcmp(verdict, "ok") == 0;
+        printf("  %10.0f pps: achieved %10.0f, lost %ld, p50 %8.1f us, p99 %8.1f us  %s%s\n", rate, achieved,
+               r->missing, p50 / 1e3, p99 / 1e3, verdict, ok || confirming ? "" : ", repeating");
+        fflush(stdout);
+
+        if (!ok && !confirming) {
+            confirming = 1;
+        } else if (ok) {
+            confirming = 0;
+            if (p99 < best_p99) {
+                best_p99 = p99;
+            }
+            if (achieved > result.max_rate) {
+                result.max_rate = achieved;
+                result.p50_ns = p50;
+                result.p99_ns = p99;
+            }
+            rate = increase > 0 ? rate + increase : rate * 2;
+        } else {
+            confirming = 0;
+            rate *= PROBE_DECREASE;
+            increase = increase > 0 ? increase / 2 : rate / 8;
+            if (increase < PROBE_CONVERGED * rate) {
+                break;
+            }
+        }
+        usleep(PROBE_SETTLE_MS * 1000);
     }
+    return result;
+}
 
-    int sockfd;
-    struct sockaddr_in server_addr;
-    socklen_t addr_len = sizeof(server_addr);
+// -P: probe every payload size in turn and report the maximum sustainable rate
+static void probe(const int *sizes, int num_sizes, struct report *r, const char *json_path) {
+    struct probe_result results[PROBE_MAX_SIZES];
+    double start_rate = target_rate;
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        perror("socket failed");
+    probing = 1;
+    recv_timeout_ms = PROBE_DRAIN_MS;
+    for (int i = 0; i < num_sizes; i++) {
+        results[i] = probe_size(sizes[i], start_rate, r);
+    }
+
+    printf("Probe results (threads: %d, flows: %d, batch: %d, step: %lu ms):\n", num_threads, num_flows, batch_size,
+           (unsigned long)(interval_ns / 1000000));
+    printf("  %8s  %12s  %10s  %10s  %6s\n", "payload", "max pps", "p50 us", "p99 us", "steps");
+    for (int i = 0; i < num_sizes; i++) {
+        const struct probe_result *pr = &results[i];
+        printf("  %8d  %12.0f  %10.1f  %10.1f  %6d\n", pr->payload, pr->max_rate, pr->p50_ns / 1e3, pr->p99_ns / 1e3,
+               pr->steps);
+    }
+
+    if (json_path == NULL) {
+        return;
+    }
+    FILE *out = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+    if (out == NULL) {
+        perror("fopen report failed");
+        return;
+    }
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\"start_rate\": %.0f, \"threads\": %d, \"flows\": %d, \"batch\": %d, \"step_ms\": %lu},\n",
+            start_rate, num_threads, num_flows, batch_size, (unsigned long)(interval_ns / 1000000));
+    fprintf(out, "  \"probe\": [");
+    for (int i = 0; i < num_sizes; i++) {
+        const struct probe_result *pr = &results[i];
+        fprintf(out, "%s\n    {\"payload\": %d, \"max_rate\": %.0f, \"p50_ns\": %lu, \"p99_ns\": %lu, \"steps\": %d}",
+                i ? "," : "", pr->payload, pr->max_rate, (unsigned long)pr->p50_ns, (unsigned long)pr->p99_ns,
+                pr->steps);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n messages] [-r rate] [-t threads] [-f flows] [-s size] [-b batch] [-g] [-i interval_ms] [-J file] [-C file] <server_ip>\n"
+                    "       %s -Z name [-Y] [options] (same-host server11 -Z, no address)\n"
+                    "       %s -A window [-L loss%%] [-O reorder%%] [options] <server_ip>\n"
+                    "       %s -A window -X rtt_us [-L loss%%] [-O reorder%%] [options] (offline, no server)\n"
+                    "       %s -P size[,size...] [-r start_rate] [-i step_ms] [options] <server_ip>\n",
+            prog, prog, prog, prog, prog);
+    fprintf(stderr, "  -n messages  Total datagrams to send (default %d)\n", NUM_MESSAGES);
+    fprintf(stderr, "  -r rate      Target packets per second across all threads, 0 = unpaced (default %d)\n", DEFAULT_RATE);
+    fprintf(stderr, "  -t threads   Sender/receiver thread pairs (1-%d, default 1)\n", MAX_THREADS);
+    fprintf(stderr, "  -f flows     Sockets (source ports) spread over the threads (default: one per thread)\n");
+    fprintf(stderr, "  -s size      Pad every payload to 'size' bytes (up to %d)\n", MAX_PAYLOAD);
+    fprintf(stderr, "  -b batch     Datagrams per sendmmsg call (1-%d, default 1)\n", MAX_BATCH);
+    fprintf(stderr, "  -g           UDP GSO/GRO offload: send each batch as one UDP_SEGMENT send and receive\n");
+    fprintf(stderr, "               coalesced echoes; payloads are padded to one size (at least the widest number)\n");
+    fprintf(stderr, "  -Z name      Shared-memory transport: each flow registers for a ring pair in /dev/shm/'name'\n");
+    fprintf(stderr, "  -Y           Spin on the shared-memory rings instead of sleeping on futexes\n");
+    fprintf(stderr, "  -A window    Reliable delivery: retransmit lost messages, at most 'window' in flight per flow\n");
+    fprintf(stderr, "               (1-%d); latencies are then delivery latencies, retransmissions included\n", MAX_WINDOW);
+    fprintf(stderr, "  -L percent   With -A: drop this share of packets in each direction, in process\n");
+    fprintf(stderr, "  -O percent   With -A: delay this share of packets by %llu us so they arrive out of order\n",
+            REL_SHIM_REORDER_NS / 1000);
+    fprintf(stderr, "  -X rtt_us    With -A: no server; echo in process after this round-trip time\n");
+    fprintf(stderr, "  -P sizes     Probe for the highest lossless rate at each payload size: steps of one\n");
+    fprintf(stderr, "               interval from -r up, AIMD on loss or p99 inflation; -n is ignored\n");
+    fprintf(stderr, "  -i ms        Time-series interval, or the length of a -P step (default %d ms)\n", DEFAULT_INTERVAL_MS);
+    fprintf(stderr, "  -J file      Write summary, percentiles and time series as JSON ('-' = stdout)\n");
+    fprintf(stderr, "  -C file      Write the time series as CSV ('-' = stdout)\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    long interval_ms = DEFAULT_INTERVAL_MS;
+    long window = 0;
+    int probe_sizes[PROBE_MAX_SIZES];
+    int num_sizes = 0;
+    const char *json_path = NULL;
+    const char *csv_path = NULL;
+
+    num_flows = 0;
+    while ((opt = getopt(argc, argv, "n:r:t:f:s:b:gZ:YA:L:O:X:P:i:J:C:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                num_messages = atol(optarg);
+                break;
+            case 'r':
+                target_rate = atof(optarg);
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                break;
+            case 'f':
+                num_flows = atoi(optarg);
+                break;
+            case 's':
+                payload_size = atoi(optarg);
+                break;
+            case 'b':
+                batch_size = atoi(optarg);
+                break;
+            case 'g':
+                offload = 1;
+                break;
+            case 'Z':
+                shm_name = optarg;
+                break;
+            case 'Y':
+                spin = 1;
+                break;
+            case 'A':
+                window = atol(optarg);
+                break;
+            case 'L':
+                loss_rate = atof(optarg) / 100;
+                break;
+            case 'O':
+                reorder_rate = atof(optarg) / 100;
+                break;
+            case 'X':
+                loopback_rtt_us = atol(optarg);
+                break;
+            case 'P':
+                for (char *p = optarg, *end;; p = end + 1) {
+                    long size = strtol(p, &end, 10);
+                    if (end == p || (*end != ',' && *end != '\0') || size < 0 || size > MAX_PAYLOAD ||
+                        num_sizes == PROBE_MAX_SIZES) {
+                        usage(argv[0]);
+                        exit(EXIT_FAILURE);
+                    }
+                    probe_sizes[num_sizes++] = (int)size;
+                    if (*end != ',') {
+                        break;
+                    }
+                }
+                break;
+            case 'i':
+                interval_ms = atol(optarg);
+                break;
+            case 'J':
+                json_path = optarg;
+                break;
+            case 'C':
+                csv_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (num_flows == 0) {
+        num_flows = num_threads;
+    }
+    int no_address = shm_name != NULL || loopback_rtt_us >= 0;
+    int impaired = loss_rate != 0 || reorder_rate != 0 || loopback_rtt_us >= 0;
+    if (argc - optind != (no_address ? 0 : 1) || (shm_name != NULL && offload) || num_messages < 1 || target_rate < 0 || num_threads < 1 || num_threads > MAX_THREADS ||
+        num_flows < num_threads || num_flows > MAX_FLOWS || payload_size < 0 || payload_size > MAX_PAYLOAD ||
+        batch_size < 1 || batch_size > MAX_BATCH || interval_ms < 1 || window < 0 || window > MAX_WINDOW ||
+        (window > 0 && (shm_name != NULL || offload)) || (impaired && window == 0) ||
+        loss_rate < 0 || loss_rate > 1 || reorder_rate < 0 || reorder_rate > 1 ||
+        (num_sizes > 0 && (target_rate <= 0 || offload || window > 0 || csv_path != NULL))) {
+        usage(argv[0]);
         exit(EXIT_FAILURE);
     }
 
+    rel_window = (uint32_t)window;
+
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(PORT);
-    inet_pton(AF_INET, argv[1], &server_addr.sin_addr);
+    if (!no_address && inet_pton(AF_INET, argv[optind], &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid server address: %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    interval_ns = (uint64_t)interval_ms * 1000000ull;
+
+    // GSO needs equal-size segments: pad every payload to the widest message number,
+    // and keep a whole batch within one 64 KB send
+    if (offload) {
+        int width = snprintf(NULL, 0, "%ld", num_messages);
+        if (payload_size < width) {
+            payload_size = width;
+        }
+        segment_size = (uint16_t)(WIRE_ECHO_HEADER_SIZE + payload_size);
+        if (batch_size > GSO_MAX_BYTES / segment_size) {
+            batch_size = GSO_MAX_BYTES / segment_size;
+        }
+    }
+
+    struct flow *flows = calloc(num_flows, sizeof(*flows));
+    workers = calloc(num_threads, sizeof(*workers));
+    if (flows == NULL || workers == NULL) {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_flows; i++) {
+        if (open_flow(&flows[i]) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Probe for UDP_SEGMENT once; without it every batch goes out with sendmmsg
+    if (offload) {
+        int size = segment_size, off = 0;
+        if (setsockopt(flows[0].sockfd, SOL_UDP, UDP_SEGMENT, &size, sizeof(size)) < 0) {
+            perror("setsockopt(UDP_SEGMENT) failed, using sendmmsg");
+            offload_gso = 0;
+        } else {
+            setsockopt(flows[0].sockfd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off));
+        }
+    }
 
-    pid_t pid = fork();
-    if (pid < 0) {
-        perror("fork failed");
+    // Flows are split as evenly as possible over the workers, once for every run
+    int first_flow = 0;
+    for (int i = 0; i < num_threads; i++) {
+        struct worker *w = &workers[i];
+        w->id = i;
+        w->num_flows = num_flows / num_threads + (i < num_flows % num_threads);
+        w->flows = &flows[first_flow];
+        w->rtt = hist_create();
+        w->interval_rtt = hist_create();
+        if (w->rtt == NULL || w->interval_rtt == NULL) {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        first_flow += w->num_flows;
+    }
+
+    struct report report = { 0 };
+    report.rtt = hist_create();
+    if (report.rtt == NULL) {
+        perror("malloc failed");
         exit(EXIT_FAILURE);
-    } else if (pid == 0) {
-        sender(argv[1], sockfd, &server_addr, addr_len);
+    }
+    if (num_sizes > 0) {
+        probe(probe_sizes, num_sizes, &report, json_path);
     } else {
-        receiver(sockfd);
-        wait(NULL);
+        run_load(&report);
+        print_report(&report);
+        if (json_path != NULL) {
+            write_report_file(json_path, &report, 1);
+        }
+        if (csv_path != NULL) {
+            write_report_file(csv_path, &report, 0);
+        }
     }
 
-    close(sockfd);
-    return 0;
+    for (int i = 0; i < num_flows; i++) {
+        if (shm_name != NULL) {
+            shm_client_detach(&flows[i].shm);
+        } else if (flows[i].sockfd >= 0) {
+            close(flows[i].sockfd);
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        free(workers[i].rtt);
+        free(workers[i].interval_rtt);
+    }
+    free(report.rtt);
+    free(series);
+    free(workers);
+    free(flows);
+    free((void *)received_map);
+
+    // Reliable mode promises every message: anything missing is a failure
+    return rel_window > 0 && report.missing > 0 ? EXIT_FAILURE : 0;
 }
@@ -1,27 +1,1443 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "calc.h"
+#include "histogram.h"
+#include "wire.h"
 
 
 #define PORT 10020
-#define BUFFER_SIZE 14  // Size of the response message
-#define REQUEST_SIZE 9   // Size of the request message
+#define BUFFER_SIZE WIRE_CALC_RESPONSE_SIZE  // Size of the response message
+#define REQUEST_SIZE WIRE_CALC_REQUEST_SIZE  // Size of the request message
+#define MAX_DEPTH 4096   // Maximum requests in flight on one connection
+#define BATCH_OPCODE 'B'
+#define BATCH_HEADER_SIZE WIRE_BATCH_HEADER_SIZE
+#define BATCH_MAX 65536  // Maximum operations in one batch message
+
+
+// Benchmark mode (-C or -R)
+#define MAX_BENCH_THREADS 64
+#define MAX_BENCH_RATE 1e9      // -R ceiling: the open-loop schedule has nanosecond steps
+#define MAX_POOL 4096           // Maximum pooled connections
+#define MAX_LEVELS 32           // Maximum concurrency levels in one sweep
+#define OPEN_WINDOW 1024        // Requests one connection may have outstanding in open loop
+#define DEFAULT_POOL 16
+#define DEFAULT_DURATION 5      // Seconds per measurement
+#define DEFAULT_EDGE_PERCENT 10
+#define DRAIN_TIMEOUT_NS 2000000000ull  // Wait for outstanding responses after a run
+#define MAX_REPORTED_MISMATCHES 5
+
+
+// Batch-file mode (-I and -O)
+#define BATCH_MIXED 'M'
+#define DEFAULT_FILE_BATCH 4096       // Records per mixed batch message
+#define MAX_FILE_CONNS MAX_BENCH_THREADS
+#define FILE_RELEASE_BYTES (16 << 20)  // Unmap finished input and output in steps of this size
+
+
+// UDP mode (-U)
+#define UDP_REQUEST_SIZE (REQUEST_SIZE + WIRE_CALC_ID_SIZE)
+#define UDP_RESPONSE_SIZE (BUFFER_SIZE + WIRE_CALC_ID_SIZE)
+#define UDP_SLOT_BITS 12                 // Request ID = generation << UDP_SLOT_BITS | slot
+#define DEFAULT_UDP_TIMEOUT_MS 100
+#define DEFAULT_UDP_RETRIES 3
+
+
+// Write all of buf, retrying after partial sends
+static int send_all(int sockfd, const unsigned char *buf, size_t len) {
+   while (len > 0) {
+       ssize_t n = send(sockfd, buf, len, 0);
+       if (n < 0) {
+           if (errno == EINTR) {
+               continue;
+           }
+           return -1;
+       }
+       buf += n;
+       len -= n;
+   }
+   return 0;
+}
+
+
+// Send 'count' copies of request over one keep-alive connection, keeping up to
+// 'depth' in flight. Every response must match 'expected'; returns the number
+// that did not, or -1 on a socket error.
+static long run_pipelined(int sockfd, const unsigned char *request, const unsigned char *expected, long count, int depth) {
+   unsigned char *out = malloc((size_t)depth * REQUEST_SIZE);
+   unsigned char *in = malloc((size_t)depth * BUFFER_SIZE);
+   long sent = 0, received = 0, mismatched = 0;
+   size_t in_len = 0;
+
+
+   if (out == NULL || in == NULL) {
+       perror("malloc failed");
+       free(out);
+       free(in);
+       return -1;
+   }
+
+
+   while (received < count) {
+       // Top the window up with one coalesced write
+       long window = depth - (sent - received);
+       if (window > count - sent) {
+           window = count - sent;
+       }
+       for (long i = 0; i < window; i++) {
+           memcpy(out + i * REQUEST_SIZE, request, REQUEST_SIZE);
+       }
+       if (window > 0 && send_all(sockfd, out, (size_t)window * REQUEST_SIZE) < 0) {
+           perror("send failed");
+           break;
+       }
+       sent += window;
+
+
+       // Consume whatever responses have arrived, keeping any partial one
+       ssize_t n = recv(sockfd, in + in_len, (size_t)depth * BUFFER_SIZE - in_len, 0);
+       if (n <= 0) {
+           if (n < 0) {
+               perror("recv failed");
+           } else {
+               fprintf(stderr, "Server closed the connection after %ld responses\n", received);
+           }
+           break;
+       }
+       in_len += n;
+
+
+       size_t offset = 0;
+       while (in_len - offset >= BUFFER_SIZE) {
+           if (memcmp(in + offset, expected, BUFFER_SIZE) != 0) {
+               mismatched++;
+           }
+           offset += BUFFER_SIZE;
+           received++;
+       }
+       memmove(in, in + offset, in_len - offset);
+       in_len -= offset;
+   }
+
+
+   free(out);
+   free(in);
+   return received == count ? mismatched : -1;
+}
+
+
+// Read exactly len bytes
+static int recv_all(int sockfd, unsigned char *buf, size_t len) {
+   while (len > 0) {
+       ssize_t n = recv(sockfd, buf, len, 0);
+       if (n <= 0) {
+           if (n == 0) {
+               errno = ECONNRESET;
+           } else if (errno == EINTR) {
+               continue;
+           }
+           return -1;
+       }
+       buf += n;
+       len -= n;
+   }
+   return 0;
+}
+
+
+// Send one batch message of 'size' operations (operandA + i) operator operandB
+// and check every result against the local reference. Returns mismatches or -1.
+static long run_batch(int sockfd, char operator, unsigned int operandA, unsigned int operandB, uint32_t size) {
+   size_t request_len = BATCH_HEADER_SIZE + (size_t)size * 8;
+   size_t response_len = BATCH_HEADER_SIZE + (size_t)size * 5;
+   unsigned char *request = malloc(request_len);
+   unsigned char *response = malloc(response_len);
+   long mismatched = -1;
+
+
+   if (request == NULL || response == NULL) {
+       perror("malloc failed");
+       goto out;
+   }
+
+
+   wire_batch_encode_header(request, BATCH_OPCODE, operator, size);
+   for (uint32_t i = 0; i < size; i++) {
+       wire_batch_encode_pair(&request[BATCH_HEADER_SIZE + i * WIRE_BATCH_PAIR_SIZE], operandA + i, operandB);
+   }
+
+
+   if (send_all(sockfd, request, request_len) < 0) {
+       perror("send failed");
+       goto out;
+   }
+   if (recv_all(sockfd, response, response_len) < 0) {
+       perror("recv failed");
+       goto out;
+   }
+
+
+   mismatched = 0;
+   for (uint32_t i = 0; i < size; i++) {
+       unsigned int expected;
+       unsigned char is_valid = calc_one(operator, operandA + i, operandB, &expected);
+       unsigned int result = wire_decode_u32(&response[BATCH_HEADER_SIZE + i * 4]);
+       if (result != expected || response[BATCH_HEADER_SIZE + (size_t)size * 4 + i] != is_valid) {
+           mismatched++;
+       }
+   }
+
+
+out:
+   free(request);
+   free(response);
+   return mismatched;
+}
+
+
+// A request awaiting its response; responses arrive in request order
+struct pending {
+   uint64_t start_ns;  // Send time (closed loop) or scheduled time (open loop)
+   unsigned int a;
+   unsigned int b;
+   char op;
+};
+
+
+// One pooled keep-alive connection, owned by a single benchmark thread per run
+struct bench_conn {
+   int fd;
+   int dead;
+   struct pending *ring;  // Outstanding requests, 'cap' entries
+   unsigned int cap;
+   unsigned int head;     // Oldest outstanding request
+   unsigned int count;    // Requests outstanding
+   unsigned char *out;    // Requests staged for the next write
+   size_t out_len;
+   unsigned char in[OPEN_WINDOW * BUFFER_SIZE];
+   size_t in_len;
+};
+
+
+struct bench_worker {
+   pthread_t thread;
+   int id;
+   int open_loop;
+   double rate;           // Requests per second for this thread (open loop)
+   int depth;             // Requests in flight per connection (closed loop)
+   uint64_t start_ns;
+   uint64_t deadline_ns;
+   uint64_t end_ns;       // When the last response was drained
+   uint64_t rng;
+   struct bench_conn **conns;
+   int num_conns;
+   long sent;
+   long completed;
+   long invalid;          // Overflow and division-by-zero answers (expected in the mix)
+   long mismatched;
+   long overruns;         // Open-loop sends skipped because every window was full
+   long errors;           // Connections lost during the run
+   struct histogram *latency;
+};
+
+
+static const char *bench_ops = "+-x/";  // Operator mix; repeat a character to weight it
+static int edge_percent = DEFAULT_EDGE_PERCENT;
+static _Atomic long reported_mismatches;
+static FILE *bench_json;     // -J: one object per run
+static int bench_json_runs;
+
+
+static uint64_t bench_now_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+// xorshift64*
+static uint64_t bench_random(uint64_t *state) {
+   uint64_t x = *state;
+   x ^= x >> 12;
+   x ^= x << 25;
+   x ^= x >> 27;
+   *state = x;
+   return x * 0x2545F4914F6CDD1Dull;
+}
+
+
+// Draw the next operation from the mix. Edge cases make '+' and 'x' overflow,
+// '/' divide by zero and '-' wrap; the rest use small operands.
+static void bench_next_op(uint64_t *rng, struct pending *p) {
+   uint64_t r = bench_random(rng);
+   p->op = bench_ops[(r >> 32) % strlen(bench_ops)];
+
+
+   r = bench_random(rng);
+   unsigned int x = (unsigned int)r, y = (unsigned int)(r >> 32);
+   if ((int)(bench_random(rng) % 100) < edge_percent) {
+       switch (p->op) {
+           case '+':
+               p->a = UINT_MAX - (x & 0xFFFF);
+               p->b = (y & 0xFFFF) + 0x10000;
+               break;
+           case 'x':
+               p->a = x | 0x10000;
+               p->b = y | 0x10000;
+               break;
+           case '/':
+               p->a = x;
+               p->b = 0;
+               break;
+           default:
+               p->a = x & 0xFFFF;
+               p->b = (y & 0xFFFF) + 0x10000;
+               break;
+       }
+   } else {
+       p->a = x & 0xFFFF;
+       p->b = (y & 0xFFFF) | (p->op == '/');  // Never zero for a regular division
+   }
+}
+
+
+// Stage a request on the connection and remember it for verification
+static void bench_enqueue(struct bench_conn *c, const struct pending *p) {
+   wire_calc_encode_request(c->out + c->out_len, p->op, p->a, p->b);
+   c->out_len += REQUEST_SIZE;
+   c->ring[(c->head + c->count) % c->cap] = *p;
+   c->count++;
+}
+
+
+static void bench_flush(struct bench_worker *w, struct bench_conn *c) {
+   if (c->out_len == 0 || c->dead) {
+       return;
+   }
+   if (send_all(c->fd, c->out, c->out_len) < 0) {
+       perror("send failed");
+       c->dead = 1;
+       w->errors++;
+   }
+   c->out_len = 0;
+}
+
+
+// Check one response against the local reference and record its latency
+static void bench_complete(struct bench_worker *w, struct bench_conn *c, const unsigned char *response, uint64_t now) {
+   struct pending *p = &c->ring[c->head];
+   c->head = (c->head + 1) % c->cap;
+   c->count--;
+
+
+   unsigned int expected;
+   unsigned char is_valid = calc_one(p->op, p->a, p->b, &expected);
+   struct wire_calc m = wire_calc_decode_response(response);
+   if (m.op != p->op || m.a != p->a || m.b != p->b || m.result != expected || m.valid != is_valid) {
+       w->mismatched++;
+       if (atomic_fetch_add(&reported_mismatches, 1) < MAX_REPORTED_MISMATCHES) {
+           fprintf(stderr, "Mismatch: %u %c %u: expected %u (valid %u), got %u %c %u = %u (valid %u)\n",
+                   p->a, p->op, p->b, expected, is_valid, m.a, m.op, m.b, m.result, m.valid);
+       }
+   }
+   if (is_valid != CALC_VALID) {
+       w->invalid++;
+   }
+   hist_record(w->latency, now > p->start_ns ? now - p->start_ns : 0);
+   w->completed++;
+}
+
+
+// Read whatever has arrived on a connection; returns responses completed
+static long bench_receive(struct bench_worker *w, struct bench_conn *c) {
+   ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+   if (n <= 0) {
+       if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+           return 0;
+       }
+       if (n < 0) {
+           perror("recv failed");
+       } else {
+           fprintf(stderr, "Server closed a connection (is server12 running with -k?)\n");
+       }
+       c->dead = 1;
+       w->errors++;
+       return 0;
+   }
+   c->in_len += n;
+
+
+   uint64_t now = bench_now_ns();
+   size_t offset = 0;
+   long done = 0;
+   while (c->in_len - offset >= BUFFER_SIZE && c->count > 0) {
+       bench_complete(w, c, c->in + offset, now);
+       offset += BUFFER_SIZE;
+       done++;
+   }
+   memmove(c->in, c->in + offset, c->in_len - offset);
+   c->in_len -= offset;
+   return done;
+}
+
+
+static void *bench_worker_main(void *arg) {
+   struct bench_worker *w = arg;
+   struct epoll_event events[64];
+   int epoll_fd = epoll_create1(0);
+   if (epoll_fd < 0) {
+       perror("epoll_create1 failed");
+       return NULL;
+   }
+   for (int i = 0; i < w->num_conns; i++) {
+       struct epoll_event ev = { .events = EPOLLIN, .data.ptr = w->conns[i] };
+       if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, w->conns[i]->fd, &ev) < 0) {
+           perror("epoll_ctl failed");
+           close(epoll_fd);
+           return NULL;
+       }
+   }
+
+
+   // Closed loop starts with every window full; open loop follows a fixed schedule
+   uint64_t interval_ns = w->open_loop ? (uint64_t)(1e9 / w->rate) : 0;
+   uint64_t next_ns = w->start_ns;
+   int next_conn = 0;
+   if (!w->open_loop) {
+       for (int i = 0; i < w->num_conns; i++) {
+           struct bench_conn *c = w->conns[i];
+           uint64_t now = bench_now_ns();
+           for (int j = 0; j < w->depth; j++) {
+               struct pending p;
+               bench_next_op(&w->rng, &p);
+               p.start_ns = now;
+               bench_enqueue(c, &p);
+           }
+           w->sent += w->depth;
+           bench_flush(w, c);
+       }
+   }
+
+
+   long outstanding = w->sent;
+   while (1) {
+       uint64_t now = bench_now_ns();
+       int running = now < w->deadline_ns;
+       if (!running && (outstanding == 0 || now >= w->deadline_ns + DRAIN_TIMEOUT_NS)) {
+           break;
+       }
+
+
+       uint64_t timeout_ns = running ? 10000000 : 100000000;
+       if (w->open_loop && running) {
+           // Issue every request that is due, spread round-robin over the pool
+           while (next_ns <= now && next_ns < w->deadline_ns) {
+               struct bench_conn *c = NULL;
+               for (int i = 0; i < w->num_conns && c == NULL; i++) {
+                   struct bench_conn *candidate = w->conns[(next_conn + i) % w->num_conns];
+                   if (!candidate->dead && candidate->count < candidate->cap) {
+                       c = candidate;
+                   }
+               }
+               next_conn = (next_conn + 1) % w->num_conns;
+               if (c == NULL) {
+                   w->overruns++;
+               } else {
+                   struct pending p;
+                   bench_next_op(&w->rng, &p);
+                   p.start_ns = next_ns;  // Latency includes any time spent behind schedule
+                   bench_enqueue(c, &p);
+                   w->sent++;
+                   outstanding++;
+               }
+               next_ns += interval_ns;
+           }
+           for (int i = 0; i < w->num_conns; i++) {
+               bench_flush(w, w->conns[i]);
+           }
+           timeout_ns = next_ns > now ? next_ns - now : 0;
+       }
+
+
+       // epoll_pwait2 takes a nanosecond timeout, so pacing needs no spinning
+       struct timespec timeout = { (time_t)(timeout_ns / 1000000000), (long)(timeout_ns % 1000000000) };
+       int n = epoll_pwait2(epoll_fd, events, 64, &timeout, NULL);
+       if (n < 0 && errno != EINTR) {
+           perror("epoll_pwait2 failed");
+           break;
+       }
+       for (int i = 0; i < n; i++) {
+           struct bench_conn *c = events[i].data.ptr;
+           if (c->dead) {
+               continue;
+           }
+           long done = bench_receive(w, c);
+           outstanding -= done;
+           if (c->dead) {
+               outstanding -= c->count;
+               c->count = 0;
+               epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+               continue;
+           }
+
+
+           // Closed loop: replace each completed request while the run lasts
+           if (!w->open_loop && bench_now_ns() < w->deadline_ns) {
+               uint64_t start = bench_now_ns();
+               for (long j = 0; j < done; j++) {
+                   struct pending p;
+                   bench_next_op(&w->rng, &p);
+                   p.start_ns = start;
+                   bench_enqueue(c, &p);
+               }
+               w->sent += done;
+               outstanding += done;
+               bench_flush(w, c);
+           }
+       }
+   }
+   w->end_ns = bench_now_ns();
+
+
+   // Anything still outstanding is abandoned with its connection
+   for (int i = 0; i < w->num_conns; i++) {
+       struct bench_conn *c = w->conns[i];
+       if (c->count > 0 && !c->dead) {
+           c->dead = 1;
+           w->errors++;
+       }
+   }
+   close(epoll_fd);
+   return NULL;
+}
+
+
+// Run one measurement over the first 'num_conns' pooled connections and print
+// throughput, latency percentiles and verification counts. Returns -1 if the
+// run lost connections or saw wrong answers.
+static int bench_run(struct bench_conn *pool, int num_conns, int num_threads, int depth, double rate, int duration) {
+   struct bench_worker workers[MAX_BENCH_THREADS];
+   struct bench_conn *assigned[MAX_POOL];
+   int open_loop = rate > 0;
+
+
+   if (num_threads > num_conns) {
+       num_threads = num_conns;
+   }
+   for (int i = 0; i < num_conns; i++) {
+       if (pool[i].dead) {
+           fprintf(stderr, "Connection %d is no longer usable\n", i);
+           return -1;
+       }
+       pool[i].head = pool[i].count = 0;
+       pool[i].in_len = pool[i].out_len = 0;
+   }
+
+
+   // Thread t owns connections t, t + num_threads, ...
+   uint64_t start = bench_now_ns() + 10000000;  // Let every thread reach its loop
+   int next = 0;
+   for (int t = 0; t < num_threads; t++) {
+       struct bench_worker *w = &workers[t];
+       memset(w, 0, sizeof(*w));
+       w->id = t;
+       w->open_loop = open_loop;
+       w->depth = depth;
+       w->start_ns = start;
+       w->deadline_ns = start + (uint64_t)duration * 1000000000ull;
+       w->rng = 0x9E3779B97F4A7C15ull * (uint64_t)(t + 1) ^ start;
+       w->conns = &assigned[next];
+       for (int i = t; i < num_conns; i += num_threads) {
+           assigned[next++] = &pool[i];
+           w->num_conns++;
+       }
+       w->rate = rate * w->num_conns / num_conns;
+       w->latency = hist_create();
+       if (w->latency == NULL) {
+           perror("malloc failed");
+           exit(EXIT_FAILURE);
+       }
+   }
+   for (int t = 0; t < num_threads; t++) {
+       if (pthread_create(&workers[t].thread, NULL, bench_worker_main, &workers[t]) != 0) {
+           perror("pthread_create failed");
+           exit(EXIT_FAILURE);
+       }
+   }
+
+
+   struct histogram *latency = hist_create();
+   long sent = 0, completed = 0, invalid = 0, mismatched = 0, overruns = 0, errors = 0;
+   uint64_t end = start;
+   if (latency == NULL) {
+       perror("malloc failed");
+       exit(EXIT_FAILURE);
+   }
+   for (int t = 0; t < num_threads; t++) {
+       struct bench_worker *w = &workers[t];
+       pthread_join(w->thread, NULL);
+       hist_merge(latency, w->latency);
+       free(w->latency);
+       sent += w->sent;
+       completed += w->completed;
+       invalid += w->invalid;
+       mismatched += w->mismatched;
+       overruns += w->overruns;
+       errors += w->errors;
+       if (w->end_ns > end) {
+           end = w->end_ns;
+       }
+   }
+
+
+   double elapsed = (end - start) / 1e9;
+   if (open_loop) {
+       printf("Open loop, %d connections, target %.0f req/s:", num_conns, rate);
+   } else {
+       printf("Closed loop, %d connections x depth %d:", num_conns, depth);
+   }
+   printf(" %.0f req/s (%ld of %ld completed in %.3f s)\n", completed / elapsed, completed, sent, elapsed);
+   printf("  latency us: min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f  mean %.1f\n",
+          latency->total ? latency->min / 1e3 : 0.0, hist_percentile(latency, 50) / 1e3,
+          hist_percentile(latency, 90) / 1e3, hist_percentile(latency, 99) / 1e3,
+          hist_percentile(latency, 99.9) / 1e3, latency->total ? latency->max / 1e3 : 0.0,
+          hist_mean(latency) / 1e3);
+   printf("  verified: %ld mismatched, %ld overflow/divide-by-zero answers", mismatched, invalid);
+   if (open_loop) {
+       printf(", %ld sends skipped behind full windows", overruns);
+   }
+   if (errors > 0) {
+       printf(", %ld connections lost", errors);
+   }
+   printf("\n");
+
+
+   if (bench_json != NULL) {
+       fprintf(bench_json, "%s\n    {\"mode\": \"%s\", \"connections\": %d, \"depth\": %d, \"target_rate\": %.0f, "
+                           "\"throughput\": %.0f, \"sent\": %ld, \"completed\": %ld, \"elapsed\": %.6f, "
+                           "\"latency_ns\": {\"min\": %lu, \"mean\": %.0f, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, "
+                           "\"p99_9\": %lu, \"max\": %lu}, \"mismatched\": %ld, \"invalid\": %ld, "
+                           "\"overruns\": %ld, \"errors\": %ld}",
+               bench_json_runs++ ? "," : "", open_loop ? "open" : "closed", num_conns, depth, rate,
+               completed / elapsed, sent, completed, elapsed,
+               (unsigned long)(latency->total ? latency->min : 0), hist_mean(latency),
+               (unsigned long)hist_percentile(latency, 50), (unsigned long)hist_percentile(latency, 90),
+               (unsigned long)hist_percentile(latency, 99), (unsigned long)hist_percentile(latency, 99.9),
+               (unsigned long)(latency->total ? latency->max : 0), mismatched, invalid, overruns, errors);
+   }
+   free(latency);
+   return mismatched == 0 && errors == 0 ? 0 : -1;
+}
+
+
+// Parse a comma-separated list of concurrency levels; returns how many
+static int parse_levels(const char *list, int *levels) {
+   int n = 0;
+   const char *p = list;
+   while (*p != '\0' && n < MAX_LEVELS) {
+       char *end;
+       long v = strtol(p, &end, 10);
+       if (end == p || v < 1 || v > MAX_POOL || (*end != ',' && *end != '\0')) {
+           return -1;
+       }
+       levels[n++] = (int)v;
+       p = *end == ',' ? end + 1 : end;
+   }
+   return *p == '\0' ? n : -1;
+}
+
+
+// Open the connection pool used by every run of the benchmark
+static struct bench_conn *bench_open_pool(const struct sockaddr_in *server_addr, int size, unsigned int cap) {
+   struct bench_conn *pool = calloc(size, sizeof(*pool));
+   if (pool == NULL) {
+       perror("calloc failed");
+       return NULL;
+   }
+   for (int i = 0; i < size; i++) {
+       struct bench_conn *c = &pool[i];
+       c->cap = cap;
+       c->ring = malloc(cap * sizeof(*c->ring));
+       c->out = malloc((size_t)cap * REQUEST_SIZE);
+       c->fd = socket(AF_INET, SOCK_STREAM, 0);
+       if (c->ring == NULL || c->out == NULL || c->fd < 0) {
+           perror("connection setup failed");
+           return NULL;
+       }
+       int one = 1;
+       setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+       if (connect(c->fd, (const struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
+           perror("connect failed");
+           return NULL;
+       }
+   }
+   return pool;
+}
+
+
+// Benchmark mode: a closed-loop sweep over 'levels', or one open-loop run at 'rate'
+static int run_benchmark(const struct sockaddr_in *server_addr, int pool_size, int num_threads, int depth,
+                         const int *levels, int num_levels, double rate, int duration, const char *json_path) {
+   int size = pool_size;
+   for (int i = 0; i < num_levels; i++) {
+       if (levels[i] > size) {
+           size = levels[i];
+       }
+   }
+   struct bench_conn *pool = bench_open_pool(server_addr, size, rate > 0 ? OPEN_WINDOW : (unsigned int)depth);
+   if (pool == NULL) {
+       exit(EXIT_FAILURE);
+   }
+   printf("Benchmark: %d pooled connections, %d threads, operators \"%s\", %d%% edge cases, %d s per run\n",
+          size, num_threads, bench_ops, edge_percent, duration);
+
+
+   if (json_path != NULL) {
+       bench_json = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+       if (bench_json == NULL) {
+           perror("fopen report failed");
+           exit(EXIT_FAILURE);
+       }
+       fprintf(bench_json, "{\n  \"threads\": %d,\n  \"operators\": \"%s\",\n  \"edge_percent\": %d,\n  \"runs\": [",
+               num_threads, bench_ops, edge_percent);
+   }
+
+
+   int status = 0;
+   if (rate > 0) {
+       status = bench_run(pool, pool_size, num_threads, depth, rate, duration);
+   } else {
+       for (int i = 0; i < num_levels && status == 0; i++) {
+           status = bench_run(pool, levels[i], num_threads, depth, 0, duration);
+       }
+   }
+
+
+   if (bench_json != NULL) {
+       fprintf(bench_json, "\n  ]\n}\n");
+       if (bench_json != stdout) {
+           fclose(bench_json);
+       }
+   }
+
+
+   for (int i = 0; i < size; i++) {
+       close(pool[i].fd);
+       free(pool[i].ring);
+       free(pool[i].out);
+   }
+   free(pool);
+   return status;
+}
+
+
+// A UDP request in flight. Its ID names the slot, so a reply finds it directly
+// and a reply to an earlier transmission of a retired request is recognised.
+struct udp_slot {
+   uint64_t first_ns;  // First transmission; latency includes any retries
+   uint64_t sent_ns;   // Latest transmission; the timeout runs from here
+   uint32_t id;
+   int attempts;
+   int busy;
+};
+
+
+struct udp_stats {
+   long completed;
+   long mismatched;
+   long retransmits;
+   long failed;      // Given up after every retry timed out
+   long stale;       // Duplicate or late replies
+   struct histogram *latency;
+};
+
+
+// Send 'count' copies of request as datagrams, keeping up to 'depth' in flight
+// and retransmitting each after 'timeout_ns' up to 'retries' times. With
+// 'expected' NULL the first reply is stored in 'response'; otherwise every
+// reply must match 'expected'. Returns -1 on a socket error.
+static int run_udp(int sockfd, const unsigned char *request, unsigned char *response, const unsigned char *expected,
+                   long count, int depth, uint64_t timeout_ns, int retries, struct udp_stats *st) {
+   struct udp_slot *slots = calloc(depth, sizeof(*slots));
+   unsigned char (*out)[UDP_REQUEST_SIZE] = malloc((size_t)depth * UDP_REQUEST_SIZE);
+   unsigned char (*in)[UDP_RESPONSE_SIZE + 1] = malloc((size_t)depth * (UDP_RESPONSE_SIZE + 1));
+   struct mmsghdr *msgs = calloc(depth, sizeof(*msgs));
+   struct iovec *iovs = calloc(depth, sizeof(*iovs));
+   long issued = 0, done = 0;
+   int status = -1;
+
+
+   if (slots == NULL || out == NULL || in == NULL || msgs == NULL || iovs == NULL) {
+       perror("malloc failed");
+       goto out;
+   }
+   for (int i = 0; i < depth; i++) {
+       slots[i].id = (uint32_t)i;  // Generation 0; the first request takes generation 1
+       memcpy(out[i], request, REQUEST_SIZE);
+       msgs[i].msg_hdr.msg_iov = &iovs[i];
+       msgs[i].msg_hdr.msg_iovlen = 1;
+   }
+
+
+   while (done < count) {
+       // Retransmit what timed out, then fill every free slot
+       uint64_t now = bench_now_ns();
+       uint64_t wake_ns = now + timeout_ns;
+       int pending = 0;
+       for (int i = 0; i < depth; i++) {
+           struct udp_slot *slot = &slots[i];
+           if (slot->busy && now - slot->sent_ns >= timeout_ns) {
+               if (slot->attempts > retries) {
+                   slot->busy = 0;
+                   st->failed++;
+                   done++;
+               } else {
+                   slot->attempts++;
+                   slot->sent_ns = now;
+                   st->retransmits++;
+                   iovs[pending].iov_base = out[i];
+                   iovs[pending++].iov_len = UDP_REQUEST_SIZE;
+               }
+           } else if (!slot->busy && issued < count) {
+               slot->id += 1u << UDP_SLOT_BITS;
+               slot->busy = 1;
+               slot->attempts = 1;
+               slot->first_ns = slot->sent_ns = now;
+               uint32_t id = htobe32(slot->id);
+               memcpy(out[i] + REQUEST_SIZE, &id, WIRE_CALC_ID_SIZE);
+               iovs[pending].iov_base = out[i];
+               iovs[pending++].iov_len = UDP_REQUEST_SIZE;
+               issued++;
+           }
+           if (slot->busy && slot->sent_ns + timeout_ns < wake_ns) {
+               wake_ns = slot->sent_ns + timeout_ns;
+           }
+       }
+       for (int sent = 0; sent < pending; ) {
+           int n = sendmmsg(sockfd, msgs + sent, pending - sent, 0);
+           if (n < 0) {
+               if (errno == EINTR) {
+                   continue;
+               }
+               if (errno == ECONNREFUSED) {
+                   break;  // Nobody listening (yet); the timeouts retry
+               }
+               perror("sendmmsg failed");
+               goto out;
+           }
+           sent += n;
+       }
+       if (done >= count) {
+           break;
+       }
+
+
+       // Wait for replies until the next retransmission is due
+       now = bench_now_ns();
+       uint64_t wait_ns = wake_ns > now ? wake_ns - now : 0;
+       struct timespec timeout = { (time_t)(wait_ns / 1000000000), (long)(wait_ns % 1000000000) };
+       struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+       if (ppoll(&pfd, 1, &timeout, NULL) <= 0) {
+           continue;
+       }
+       for (int i = 0; i < depth; i++) {
+           iovs[i].iov_base = in[i];
+           iovs[i].iov_len = UDP_RESPONSE_SIZE + 1;  // One spare byte exposes oversized replies
+       }
+       int received = recvmmsg(sockfd, msgs, depth, MSG_DONTWAIT, NULL);
+       if (received < 0) {
+           if (errno == EAGAIN || errno == EINTR || errno == ECONNREFUSED) {
+               continue;
+           }
+           perror("recvmmsg failed");
+           goto out;
+       }
+       now = bench_now_ns();
+       for (int i = 0; i < received; i++) {
+           if (msgs[i].msg_len != UDP_RESPONSE_SIZE) {
+               st->stale++;
+               continue;
+           }
+           uint32_t id = wire_decode_u32(in[i] + BUFFER_SIZE);
+           struct udp_slot *slot = &slots[id & ((1u << UDP_SLOT_BITS) - 1)];
+           if ((id & ((1u << UDP_SLOT_BITS) - 1)) >= (uint32_t)depth || !slot->busy || slot->id != id) {
+               st->stale++;
+               continue;
+           }
+           if (expected == NULL) {
+               memcpy(response, in[i], BUFFER_SIZE);
+           } else if (memcmp(in[i], expected, BUFFER_SIZE) != 0) {
+               st->mismatched++;
+           }
+           hist_record(st->latency, now - slot->first_ns);
+           slot->busy = 0;
+           st->completed++;
+           done++;
+       }
+   }
+   status = 0;
+
+
+out:
+   free(slots);
+   free(out);
+   free(in);
+   free(msgs);
+   free(iovs);
+   return status;
+}
+
+
+// One connection's share of a batch file: records [first, first + count)
+struct file_stream {
+   pthread_t sender;
+   pthread_t receiver;
+   int fd;
+   const unsigned char *in;  // Input records, WIRE_CALC_REQUEST_SIZE each
+   unsigned char *out;       // Output records, WIRE_CALC_RESPONSE_SIZE each
+   size_t first;
+   size_t count;
+   uint32_t batch;
+   long invalid;             // Overflow and division-by-zero answers
+   long unknown;             // Records with an operator the server does not know
+   int failed;
+};
+
+
+// Drop the pages of [start, end) from this process. The output mapping is shared,
+// so its dirty pages stay in the page cache until the kernel writes them back.
+static void file_release(const unsigned char *base, size_t start, size_t end) {
+   size_t page = (size_t)sysconf(_SC_PAGESIZE);
+   start = (start + page - 1) / page * page;
+   end = end / page * page;
+   if (end > start) {
+       madvise((void *)(base + start), end - start, MADV_DONTNEED);
+   }
+}
+
+
+// Send every record as mixed batch messages straight from the input mapping;
+// TCP flow control paces the sender to the receiver's progress
+static void *file_sender_main(void *arg) {
+   struct file_stream *s = arg;
+   unsigned char header[BATCH_HEADER_SIZE];
+
+
+   for (size_t done = 0; done < s->count; ) {
+       uint32_t n = s->count - done < s->batch ? (uint32_t)(s->count - done) : s->batch;
+       wire_batch_encode_header(header, BATCH_OPCODE, BATCH_MIXED, n);
+       struct iovec iov[2] = {
+           { .iov_base = header, .iov_len = BATCH_HEADER_SIZE },
+           { .iov_base = (void *)(s->in + (s->first + done) * REQUEST_SIZE), .iov_len = (size_t)n * REQUEST_SIZE },
+       };
+       struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+       while (msg.msg_iovlen > 0) {
+           ssize_t sent = sendmsg(s->fd, &msg, MSG_NOSIGNAL);
+           if (sent < 0) {
+               if (errno == EINTR) {
+                   continue;
+               }
+               perror("send failed");
+               s->failed = 1;
+               shutdown(s->fd, SHUT_RDWR);  // Wake the receiver
+               return NULL;
+           }
+           while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+               sent -= msg.msg_iov->iov_len;
+               msg.msg_iov++;
+               msg.msg_iovlen--;
+           }
+           if (msg.msg_iovlen > 0) {
+               msg.msg_iov->iov_base = (unsigned char *)msg.msg_iov->iov_base + sent;
+               msg.msg_iov->iov_len -= sent;
+           }
+       }
+       done += n;
+   }
+   shutdown(s->fd, SHUT_WR);  // Lets a serial server12 finish this connection and accept the next
+   return NULL;
+}
+
+
+// Read the batch responses in order and write one wire_calc_response record per
+// input record into the output mapping
+static void *file_receiver_main(void *arg) {
+   struct file_stream *s = arg;
+   size_t response_max = BATCH_HEADER_SIZE + (size_t)s->batch * 5;
+   unsigned char *response = malloc(response_max);
+   size_t released = s->first;
+
+
+   if (response == NULL) {
+       perror("malloc failed");
+       s->failed = 1;
+       shutdown(s->fd, SHUT_RDWR);
+       return NULL;
+   }
+   for (size_t done = 0; done < s->count; ) {
+       uint32_t n = s->count - done < s->batch ? (uint32_t)(s->count - done) : s->batch;
+       if (recv_all(s->fd, response, BATCH_HEADER_SIZE + (size_t)n * 5) < 0) {
+           perror("recv failed");
+           s->failed = 1;
+           break;
+       }
+       if (response[0] != BATCH_OPCODE || response[1] != BATCH_MIXED || wire_batch_count(response) != n) {
+           fprintf(stderr, "Unexpected batch response (is server12 running with -k?)\n");
+           s->failed = 1;
+           break;
+       }
+
+
+       size_t index = s->first + done;
+       const unsigned char *results = response + BATCH_HEADER_SIZE;
+       const unsigned char *valid = results + (size_t)n * 4;
+       for (uint32_t i = 0; i < n; i++) {
+           struct wire_calc_response *r = (struct wire_calc_response *)(s->out + (index + i) * BUFFER_SIZE);
+           memcpy(r, s->in + (index + i) * REQUEST_SIZE, REQUEST_SIZE);  // Operator and operands
+           memcpy(&r->result, results + (size_t)i * 4, 4);               // Already big-endian
+           r->valid = valid[i];
+           s->invalid += valid[i] == CALC_INVALID;
+           s->unknown += valid[i] == CALC_UNKNOWN;
+       }
+       done += n;
+
+
+       // Keep the resident set constant however large the file is
+       if ((s->first + done - released) * REQUEST_SIZE >= FILE_RELEASE_BYTES || done == s->count) {
+           file_release(s->in, released * REQUEST_SIZE, (s->first + done) * REQUEST_SIZE);
+           file_release(s->out, released * BUFFER_SIZE, (s->first + done) * BUFFER_SIZE);
+           released = s->first + done;
+       }
+   }
+   free(response);
+   return NULL;
+}
+
+
+// Batch-file mode: evaluate every (operator, A, B) record of 'in_path' and write
+// the answers to 'out_path' in the same order. Each of 'num_conns' connections
+// streams a contiguous share of the file with its own sender and receiver thread.
+static int run_file(const struct sockaddr_in *server_addr, const char *in_path, const char *out_path,
+                    int num_conns, uint32_t batch) {
+   struct file_stream streams[MAX_FILE_CONNS];
+   struct stat st;
+   unsigned char *in = MAP_FAILED, *out = MAP_FAILED;
+   int opened = 0;  // Streams with a socket to close
+   int status = -1;
+
+
+   int in_fd = open(in_path, O_RDONLY);
+   if (in_fd < 0 || fstat(in_fd, &st) < 0) {
+       perror("open input failed");
+       return -1;
+   }
+   if (st.st_size % REQUEST_SIZE != 0) {
+       fprintf(stderr, "%s: size %lld is not a multiple of %d-byte records\n", in_path, (long long)st.st_size,
+               REQUEST_SIZE);
+       close(in_fd);
+       return -1;
+   }
+   size_t records = (size_t)st.st_size / REQUEST_SIZE;
+   size_t in_len = records * REQUEST_SIZE;
+   size_t out_len = records * BUFFER_SIZE;
+
+
+   int out_fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (out_fd < 0 || ftruncate(out_fd, (off_t)out_len) < 0) {
+       perror("open output failed");
+       close(in_fd);
+       if (out_fd >= 0) {
+           close(out_fd);
+       }
+       return -1;
+   }
+   if (records == 0) {
+       close(in_fd);
+       close(out_fd);
+       printf("No records in %s\n", in_path);
+       return 0;
+   }
+
+
+   in = mmap(NULL, in_len, PROT_READ, MAP_SHARED, in_fd, 0);
+   out = mmap(NULL, out_len, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+   if (in == MAP_FAILED || out == MAP_FAILED) {
+       perror("mmap failed");
+       goto out;
+   }
+   madvise(in, in_len, MADV_SEQUENTIAL);
+   madvise(out, out_len, MADV_SEQUENTIAL);
+
+
+   if ((size_t)num_conns > records) {
+       num_conns = (int)records;
+   }
+   for (int i = 0; i < num_conns; i++) {
+       struct file_stream *s = &streams[i];
+       memset(s, 0, sizeof(*s));
+       s->in = in;
+       s->out = out;
+       s->first = records * i / num_conns;
+       s->count = records * (i + 1) / num_conns - s->first;
+       s->batch = batch;
+       s->fd = socket(AF_INET, SOCK_STREAM, 0);
+       if (s->fd < 0) {
+           perror("socket failed");
+           goto out;
+       }
+       opened++;
+       int one = 1;
+       setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+       if (connect(s->fd, (const struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
+           perror("connect failed");
+           goto out;
+       }
+   }
+
+
+   uint64_t start = bench_now_ns();
+   for (int i = 0; i < num_conns; i++) {
+       if (pthread_create(&streams[i].receiver, NULL, file_receiver_main, &streams[i]) != 0 ||
+           pthread_create(&streams[i].sender, NULL, file_sender_main, &streams[i]) != 0) {
+           perror("pthread_create failed");
+           exit(EXIT_FAILURE);
+       }
+   }
+   long invalid = 0, unknown = 0;
+   int failed = 0;
+   for (int i = 0; i < num_conns; i++) {
+       pthread_join(streams[i].sender, NULL);
+       pthread_join(streams[i].receiver, NULL);
+       invalid += streams[i].invalid;
+       unknown += streams[i].unknown;
+       failed |= streams[i].failed;
+   }
+   double elapsed = (bench_now_ns() - start) / 1e9;
+
+
+   if (failed) {
+       fprintf(stderr, "Batch file incomplete: %s is not usable\n", out_path);
+       goto out;
+   }
+   printf("Processed %zu operations over %d connections in %.3f s (%.0f operations/s)\n",
+          records, num_conns, elapsed, records / elapsed);
+   printf("  %ld overflow/divide-by-zero answers, %ld unknown operators; results in %s\n", invalid, unknown, out_path);
+   status = 0;
+
+
+out:
+   for (int i = 0; i < opened; i++) {
+       close(streams[i].fd);
+   }
+   if (in != MAP_FAILED) {
+       munmap(in, in_len);
+   }
+   if (out != MAP_FAILED) {
+       munmap(out, out_len);
+   }
+   close(in_fd);
+   close(out_fd);
+   return status;
+}
+
+
+// UDP mode: answer the operation once, then repeat it 'count' - 1 times with
+// 'depth' requests in flight and report throughput and latency
+static int run_udp_mode(const struct sockaddr_in *server_addr, const unsigned char *request, long count, int depth,
+                        uint64_t timeout_ns, int retries) {
+   struct udp_stats first = { 0 }, repeat = { 0 };
+   unsigned char response[BUFFER_SIZE];
+   int status = EXIT_FAILURE;
+
+
+   // Connected, so the kernel drops datagrams from anyone but the server
+   int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+   if (sockfd < 0) {
+       perror("socket failed");
+       return EXIT_FAILURE;
+   }
+   if (connect(sockfd, (const struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
+       perror("connect failed");
+       close(sockfd);
+       return EXIT_FAILURE;
+   }
+   first.latency = hist_create();
+   repeat.latency = hist_create();
+   if (first.latency == NULL || repeat.latency == NULL) {
+       perror("malloc failed");
+       goto out;
+   }
+
+
+   if (run_udp(sockfd, request, response, NULL, 1, 1, timeout_ns, retries, &first) < 0) {
+       goto out;
+   }
+   if (first.completed == 0) {
+       fprintf(stderr, "No reply after %d retries (is server12 running with -u?)\n", retries);
+       goto out;
+   }
+   struct wire_calc reply = wire_calc_decode_response(response);
+   if (reply.valid == CALC_VALID) {
+       printf("Result: %u %c %u = %u\n", reply.a, reply.op, reply.b, reply.result);
+   } else {
+       printf("Error: Invalid operation (e.g., overflow or division by zero)\n");
+   }
+   printf("Round-trip time: %.1f us%s\n", first.latency->max / 1e3, first.retransmits ? " (retransmitted)" : "");
+   status = 0;
+
+
+   if (count > 1) {
+       uint64_t start = bench_now_ns();
+       if (run_udp(sockfd, request, NULL, response, count - 1, depth, timeout_ns, retries, &repeat) < 0) {
+           status = EXIT_FAILURE;
+           goto out;
+       }
+       double elapsed = (bench_now_ns() - start) / 1e9;
+       struct histogram *latency = repeat.latency;
+       printf("UDP: %ld requests at depth %d in %.3f s (%.0f requests/s), %ld mismatched responses\n",
+              count - 1, depth, elapsed, repeat.completed / elapsed, repeat.mismatched);
+       printf("  latency us: min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f  mean %.1f\n",
+              latency->total ? latency->min / 1e3 : 0.0, hist_percentile(latency, 50) / 1e3,
+              hist_percentile(latency, 90) / 1e3, hist_percentile(latency, 99) / 1e3,
+              hist_percentile(latency, 99.9) / 1e3, latency->total ? latency->max / 1e3 : 0.0,
+              hist_mean(latency) / 1e3);
+       printf("  %ld retransmitted, %ld failed after %d retries, %ld duplicate or late replies\n",
+              repeat.retransmits, repeat.failed, retries, repeat.stale);
+       if (repeat.mismatched > 0 || repeat.failed > 0) {
+           status = EXIT_FAILURE;
+       }
+   }
+
+
+out:
+   free(first.latency);
+   free(repeat.latency);
+   close(sockfd);
+   return status;
+}
+
+
+static void usage(const char *prog) {
+   fprintf(stderr, "Usage: %s [-a address] [-n count] [-d depth] [-b size] <operandA> <operandB> <operator>\n", prog);
+   fprintf(stderr, "       %s [-a address] -U [-n count] [-d depth] [-W timeout_ms] [-r retries] <operandA> <operandB> <operator>\n", prog);
+   fprintf(stderr, "       %s [-a address] -I input -O output [-c connections] [-b size]\n", prog);
+   fprintf(stderr, "       %s [-a address] -C levels | -R rate [-c connections] [-t threads] [-d depth] [-T seconds] [-o ops] [-e percent] [-J file]\n", prog);
+   fprintf(stderr, "  -a address  Server IPv4 address (default 127.0.0.1)\n");
+   fprintf(stderr, "  -n count  Repeat the operation 'count' times on one keep-alive connection (server12 -k)\n");
+   fprintf(stderr, "  -d depth  Requests kept in flight while repeating (1-%d, default 1)\n", MAX_DEPTH);
+   fprintf(stderr, "  -b size   Send one batch message of 'size' operations (operandA + i) operator operandB\n");
+   fprintf(stderr, "UDP mode needs server12 -u; each request carries an ID that matches its reply:\n");
+   fprintf(stderr, "  -U          Send the operation (and its -n repeats, -d in flight) as datagrams\n");
+   fprintf(stderr, "  -W ms       Retransmit a request unanswered for this long (default %d ms)\n", DEFAULT_UDP_TIMEOUT_MS);
+   fprintf(stderr, "  -r retries  Retransmissions before a request counts as failed (default %d)\n", DEFAULT_UDP_RETRIES);
+   fprintf(stderr, "Batch-file mode needs server12 -k, with -w for concurrent connections:\n");
+   fprintf(stderr, "  -I file     Evaluate every 9-byte record (operator, A, B; operands big-endian) in 'file'\n");
+   fprintf(stderr, "  -O file     Write one 14-byte record (operator, A, B, result, validity) per input record\n");
+   fprintf(stderr, "              to 'file', in input order\n");
+   fprintf(stderr, "  -c count    Connections sharing the file (1-%d, default 1)\n", MAX_FILE_CONNS);
+   fprintf(stderr, "  -b size     Records per batch message (default %d)\n", DEFAULT_FILE_BATCH);
+   fprintf(stderr, "Benchmark mode needs server12 -k, with -w for concurrent connections:\n");
+   fprintf(stderr, "  -C levels   Closed-loop sweep over comma-separated connection counts, e.g. 1,4,16,64\n");
+   fprintf(stderr, "  -R rate     Open-loop run at 'rate' requests/s spread over the pool (at most %.0e)\n", MAX_BENCH_RATE);
+   fprintf(stderr, "  -c count    Pooled connections for open loop (1-%d, default %d)\n", MAX_POOL, DEFAULT_POOL);
+   fprintf(stderr, "  -t threads  Benchmark threads (1-%d, default 1)\n", MAX_BENCH_THREADS);
+   fprintf(stderr, "  -T seconds  Duration of each run (default %d)\n", DEFAULT_DURATION);
+   fprintf(stderr, "  -o ops      Operator mix drawn uniformly, e.g. \"++x/\" (default \"+-x/\")\n");
+   fprintf(stderr, "  -e percent  Operations that overflow or divide by zero (default %d)\n", DEFAULT_EDGE_PERCENT);
+   fprintf(stderr, "  -J file     Also write every run as JSON ('-' = stdout)\n");
+}
 
 
 int main(int argc, char *argv[]) {
-   if (argc != 4) {
-       fprintf(stderr, "Usage: %s <operandA> <operandB> <operator>\n", argv[0]);
+   long count = 1;
+   int depth = 1;
+   long batch_size = 0;
+   const char *address = "127.0.0.1";
+   int levels[MAX_LEVELS];
+   int num_levels = 0;
+   double rate = 0;
+   int pool_size = DEFAULT_POOL;
+   int num_threads = 1;
+   int duration = DEFAULT_DURATION;
+   const char *json_path = NULL;
+   const char *in_path = NULL;
+   const char *out_path = NULL;
+   int pool_given = 0;
+   int use_udp = 0;
+   long udp_timeout_ms = DEFAULT_UDP_TIMEOUT_MS;
+   int udp_retries = DEFAULT_UDP_RETRIES;
+   int opt;
+
+
+   while ((opt = getopt(argc, argv, "n:d:b:a:C:R:c:t:T:o:e:J:I:O:UW:r:h")) != -1) {
+       switch (opt) {
+           case 'n':
+               count = atol(optarg);
+               if (count < 1) {
+                   fprintf(stderr, "Invalid count: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               break;
+           case 'd':
+               depth = atoi(optarg);
+               if (depth < 1 || depth > MAX_DEPTH) {
+                   fprintf(stderr, "Invalid depth: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               break;
+           case 'b':
+               batch_size = atol(optarg);
+               if (batch_size < 1 || batch_size > BATCH_MAX) {
+                   fprintf(stderr, "Invalid batch size: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               break;
+           case 'a':
+               address = optarg;
+               break;
+           case 'C':
+               num_levels = parse_levels(optarg, levels);
+               if (num_levels < 1) {
+                   fprintf(stderr, "Invalid concurrency levels: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               break;
+           case 'R':
+               rate = atof(optarg);
+               if (rate <= 0 || rate > MAX_BENCH_RATE) {
+                   fprintf(stderr, "Invalid rate: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               break;
+           case 'c':
+               pool_size = atoi(optarg);
+               if (pool_size < 1 || pool_size > MAX_POOL) {
+                   fprintf(stderr, "Invalid connection count: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               pool_given = 1;
+               break;
+           case 't':
+               num_threads = atoi(optarg);
+               if (num_threads < 1 || num_threads > MAX_BENCH_THREADS) {
+                   fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               break;
+           case 'T':
+               duration = atoi(optarg);
+               if (duration < 1) {
+                   fprintf(stderr, "Invalid duration: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               break;
+           case 'o':
+               bench_ops = optarg;
+               if (*bench_ops == '\0' || strspn(bench_ops, "+-x/") != strlen(bench_ops)) {
+                   fprintf(stderr, "Invalid operator mix: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               break;
+           case 'e':
+               edge_percent = atoi(optarg);
+               if (edge_percent < 0 || edge_percent > 100) {
+                   fprintf(stderr, "Invalid edge-case percentage: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               break;
+           case 'J':
+               json_path = optarg;
+               break;
+           case 'I':
+               in_path = optarg;
+               break;
+           case 'O':
+               out_path = optarg;
+               break;
+           case 'U':
+               use_udp = 1;
+               break;
+           case 'W':
+               udp_timeout_ms = atol(optarg);
+               if (udp_timeout_ms < 1) {
+                   fprintf(stderr, "Invalid timeout: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               break;
+           case 'r':
+               udp_retries = atoi(optarg);
+               if (udp_retries < 0) {
+                   fprintf(stderr, "Invalid retry count: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               break;
+           default:
+               usage(argv[0]);
+               exit(EXIT_FAILURE);
+       }
+   }
+
+
+   // Configure server address
+   struct sockaddr_in server_addr;
+   memset(&server_addr, 0, sizeof(server_addr));
+   server_addr.sin_family = AF_INET;
+   server_addr.sin_port = htons(PORT);
+   if (inet_pton(AF_INET, address, &server_addr.sin_addr) != 1) {
+       fprintf(stderr, "Invalid server address: %s\n", address);
+       exit(EXIT_FAILURE);
+   }
+
+
+   // Batch-file mode replaces the single operation
+   if (in_path != NULL || out_path != NULL) {
+       int num_conns = pool_given ? pool_size : 1;
+       if (in_path == NULL || out_path == NULL || argc != optind || num_levels > 0 || rate > 0) {
+           usage(argv[0]);
+           exit(EXIT_FAILURE);
+       }
+       if (num_conns > MAX_FILE_CONNS) {
+           fprintf(stderr, "Invalid connection count for a batch file: %d\n", num_conns);
+           exit(EXIT_FAILURE);
+       }
+       uint32_t batch = batch_size > 0 ? (uint32_t)batch_size : DEFAULT_FILE_BATCH;
+       return run_file(&server_addr, in_path, out_path, num_conns, batch) == 0 ? 0 : EXIT_FAILURE;
+   }
+
+
+   // Benchmark mode replaces the single operation
+   if (num_levels > 0 || rate > 0) {
+       if (argc != optind || (num_levels > 0 && rate > 0)) {
+           usage(argv[0]);
+           exit(EXIT_FAILURE);
+       }
+       return run_benchmark(&server_addr, pool_size, num_threads, depth, levels, num_levels, rate, duration, json_path) == 0 ? 0 : EXIT_FAILURE;
+   }
+   if (argc - optind != 3) {
+       usage(argv[0]);
        exit(EXIT_FAILURE);
    }
 
 
    // Parse command-line arguments
-   long long int operandA = atoll(argv[1]);
-   long long int operandB = atoll(argv[2]);
-   char operator = argv[3][0];
+   long long int operandA = atoll(argv[optind]);
+   long long int operandB = atoll(argv[optind + 1]);
+   char operator = argv[optind + 2][0];
 
 
    // Ensure operands are positive unsigned 32-bit integers
@@ -38,13 +1454,21 @@ int main(int argc, char *argv[]) {
    }
 
 
-   // Create the request message (9 bytes)
+   // Create the request message (9 bytes): operator, then operands A and B in network byte order
    unsigned char request[REQUEST_SIZE];
-   request[0] = operator;  // 1-byte operator
    unsigned int opA = (unsigned int) operandA;
    unsigned int opB = (unsigned int) operandB;
-   memcpy(&request[1], &opA, 4);  // 4-byte operand A (in network byte order)
-   memcpy(&request[5], &opB, 4);  // 4-byte operand B (in network byte order)
+   wire_calc_encode_request(request, operator, opA, opB);
+
+
+   // UDP mode: no connection to set up, one datagram each way per request
+   if (use_udp) {
+       if (batch_size > 0) {
+           fprintf(stderr, "Batch messages need TCP\n");
+           exit(EXIT_FAILURE);
+       }
+       return run_udp_mode(&server_addr, request, count, depth, (uint64_t)udp_timeout_ms * 1000000, udp_retries);
+   }
 
 
    // Create TCP socket
@@ -55,13 +1479,6 @@ int main(int argc, char *argv[]) {
    }
 
 
-   // Configure server address
-   struct sockaddr_in server_addr;
-   server_addr.sin_family = AF_INET;
-   server_addr.sin_port = htons(PORT);
-   inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);  // Localhost
-
-
    // Connect to the server
    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
        perror("connect failed");
@@ -70,40 +1487,81 @@ int main(int argc, char *argv[]) {
    }
 
 
+   // Batch mode: one message carries every operation
+   if (batch_size > 0) {
+       struct timespec start, end;
+       clock_gettime(CLOCK_MONOTONIC, &start);
+       long mismatched = run_batch(sockfd, operator, opA, opB, (uint32_t)batch_size);
+       clock_gettime(CLOCK_MONOTONIC, &end);
+       close(sockfd);
+       if (mismatched < 0) {
+           exit(EXIT_FAILURE);
+       }
+
+
+       double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+       printf("Batch of %ld operations in %.3f s (%.0f operations/s), %ld mismatched results\n",
+              batch_size, elapsed, batch_size / elapsed, mismatched);
+       return mismatched == 0 ? 0 : EXIT_FAILURE;
+   }
+
+
    // Send the request message
-   if (send(sockfd, request, REQUEST_SIZE, 0) < 0) {
+   if (send_all(sockfd, request, REQUEST_SIZE) < 0) {
        perror("send failed");
        close(sockfd);
        exit(EXIT_FAILURE);
    }
 
 
-   // Receive the response message
+   // Receive the response message, which may arrive in pieces
    unsigned char response[BUFFER_SIZE];
-   ssize_t bytes_received = recv(sockfd, response, BUFFER_SIZE, 0);
-   if (bytes_received < 0) {
-       perror("recv failed");
-       close(sockfd);
-       exit(EXIT_FAILURE);
+   size_t response_len = 0;
+   while (response_len < BUFFER_SIZE) {
+       ssize_t bytes_received = recv(sockfd, response + response_len, BUFFER_SIZE - response_len, 0);
+       if (bytes_received <= 0) {
+           if (bytes_received < 0) {
+               perror("recv failed");
+           } else {
+               fprintf(stderr, "Server closed the connection\n");
+           }
+           close(sockfd);
+           exit(EXIT_FAILURE);
+       }
+       response_len += bytes_received;
    }
 
 
    // Extract values from the response message
-   unsigned int operandA_resp, operandB_resp, result;
-   memcpy(&operandA_resp, &response[1], 4);  // Operand A from server
-   memcpy(&operandB_resp, &response[5], 4);  // Operand B from server
-   memcpy(&result, &response[9], 4);         // Result from server
-   unsigned char is_valid = response[13];    // Is Answer Valid (1 byte)
+   struct wire_calc reply = wire_calc_decode_response(response);
 
 
    // Print the result
-   if (is_valid == 1) {
-       printf("Result: %u %c %u = %u\n", operandA_resp, operator, operandB_resp, result);
+   if (reply.valid == CALC_VALID) {
+       printf("Result: %u %c %u = %u\n", reply.a, operator, reply.b, reply.result);
    } else {
        printf("Error: Invalid operation (e.g., overflow or division by zero)\n");
    }
 
 
+   // Repeat the remaining operations pipelined on the same connection
+   if (count > 1) {
+       struct timespec start, end;
+       clock_gettime(CLOCK_MONOTONIC, &start);
+       long mismatched = run_pipelined(sockfd, request, response, count - 1, depth);
+       clock_gettime(CLOCK_MONOTONIC, &end);
+       if (mismatched < 0) {
+           close(sockfd);
+           exit(EXIT_FAILURE);
+       }
+
+
+       double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+       printf("Pipelined %ld requests at depth %d in %.3f s (%.0f requests/s), %ld mismatched responses\n",
+              count - 1, depth, elapsed, (count - 1) / elapsed, mismatched);
+   }
+
+
    // Close the socket
    close(sockfd);
    return 0;
@@ -0,0 +1,259 @@
+#ifndef ECHOLOG_H
+#define ECHOLOG_H
+
+// Asynchronous, sampled binary logging for the echo data path.
+//
+// Each thread that logs gets its own single-producer/single-consumer ring of
+// fixed-size records. Producers never block and never take a lock: when the
+// ring is full the record is counted as dropped. One background drain thread
+// copies records from every ring to the log file. Use echolog_decode to turn
+// the file back into text. The ring of a thread that exits is handed to the
+// next thread that logs, so respawned threads never allocate another.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ECHOLOG_MAGIC "ECHOLOG1"
+#define ECHOLOG_RING_SIZE 8192  // Records per thread ring (power of two)
+#define ECHOLOG_MAX_RINGS 1024  // Maximum number of logging threads
+#define ECHOLOG_CACHE_LINE 64
+
+// Record types
+enum echolog_event {
+    ECHOLOG_RECV = 1,         // Datagram received and echoed (sampled)
+    ECHOLOG_SEND_FAILED = 2,  // Echo could not be sent (always logged)
+    ECHOLOG_END = 3           // Client sent the END marker (always logged)
+};
+
+// One 32-byte log record; peer fields stay in network byte order
+struct echolog_record {
+    uint64_t time_ns;    // CLOCK_REALTIME when the record was written
+    uint64_t timestamp;  // Timestamp field from the message header
+    uint32_t sequence;   // Sequence number from the message header
+    uint32_t peer_addr;  // Peer IPv4 address
+    uint16_t peer_port;  // Peer UDP port
+    uint16_t length;     // Datagram length in bytes
+    uint16_t thread;     // Index of the ring that produced the record
+    uint8_t event;       // enum echolog_event
+    uint8_t reserved;
+};
+
+// File header written once at the start of the log
+struct echolog_file_header {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+struct echolog_ring {
+    _Alignas(ECHOLOG_CACHE_LINE) _Atomic uint64_t head;  // Next slot the producer writes
+    _Alignas(ECHOLOG_CACHE_LINE) _Atomic uint64_t tail;  // Next slot the drain thread reads
+    _Alignas(ECHOLOG_CACHE_LINE) _Atomic uint64_t dropped;  // Records lost to a full ring
+    uint32_t sample_countdown;  // Producer-private sampling counter
+    uint16_t index;
+    struct echolog_ring *next_released;  // On the released list
+    struct echolog_record records[ECHOLOG_RING_SIZE];
+};
+
+static struct {
+    FILE *file;
+    unsigned int sample_every;  // 0 = off, 1 = every packet, N = one in N
+    pthread_t drain_thread;
+    pthread_mutex_t lock;  // Guards ring registration and the released list
+    pthread_key_t key;     // Releases a thread's ring when it exits
+    _Atomic unsigned int num_rings;
+    struct echolog_ring *rings[ECHOLOG_MAX_RINGS];
+    struct echolog_ring *released;  // Rings of exited threads; the drain thread still empties them
+} echolog = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread struct echolog_ring *echolog_thread_ring;
+
+static inline uint64_t echolog_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Thread exit: leave the ring, records still queued, to the next thread that logs
+static void echolog_release_thread(void *arg) {
+    struct echolog_ring *ring = arg;
+    pthread_mutex_lock(&echolog.lock);
+    ring->next_released = echolog.released;
+    echolog.released = ring;
+    pthread_mutex_unlock(&echolog.lock);
+}
+
+// Slow path: give this thread an exited thread's ring, or allocate and
+// register a new one, on its first record
+static inline struct echolog_ring *echolog_register_thread(void) {
+    pthread_mutex_lock(&echolog.lock);
+    struct echolog_ring *ring = echolog.released;
+    if (ring != NULL) {
+        echolog.released = ring->next_released;
+    }
+    pthread_mutex_unlock(&echolog.lock);
+    if (ring != NULL) {
+        ring->sample_countdown = echolog.sample_every;
+        echolog_thread_ring = ring;
+        pthread_setspecific(echolog.key, ring);
+        return ring;
+    }
+
+    ring = aligned_alloc(ECHOLOG_CACHE_LINE, sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->sample_countdown = echolog.sample_every;
+
+    pthread_mutex_lock(&echolog.lock);
+    unsigned int n = atomic_load(&echolog.num_rings);
+    if (n == ECHOLOG_MAX_RINGS) {
+        pthread_mutex_unlock(&echolog.lock);
+        free(ring);
+        return NULL;
+    }
+    ring->index = (uint16_t)n;
+    echolog.rings[n] = ring;
+    atomic_store_explicit(&echolog.num_rings, n + 1, memory_order_release);
+    pthread_mutex_unlock(&echolog.lock);
+
+    echolog_thread_ring = ring;
+    pthread_setspecific(echolog.key, ring);
+    return ring;
+}
+
+// Append a record to the calling thread's ring. Sampled events are skipped
+// unless they fall on the sampling interval; other events are always kept.
+static inline void echolog_write(uint8_t event, uint32_t sequence, uint64_t timestamp,
+                                 uint16_t length, uint32_t peer_addr, uint16_t peer_port) {
+    if (echolog.sample_every == 0) {
+        return;
+    }
+
+    struct echolog_ring *ring = echolog_thread_ring;
+    if (__builtin_expect(ring == NULL, 0)) {
+        ring = echolog_register_thread();
+        if (ring == NULL) {
+            return;
+        }
+    }
+
+    // Only RECV records are sampled; other events must not shift the 1-in-N phase
+    if (event == ECHOLOG_RECV) {
+        if (--ring->sample_countdown != 0) {
+            return;
+        }
+        ring->sample_countdown = echolog.sample_every;
+    }
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == ECHOLOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct echolog_record *r = &ring->records[head & (ECHOLOG_RING_SIZE - 1)];
+    r->time_ns = echolog_now_ns();
+    r->timestamp = timestamp;
+    r->sequence = sequence;
+    r->peer_addr = peer_addr;
+    r->peer_port = peer_port;
+    r->length = length;
+    r->thread = ring->index;
+    r->event = event;
+    r->reserved = 0;
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Copy every pending record to the log file; returns the number written
+static inline size_t echolog_drain_once(void) {
+    size_t written = 0;
+    unsigned int n = atomic_load_explicit(&echolog.num_rings, memory_order_acquire);
+
+    for (unsigned int i = 0; i < n; i++) {
+        struct echolog_ring *ring = echolog.rings[i];
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        while (tail != head) {
+            // Write the contiguous run up to the end of the ring in one call
+            uint64_t start = tail & (ECHOLOG_RING_SIZE - 1);
+            uint64_t count = head - tail;
+            if (start + count > ECHOLOG_RING_SIZE) {
+                count = ECHOLOG_RING_SIZE - start;
+            }
+            fwrite(&ring->records[start], sizeof(struct echolog_record), count, echolog.file);
+            tail += count;
+            written += count;
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+    }
+    return written;
+}
+
+static inline void *echolog_drain_main(void *arg) {
+    (void)arg;
+    while (1) {
+        if (echolog_drain_once() == 0) {
+            fflush(echolog.file);
+            usleep(1000);  // Idle: poll the rings again in 1 ms
+        }
+    }
+    return NULL;
+}
+
+// Open the log file and start the drain thread. sample_every = 0 disables logging.
+static inline int echolog_start(const char *path, unsigned int sample_every) {
+    echolog.sample_every = sample_every;
+    if (sample_every == 0) {
+        return 0;
+    }
+
+    int err = pthread_key_create(&echolog.key, echolog_release_thread);
+    if (err != 0) {
+        fprintf(stderr, "pthread_key_create failed: %s\n", strerror(err));
+        echolog.sample_every = 0;
+        return -1;
+    }
+    echolog.file = fopen(path, "wb");
+    if (echolog.file == NULL) {
+        perror("fopen log file failed");
+        return -1;
+    }
+
+    struct echolog_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ECHOLOG_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(struct echolog_record);
+    fwrite(&header, sizeof(header), 1, echolog.file);
+
+    if (pthread_create(&echolog.drain_thread, NULL, echolog_drain_main, NULL) != 0) {
+        perror("pthread_create failed");
+        fclose(echolog.file);
+        echolog.sample_every = 0;
+        return -1;
+    }
+    pthread_detach(echolog.drain_thread);
+    return 0;
+}
+
+// Total records dropped because a ring was full
+static inline uint64_t echolog_dropped(void) {
+    uint64_t total = 0;
+    unsigned int n = atomic_load_explicit(&echolog.num_rings, memory_order_acquire);
+    for (unsigned int i = 0; i < n; i++) {
+        total += atomic_load_explicit(&echolog.rings[i]->dropped, memory_order_relaxed);
+    }
+    return total;
+}
+
+#endif // ECHOLOG_H
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "echolog.h"
+
+// Offline decoder: converts a binary server11 log into one text line per record
+
+static const char *event_name(uint8_t event) {
+    switch (event) {
+        case ECHOLOG_RECV:
+            return "recv";
+        case ECHOLOG_SEND_FAILED:
+            return "send_failed";
+        case ECHOLOG_END:
+            return "end";
+        default:
+            return "unknown";
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <log_file>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror("fopen failed");
+        exit(EXIT_FAILURE);
+    }
+
+    struct echolog_file_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, ECHOLOG_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "Not an echo log: %s\n", argv[1]);
+        fclose(file);
+        exit(EXIT_FAILURE);
+    }
+    if (header.record_size != sizeof(struct echolog_record)) {
+        fprintf(stderr, "Unsupported record size %u (expected %zu)\n", header.record_size, sizeof(struct echolog_record));
+        fclose(file);
+        exit(EXIT_FAILURE);
+    }
+
+    struct echolog_record r;
+    char peer[INET_ADDRSTRLEN];
+    unsigned long count = 0;
+
+    while (fread(&r, sizeof(r), 1, file) == 1) {
+        struct in_addr addr = { .s_addr = r.peer_addr };
+        inet_ntop(AF_INET, &addr, peer, sizeof(peer));
+        printf("%lu.%09lu thread=%u event=%s peer=%s:%u seq=%u timestamp=%lu length=%u\n",
+               (unsigned long)(r.time_ns / 1000000000ull), (unsigned long)(r.time_ns % 1000000000ull),
+               r.thread, event_name(r.event), peer, ntohs(r.peer_port),
+               r.sequence, (unsigned long)r.timestamp, r.length);
+        count++;
+    }
+
+    fprintf(stderr, "Decoded %lu records\n", count);
+    fclose(file);
+    return 0;
+}
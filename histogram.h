@@ -0,0 +1,108 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+// Log-linear latency histogram in the style of HdrHistogram.
+//
+// Values below 2^HIST_SUB_BITS are counted exactly. Above that, every power of
+// two is split into 2^(HIST_SUB_BITS - 1) equal sub-buckets, so any reported
+// value is within 1 / 2^(HIST_SUB_BITS - 1) of the true one (1.6% with 7 bits).
+// Recording is a count increment with no allocation; histograms merge by adding.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HIST_SUB_BITS 7
+#define HIST_MAX_BITS 40  // Largest trackable value is 2^40 - 1 (about 18 minutes in ns)
+#define HIST_LINEAR (1u << HIST_SUB_BITS)
+#define HIST_HALF (1u << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS (HIST_LINEAR + (HIST_MAX_BITS - HIST_SUB_BITS) * HIST_HALF)
+
+struct histogram {
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+    uint64_t counts[HIST_BUCKETS];
+};
+
+static inline void hist_reset(struct histogram *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+static inline struct histogram *hist_create(void) {
+    struct histogram *h = malloc(sizeof(*h));
+    if (h != NULL) {
+        hist_reset(h);
+    }
+    return h;
+}
+
+static inline unsigned int hist_index(uint64_t value) {
+    if (value < HIST_LINEAR) {
+        return (unsigned int)value;
+    }
+    if (value >> HIST_MAX_BITS) {
+        return HIST_BUCKETS - 1;  // Clamp out-of-range values into the top bucket
+    }
+    unsigned int msb = 63 - __builtin_clzll(value);
+    unsigned int shift = msb - HIST_SUB_BITS + 1;
+    return HIST_LINEAR + (msb - HIST_SUB_BITS) * HIST_HALF + (unsigned int)(value >> shift) - HIST_HALF;
+}
+
+// Highest value that maps to bucket 'index'
+static inline uint64_t hist_bucket_value(unsigned int index) {
+    if (index < HIST_LINEAR) {
+        return index;
+    }
+    unsigned int k = index - HIST_LINEAR;
+    unsigned int msb = k / HIST_HALF + HIST_SUB_BITS;
+    unsigned int shift = msb - HIST_SUB_BITS + 1;
+    uint64_t low = (uint64_t)(HIST_HALF + k % HIST_HALF) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+static inline void hist_record(struct histogram *h, uint64_t value) {
+    h->counts[hist_index(value)]++;
+    h->total++;
+    h->sum += (double)value;
+    if (value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+}
+
+static inline void hist_merge(struct histogram *dst, const struct histogram *src) {
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+// Value at percentile p (0-100); the exact maximum is returned for p = 100
+static inline uint64_t hist_percentile(const struct histogram *h, double p) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p / 100.0 * h->total + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank >= h->total) return h->max;
+
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t value = hist_bucket_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+static inline double hist_mean(const struct histogram *h) {
+    return h->total ? h->sum / h->total : 0.0;
+}
+
+#endif // HISTOGRAM_H
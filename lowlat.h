@@ -0,0 +1,135 @@
+#ifndef LOWLAT_H
+#define LOWLAT_H
+
+// Low-latency helpers for the echo server and client: spinning receives,
+// kernel busy polling, CPU pinning, memory locking, SCHED_FIFO and buffer
+// prefaulting. Each one trades CPU time (or a core) for a shorter and more
+// predictable wake-up path; none of them is on by default.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define LOWLAT_BUSY_POLL_BUDGET 64  // Packets the kernel may poll per busy-poll pass
+
+// Polite spin-wait hint: lets the sibling hyperthread run and avoids a
+// memory-order flush when the awaited data arrives
+static inline void lowlat_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Let blocking receives on sockfd poll the device queue for up to 'usec'
+// microseconds before sleeping. SO_PREFER_BUSY_POLL and the budget need
+// Linux 5.11; older kernels still get plain SO_BUSY_POLL.
+static inline int lowlat_busy_poll(int sockfd, int usec) {
+    int on = 1;
+    int budget = LOWLAT_BUSY_POLL_BUDGET;
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0) {
+        perror("setsockopt(SO_BUSY_POLL) failed");
+        return -1;
+    }
+    if (setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) < 0 ||
+        setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)) < 0) {
+        static int warned;
+        if (!warned++) {
+            perror("setsockopt(SO_PREFER_BUSY_POLL) failed, using SO_BUSY_POLL alone");
+        }
+    }
+    return 0;
+}
+
+// Pin the calling thread to one CPU
+static inline int lowlat_pin(int cpu) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (err != 0) {
+        fprintf(stderr, "Failed to pin to CPU %d: %s\n", cpu, strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+// Parse a CPU list such as "2,3,6-7" into cpus[]; returns the count or -1
+static inline int lowlat_parse_cpus(const char *list, int *cpus, int max) {
+    int n = 0;
+    const char *p = list;
+
+    while (*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0 || first >= CPU_SETSIZE) {
+            return -1;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE) {
+                return -1;
+            }
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (n == max) {
+                return -1;
+            }
+            cpus[n++] = (int)cpu;
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        p = end;
+    }
+    return n;
+}
+
+// Lock every current and future page so no page fault or swap-in lands on the data path
+static inline int lowlat_lock_memory(void) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        perror("mlockall failed (raise RLIMIT_MEMLOCK or run with CAP_IPC_LOCK)");
+        return -1;
+    }
+    return 0;
+}
+
+// Run the calling thread, and the threads it creates afterwards, as SCHED_FIFO
+static inline int lowlat_fifo(int priority) {
+    struct sched_param param = { .sched_priority = priority };
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err != 0) {
+        fprintf(stderr, "SCHED_FIFO priority %d failed: %s\n", priority, strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+// Write one byte per page so the first packet does not pay for the page faults
+static inline void lowlat_prefault(void *buffer, size_t len) {
+    volatile unsigned char *p = buffer;
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t off = 0; off < len; off += (size_t)page) {
+        p[off] = p[off];
+    }
+    if (len > 0) {
+        p[len - 1] = p[len - 1];
+    }
+}
+
+#endif // LOWLAT_H
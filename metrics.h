@@ -0,0 +1,345 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// Lock-free metrics for the servers, exported through shared memory.
+//
+// Each thread that records a metric claims its own cache-line aligned slot in
+// a POSIX shared-memory segment: a set of counters and latency histograms in
+// the layout of histogram.h. Only the owning thread writes its slot, so an
+// update is a plain load, add and store with no lock and no atomic
+// read-modify-write. Nothing on the data path makes a system call.
+//
+// Readers (metrics_stat) map the same segment read-only and add the slots up
+// whenever they want a total. A reader may see a slot mid-update; every field
+// is a naturally aligned 64-bit word, so it sees either the old or the new
+// value of each one.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "bufpool.h"
+#include "histogram.h"
+
+#define METRICS_MAGIC "METRICS1"
+#define METRICS_VERSION 4
+#define METRICS_MAX_THREADS 1024  // Slots in the segment; untouched slots cost no memory
+#define METRICS_CACHE_LINE 64
+#define METRICS_NAME_MAX 64
+#define METRICS_TID_RELEASED (-1)  // Slot of an exited thread, counts kept, free for the next new thread
+
+// Counters shared by both servers; each server leaves the ones it has no use for at 0.
+// X(identifier, exported name, description)
+#define METRICS_COUNTERS(X) \
+    X(RX_CALLS, "rx_calls", "Receive calls (recv, recvfrom, recvmmsg or io_uring waits) that returned data") \
+    X(RX_PACKETS, "rx_packets", "Datagrams received") \
+    X(RX_BYTES, "rx_bytes", "Bytes received") \
+    X(RX_ERRORS, "rx_errors", "Failed receive calls") \
+    X(TX_PACKETS, "tx_packets", "Datagrams sent") \
+    X(TX_BYTES, "tx_bytes", "Bytes sent") \
+    X(TX_ERRORS, "tx_errors", "Failed sends (sendto, sendmmsg, send or io_uring send)") \
+    X(MALFORMED, "malformed", "Datagrams or requests without a valid header or operator") \
+    X(END_MARKERS, "end_markers", "END datagrams received") \
+    X(CONNECTIONS, "connections", "Connections accepted") \
+    X(CLOSED, "connections_closed", "Connections closed") \
+    X(REQUESTS, "requests", "Calculator messages answered") \
+    X(OPS_ADD, "ops_add", "Single '+' requests") \
+    X(OPS_SUB, "ops_sub", "Single '-' requests") \
+    X(OPS_MUL, "ops_mul", "Single 'x' requests") \
+    X(OPS_DIV, "ops_div", "Single '/' requests") \
+    X(BATCHES, "batches", "Batch messages") \
+    X(BATCH_OPS, "batch_ops", "Operations carried in batch messages") \
+    X(INVALID_RESULTS, "invalid_results", "Single requests that overflowed or divided by zero") \
+    X(RX_QUEUE_DROPS, "rx_queue_drops", "Datagrams the kernel dropped on a full receive buffer (SO_RXQ_OVFL)") \
+    X(BUF_HIGH_WATER, "buffer_high_water", "Most pool buffers in use at once, summed over the threads' pools") \
+    X(BUF_EXHAUSTED, "buffer_exhausted", "Buffer requests that found their pool empty") \
+    X(ADMIT_SHED, "admission_shed", "Datagrams dropped for exceeding their peer's admission limit") \
+    X(ADMIT_DEFERRED, "admission_deferred", "Over-limit datagrams echoed because the socket was idle (-D)") \
+    X(ADMIT_OVERFLOW, "admission_overflow", "Datagrams from peers limited by the shared overflow bucket")
+
+// Latency distributions, all in nanoseconds.
+// X(identifier, exported name, description)
+#define METRICS_HISTOGRAMS(X) \
+    X(HANDLER, "handler_latency", "Time to handle one receive call's worth of work") \
+    X(QUEUE_DELAY, "queue_delay", "Time a datagram waited in the socket receive queue before it was read") \
+    X(ECHO_TIME, "echo_time", "Time from reading a datagram to its echo being sent")
+
+enum metrics_counter {
+#define METRICS_ENUM(id, name, help) METRIC_##id,
+    METRICS_COUNTERS(METRICS_ENUM)
+#undef METRICS_ENUM
+    METRIC_COUNT
+};
+
+enum metrics_histogram {
+#define METRICS_ENUM(id, name, help) METRIC_HIST_##id,
+    METRICS_HISTOGRAMS(METRICS_ENUM)
+#undef METRICS_ENUM
+    METRIC_HIST_COUNT
+};
+
+// One latency distribution in histogram.h buckets
+struct metrics_latency {
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+    _Alignas(METRICS_CACHE_LINE) _Atomic uint64_t counts[HIST_BUCKETS];
+};
+
+// One thread's metrics; only that thread writes it
+struct metrics_thread {
+    _Alignas(METRICS_CACHE_LINE) _Atomic uint64_t counters[METRIC_COUNT];
+    _Atomic int32_t tid;  // Kernel thread id of the owner, or METRICS_TID_RELEASED
+    struct metrics_latency latency[METRIC_HIST_COUNT];
+};
+
+// The shared-memory segment
+struct metrics_segment {
+    char magic[8];         // Written last, once the header is complete
+    uint32_t version;
+    uint32_t counters;     // METRIC_COUNT of the writer
+    uint32_t buckets;      // HIST_BUCKETS of the writer
+    uint32_t histograms;   // METRIC_HIST_COUNT of the writer
+    uint32_t max_threads;
+    int32_t pid;
+    uint64_t start_ns;     // CLOCK_REALTIME when the server started
+    char program[32];
+    _Alignas(METRICS_CACHE_LINE) _Atomic uint32_t num_threads;  // Slots claimed so far
+    _Atomic uint32_t overflow;  // Threads that found every slot taken and are not counted
+    struct metrics_thread threads[METRICS_MAX_THREADS];
+};
+
+static const char *const metrics_names[METRIC_COUNT] = {
+#define METRICS_NAME(id, name, help) name,
+    METRICS_COUNTERS(METRICS_NAME)
+#undef METRICS_NAME
+};
+
+static const char *const metrics_help[METRIC_COUNT] = {
+#define METRICS_HELP(id, name, help) help,
+    METRICS_COUNTERS(METRICS_HELP)
+#undef METRICS_HELP
+};
+
+static const char *const metrics_histogram_names[METRIC_HIST_COUNT] = {
+#define METRICS_NAME(id, name, help) name,
+    METRICS_HISTOGRAMS(METRICS_NAME)
+#undef METRICS_NAME
+};
+
+static const char *const metrics_histogram_help[METRIC_HIST_COUNT] = {
+#define METRICS_HELP(id, name, help) help,
+    METRICS_HISTOGRAMS(METRICS_HELP)
+#undef METRICS_HELP
+};
+
+static struct metrics_segment *metrics_segment;
+static __thread struct metrics_thread *metrics_thread_slot;
+static pthread_key_t metrics_key;  // Releases a thread's slot when it exits
+
+static inline uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Thread exit: free the slot for a later thread, which adds to the counts kept in it
+static void metrics_release_thread(void *arg) {
+    struct metrics_thread *t = arg;
+    atomic_store_explicit(&t->tid, METRICS_TID_RELEASED, memory_order_release);
+}
+
+// Slow path: claim a slot for the calling thread on its first update, taking
+// over an exited thread's slot before using up a new one
+static inline struct metrics_thread *metrics_register_thread(void) {
+    struct metrics_segment *seg = metrics_segment;
+    if (seg == NULL) {
+        return NULL;  // metrics_start() has not run
+    }
+    int32_t tid = (int32_t)syscall(SYS_gettid);
+    struct metrics_thread *t = NULL;
+    unsigned int n = atomic_load_explicit(&seg->num_threads, memory_order_relaxed);
+    for (unsigned int i = 0; i < n && i < METRICS_MAX_THREADS && t == NULL; i++) {
+        int32_t released = METRICS_TID_RELEASED;
+        if (atomic_compare_exchange_strong_explicit(&seg->threads[i].tid, &released, tid, memory_order_acq_rel,
+                                                    memory_order_relaxed)) {
+            t = &seg->threads[i];
+        }
+    }
+    if (t == NULL) {
+        unsigned int i = atomic_fetch_add_explicit(&seg->num_threads, 1, memory_order_relaxed);
+        if (i >= METRICS_MAX_THREADS) {
+            atomic_fetch_add_explicit(&seg->overflow, 1, memory_order_relaxed);
+            return NULL;
+        }
+        t = &seg->threads[i];
+        atomic_store_explicit(&t->tid, tid, memory_order_relaxed);
+    }
+    metrics_thread_slot = t;
+    pthread_setspecific(metrics_key, t);
+    return t;
+}
+
+static inline struct metrics_thread *metrics_thread(void) {
+    struct metrics_thread *t = metrics_thread_slot;
+    if (__builtin_expect(t == NULL, 0)) {
+        t = metrics_register_thread();
+    }
+    return t;
+}
+
+// Single-writer increment: a relaxed load and store, never a locked instruction
+static inline void metrics_bump(_Atomic uint64_t *word, uint64_t n) {
+    atomic_store_explicit(word, atomic_load_explicit(word, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void metrics_add(enum metrics_counter counter, uint64_t n) {
+    struct metrics_thread *t = metrics_thread();
+    if (t != NULL) {
+        metrics_bump(&t->counters[counter], n);
+    }
+}
+
+static inline void metrics_observe(enum metrics_histogram histogram, uint64_t ns) {
+    struct metrics_thread *t = metrics_thread();
+    if (t == NULL) {
+        return;
+    }
+    struct metrics_latency *l = &t->latency[histogram];
+    metrics_bump(&l->counts[hist_index(ns)], 1);
+    metrics_bump(&l->sum, ns);
+    if (ns > atomic_load_explicit(&l->max, memory_order_relaxed)) {
+        atomic_store_explicit(&l->max, ns, memory_order_relaxed);
+    }
+}
+
+// Record one handler latency measured from 'start_ns' (metrics_now_ns) to now
+static inline void metrics_latency_since(uint64_t start_ns) {
+    metrics_observe(METRIC_HIST_HANDLER, metrics_now_ns() - start_ns);
+}
+
+// Take a slot from a packet buffer pool (NULL for a NULL or empty pool),
+// counting a new high-water mark or an empty pool
+static inline void *metrics_pool_get(struct bufpool *pool) {
+    if (pool == NULL) {
+        return NULL;
+    }
+    uint32_t high_water = pool->high_water;
+    void *buf = bufpool_get(pool);
+    metrics_add(METRIC_BUF_HIGH_WATER, pool->high_water - high_water);
+    metrics_add(METRIC_BUF_EXHAUSTED, buf == NULL);
+    return buf;
+}
+
+// Create (or replace) the shared-memory segment /dev/shm/<name>. If it cannot
+// be created, metrics are still kept in private memory but not exported.
+static inline int metrics_start(const char *program, const char *name) {
+    char path[METRICS_NAME_MAX + 2];
+    size_t size = sizeof(struct metrics_segment);
+    struct metrics_segment *seg = MAP_FAILED;
+
+    snprintf(path, sizeof(path), "/%s", name);
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)size) < 0) {
+        perror("shm_open(metrics) failed, metrics are not exported");
+    } else {
+        seg = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (seg == MAP_FAILED) {
+        seg = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (seg == MAP_FAILED) {
+            perror("mmap(metrics) failed");
+            return -1;
+        }
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    seg->version = METRICS_VERSION;
+    seg->counters = METRIC_COUNT;
+    seg->buckets = HIST_BUCKETS;
+    seg->histograms = METRIC_HIST_COUNT;
+    seg->max_threads = METRICS_MAX_THREADS;
+    seg->pid = getpid();
+    seg->start_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    snprintf(seg->program, sizeof(seg->program), "%s", program);
+    atomic_thread_fence(memory_order_release);
+    memcpy(seg->magic, METRICS_MAGIC, sizeof(seg->magic));
+
+    int err = pthread_key_create(&metrics_key, metrics_release_thread);
+    if (err != 0) {
+        fprintf(stderr, "pthread_key_create failed: %s\n", strerror(err));
+        return -1;
+    }
+    metrics_segment = seg;
+    return 0;
+}
+
+// Map an exported segment read-only; returns NULL if it is missing or incompatible
+static inline const struct metrics_segment *metrics_attach(const char *name) {
+    char path[METRICS_NAME_MAX + 2];
+    snprintf(path, sizeof(path), "/%s", name);
+
+    int fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        perror("shm_open failed");
+        return NULL;
+    }
+    const struct metrics_segment *seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) {
+        perror("mmap failed");
+        return NULL;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (memcmp(seg->magic, METRICS_MAGIC, sizeof(seg->magic)) != 0 || seg->version != METRICS_VERSION ||
+        seg->counters != METRIC_COUNT || seg->buckets != HIST_BUCKETS || seg->histograms != METRIC_HIST_COUNT) {
+        fprintf(stderr, "%s is not a compatible metrics segment\n", path);
+        munmap((void *)seg, sizeof(*seg));
+        return NULL;
+    }
+    return seg;
+}
+
+// Number of slots that hold a thread's metrics
+static inline unsigned int metrics_threads(const struct metrics_segment *seg) {
+    unsigned int n = atomic_load_explicit(&seg->num_threads, memory_order_relaxed);
+    return n < METRICS_MAX_THREADS ? n : METRICS_MAX_THREADS;
+}
+
+// Add one thread's counters and latency histograms (METRIC_HIST_COUNT of them) into the totals
+static inline void metrics_collect(const struct metrics_thread *t, uint64_t *counters, struct histogram *latency) {
+    for (unsigned int c = 0; c < METRIC_COUNT; c++) {
+        counters[c] += atomic_load_explicit(&t->counters[c], memory_order_relaxed);
+    }
+    for (unsigned int h = 0; h < METRIC_HIST_COUNT; h++) {
+        const struct metrics_latency *l = &t->latency[h];
+        struct histogram *dst = &latency[h];
+        uint64_t total = 0;
+        for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+            uint64_t n = atomic_load_explicit(&l->counts[i], memory_order_relaxed);
+            dst->counts[i] += n;
+            total += n;
+            if (n != 0 && hist_bucket_value(i) < dst->min) {
+                dst->min = hist_bucket_value(i);
+            }
+        }
+        dst->total += total;
+        dst->sum += (double)atomic_load_explicit(&l->sum, memory_order_relaxed);
+        uint64_t max = atomic_load_explicit(&l->max, memory_order_relaxed);
+        if (max > dst->max) {
+            dst->max = max;
+        }
+    }
+}
+
+#endif // METRICS_H
@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include "metrics.h"
+
+// Reads the metrics a server exports in shared memory (server11/server12 -m).
+// By default it prints per-second rates and the latency distributions of each
+// interval. -t lists every thread's totals, and -p writes Prometheus text.
+
+struct snapshot {
+    uint64_t time_ns;
+    uint64_t counters[METRIC_COUNT];
+    struct histogram latency[METRIC_HIST_COUNT];
+};
+
+static void snapshot_take(const struct metrics_segment *seg, struct snapshot *s) {
+    memset(s->counters, 0, sizeof(s->counters));
+    for (unsigned int h = 0; h < METRIC_HIST_COUNT; h++) {
+        hist_reset(&s->latency[h]);
+    }
+    unsigned int n = metrics_threads(seg);
+    for (unsigned int i = 0; i < n; i++) {
+        metrics_collect(&seg->threads[i], s->counters, s->latency);
+    }
+    s->time_ns = metrics_now_ns();
+}
+
+// Latency recorded between two snapshots. The interval maximum is not kept, so
+// it is estimated from the highest bucket that changed.
+static void latency_delta(const struct histogram *cur, const struct histogram *prev, struct histogram *out) {
+    hist_reset(out);
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t n = cur->counts[i] - prev->counts[i];
+        out->counts[i] = n;
+        out->total += n;
+        if (n != 0) {
+            uint64_t value = hist_bucket_value(i);
+            if (value < out->min) out->min = value;
+            out->max = value < cur->max ? value : cur->max;
+        }
+    }
+    out->sum = cur->sum - prev->sum;
+}
+
+static int server_alive(const struct metrics_segment *seg) {
+    return kill(seg->pid, 0) == 0 || errno == EPERM;
+}
+
+static void print_rates(const struct metrics_segment *seg, const struct snapshot *cur, const struct snapshot *prev) {
+    double seconds = (cur->time_ns - prev->time_ns) / 1e9;
+    struct histogram latency;
+
+    printf("%s pid %d%s\n", seg->program, seg->pid, server_alive(seg) ? "" : " (not running)");
+    for (unsigned int c = 0; c < METRIC_COUNT; c++) {
+        if (cur->counters[c] == 0) {
+            continue;  // Not used by this server, or nothing happened yet
+        }
+        printf("  %-20s %14.0f/s %18llu\n", metrics_names[c], (cur->counters[c] - prev->counters[c]) / seconds,
+               (unsigned long long)cur->counters[c]);
+    }
+    for (unsigned int h = 0; h < METRIC_HIST_COUNT; h++) {
+        if (cur->latency[h].total == 0) {
+            continue;
+        }
+        latency_delta(&cur->latency[h], &prev->latency[h], &latency);
+        printf("  %-20s %10llu samples  mean %.1f us  p50 %.1f us  p99 %.1f us  p99.9 %.1f us  max %.1f us\n",
+               metrics_histogram_names[h], (unsigned long long)latency.total, hist_mean(&latency) / 1e3,
+               hist_percentile(&latency, 50) / 1e3, hist_percentile(&latency, 99) / 1e3,
+               hist_percentile(&latency, 99.9) / 1e3, latency.max / 1e3);
+    }
+    fflush(stdout);
+}
+
+static void print_threads(const struct metrics_segment *seg) {
+    unsigned int n = metrics_threads(seg);
+    printf("%-6s %-8s", "slot", "tid");
+    for (unsigned int c = 0; c < METRIC_COUNT; c++) {
+        printf(" %14s", metrics_names[c]);
+    }
+    printf(" %10s %10s\n", "p50_us", "p99_us");
+
+    static struct histogram latency[METRIC_HIST_COUNT];
+    for (unsigned int i = 0; i < n; i++) {
+        uint64_t counters[METRIC_COUNT] = { 0 };
+        for (unsigned int h = 0; h < METRIC_HIST_COUNT; h++) {
+            hist_reset(&latency[h]);
+        }
+        metrics_collect(&seg->threads[i], counters, latency);
+        int32_t tid = atomic_load_explicit(&seg->threads[i].tid, memory_order_relaxed);
+        if (tid == METRICS_TID_RELEASED) {
+            printf("%-6u %-8s", i, "exited");  // Counts of exited threads, kept for the next one
+        } else {
+            printf("%-6u %-8d", i, tid);
+        }
+        for (unsigned int c = 0; c < METRIC_COUNT; c++) {
+            printf(" %14llu", (unsigned long long)counters[c]);
+        }
+        printf(" %10.1f %10.1f\n", hist_percentile(&latency[METRIC_HIST_HANDLER], 50) / 1e3,
+               hist_percentile(&latency[METRIC_HIST_HANDLER], 99) / 1e3);
+    }
+    unsigned int overflow = atomic_load_explicit(&seg->overflow, memory_order_relaxed);
+    if (overflow > 0) {
+        printf("%u threads not counted: all %d slots taken\n", overflow, METRICS_MAX_THREADS);
+    }
+}
+
+// Prometheus text exposition: one counter per metric and a summary per latency distribution
+static void write_prometheus(FILE *out, const struct metrics_segment *seg, const struct snapshot *s) {
+    const char *p = seg->program;
+    for (unsigned int c = 0; c < METRIC_COUNT; c++) {
+        fprintf(out, "# HELP %s_%s_total %s\n", p, metrics_names[c], metrics_help[c]);
+        fprintf(out, "# TYPE %s_%s_total counter\n", p, metrics_names[c]);
+        fprintf(out, "%s_%s_total %llu\n", p, metrics_names[c], (unsigned long long)s->counters[c]);
+    }
+
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    for (unsigned int h = 0; h < METRIC_HIST_COUNT; h++) {
+        const char *name = metrics_histogram_names[h];
+        const struct histogram *latency = &s->latency[h];
+        fprintf(out, "# HELP %s_%s_seconds %s\n", p, name, metrics_histogram_help[h]);
+        fprintf(out, "# TYPE %s_%s_seconds summary\n", p, name);
+        for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+            fprintf(out, "%s_%s_seconds{quantile=\"%g\"} %.9f\n", p, name, quantiles[i],
+                    hist_percentile(latency, quantiles[i] * 100) / 1e9);
+        }
+        fprintf(out, "%s_%s_seconds_sum %.9f\n", p, name, latency->sum / 1e9);
+        fprintf(out, "%s_%s_seconds_count %llu\n", p, name, (unsigned long long)latency->total);
+    }
+
+    fprintf(out, "# HELP %s_threads Threads recording metrics\n", p);
+    fprintf(out, "# TYPE %s_threads gauge\n", p);
+    fprintf(out, "%s_threads %u\n", p, metrics_threads(seg));
+    fprintf(out, "# HELP %s_start_time_seconds Server start time since the Unix epoch\n", p);
+    fprintf(out, "# TYPE %s_start_time_seconds gauge\n", p);
+    fprintf(out, "%s_start_time_seconds %.3f\n", p, seg->start_ns / 1e9);
+}
+
+// Replace 'path' in one step so a scraper never reads a half-written file
+static int write_prometheus_file(const char *path, const struct metrics_segment *seg, const struct snapshot *s) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        perror("fopen failed");
+        return -1;
+    }
+    write_prometheus(out, seg, s);
+    if (fclose(out) != 0 || rename(tmp, path) < 0) {
+        perror("writing Prometheus file failed");
+        return -1;
+    }
+    return 0;
+}
+
+static void sleep_ns(uint64_t ns) {
+    struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-i seconds] [-n count] [-t] [-p] [-o file] <name>\n", prog);
+    fprintf(stderr, "  name        Metrics segment given to the server with -m (server11 or server12 by default)\n");
+    fprintf(stderr, "  -i seconds  Reporting interval (default 1)\n");
+    fprintf(stderr, "  -n count    Stop after 'count' intervals (default: run until interrupted)\n");
+    fprintf(stderr, "  -t          Print each thread's totals once and exit\n");
+    fprintf(stderr, "  -p          Print totals in Prometheus text format once and exit;\n");
+    fprintf(stderr, "              with -i, rewrite the output every interval\n");
+    fprintf(stderr, "  -o file     Write the Prometheus text to 'file' instead of stdout\n");
+}
+
+int main(int argc, char *argv[]) {
+    double interval = 1.0;
+    int interval_given = 0;
+    long count = 0;
+    int threads = 0;
+    int prometheus = 0;
+    const char *out_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:n:tpo:h")) != -1) {
+        switch (opt) {
+            case 'i':
+                interval = atof(optarg);
+                if (interval <= 0) {
+                    fprintf(stderr, "Invalid interval: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                interval_given = 1;
+                break;
+            case 'n':
+                count = atol(optarg);
+                if (count < 1) {
+                    fprintf(stderr, "Invalid count: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                threads = 1;
+                break;
+            case 'p':
+                prometheus = 1;
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    const struct metrics_segment *seg = metrics_attach(argv[optind]);
+    if (seg == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (threads) {
+        print_threads(seg);
+        return 0;
+    }
+
+    uint64_t interval_ns = (uint64_t)(interval * 1e9);
+    struct snapshot *cur = malloc(sizeof(*cur));
+    struct snapshot *prev = malloc(sizeof(*prev));
+    if (cur == NULL || prev == NULL) {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (prometheus) {
+        for (long i = 0; ; i++) {
+            snapshot_take(seg, cur);
+            if (out_path != NULL) {
+                if (write_prometheus_file(out_path, seg, cur) < 0) {
+                    exit(EXIT_FAILURE);
+                }
+            } else {
+                write_prometheus(stdout, seg, cur);
+                fflush(stdout);
+            }
+            if (!interval_given || (count > 0 && i + 1 >= count)) {
+                break;
+            }
+            sleep_ns(interval_ns);
+        }
+        return 0;
+    }
+
+    snapshot_take(seg, prev);
+    for (long i = 0; count == 0 || i < count; i++) {
+        sleep_ns(interval_ns);
+        snapshot_take(seg, cur);
+        print_rates(seg, cur, prev);
+        struct snapshot *t = prev;
+        prev = cur;
+        cur = t;
+    }
+
+    free(cur);
+    free(prev);
+    return 0;
+}
@@ -0,0 +1,544 @@
+#ifndef RELIABLE_H
+#define RELIABLE_H
+
+// Selective-acknowledgement reliability over the echo protocol (client11c -A).
+//
+// The server returns every message unchanged, so each echo is a selective
+// acknowledgement of exactly one sequence number. The sender keeps a sliding
+// window of unacknowledged messages per flow and resends a message when
+//   - its retransmission timeout expires (RFC 6298 estimator, exponential
+//     backoff per message), or
+//   - REL_DUPTHRESH later messages of the same flow have been acknowledged
+//     (fast retransmit on a gap, as SACK-based TCP does).
+// Each transmission stamps the current time into the header and the echo
+// brings it back, so every echo is an unambiguous RTT sample even for a
+// retransmitted message (the TCP timestamp option's answer to Karn's problem).
+//
+// Timeouts live in a hashed timer wheel: arming, cancelling and expiring a
+// timer are O(1) whatever the window size. Timers further out than one turn
+// of the wheel stay in their bucket until their turn comes round.
+//
+// The impairment shim at the end drops and reorders packets in process, and can
+// stand in for the server altogether, so the layer can be exercised offline.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REL_TICK_NS 250000ull             // Timer wheel resolution
+#define REL_WHEEL_SLOTS 4096              // One turn: about one second
+#define REL_INITIAL_RTO_NS 20000000ull    // Before the first RTT sample
+#define REL_MIN_RTO_NS 5000000ull         // Scheduling noise on a busy host reaches a few ms
+#define REL_MAX_RTO_NS 1000000000ull
+#define REL_MAX_RETRIES 10                // Transmissions after the first before a message is abandoned
+#define REL_DUPTHRESH 3                   // Later acknowledgements that mark a hole as lost
+#define REL_NONE UINT32_MAX
+
+#define REL_EXPIRED REL_WHEEL_SLOTS       // List of timers due for the caller
+#define REL_UNLINKED (REL_WHEEL_SLOTS + 1)
+
+// Message states in the window
+#define REL_FREE 0
+#define REL_IN_FLIGHT 1
+#define REL_ACKED 2
+#define REL_ABANDONED 3
+
+// rel_ack results
+#define REL_ACK_NEW 1    // First echo of a message in flight
+#define REL_ACK_DUP 2    // Echo of a message already acknowledged or abandoned
+#define REL_ACK_STRAY 3  // Outside the window, or the payload does not match
+
+// rel_next_expired results
+#define REL_RESEND 1     // Transmit the message again now
+#define REL_GIVE_UP 2    // The message exhausted its retries
+
+struct rel_entry {
+    uint64_t cookie;     // Caller's identity for the message (client11c: its number)
+    uint64_t first_ns;   // When the message was first due
+    uint64_t due_tick;   // Timer expiry
+    uint32_t sequence;
+    uint32_t next;       // Timer list links, by entry index
+    uint32_t prev;
+    uint32_t list;       // Wheel bucket, REL_EXPIRED or REL_UNLINKED
+    uint16_t retries;
+    uint8_t timeouts;    // Timeouts so far: the exponent of the backoff
+    uint8_t state;
+    uint8_t fast;        // Queued by fast retransmit rather than a timeout
+};
+
+struct rel_flow {
+    uint32_t una;         // Oldest message not yet acknowledged or abandoned
+    uint32_t nxt;         // Sequence number of the next new message
+    uint32_t high_acked;  // Highest sequence number acknowledged so far
+    uint32_t scan;        // Fast-retransmit cursor: holes before it were already considered
+    int sampled;          // An RTT sample has been taken
+    uint64_t srtt_ns;
+    uint64_t rttvar_ns;
+    uint64_t rto_ns;
+};
+
+struct rel_stats {
+    uint64_t sent;             // First transmissions
+    uint64_t retransmits;      // Every later transmission
+    uint64_t fast_retransmits; // Retransmissions caused by a gap
+    uint64_t timeouts;         // Retransmissions caused by an expired timer
+    uint64_t delivered;        // Messages acknowledged
+    uint64_t duplicates;       // Echoes of messages already acknowledged
+    uint64_t stray;            // Echoes that match nothing in the window
+    uint64_t abandoned;        // Messages given up after REL_MAX_RETRIES
+};
+
+struct rel_sender {
+    struct rel_entry *entries;  // num_flows windows of 'window' entries
+    struct rel_flow *flows;
+    uint32_t num_flows;
+    uint32_t window;            // Power of two
+    uint32_t in_flight;
+    uint64_t start_ns;          // Time of tick 0
+    uint64_t tick;              // Next wheel tick to expire
+    uint32_t heads[REL_WHEEL_SLOTS + 1];  // Wheel buckets, then the expired list
+    struct rel_stats stats;
+};
+
+static inline uint32_t rel_index(const struct rel_sender *s, uint32_t flow, uint32_t sequence) {
+    return flow * s->window + (sequence & (s->window - 1));
+}
+
+// Whether 'a' comes before 'b' in sequence space, across wrap-around
+static inline int rel_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+static inline void rel_unlink(struct rel_sender *s, uint32_t index) {
+    struct rel_entry *e = &s->entries[index];
+    if (e->list == REL_UNLINKED) {
+        return;
+    }
+    if (e->prev != REL_NONE) {
+        s->entries[e->prev].next = e->next;
+    } else {
+        s->heads[e->list] = e->next;
+    }
+    if (e->next != REL_NONE) {
+        s->entries[e->next].prev = e->prev;
+    }
+    e->list = REL_UNLINKED;
+}
+
+static inline void rel_link(struct rel_sender *s, uint32_t index, uint32_t list) {
+    struct rel_entry *e = &s->entries[index];
+    e->list = list;
+    e->prev = REL_NONE;
+    e->next = s->heads[list];
+    if (e->next != REL_NONE) {
+        s->entries[e->next].prev = index;
+    }
+    s->heads[list] = index;
+}
+
+// Arm the entry's timer to fire 'after_ns' from 'now_ns'
+static inline void rel_arm(struct rel_sender *s, uint32_t index, uint64_t now_ns, uint64_t after_ns) {
+    uint64_t due = (now_ns - s->start_ns + after_ns + REL_TICK_NS - 1) / REL_TICK_NS;
+    if (due < s->tick) {
+        due = s->tick;
+    }
+    rel_unlink(s, index);
+    s->entries[index].due_tick = due;
+    rel_link(s, index, (uint32_t)(due % REL_WHEEL_SLOTS));
+}
+
+// A sender for 'num_flows' flows, each with room for 'window' messages in
+// flight (rounded up to a power of two)
+static inline struct rel_sender *rel_create(uint32_t num_flows, uint32_t window, uint64_t now_ns) {
+    uint32_t size = 1;
+    while (size < window) {
+        size <<= 1;
+    }
+    struct rel_sender *s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->entries = calloc((size_t)num_flows * size, sizeof(*s->entries));
+    s->flows = calloc(num_flows, sizeof(*s->flows));
+    if (s->entries == NULL || s->flows == NULL) {
+        free(s->entries);
+        free(s->flows);
+        free(s);
+        return NULL;
+    }
+    s->num_flows = num_flows;
+    s->window = size;
+    s->start_ns = now_ns;
+    for (uint32_t i = 0; i < num_flows * size; i++) {
+        s->entries[i].list = REL_UNLINKED;
+    }
+    for (uint32_t i = 0; i <= REL_WHEEL_SLOTS; i++) {
+        s->heads[i] = REL_NONE;
+    }
+    for (uint32_t f = 0; f < num_flows; f++) {
+        struct rel_flow *fl = &s->flows[f];
+        fl->una = fl->nxt = fl->scan = 1;  // Sequence numbers start at 1, as in every echo client
+        fl->high_acked = 0;
+        fl->rto_ns = REL_INITIAL_RTO_NS;
+    }
+    return s;
+}
+
+static inline void rel_destroy(struct rel_sender *s) {
+    if (s != NULL) {
+        free(s->entries);
+        free(s->flows);
+        free(s);
+    }
+}
+
+static inline int rel_can_send(const struct rel_sender *s, uint32_t flow) {
+    const struct rel_flow *f = &s->flows[flow];
+    return f->nxt - f->una < s->window;
+}
+
+// Whether every message sent so far is acknowledged or abandoned
+static inline int rel_idle(const struct rel_sender *s) {
+    return s->in_flight == 0;
+}
+
+// Enter a new message into the flow's window and arm its timer; returns the
+// sequence number to send it with. 'first_ns' is when it was due, for the
+// caller's delivery latency.
+static inline uint32_t rel_send(struct rel_sender *s, uint32_t flow, uint64_t cookie, uint64_t first_ns, uint64_t now_ns) {
+    struct rel_flow *f = &s->flows[flow];
+    uint32_t sequence = f->nxt++;
+    uint32_t index = rel_index(s, flow, sequence);
+    struct rel_entry *e = &s->entries[index];
+    e->cookie = cookie;
+    e->first_ns = first_ns;
+    e->sequence = sequence;
+    e->retries = 0;
+    e->timeouts = 0;
+    e->fast = 0;
+    e->state = REL_IN_FLIGHT;
+    rel_arm(s, index, now_ns, f->rto_ns);
+    s->in_flight++;
+    s->stats.sent++;
+    return sequence;
+}
+
+// RFC 6298 estimator
+static inline void rel_rtt_sample(struct rel_flow *f, uint64_t rtt_ns) {
+    if (!f->sampled) {
+        f->srtt_ns = rtt_ns;
+        f->rttvar_ns = rtt_ns / 2;
+        f->sampled = 1;
+    } else {
+        uint64_t delta = f->srtt_ns > rtt_ns ? f->srtt_ns - rtt_ns : rtt_ns - f->srtt_ns;
+        f->rttvar_ns = (3 * f->rttvar_ns + delta) / 4;
+        f->srtt_ns = (7 * f->srtt_ns + rtt_ns) / 8;
+    }
+    uint64_t var = 4 * f->rttvar_ns > REL_TICK_NS ? 4 * f->rttvar_ns : REL_TICK_NS;
+    f->rto_ns = f->srtt_ns + var;
+    if (f->rto_ns < REL_MIN_RTO_NS) {
+        f->rto_ns = REL_MIN_RTO_NS;
+    } else if (f->rto_ns > REL_MAX_RTO_NS) {
+        f->rto_ns = REL_MAX_RTO_NS;
+    }
+}
+
+// Slide the window past every finished message at its left edge
+static inline void rel_advance_una(struct rel_sender *s, uint32_t flow) {
+    struct rel_flow *f = &s->flows[flow];
+    while (f->una != f->nxt) {
+        struct rel_entry *e = &s->entries[rel_index(s, flow, f->una)];
+        if (e->state != REL_ACKED && e->state != REL_ABANDONED) {
+            break;
+        }
+        e->state = REL_FREE;
+        f->una++;
+    }
+}
+
+// Queue every hole REL_DUPTHRESH or more below the highest acknowledgement
+// for retransmission, once. The cursor only moves forward, so this is
+// amortised O(1) per acknowledgement.
+static inline void rel_find_holes(struct rel_sender *s, uint32_t flow) {
+    struct rel_flow *f = &s->flows[flow];
+    if (rel_before(f->scan, f->una)) {
+        f->scan = f->una;
+    }
+    while ((int32_t)(f->high_acked - f->scan) >= REL_DUPTHRESH) {
+        uint32_t index = rel_index(s, flow, f->scan);
+        struct rel_entry *e = &s->entries[index];
+        if (e->state == REL_IN_FLIGHT && e->retries == 0 && e->list != REL_EXPIRED) {
+            rel_unlink(s, index);
+            e->fast = 1;
+            rel_link(s, index, REL_EXPIRED);
+        }
+        f->scan++;
+    }
+}
+
+// Account an echo of 'sequence' carrying the payload identity 'cookie' and the
+// transmission time 'echo_ns'. On REL_ACK_NEW, *first_ns is when the message was due.
+static inline int rel_ack(struct rel_sender *s, uint32_t flow, uint32_t sequence, uint64_t cookie, uint64_t echo_ns,
+                          uint64_t now_ns, uint64_t *first_ns) {
+    struct rel_flow *f = &s->flows[flow];
+    if (flow >= s->num_flows || rel_before(sequence, f->una) || !rel_before(sequence, f->nxt)) {
+        // Behind the window the message is finished; a late duplicate is the likely cause
+        if (flow < s->num_flows && rel_before(sequence, f->una) && f->una - sequence <= s->window) {
+            s->stats.duplicates++;
+            return REL_ACK_DUP;
+        }
+        s->stats.stray++;
+        return REL_ACK_STRAY;
+    }
+    uint32_t index = rel_index(s, flow, sequence);
+    struct rel_entry *e = &s->entries[index];
+    if (e->cookie != cookie) {
+        s->stats.stray++;
+        return REL_ACK_STRAY;
+    }
+    if (e->state != REL_IN_FLIGHT) {
+        s->stats.duplicates++;
+        return REL_ACK_DUP;
+    }
+
+    if (echo_ns <= now_ns) {
+        rel_rtt_sample(f, now_ns - echo_ns);
+    }
+    rel_unlink(s, index);
+    e->state = REL_ACKED;
+    *first_ns = e->first_ns;
+    s->in_flight--;
+    s->stats.delivered++;
+    if (rel_before(f->high_acked, sequence) || f->high_acked == 0) {
+        f->high_acked = sequence;
+    }
+    rel_advance_una(s, flow);
+    rel_find_holes(s, flow);
+    return REL_ACK_NEW;
+}
+
+// Move the timers of every tick up to 'now_ns' onto the expired list
+static inline void rel_expire(struct rel_sender *s, uint64_t now_ns) {
+    uint64_t now_tick = (now_ns - s->start_ns) / REL_TICK_NS;
+    if (s->in_flight == 0) {
+        s->tick = now_tick + 1;  // Nothing armed: skip the idle ticks
+        return;
+    }
+    for (; s->tick <= now_tick; s->tick++) {
+        uint32_t bucket = (uint32_t)(s->tick % REL_WHEEL_SLOTS);
+        uint32_t index = s->heads[bucket];
+        while (index != REL_NONE) {
+            uint32_t next = s->entries[index].next;
+            if (s->entries[index].due_tick <= s->tick) {
+                rel_unlink(s, index);
+                rel_link(s, index, REL_EXPIRED);
+            }
+            index = next;
+        }
+    }
+}
+
+// Take one message that needs attention at 'now_ns'. REL_RESEND: transmit
+// *sequence / *cookie of *flow again (its timer is already re-armed with
+// backoff). REL_GIVE_UP: the message is abandoned. 0: nothing is due.
+static inline int rel_next_expired(struct rel_sender *s, uint64_t now_ns, uint32_t *flow, uint32_t *sequence,
+                                   uint64_t *cookie) {
+    rel_expire(s, now_ns);
+    uint32_t index = s->heads[REL_EXPIRED];
+    if (index == REL_NONE) {
+        return 0;
+    }
+    rel_unlink(s, index);
+    struct rel_entry *e = &s->entries[index];
+    uint32_t f = index / s->window;
+    *flow = f;
+    *sequence = e->sequence;
+    *cookie = e->cookie;
+
+    if (e->retries >= REL_MAX_RETRIES) {
+        e->state = REL_ABANDONED;
+        s->in_flight--;
+        s->stats.abandoned++;
+        rel_advance_una(s, f);
+        return REL_GIVE_UP;
+    }
+    e->retries++;
+    s->stats.retransmits++;
+    if (e->fast) {
+        s->stats.fast_retransmits++;
+        e->fast = 0;
+    } else {
+        s->stats.timeouts++;
+        e->timeouts++;
+    }
+    // Only timeouts back off, as in TCP: a gap says the path still delivers
+    uint64_t backoff = s->flows[f].rto_ns << (e->timeouts < 6 ? e->timeouts : 6);
+    rel_arm(s, index, now_ns, backoff < REL_MAX_RTO_NS ? backoff : REL_MAX_RTO_NS);
+    return REL_RESEND;
+}
+
+// When rel_next_expired next needs calling: the next tick while anything is
+// in flight, UINT64_MAX otherwise
+static inline uint64_t rel_next_deadline(const struct rel_sender *s) {
+    if (s->in_flight == 0) {
+        return UINT64_MAX;
+    }
+    if (s->heads[REL_EXPIRED] != REL_NONE) {
+        return 0;
+    }
+    return s->start_ns + s->tick * REL_TICK_NS;
+}
+
+// ---------------------------------------------------------------------------
+// Impairment shim: drops a fraction of packets in each direction and holds
+// another fraction back for REL_SHIM_REORDER_NS, so they arrive after packets
+// sent later. In loopback mode it also plays the server, echoing every packet
+// that survives after a fixed round-trip time, and no socket is involved.
+
+#define REL_SHIM_FRAME_MAX 1038            // Largest echo message
+#define REL_SHIM_REORDER_NS 500000ull      // Extra delay of a reordered packet
+
+// What a held packet is waiting to do
+#define REL_SHIM_SEND 0     // A request, to be sent
+#define REL_SHIM_ECHO 1     // Loopback: the server's echo, not yet impaired on its way back
+#define REL_SHIM_DELIVER 2  // An echo, to be processed by the caller
+
+struct rel_shim_packet {
+    uint64_t due_ns;
+    uint32_t flow;
+    uint16_t len;
+    uint8_t kind;
+    unsigned char data[REL_SHIM_FRAME_MAX];
+};
+
+struct rel_shim {
+    double loss;          // Probability of dropping a packet, each direction
+    double reorder;       // Probability of holding a packet back
+    int loopback;         // Echo in process instead of sending
+    uint64_t rtt_ns;      // Loopback round-trip time
+    uint64_t rng;
+    struct rel_shim_packet *heap;  // Held packets, earliest due first
+    uint32_t count;
+    uint32_t cap;
+    uint64_t dropped;
+    uint64_t reordered;
+};
+
+static inline struct rel_shim *rel_shim_create(double loss, double reorder, int loopback, uint64_t rtt_ns, uint64_t seed) {
+    struct rel_shim *sh = calloc(1, sizeof(*sh));
+    if (sh == NULL) {
+        return NULL;
+    }
+    sh->loss = loss;
+    sh->reorder = reorder;
+    sh->loopback = loopback;
+    sh->rtt_ns = rtt_ns;
+    sh->rng = seed | 1;  // Fixed seeds make a run's loss pattern repeatable
+    return sh;
+}
+
+static inline void rel_shim_destroy(struct rel_shim *sh) {
+    if (sh != NULL) {
+        free(sh->heap);
+        free(sh);
+    }
+}
+
+// xorshift64*: uniform in [0, 1)
+static inline double rel_shim_random(struct rel_shim *sh) {
+    sh->rng ^= sh->rng >> 12;
+    sh->rng ^= sh->rng << 25;
+    sh->rng ^= sh->rng >> 27;
+    return (double)((sh->rng * 2685821657736338717ull) >> 11) / (double)(1ull << 53);
+}
+
+static inline int rel_shim_hold(struct rel_shim *sh, uint32_t flow, const void *buf, size_t len, int kind,
+                                uint64_t due_ns) {
+    if (sh->count == sh->cap) {
+        uint32_t cap = sh->cap ? sh->cap * 2 : 256;
+        struct rel_shim_packet *heap = realloc(sh->heap, (size_t)cap * sizeof(*heap));
+        if (heap == NULL) {
+            return -1;
+        }
+        sh->heap = heap;
+        sh->cap = cap;
+    }
+    struct rel_shim_packet p = { .due_ns = due_ns, .flow = flow, .kind = (uint8_t)kind };
+    p.len = (uint16_t)(len < REL_SHIM_FRAME_MAX ? len : REL_SHIM_FRAME_MAX);
+    memcpy(p.data, buf, p.len);
+    uint32_t i = sh->count++;
+    while (i > 0 && sh->heap[(i - 1) / 2].due_ns > due_ns) {
+        sh->heap[i] = sh->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    sh->heap[i] = p;
+    return 0;
+}
+
+// An outgoing packet: returns 1 if the caller should send it now, 0 if the
+// shim dropped it, held it back, or (loopback) took it to echo later
+static inline int rel_shim_out(struct rel_shim *sh, uint32_t flow, const void *buf, size_t len, uint64_t now_ns) {
+    if (rel_shim_random(sh) < sh->loss) {
+        sh->dropped++;
+        return 0;
+    }
+    int reordered = rel_shim_random(sh) < sh->reorder;
+    sh->reordered += reordered;
+    uint64_t extra = reordered ? REL_SHIM_REORDER_NS : 0;
+    if (sh->loopback) {
+        // The echo's own trip back is impaired when it comes due, in rel_shim_in
+        rel_shim_hold(sh, flow, buf, len, REL_SHIM_ECHO, now_ns + sh->rtt_ns + extra);
+        return 0;
+    }
+    if (reordered) {
+        rel_shim_hold(sh, flow, buf, len, REL_SHIM_SEND, now_ns + extra);
+        return 0;
+    }
+    return 1;
+}
+
+// An incoming echo: returns 1 if the caller should process it now, 0 if the
+// shim dropped it or held it back
+static inline int rel_shim_in(struct rel_shim *sh, uint32_t flow, const void *buf, size_t len, uint64_t now_ns) {
+    if (rel_shim_random(sh) < sh->loss) {
+        sh->dropped++;
+        return 0;
+    }
+    if (rel_shim_random(sh) < sh->reorder) {
+        sh->reordered++;
+        rel_shim_hold(sh, flow, buf, len, REL_SHIM_DELIVER, now_ns + REL_SHIM_REORDER_NS);
+        return 0;
+    }
+    return 1;
+}
+
+// Pop the earliest held packet into *p if it is due at 'now_ns'
+static inline int rel_shim_due(struct rel_shim *sh, uint64_t now_ns, struct rel_shim_packet *p) {
+    if (sh->count == 0 || sh->heap[0].due_ns > now_ns) {
+        return 0;
+    }
+    *p = sh->heap[0];
+    struct rel_shim_packet last = sh->heap[--sh->count];
+    uint32_t i = 0;
+    while (2 * i + 1 < sh->count) {
+        uint32_t child = 2 * i + 1;
+        if (child + 1 < sh->count && sh->heap[child + 1].due_ns < sh->heap[child].due_ns) {
+            child++;
+        }
+        if (sh->heap[child].due_ns >= last.due_ns) {
+            break;
+        }
+        sh->heap[i] = sh->heap[child];
+        i = child;
+    }
+    if (sh->count > 0) {
+        sh->heap[i] = last;
+    }
+    return 1;
+}
+
+static inline uint64_t rel_shim_next_ns(const struct rel_shim *sh) {
+    return sh->count > 0 ? sh->heap[0].due_ns : UINT64_MAX;
+}
+
+#endif // RELIABLE_H
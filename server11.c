@@ -1,72 +1,1513 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/udp.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <endian.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/filter.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include "admission.h"
+#include "bufpool.h"
+#include "capture.h"
+#include "echolog.h"
+#include "lowlat.h"
+#include "metrics.h"
+#include "session.h"
+#include "shmring.h"
+#include "uring.h"
+#include "wire.h"
 
 #define PORT 10010
 #define BUFFER_SIZE 1038  // Maximum size: 2 + 4 + 8 + 1024 bytes
 #define MAX_THREADS 10    // Maximum number of concurrent threads
+#define MAX_WORKERS 256   // Maximum number of sharded workers
+#define MAX_BATCH 1024    // Maximum datagrams per recvmmsg/sendmmsg call
+#define URING_ENTRIES 1024   // Submission queue depth per io_uring worker
+#define URING_BUFFERS 1024   // Provided receive buffers per worker (power of two)
+#define URING_BUF_SIZE 2048  // io_uring_recvmsg_out + peer address + BUFFER_SIZE payload
+#define URING_BGID 0         // Provided-buffer group id
+#define DEFAULT_SESSION_IDLE 60  // Seconds before an idle peer's session is evicted
+#define DEFAULT_METRICS_NAME "server11"
+#define QUEUE_MAX_FDS 4096       // Sockets whose kernel drop count is tracked (by descriptor)
+#define QUEUE_CONTROL_SIZE (CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(uint32_t)))
+#define OFFLOAD_BUFFER_SIZE 65536  // One UDP_GRO super-datagram: up to 64 KB of coalesced segments
+#define OFFLOAD_MAX_SEGMENTS 64    // Segments the kernel coalesces into one receive at most
+#define SHM_BURST 64                  // Requests taken from one shared-memory client before the next
+#define SHM_REAP_NS 1000000000ull     // How often dead shared-memory clients are looked for
+
+// io_uring user_data tags: operation in the high word, buffer id in the low word
+#define URING_OP_RECV 1
+#define URING_OP_SEND 2
+#define URING_USER_DATA(op, bid) (((uint64_t)(op) << 32) | (bid))
+
+// How the kernel picks a worker socket inside the SO_REUSEPORT group
+enum steering_policy {
+    STEER_HASH,  // Default 4-tuple hash: a flow always lands on the same socket
+    STEER_CPU    // Reuseport BPF: deliver to the socket owned by the receiving CPU
+};
+
+// One sharded worker: its own socket, its own thread, its own core
+struct worker {
+    pthread_t thread_id;
+    int id;
+    int cpu;
+    int sockfd;
+};
 
 sem_t thread_semaphore;  // Semaphore to limit the number of threads
 
-void *handle_client(void *client_socket) {
-    int sockfd = *((int *)client_socket);
-    free(client_socket);
+static int num_workers = 0;  // 0 selects the shared-socket thread pool
+static enum steering_policy steering = STEER_HASH;
+static int batch_size = 1;  // Datagrams per recvmmsg call; 1 keeps the recvfrom/sendto path
+
+// Execution backend for each worker
+enum backend {
+    BACKEND_THREADS,  // Blocking recvfrom/sendto (or recvmmsg/sendmmsg) threads
+    BACKEND_URING     // io_uring multishot recvmsg with provided buffers
+};
+static enum backend backend = BACKEND_THREADS;
+
+// Socket buffer sizes and kernel queue instrumentation (-R, -T, -q)
+static int rcvbuf_size = 0;  // Requested SO_RCVBUF in bytes; 0 keeps the system default
+static int sndbuf_size = 0;  // Requested SO_SNDBUF in bytes; 0 keeps the system default
+static int queue_stats = 0;  // Read SO_RXQ_OVFL and SO_TIMESTAMPING control messages
+
+// SO_RXQ_OVFL reports a running total per socket; threads sharing a socket
+// advance this high-water mark so every drop is counted exactly once
+static _Atomic uint32_t queue_dropped[QUEUE_MAX_FDS];
+
+// Control message space for one datagram, aligned for struct cmsghdr
+union queue_control {
+    struct cmsghdr align;
+    unsigned char buf[QUEUE_CONTROL_SIZE];
+};
+
+// UDP GRO/GSO offload (-g): the kernel hands over runs of same-size datagrams
+// from one peer as a single buffer, and the echo goes back as one GSO send
+static int offload = 0;
+static _Atomic int offload_gso = 1;  // Cleared if the kernel refuses UDP_SEGMENT sends
+
+// Low-latency mode (-Y, -y, -c, -M, -F): spend CPU to keep the receive path awake
+static int spin = 0;            // Poll with MSG_DONTWAIT instead of sleeping in the kernel
+static int busy_poll_usec = 0;  // SO_BUSY_POLL budget for blocking receives; 0 = off
+static int pin_cpus[CPU_SETSIZE];  // -c list; workers and threads are pinned round-robin
+static int num_pin_cpus = 0;
+static _Atomic unsigned int next_pin;  // Next -c slot for a shared-socket thread
+static int prefault = 0;        // Touch packet buffers up front; set by any low-latency option
+static int pool_flags = 0;      // -H: back the packet buffer pools with huge pages
+
+// Per-thread state for the offload path; buffers receive OFFLOAD_BUFFER_SIZE bytes
+// and have WIRE_ECHO_MIN_BUFFER more behind them for decoding a short last segment
+struct offload_batch {
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iovs[MAX_BATCH];
+    struct sockaddr_in addrs[MAX_BATCH];
+    union {
+        struct cmsghdr align;
+        unsigned char buf[QUEUE_CONTROL_SIZE + CMSG_SPACE(sizeof(int))];
+    } controls[MAX_BATCH];
+    uint16_t segment_sizes[MAX_BATCH];  // 0 = a single datagram
+    unsigned char *buffers[MAX_BATCH];
+    unsigned long buffers_received;  // Receive buffers filled, coalesced or not
+    unsigned long packets;           // Datagrams they carried
+};
+
+// Preallocated per-thread state for the batched echo path
+struct batch {
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iovs[MAX_BATCH];
+    struct sockaddr_in addrs[MAX_BATCH];
+    union queue_control controls[MAX_BATCH];
+    unsigned char *buffers[MAX_BATCH];  // Pool slots of BUFFER_SIZE + 1 bytes (+1 for the null terminator)
+    unsigned long calls;    // recvmmsg calls that returned data
+    unsigned long packets;  // Datagrams received across those calls
+};
+
+static void echo_loop_batched(int sockfd);
+static void echo_loop_offload(int sockfd);
+static void echo_loop_uring(int sockfd);
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Account the control messages of one received datagram: the kernel's software
+// receive timestamp gives its queueing delay up to 'read_ns' (CLOCK_REALTIME,
+// like the timestamp), and SO_RXQ_OVFL the socket's total receive-buffer drops.
+static void queue_stats_record(int sockfd, struct msghdr *msg, uint64_t read_ns) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET) {
+            continue;
+        }
+        if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            uint64_t queued_ns = (uint64_t)ts.ts[0].tv_sec * 1000000000ull + ts.ts[0].tv_nsec;
+            if (queued_ns != 0) {
+                metrics_observe(METRIC_HIST_QUEUE_DELAY, read_ns > queued_ns ? read_ns - queued_ns : 0);
+            }
+        } else if (cmsg->cmsg_type == SO_RXQ_OVFL && sockfd < QUEUE_MAX_FDS) {
+            uint32_t total;
+            memcpy(&total, CMSG_DATA(cmsg), sizeof(total));
+            uint32_t last = atomic_load_explicit(&queue_dropped[sockfd], memory_order_relaxed);
+            while ((int32_t)(total - last) > 0) {
+                if (atomic_compare_exchange_weak_explicit(&queue_dropped[sockfd], &last, total,
+                                                          memory_order_relaxed, memory_order_relaxed)) {
+                    metrics_add(METRIC_RX_QUEUE_DROPS, total - last);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Admission control (-A, -a): whether 'count' datagrams from 'peer' get echoed.
+// Over its limit a peer's datagrams are shed, or with -D echoed only while no
+// other datagram is waiting: 'idle' says so for a batch, -1 asks the socket.
+static int admit(int sockfd, int idle, const struct sockaddr_in *peer, unsigned int count, uint64_t now_ns) {
+    if (admission.table == NULL) {
+        return 1;
+    }
+    int overflow = 0;
+    int admitted = admission_check(peer->sin_addr.s_addr, peer->sin_port, count, now_ns, &overflow);
+    metrics_add(METRIC_ADMIT_OVERFLOW, overflow ? count : 0);
+    if (admitted) {
+        return 1;
+    }
+    if (admission.deprioritize) {
+        int queued = 0;
+        if (idle < 0) {
+            idle = ioctl(sockfd, FIONREAD, &queued) == 0 && queued == 0;
+        }
+        if (idle) {
+            metrics_add(METRIC_ADMIT_DEFERRED, count);
+            return 1;
+        }
+    }
+    metrics_add(METRIC_ADMIT_SHED, count);
+    return 0;
+}
+
+// Announce an END marker, with what the packet log and the capture lost so
+// far: a lossy log must not pass for a sampled one, nor a capture with holes
+// for a complete one
+static void print_end_received(void) {
+    printf("Received 'END' from client but continuing to listen...\n");
+    uint64_t log_dropped = echolog_dropped();
+    if (log_dropped > 0) {
+        printf("Packet log: %lu records dropped on full rings\n", (unsigned long)log_dropped);
+    }
+    uint64_t capture_dropped = atomic_load_explicit(&capture.dropped, memory_order_relaxed);
+    if (capture_dropped > 0) {
+        printf("Capture: %lu datagrams not captured (no segment could be opened)\n", (unsigned long)capture_dropped);
+    }
+}
+
+// Create the calling thread's packet buffer pool: every buffer an echo loop
+// needs is taken from it once, so the data path never calls the allocator
+static struct bufpool *echo_pool_create(uint32_t slots, size_t slot_size) {
+    struct bufpool *pool = bufpool_create(slots, slot_size, pool_flags);
+    if (pool == NULL) {
+        fprintf(stderr, "Failed to create a pool of %u %zu-byte buffers\n", slots, slot_size);
+    }
+    return pool;
+}
+
+// Receive and echo datagrams on sockfd until an error occurs
+static void echo_loop(int sockfd) {
+    if (backend == BACKEND_URING) {
+        echo_loop_uring(sockfd);
+        return;
+    }
+    if (offload) {
+        echo_loop_offload(sockfd);
+        return;
+    }
+    if (batch_size > 1) {
+        echo_loop_batched(sockfd);
+        return;
+    }
+
+    struct bufpool *pool = echo_pool_create(1, BUFFER_SIZE);
+    unsigned char *buffer = metrics_pool_get(pool);
+    if (buffer == NULL) {
+        bufpool_destroy(pool);
+        return;
+    }
 
     struct sockaddr_in client_addr;
-    unsigned char buffer[BUFFER_SIZE];
     socklen_t addr_len = sizeof(client_addr);
-    uint16_t total_length;
-    uint32_t sequence_number;
-    uint64_t timestamp;
+    union queue_control control;
+    struct iovec iov = { .iov_base = buffer, .iov_len = BUFFER_SIZE };
+    struct msghdr msg = { .msg_name = &client_addr, .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf };
+    int recv_flags = spin ? MSG_DONTWAIT : 0;
 
     while (1) {
-        // Receive message from client
-        ssize_t bytes_received = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&client_addr, &addr_len);
+        // Receive message from client; -q needs recvmsg for the control messages
+        ssize_t bytes_received;
+        if (queue_stats) {
+            msg.msg_namelen = sizeof(client_addr);
+            msg.msg_controllen = sizeof(control);
+            bytes_received = recvmsg(sockfd, &msg, recv_flags);
+            addr_len = msg.msg_namelen;
+        } else {
+            addr_len = sizeof(client_addr);
+            bytes_received = recvfrom(sockfd, buffer, BUFFER_SIZE, recv_flags, (struct sockaddr *)&client_addr, &addr_len);
+        }
+        if (bytes_received < 0 && spin && errno == EAGAIN) {
+            lowlat_relax();
+            continue;
+        }
         if (bytes_received < 0) {
-            perror("recvfrom failed");
+            metrics_add(METRIC_RX_ERRORS, 1);
+            perror(queue_stats ? "recvmsg failed" : "recvfrom failed");
             break;
         }
+        uint64_t start_ns = metrics_now_ns();
+        if (queue_stats) {
+            queue_stats_record(sockfd, &msg, realtime_ns());
+        }
+        metrics_add(METRIC_RX_CALLS, 1);
+        metrics_add(METRIC_RX_PACKETS, 1);
+        metrics_add(METRIC_RX_BYTES, bytes_received);
+        capture_write(buffer, bytes_received, client_addr.sin_addr.s_addr, client_addr.sin_port);
+        if (!admit(sockfd, -1, &client_addr, 1, start_ns)) {
+            continue;
+        }
 
-        // Unpack the received message
-        memcpy(&total_length, buffer, 2);        // 2 bytes for total message length
-        memcpy(&sequence_number, buffer + 2, 4); // 4 bytes for sequence number
-        memcpy(&timestamp, buffer + 6, 8);       // 8 bytes for timestamp
-
-        // Convert fields from network byte order to host byte order
-        total_length = ntohs(total_length);
-        sequence_number = ntohl(sequence_number);
-        timestamp = be64toh(timestamp);
-
-        // Null-terminate the string part and print the extracted data
-        buffer[bytes_received] = '\0';  // Null terminate the string
-        printf("Received from client - Sequence Number: %u, Timestamp: %lu, Message: %s\n", sequence_number, timestamp, buffer + 14);
+        // Decode the header in place
+        struct wire_echo m = wire_echo_decode(buffer, bytes_received);
+        if (!m.valid) {
+            metrics_add(METRIC_MALFORMED, 1);
+        }
 
         // Echo the exact message back to the client
         if (sendto(sockfd, buffer, bytes_received, 0, (struct sockaddr *)&client_addr, addr_len) < 0) {
+            metrics_add(METRIC_TX_ERRORS, 1);
+            echolog_write(ECHOLOG_SEND_FAILED, m.sequence, m.timestamp, bytes_received,
+                          client_addr.sin_addr.s_addr, client_addr.sin_port);
             perror("sendto failed");
             break;
         }
+        metrics_add(METRIC_TX_PACKETS, 1);
+        metrics_add(METRIC_TX_BYTES, bytes_received);
+        if (queue_stats) {
+            metrics_observe(METRIC_HIST_ECHO_TIME, metrics_now_ns() - start_ns);
+        }
 
-        printf("Server echoed message to client: %s\n", buffer + 14);
+        echolog_write(ECHOLOG_RECV, m.sequence, m.timestamp, bytes_received,
+                      client_addr.sin_addr.s_addr, client_addr.sin_port);
+        session_record(client_addr.sin_addr.s_addr, client_addr.sin_port, m.sequence, bytes_received, m.valid, m.end);
 
         // Check for termination signal "END" but don't shut down the server
-        if (strcmp((char *)buffer + 14, "END") == 0) {
-            printf("Received 'END' from client but continuing to listen...\n");
+        if (m.end) {
+            metrics_add(METRIC_END_MARKERS, 1);
+            echolog_write(ECHOLOG_END, m.sequence, m.timestamp, bytes_received,
+                          client_addr.sin_addr.s_addr, client_addr.sin_port);
+            print_end_received();
+            session_print_peer(stdout, client_addr.sin_addr.s_addr, client_addr.sin_port);
+        }
+        metrics_latency_since(start_ns);
+    }
+    bufpool_put(pool, buffer);
+    bufpool_destroy(pool);
+}
+
+// Drain up to batch_size datagrams per recvmmsg and echo them with one sendmmsg
+static void echo_loop_batched(int sockfd) {
+    struct batch *b = calloc(1, sizeof(*b));
+    struct bufpool *pool = echo_pool_create(batch_size, BUFFER_SIZE + 1);
+    if (b == NULL || pool == NULL) {
+        perror("calloc failed");
+        free(b);
+        bufpool_destroy(pool);
+        return;
+    }
+    for (int i = 0; i < batch_size; i++) {
+        b->buffers[i] = metrics_pool_get(pool);
+    }
+    if (prefault) {
+        lowlat_prefault(b, sizeof(*b));
+    }
+
+    while (1) {
+        // Re-arm the slots: the kernel overwrites msg_namelen and msg_len on every call
+        for (int i = 0; i < batch_size; i++) {
+            b->iovs[i].iov_base = b->buffers[i];
+            b->iovs[i].iov_len = BUFFER_SIZE;
+            memset(&b->msgs[i].msg_hdr, 0, sizeof(b->msgs[i].msg_hdr));
+            b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+            b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+            b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+            b->msgs[i].msg_hdr.msg_iovlen = 1;
+            if (queue_stats) {
+                b->msgs[i].msg_hdr.msg_control = b->controls[i].buf;
+                b->msgs[i].msg_hdr.msg_controllen = sizeof(b->controls[i]);
+            }
+        }
+
+        // Block for the first datagram, then take whatever else is already queued;
+        // a spinning worker never blocks and simply retries an empty socket
+        int received = recvmmsg(sockfd, b->msgs, batch_size, spin ? MSG_DONTWAIT : MSG_WAITFORONE, NULL);
+        if (received < 0 && spin && errno == EAGAIN) {
+            lowlat_relax();
+            continue;
+        }
+        if (received < 0) {
+            metrics_add(METRIC_RX_ERRORS, 1);
+            perror("recvmmsg failed");
+            break;
+        }
+        uint64_t start_ns = metrics_now_ns();
+        uint64_t read_ns = queue_stats ? realtime_ns() : 0;
+        b->calls++;
+        b->packets += received;
+
+        int end_seen = 0;
+        int malformed = 0;
+        int echoes = 0;  // Admitted datagrams, moved to the front of b->msgs
+        uint64_t bytes = 0;
+        uint64_t echo_bytes = 0;
+        for (int i = 0; i < received; i++) {
+            unsigned int len = b->msgs[i].msg_len;
+            bytes += len;
+
+            // Echo the exact bytes back to the sender of this datagram
+            b->iovs[i].iov_len = len;
+
+            if (queue_stats) {
+                queue_stats_record(sockfd, &b->msgs[i].msg_hdr, read_ns);
+                b->msgs[i].msg_hdr.msg_controllen = 0;  // sendmmsg must not pass the receive cmsgs back
+            }
+            capture_write(b->buffers[i], len, b->addrs[i].sin_addr.s_addr, b->addrs[i].sin_port);
+            if (!admit(sockfd, received < batch_size, &b->addrs[i], 1, start_ns)) {
+                continue;
+            }
+            b->msgs[echoes++] = b->msgs[i];
+            echo_bytes += len;
+
+            struct wire_echo m = wire_echo_decode(b->buffers[i], len);
+            malformed += !m.valid;
+            echolog_write(ECHOLOG_RECV, m.sequence, m.timestamp, len,
+                          b->addrs[i].sin_addr.s_addr, b->addrs[i].sin_port);
+            session_record(b->addrs[i].sin_addr.s_addr, b->addrs[i].sin_port, m.sequence, len, m.valid, m.end);
+            if (m.end) {
+                echolog_write(ECHOLOG_END, m.sequence, m.timestamp, len,
+                              b->addrs[i].sin_addr.s_addr, b->addrs[i].sin_port);
+                session_print_peer(stdout, b->addrs[i].sin_addr.s_addr, b->addrs[i].sin_port);
+                end_seen++;
+            }
+        }
+        metrics_add(METRIC_RX_CALLS, 1);
+        metrics_add(METRIC_RX_PACKETS, received);
+        metrics_add(METRIC_RX_BYTES, bytes);
+        metrics_add(METRIC_MALFORMED, malformed);
+        metrics_add(METRIC_END_MARKERS, end_seen);
+
+        // sendmmsg may stop early; resume after the last datagram it accepted
+        int sent = 0;
+        int failed = 0;
+        while (sent < echoes) {
+            int n = sendmmsg(sockfd, b->msgs + sent, echoes - sent, 0);
+            if (n < 0) {
+                struct msghdr *hdr = &b->msgs[sent].msg_hdr;
+                struct sockaddr_in *peer = hdr->msg_name;
+                struct wire_echo m = wire_echo_decode(hdr->msg_iov[0].iov_base, b->msgs[sent].msg_len);
+                failed++;
+                echo_bytes -= b->msgs[sent].msg_len;
+                echolog_write(ECHOLOG_SEND_FAILED, m.sequence, m.timestamp, b->msgs[sent].msg_len,
+                              peer->sin_addr.s_addr, peer->sin_port);
+                perror("sendmmsg failed");
+                sent++;  // Drop the datagram that failed and keep echoing the rest
+                continue;
+            }
+            sent += n;
+        }
+        metrics_add(METRIC_TX_PACKETS, echoes - failed);
+        metrics_add(METRIC_TX_BYTES, echo_bytes);
+        metrics_add(METRIC_TX_ERRORS, failed);
+        metrics_latency_since(start_ns);
+        if (queue_stats) {
+            // Every datagram of the batch went out with the same sendmmsg calls
+            uint64_t echo_ns = metrics_now_ns() - start_ns;
+            for (int i = 0; i < echoes - failed; i++) {
+                metrics_observe(METRIC_HIST_ECHO_TIME, echo_ns);
+            }
+        }
+
+        if (end_seen) {
+            print_end_received();
+            printf("Average batch fill: %.2f of %d (%lu datagrams in %lu calls)\n",
+                   (double)b->packets / b->calls, batch_size, b->packets, b->calls);
+        }
+    }
+
+    bufpool_destroy(pool);
+    free(b);
+}
+
+// Segment size of a UDP_GRO receive, or 0 if the kernel did not coalesce it
+static uint16_t offload_segment_size(struct msghdr *msg) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            return (uint16_t)size;
+        }
+    }
+    return 0;
+}
+
+// Fallback for a coalesced buffer when GSO sends fail: one datagram per segment.
+// Returns the number of segments that could not be sent.
+static int offload_send_segments(int sockfd, struct msghdr *msg, uint16_t segment_size) {
+    struct mmsghdr msgs[OFFLOAD_MAX_SEGMENTS];
+    struct iovec iovs[OFFLOAD_MAX_SEGMENTS];
+    unsigned char *data = msg->msg_iov[0].iov_base;
+    size_t len = msg->msg_iov[0].iov_len;
+    int count = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (size_t off = 0; off < len && count < OFFLOAD_MAX_SEGMENTS; off += segment_size, count++) {
+        iovs[count].iov_base = data + off;
+        iovs[count].iov_len = len - off < segment_size ? len - off : segment_size;
+        msgs[count].msg_hdr.msg_name = msg->msg_name;
+        msgs[count].msg_hdr.msg_namelen = msg->msg_namelen;
+        msgs[count].msg_hdr.msg_iov = &iovs[count];
+        msgs[count].msg_hdr.msg_iovlen = 1;
+    }
+
+    int sent = 0;
+    int failed = 0;
+    while (sent < count) {
+        int n = sendmmsg(sockfd, msgs + sent, count - sent, 0);
+        if (n < 0) {
+            failed++;
+            sent++;
+            continue;
+        }
+        sent += n;
+    }
+    return failed;
+}
+
+// Offload path: recvmmsg into 64 KB buffers that may each hold a GRO run of
+// datagrams, account every datagram in it, and echo each buffer whole with
+// UDP_SEGMENT set to the received segment size. The segments leave exactly as
+// they arrived, so every message keeps its header and its boundaries.
+static void echo_loop_offload(int sockfd) {
+    struct offload_batch *b = calloc(1, sizeof(*b));
+    struct bufpool *pool = echo_pool_create(batch_size, OFFLOAD_BUFFER_SIZE + WIRE_ECHO_MIN_BUFFER);
+    if (b == NULL || pool == NULL) {
+        perror("calloc failed");
+        free(b);
+        bufpool_destroy(pool);
+        return;
+    }
+    for (int i = 0; i < batch_size; i++) {
+        b->buffers[i] = metrics_pool_get(pool);
+    }
+    if (prefault) {
+        lowlat_prefault(b, sizeof(*b));
+    }
+
+    while (1) {
+        for (int i = 0; i < batch_size; i++) {
+            b->iovs[i].iov_base = b->buffers[i];
+            b->iovs[i].iov_len = OFFLOAD_BUFFER_SIZE;
+            memset(&b->msgs[i].msg_hdr, 0, sizeof(b->msgs[i].msg_hdr));
+            b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+            b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+            b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+            b->msgs[i].msg_hdr.msg_iovlen = 1;
+            b->msgs[i].msg_hdr.msg_control = b->controls[i].buf;
+            b->msgs[i].msg_hdr.msg_controllen = sizeof(b->controls[i]);
+        }
+
+        int received = recvmmsg(sockfd, b->msgs, batch_size, spin ? MSG_DONTWAIT : MSG_WAITFORONE, NULL);
+        if (received < 0 && spin && errno == EAGAIN) {
+            lowlat_relax();
+            continue;
+        }
+        if (received < 0) {
+            metrics_add(METRIC_RX_ERRORS, 1);
+            perror("recvmmsg failed");
+            break;
+        }
+        uint64_t start_ns = metrics_now_ns();
+        uint64_t read_ns = queue_stats ? realtime_ns() : 0;
+
+        int end_seen = 0;
+        int malformed = 0;
+        int echoes = 0;  // Admitted buffers, moved to the front of b->msgs
+        uint64_t packets = 0;
+        uint64_t bytes = 0;
+        uint64_t echo_packets = 0;
+        uint64_t echo_bytes = 0;
+        for (int i = 0; i < received; i++) {
+            struct msghdr *hdr = &b->msgs[i].msg_hdr;
+            struct sockaddr_in *peer = &b->addrs[i];
+            unsigned char *data = b->iovs[i].iov_base;
+            unsigned int len = b->msgs[i].msg_len;
+            uint16_t segment_size = offload_segment_size(hdr);
+            if (segment_size == 0 || segment_size >= len) {
+                segment_size = 0;
+            }
+            if (queue_stats) {
+                queue_stats_record(sockfd, hdr, read_ns);  // One kernel timestamp covers the whole run
+            }
+
+            // A run comes from one peer and is admitted or shed whole
+            unsigned int step = segment_size ? segment_size : len;
+            unsigned int count = (len + step - 1) / step;
+            packets += count;
+            bytes += len;
+            for (unsigned int off = 0; off < len; off += step) {
+                unsigned int n = len - off < step ? len - off : step;
+                capture_write(data + off, n, peer->sin_addr.s_addr, peer->sin_port);
+            }
+            if (!admit(sockfd, received < batch_size, peer, count, start_ns)) {
+                continue;
+            }
+            echo_packets += count;
+            echo_bytes += len;
+
+            // Account every datagram of the run on its own
+            for (unsigned int off = 0; off < len; off += step) {
+                unsigned int n = len - off < step ? len - off : step;
+                struct wire_echo m = wire_echo_decode(data + off, n);
+                malformed += !m.valid;
+                echolog_write(ECHOLOG_RECV, m.sequence, m.timestamp, n, peer->sin_addr.s_addr, peer->sin_port);
+                session_record(peer->sin_addr.s_addr, peer->sin_port, m.sequence, n, m.valid, m.end);
+                if (m.end) {
+                    echolog_write(ECHOLOG_END, m.sequence, m.timestamp, n, peer->sin_addr.s_addr, peer->sin_port);
+                    session_print_peer(stdout, peer->sin_addr.s_addr, peer->sin_port);
+                    end_seen++;
+                }
+            }
+
+            // Reuse the control buffer for the echo: UDP_SEGMENT, or nothing
+            b->iovs[i].iov_len = len;
+            b->segment_sizes[echoes] = segment_size;
+            hdr->msg_controllen = 0;
+            if (segment_size && atomic_load_explicit(&offload_gso, memory_order_relaxed)) {
+                hdr->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+            }
+            b->msgs[echoes++] = b->msgs[i];
+        }
+        b->buffers_received += received;
+        b->packets += packets;
+        metrics_add(METRIC_RX_CALLS, 1);
+        metrics_add(METRIC_RX_PACKETS, packets);
+        metrics_add(METRIC_RX_BYTES, bytes);
+        metrics_add(METRIC_MALFORMED, malformed);
+        metrics_add(METRIC_END_MARKERS, end_seen);
+
+        // sendmmsg may stop early; resume after the last buffer it accepted.
+        // A run without UDP_SEGMENT (GSO refused) must never leave as one
+        // datagram: it is split by hand and the sendmmsg calls stop short of it.
+        int sent = 0;
+        uint64_t failed = 0;
+        while (sent < echoes) {
+            if (b->segment_sizes[sent] && b->msgs[sent].msg_hdr.msg_controllen == 0) {
+                failed += offload_send_segments(sockfd, &b->msgs[sent].msg_hdr, b->segment_sizes[sent]);
+                sent++;
+                continue;
+            }
+            int end = sent + 1;
+            while (end < echoes && !(b->segment_sizes[end] && b->msgs[end].msg_hdr.msg_controllen == 0)) {
+                end++;
+            }
+            int n = sendmmsg(sockfd, b->msgs + sent, end - sent, 0);
+            if (n >= 0) {
+                sent += n;
+                continue;
+            }
+            struct msghdr *hdr = &b->msgs[sent].msg_hdr;
+            uint16_t segment_size = b->segment_sizes[sent];
+            if (hdr->msg_controllen != 0 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+                // No GSO for this route or kernel: split this and every later run by hand
+                if (atomic_exchange(&offload_gso, 0)) {
+                    fprintf(stderr, "UDP_SEGMENT send failed (%s), echoing segments one by one\n", strerror(errno));
+                }
+                for (int i = sent; i < echoes; i++) {
+                    b->msgs[i].msg_hdr.msg_controllen = 0;
+                }
+            }
+            if (segment_size) {
+                failed += offload_send_segments(sockfd, hdr, segment_size);
+            } else {
+                struct sockaddr_in *peer = hdr->msg_name;
+                struct wire_echo m = wire_echo_decode(hdr->msg_iov[0].iov_base, b->msgs[sent].msg_len);
+                echolog_write(ECHOLOG_SEND_FAILED, m.sequence, m.timestamp, b->msgs[sent].msg_len,
+                              peer->sin_addr.s_addr, peer->sin_port);
+                perror("sendmmsg failed");
+                failed++;
+            }
+            sent++;
+        }
+        metrics_add(METRIC_TX_PACKETS, echo_packets - failed);
+        metrics_add(METRIC_TX_BYTES, echo_bytes);
+        metrics_add(METRIC_TX_ERRORS, failed);
+        metrics_latency_since(start_ns);
+        if (queue_stats) {
+            uint64_t echo_ns = metrics_now_ns() - start_ns;
+            for (uint64_t i = 0; i < echo_packets - failed; i++) {
+                metrics_observe(METRIC_HIST_ECHO_TIME, echo_ns);
+            }
+        }
+
+        if (end_seen) {
+            print_end_received();
+            printf("Offload: %.2f datagrams per receive buffer (%lu datagrams in %lu buffers)%s\n",
+                   (double)b->packets / b->buffers_received, b->packets, b->buffers_received,
+                   atomic_load(&offload_gso) ? "" : ", GSO sends unavailable");
+        }
+    }
+
+    bufpool_destroy(pool);
+    free(b);
+}
+
+// Arm a multishot recvmsg that picks buffers from the provided-buffer group
+static int uring_arm_recv(struct uring *ring, int sockfd, struct msghdr *recv_msg) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sockfd;
+    sqe->addr = (uint64_t)(uintptr_t)recv_msg;
+    sqe->len = 1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = URING_USER_DATA(URING_OP_RECV, 0);
+    return 0;
+}
+
+// io_uring backend: every datagram lands in a provided buffer and is echoed by a
+// send that points straight back into that buffer. The buffer is only returned
+// to the kernel once the send has completed, so nothing is copied in user space.
+static void echo_loop_uring(int sockfd) {
+    struct uring ring;
+    struct uring_buf_ring br = { 0 };
+    struct msghdr recv_msg;
+    struct {
+        struct msghdr msg;
+        struct iovec iov;
+    } *slots;  // Per-buffer sendmsg state, used when zero-copy fixed sends are unavailable
+    uint64_t *read_at;  // Per-buffer time its datagram was read, for -q echo times
+    unsigned long packets = 0;
+
+    // The provided-buffer ring is the free list here: the kernel picks a slot
+    // by buffer id and the echo hands it back, so the pool only supplies the
+    // aligned, prefaulted (and with -H huge-page) region
+    struct bufpool *buffers = echo_pool_create(URING_BUFFERS, URING_BUF_SIZE);
+    if (buffers == NULL) {
+        return;
+    }
+    unsigned char *pool = buffers->base;
+    metrics_add(METRIC_BUF_HIGH_WATER, URING_BUFFERS);
+    slots = calloc(URING_BUFFERS, sizeof(*slots));
+    read_at = calloc(URING_BUFFERS, sizeof(*read_at));
+    if (slots == NULL || read_at == NULL) {
+        perror("calloc failed");
+        free(slots);
+        free(read_at);
+        bufpool_destroy(buffers);
+        return;
+    }
+
+    if (uring_init(&ring, URING_ENTRIES, IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER) < 0) {
+        free(slots);
+        free(read_at);
+        bufpool_destroy(buffers);
+        return;
+    }
+
+    // Register the whole pool as fixed buffer 0 so sends can skip page pinning
+    struct iovec pool_iov = { .iov_base = pool, .iov_len = (size_t)URING_BUFFERS * URING_BUF_SIZE };
+    int use_fixed = uring_register_buffers(&ring, &pool_iov, 1) == 0;
+    if (!use_fixed) {
+        perror("io_uring_register(IORING_REGISTER_BUFFERS) failed, using sendmsg");
+    }
+
+    if (uring_buf_ring_init(&ring, &br, URING_BUFFERS, URING_BGID) < 0) {
+        goto out;
+    }
+    for (unsigned int i = 0; i < URING_BUFFERS; i++) {
+        uring_buf_ring_add(&br, pool + (size_t)i * URING_BUF_SIZE, URING_BUF_SIZE, (uint16_t)i, i);
+    }
+    uring_buf_ring_advance(&br, URING_BUFFERS);
+
+    // Template for multishot recvmsg: the kernel only looks at the name and control lengths
+    memset(&recv_msg, 0, sizeof(recv_msg));
+    recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+    if (queue_stats) {
+        recv_msg.msg_controllen = QUEUE_CONTROL_SIZE;
+    }
+
+    int rearm = 1;
+    while (1) {
+        if (rearm) {
+            if (uring_arm_recv(&ring, sockfd, &recv_msg) < 0) {
+                fprintf(stderr, "io_uring submission queue full\n");
+                break;
+            }
+            rearm = 0;
+        }
+
+        // One syscall both submits the queued echoes and waits for more datagrams
+        if (uring_submit_and_wait(&ring, 1) < 0) {
+            metrics_add(METRIC_RX_ERRORS, 1);
+            perror("io_uring_enter failed");
+            break;
+        }
+        uint64_t start_ns = metrics_now_ns();
+        uint64_t read_ns = queue_stats ? realtime_ns() : 0;
+        metrics_add(METRIC_RX_CALLS, 1);
+
+        unsigned int recycled = 0;
+        int end_seen = 0;
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned int flags = cqe->flags;
+            uring_cqe_seen(&ring);
+
+            if ((user_data >> 32) == URING_OP_SEND) {
+                uint16_t bid = (uint16_t)user_data;
+                if (res >= 0 && !(flags & IORING_CQE_F_NOTIF)) {
+                    metrics_add(METRIC_TX_PACKETS, 1);
+                    metrics_add(METRIC_TX_BYTES, res);
+                    if (queue_stats) {
+                        metrics_observe(METRIC_HIST_ECHO_TIME, start_ns - read_at[bid]);  // Completion seen this wakeup
+                    }
+                }
+                if (res < 0 && !(flags & IORING_CQE_F_NOTIF)) {
+                    metrics_add(METRIC_TX_ERRORS, 1);
+                    if (use_fixed && (res == -EINVAL || res == -EOPNOTSUPP)) {
+                        fprintf(stderr, "Zero-copy fixed-buffer send unsupported, using sendmsg\n");
+                        use_fixed = 0;
+                    }
+                    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)(pool + (size_t)bid * URING_BUF_SIZE);
+                    struct sockaddr_in *peer = (struct sockaddr_in *)(out + 1);
+                    echolog_write(ECHOLOG_SEND_FAILED, 0, 0, out->payloadlen, peer->sin_addr.s_addr, peer->sin_port);
+                }
+                // A zero-copy send holds the buffer until its notification arrives
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    uring_buf_ring_add(&br, pool + (size_t)bid * URING_BUF_SIZE, URING_BUF_SIZE, bid, recycled++);
+                }
+                continue;
+            }
+
+            // Multishot receive stops on errors or when the buffer group runs dry
+            if (!(flags & IORING_CQE_F_MORE)) {
+                rearm = 1;
+            }
+            if (res < 0) {
+                if (res != -ENOBUFS) {
+                    metrics_add(METRIC_RX_ERRORS, 1);
+                    errno = -res;
+                    perror("io_uring recvmsg failed");
+                }
+                continue;
+            }
+
+            uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+            unsigned char *buf = pool + (size_t)bid * URING_BUF_SIZE;
+            struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+            struct sockaddr_in *peer = (struct sockaddr_in *)(out + 1);
+            unsigned char *payload = buf + sizeof(*out) + recv_msg.msg_namelen + recv_msg.msg_controllen;
+            unsigned int len = out->payloadlen;
+            if (len > BUFFER_SIZE) {
+                len = BUFFER_SIZE;  // Truncated datagram: echo what was kept
+            }
+            packets++;
+            metrics_add(METRIC_RX_PACKETS, 1);
+            metrics_add(METRIC_RX_BYTES, len);
+            if (queue_stats) {
+                struct msghdr control = {
+                    .msg_control = buf + sizeof(*out) + recv_msg.msg_namelen,
+                    .msg_controllen = out->controllen,
+                };
+                queue_stats_record(sockfd, &control, read_ns);
+                read_at[bid] = start_ns;
+            }
+            capture_write(payload, len, peer->sin_addr.s_addr, peer->sin_port);
+            if (!admit(sockfd, -1, peer, 1, start_ns)) {
+                uring_buf_ring_add(&br, buf, URING_BUF_SIZE, bid, recycled++);
+                continue;
+            }
+
+            struct wire_echo m = wire_echo_decode(payload, len);
+            if (!m.valid) {
+                metrics_add(METRIC_MALFORMED, 1);
+            }
+            echolog_write(ECHOLOG_RECV, m.sequence, m.timestamp, len, peer->sin_addr.s_addr, peer->sin_port);
+            session_record(peer->sin_addr.s_addr, peer->sin_port, m.sequence, len, m.valid, m.end);
+            if (m.end) {
+                metrics_add(METRIC_END_MARKERS, 1);
+                echolog_write(ECHOLOG_END, m.sequence, m.timestamp, len, peer->sin_addr.s_addr, peer->sin_port);
+                session_print_peer(stdout, peer->sin_addr.s_addr, peer->sin_port);
+                end_seen = 1;
+            }
+
+            // The echo is submitted here rather than linked to the receive: a
+            // multishot RECVMSG has no SQE per datagram that a send could follow
+            struct io_uring_sqe *sqe;
+            while ((sqe = uring_get_sqe(&ring)) == NULL) {
+                uring_submit_and_wait(&ring, 0);  // Flush a full submission queue
+            }
+            sqe->fd = sockfd;
+            sqe->user_data = URING_USER_DATA(URING_OP_SEND, bid);
+            if (use_fixed) {
+                sqe->opcode = IORING_OP_SEND_ZC;
+                sqe->addr = (uint64_t)(uintptr_t)payload;
+                sqe->len = len;
+                sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+                sqe->buf_index = 0;
+                sqe->addr2 = (uint64_t)(uintptr_t)peer;
+                sqe->addr_len = sizeof(struct sockaddr_in);
+            } else {
+                slots[bid].iov.iov_base = payload;
+                slots[bid].iov.iov_len = len;
+                memset(&slots[bid].msg, 0, sizeof(slots[bid].msg));
+                slots[bid].msg.msg_name = peer;
+                slots[bid].msg.msg_namelen = sizeof(struct sockaddr_in);
+                slots[bid].msg.msg_iov = &slots[bid].iov;
+                slots[bid].msg.msg_iovlen = 1;
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->addr = (uint64_t)(uintptr_t)&slots[bid].msg;
+                sqe->len = 1;
+            }
+        }
+
+        if (recycled > 0) {
+            uring_buf_ring_advance(&br, recycled);
+        }
+        metrics_latency_since(start_ns);
+
+        if (end_seen) {
+            print_end_received();
+            printf("io_uring: %.3f syscalls per datagram (%lu datagrams, %lu io_uring_enter calls)\n",
+                   packets ? (double)ring.enter_calls / packets : 0.0, packets, ring.enter_calls);
+        }
+    }
+
+out:
+    uring_exit(&ring);
+    uring_buf_ring_exit(&br);
+    free(slots);
+    free(read_at);
+    bufpool_destroy(buffers);
+}
+
+// Shared-memory transport (-Z): one thread serves every registered same-host
+// client's ring pair, next to whichever UDP model runs. Clients have no
+// address, so logs and sessions show them as 0.0.0.0 with the slot as port.
+// A request is only taken once its echo fits, so a slow client throttles
+// itself and never makes the server drop or wait.
+static void *shm_main(void *arg) {
+    struct shm_segment *seg = arg;
+    uint8_t attached[SHM_MAX_CLIENTS] = { 0 };
+    uint64_t reaped_ns = metrics_now_ns();
+
+    if (num_pin_cpus > 0) {
+        lowlat_pin(pin_cpus[atomic_fetch_add(&next_pin, 1) % num_pin_cpus]);
+    }
+
+    while (1) {
+        uint64_t start_ns = metrics_now_ns();
+        uint64_t packets = 0, bytes = 0;
+        int malformed = 0, end_seen = 0;
+
+        for (unsigned int i = 0; i < SHM_MAX_CLIENTS; i++) {
+            struct shm_slot *slot = &seg->slots[i];
+            uint32_t state = atomic_load_explicit(&slot->state, memory_order_acquire);
+            if (state == SHM_SLOT_CLOSING) {
+                if (attached[i]) {
+                    printf("Shared-memory client %u detached\n", i);
+                }
+                attached[i] = 0;
+                atomic_store_explicit(&slot->state, SHM_SLOT_FREE, memory_order_release);
+                continue;
+            }
+            if (state != SHM_SLOT_ACTIVE) {
+                continue;
+            }
+            if (!attached[i]) {
+                printf("Shared-memory client %u attached (pid %d)\n", i, (int)atomic_load(&slot->pid));
+                attached[i] = 1;
+            }
+
+            uint16_t port = htons((uint16_t)i);
+            struct shm_frame *request, *echo;
+            for (int n = 0; n < SHM_BURST && (request = shm_ring_peek(&slot->requests)) != NULL &&
+                            (echo = shm_ring_reserve(&slot->echoes)) != NULL; n++) {
+                uint32_t len = request->len < SHM_FRAME_MAX ? request->len : SHM_FRAME_MAX;
+                struct wire_echo m = wire_echo_decode(request->data, len);
+                memcpy(echo->data, request->data, len);
+                shm_ring_publish(&slot->echoes, len);
+                shm_ring_consume(&slot->requests);
+
+                packets++;
+                bytes += len;
+                malformed += !m.valid;
+                capture_write(request->data, len, 0, port);
+                echolog_write(ECHOLOG_RECV, m.sequence, m.timestamp, len, 0, port);
+                session_record(0, port, m.sequence, len, m.valid, m.end);
+                if (m.end) {
+                    echolog_write(ECHOLOG_END, m.sequence, m.timestamp, len, 0, port);
+                    print_end_received();
+                    session_print_peer(stdout, 0, port);
+                    end_seen++;
+                }
+            }
+        }
+
+        if (packets > 0) {
+            metrics_add(METRIC_RX_CALLS, 1);
+            metrics_add(METRIC_RX_PACKETS, packets);
+            metrics_add(METRIC_RX_BYTES, bytes);
+            metrics_add(METRIC_TX_PACKETS, packets);
+            metrics_add(METRIC_TX_BYTES, bytes);
+            metrics_add(METRIC_MALFORMED, malformed);
+            metrics_add(METRIC_END_MARKERS, end_seen);
+            metrics_latency_since(start_ns);
+            continue;
         }
+
+        if (start_ns - reaped_ns >= SHM_REAP_NS) {
+            shm_server_reap(seg);
+            reaped_ns = start_ns;
+        }
+        if (spin) {
+            lowlat_relax();
+        } else {
+            shm_server_wait(seg, SHM_REAP_NS);
+        }
+    }
+    return NULL;
+}
+
+// Create the -Z segment and start the thread that serves it
+static int shm_start(const char *name) {
+    struct shm_segment *seg = shm_server_create(name);
+    if (seg == NULL) {
+        return -1;
+    }
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, shm_main, seg) != 0) {
+        perror("pthread_create failed");
+        return -1;
+    }
+    pthread_detach(thread_id);
+    printf("Shared-memory transport in /dev/shm/%s (%d clients, %d-frame rings)\n", name, SHM_MAX_CLIENTS,
+           SHM_RING_SLOTS);
+    return 0;
+}
+
+void *handle_client(void *client_socket) {
+    int sockfd = (int)(intptr_t)client_socket;
+
+    if (num_pin_cpus > 0) {
+        lowlat_pin(pin_cpus[atomic_fetch_add(&next_pin, 1) % num_pin_cpus]);
     }
+    echo_loop(sockfd);
 
     sem_post(&thread_semaphore);  // Release semaphore
     return NULL;
 }
 
-int main() {
+// Set a socket buffer size. The FORCE variant lifts the net.core.[rw]mem_max cap
+// but needs CAP_NET_ADMIN; without it the request is capped silently, so warn.
+static int set_buffer_size(int sockfd, int force_option, int option, int bytes, const char *name) {
+    static _Atomic int warned;
+    int actual;
+    socklen_t len = sizeof(actual);
+
+    if (setsockopt(sockfd, SOL_SOCKET, force_option, &bytes, sizeof(bytes)) < 0 &&
+        setsockopt(sockfd, SOL_SOCKET, option, &bytes, sizeof(bytes)) < 0) {
+        fprintf(stderr, "setsockopt(%s) failed: %s\n", name, strerror(errno));
+        return -1;
+    }
+    // The kernel doubles the request to allow for bookkeeping overhead
+    if (getsockopt(sockfd, SOL_SOCKET, option, &actual, &len) == 0 && actual / 2 < bytes &&
+        !atomic_exchange(&warned, 1)) {
+        fprintf(stderr, "%s capped at %d bytes (raise net.core.%s_max or run with CAP_NET_ADMIN)\n",
+                name, actual / 2, option == SO_RCVBUF ? "rmem" : "wmem");
+    }
+    return 0;
+}
+
+// Apply the -R/-T buffer sizes, -g offload, -y busy polling and -q control messages to a new socket
+static int configure_socket(int sockfd) {
+    if (rcvbuf_size > 0 && set_buffer_size(sockfd, SO_RCVBUFFORCE, SO_RCVBUF, rcvbuf_size, "SO_RCVBUF") < 0) {
+        return -1;
+    }
+    if (sndbuf_size > 0 && set_buffer_size(sockfd, SO_SNDBUFFORCE, SO_SNDBUF, sndbuf_size, "SO_SNDBUF") < 0) {
+        return -1;
+    }
+    if (offload) {
+        int on = 1;
+        if (setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+            perror("setsockopt(UDP_GRO) failed, offload disabled");
+            offload = 0;  // Every datagram arrives on its own; the regular paths handle that
+        }
+    }
+    if (busy_poll_usec > 0 && lowlat_busy_poll(sockfd, busy_poll_usec) < 0) {
+        return -1;
+    }
+    if (queue_stats) {
+        int on = 1;
+        int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0) {
+            perror("setsockopt(SO_RXQ_OVFL) failed");
+            return -1;
+        }
+        if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+            perror("setsockopt(SO_TIMESTAMPING) failed");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Create a UDP socket bound to PORT as a member of the SO_REUSEPORT group
+static int open_reuseport_socket(void) {
+    struct sockaddr_in server_addr;
+    int optval = 1;
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        perror("socket failed");
+        return -1;
+    }
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
+        perror("setsockopt(SO_REUSEADDR) failed");
+        close(sockfd);
+        return -1;
+    }
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+        perror("setsockopt(SO_REUSEPORT) failed");
+        close(sockfd);
+        return -1;
+    }
+
+    if (configure_socket(sockfd) < 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(PORT);
+    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");  // Bind to local loopback
+
+    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("bind failed");
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+// Steer each datagram to the group socket of the worker pinned to the receiving
+// CPU, whatever the CPU list: sockets join the group in bind order, so worker i
+// owns index i, and the program tests the CPU against each worker's CPU in turn.
+// A flow handled by one CPU's softirq then stays on that core. CPUs without a
+// worker of their own fall back to CPU modulo the group size.
+static int attach_cpu_steering(int sockfd, const struct worker *workers, int count) {
+    struct sock_filter code[2 * MAX_WORKERS + 3];
+    int len = 0;
+    code[len++] = (struct sock_filter){ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU };  // A = current CPU
+    for (int i = 0; i < count; i++) {
+        // if (A == worker i's CPU) return i
+        code[len++] = (struct sock_filter){ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, (unsigned int)workers[i].cpu };
+        code[len++] = (struct sock_filter){ BPF_RET | BPF_K, 0, 0, (unsigned int)i };
+    }
+    code[len++] = (struct sock_filter){ BPF_ALU | BPF_MOD | BPF_K, 0, 0, (unsigned int)count };  // A %= group size
+    code[len++] = (struct sock_filter){ BPF_RET | BPF_A, 0, 0, 0 };                              // Return socket index
+    struct sock_fprog prog = { .len = (unsigned short)len, .filter = code };
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF) failed");
+        return -1;
+    }
+    return 0;
+}
+
+void *worker_main(void *arg) {
+    struct worker *w = (struct worker *)arg;
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(w->cpu, &cpuset);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (err != 0) {
+        fprintf(stderr, "Worker %d: failed to pin to CPU %d: %s\n", w->id, w->cpu, strerror(err));
+    }
+
+    echo_loop(w->sockfd);
+    return NULL;
+}
+
+// Sharded model: one SO_REUSEPORT socket and one pinned thread per worker
+static int run_sharded(void) {
+    static struct worker workers[MAX_WORKERS];
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int num_cpus = 0;
+
+    // Map workers onto the -c CPUs, or else the CPUs this process may run on,
+    // wrapping if there are more workers
+    if (num_pin_cpus > 0) {
+        memcpy(cpus, pin_cpus, num_pin_cpus * sizeof(int));
+        num_cpus = num_pin_cpus;
+    } else if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity failed");
+        return -1;
+    }
+    for (int cpu = 0; num_pin_cpus == 0 && cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus[num_cpus++] = cpu;
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        workers[i].id = i;
+        workers[i].cpu = cpus[i % num_cpus];
+        workers[i].sockfd = open_reuseport_socket();
+        if (workers[i].sockfd < 0) {
+            return -1;
+        }
+    }
+
+    if (steering == STEER_CPU && attach_cpu_steering(workers[0].sockfd, workers, num_workers) < 0) {
+        return -1;
+    }
+
+    printf("Server is running on port %d with %d sharded workers (%s steering, %s backend)...\n",
+           PORT, num_workers, steering == STEER_CPU ? "cpu" : "hash",
+           backend == BACKEND_URING ? "io_uring" : "threads");
+
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i].thread_id, NULL, worker_main, &workers[i]) != 0) {
+            perror("pthread_create failed");
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i].thread_id, NULL);
+        close(workers[i].sockfd);
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-w workers] [-s hash|cpu] [-b batch] [-l log_file] [-S sample] [-K prefix] [-k MB] [-j keep] [-e threads|uring] [-i idle_seconds] [-m metrics] [-R rcvbuf] [-T sndbuf] [-q] [-g]\n"
+                    "       [-Y] [-y usec] [-c cpus] [-M] [-F priority] [-H] [-Z name]\n"
+                    "       [-A rate[:burst]] [-a addr[:port]=rate[:burst]] [-p] [-D]\n", prog);
+    fprintf(stderr, "  -w workers  Sharded mode: one SO_REUSEPORT socket and pinned thread per worker (1-%d)\n", MAX_WORKERS);
+    fprintf(stderr, "  -s policy   Sharded steering: 'hash' (per-flow, default) or 'cpu' (receiving CPU)\n");
+    fprintf(stderr, "  -b batch    Echo up to 'batch' datagrams per recvmmsg/sendmmsg call (1-%d, default 1)\n", MAX_BATCH);
+    fprintf(stderr, "  -l file     Write binary per-packet records to 'file' (decode with echolog_decode)\n");
+    fprintf(stderr, "  -S sample   Log one in 'sample' datagrams (0 = off, default 1)\n");
+    fprintf(stderr, "  -K prefix   Capture every datagram with its arrival time and peer to memory-mapped files\n");
+    fprintf(stderr, "              'prefix'.<thread>.<segment> (replay with capture_replay)\n");
+    fprintf(stderr, "  -k MB       Capture segment size (default %llu MB)\n", CAPTURE_DEFAULT_SEGMENT >> 20);
+    fprintf(stderr, "  -j keep     Keep only the newest 'keep' capture segments of each thread (default: all)\n");
+    fprintf(stderr, "  -e backend  'threads' (blocking syscalls, default) or 'uring' (io_uring, one ring per worker)\n");
+    fprintf(stderr, "  -i seconds  Evict per-peer sessions idle this long (0 = no session tracking, default %d);\n", DEFAULT_SESSION_IDLE);
+    fprintf(stderr, "              send SIGUSR1 to print the session table\n");
+    fprintf(stderr, "  -m name     Export metrics in shared memory /dev/shm/'name' (default %s; read with metrics_stat)\n", DEFAULT_METRICS_NAME);
+    fprintf(stderr, "  -R bytes    Socket receive buffer size (SO_RCVBUF; default: system setting)\n");
+    fprintf(stderr, "  -T bytes    Socket send buffer size (SO_SNDBUF; default: system setting)\n");
+    fprintf(stderr, "  -q          Kernel queue instrumentation: count receive-buffer drops (SO_RXQ_OVFL) and\n");
+    fprintf(stderr, "              record each datagram's queueing delay (SO_TIMESTAMPING) and echo time\n");
+    fprintf(stderr, "  -g          UDP GRO/GSO offload: receive coalesced runs of datagrams into 64 KB buffers\n");
+    fprintf(stderr, "              (-b of them per call) and echo each run with one UDP_SEGMENT send\n");
+    fprintf(stderr, "  -Y          Spin: poll the socket with MSG_DONTWAIT instead of blocking (one busy core per thread)\n");
+    fprintf(stderr, "  -y usec     Let blocking receives busy-poll the device queue (SO_BUSY_POLL/SO_PREFER_BUSY_POLL)\n");
+    fprintf(stderr, "  -c cpus     Pin workers and threads round-robin to these CPUs, e.g. 2,3 or 4-7 (isolated cores)\n");
+    fprintf(stderr, "  -M          Lock all memory (mlockall) so no page fault lands on the data path\n");
+    fprintf(stderr, "  -F priority Run every thread as SCHED_FIFO at 'priority' (1-99; needs CAP_SYS_NICE)\n");
+    fprintf(stderr, "  -H          Back each thread's packet buffer pool with huge pages (MAP_HUGETLB, else THP)\n");
+    fprintf(stderr, "  -Z name     Also serve same-host clients over shared-memory rings in /dev/shm/'name'\n");
+    fprintf(stderr, "              (client11b/client11c -Z); with -Y the ring thread spins instead of sleeping\n");
+    fprintf(stderr, "  -A rate[:burst]  Admission control: limit each peer to 'rate' datagrams/s with bursts of\n");
+    fprintf(stderr, "              'burst' (default rate/10); over-limit datagrams are shed before any echo work\n");
+    fprintf(stderr, "  -a addr[:port]=rate[:burst]  Limit for one peer instead of -A (rate 0 = unlimited; repeatable,\n");
+    fprintf(stderr, "              up to %d; ports need -p)\n", ADMIT_MAX_RULES);
+    fprintf(stderr, "  -p          Admission control per address and port instead of per address\n");
+    fprintf(stderr, "  -D          Deprioritize instead of shedding: echo over-limit datagrams while no other is waiting\n");
+}
+
+int main(int argc, char *argv[]) {
     int sockfd;
     struct sockaddr_in server_addr;
+    int opt;
+    const char *log_path = NULL;
+    long log_sample = 1;
+    long session_idle = DEFAULT_SESSION_IDLE;
+    const char *metrics_name = DEFAULT_METRICS_NAME;
+    int lock_memory = 0;
+    int fifo_priority = 0;
+    const char *shm_name = NULL;
+    const char *capture_prefix = NULL;
+    long capture_mb = CAPTURE_DEFAULT_SEGMENT >> 20;
+    long capture_keep = 0;
+    int admission_on = 0;
+    int admission_by_port = 0;
+    int admission_deprioritize = 0;
+
+    while ((opt = getopt(argc, argv, "w:s:b:l:S:K:k:j:e:i:m:R:T:qgYy:c:MF:HZ:A:a:pDh")) != -1) {
+        switch (opt) {
+            case 'w':
+                num_workers = atoi(optarg);
+                if (num_workers < 1 || num_workers > MAX_WORKERS) {
+                    fprintf(stderr, "Invalid worker count: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                if (strcmp(optarg, "hash") == 0) {
+                    steering = STEER_HASH;
+                } else if (strcmp(optarg, "cpu") == 0) {
+                    steering = STEER_CPU;
+                } else {
+                    fprintf(stderr, "Invalid steering policy: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'b':
+                batch_size = atoi(optarg);
+                if (batch_size < 1 || batch_size > MAX_BATCH) {
+                    fprintf(stderr, "Invalid batch size: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                log_path = optarg;
+                break;
+            case 'S':
+                log_sample = atol(optarg);
+                if (log_sample < 0) {
+                    fprintf(stderr, "Invalid sampling interval: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'K':
+                capture_prefix = optarg;
+                break;
+            case 'k':
+                capture_mb = atol(optarg);
+                if (capture_mb < 1) {
+                    fprintf(stderr, "Invalid capture segment size: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'j':
+                capture_keep = atol(optarg);
+                if (capture_keep < 0) {
+                    fprintf(stderr, "Invalid capture segment count: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'e':
+                if (strcmp(optarg, "threads") == 0) {
+                    backend = BACKEND_THREADS;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    backend = BACKEND_URING;
+                } else {
+                    fprintf(stderr, "Invalid backend: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'i':
+                session_idle = atol(optarg);
+                if (session_idle < 0) {
+                    fprintf(stderr, "Invalid idle timeout: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                if (optarg[0] == '\0' || strlen(optarg) > METRICS_NAME_MAX || strchr(optarg, '/') != NULL) {
+                    fprintf(stderr, "Invalid metrics name: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                metrics_name = optarg;
+                break;
+            case 'R':
+                rcvbuf_size = atoi(optarg);
+                if (rcvbuf_size < 1) {
+                    fprintf(stderr, "Invalid receive buffer size: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                sndbuf_size = atoi(optarg);
+                if (sndbuf_size < 1) {
+                    fprintf(stderr, "Invalid send buffer size: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                queue_stats = 1;
+                break;
+            case 'g':
+                offload = 1;
+                break;
+            case 'Y':
+                spin = 1;
+                break;
+            case 'y':
+                busy_poll_usec = atoi(optarg);
+                if (busy_poll_usec < 1) {
+                    fprintf(stderr, "Invalid busy-poll time: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                num_pin_cpus = lowlat_parse_cpus(optarg, pin_cpus, CPU_SETSIZE);
+                if (num_pin_cpus < 1) {
+                    fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'M':
+                lock_memory = 1;
+                break;
+            case 'H':
+                pool_flags |= BUFPOOL_HUGEPAGES;
+                break;
+            case 'F':
+                fifo_priority = atoi(optarg);
+                if (fifo_priority < 1 || fifo_priority > 99) {
+                    fprintf(stderr, "Invalid SCHED_FIFO priority: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'Z':
+                if (optarg[0] == '\0' || strlen(optarg) > SHM_NAME_MAX || strchr(optarg, '/') != NULL) {
+                    fprintf(stderr, "Invalid shared-memory name: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                shm_name = optarg;
+                break;
+            case 'A':
+                if (admission_parse_limit(optarg, &admission.interval_ns, &admission.capacity_ns) < 0) {
+                    fprintf(stderr, "Invalid admission limit: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                admission_on = 1;
+                break;
+            case 'a':
+                if (admission_add_rule(optarg) < 0) {
+                    fprintf(stderr, "Invalid admission rule: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                admission_on = 1;
+                break;
+            case 'p':
+                admission_by_port = 1;
+                break;
+            case 'D':
+                admission_deprioritize = 1;
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (offload && backend == BACKEND_URING) {
+        fprintf(stderr, "-g needs the threads backend\n");
+        exit(EXIT_FAILURE);
+    }
+    if (spin && backend == BACKEND_URING) {
+        fprintf(stderr, "-Y needs the threads backend\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((admission_by_port || admission_deprioritize) && !admission_on) {
+        fprintf(stderr, "-p and -D need -A or -a\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < admission.num_rules; i++) {
+        if (admission.rules[i].port != 0 && !admission_by_port) {
+            fprintf(stderr, "Admission rules with a port need -p\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    prefault = spin || busy_poll_usec > 0 || num_pin_cpus > 0 || lock_memory || fifo_priority > 0;
+
+    // Threads inherit the scheduling policy, and MCL_FUTURE covers their stacks
+    if (lock_memory && lowlat_lock_memory() < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (fifo_priority > 0 && lowlat_fifo(fifo_priority) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // The session table blocks SIGUSR1, so it starts before any other thread
+    if (session_start((unsigned int)session_idle) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (metrics_start("server11", metrics_name) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Per-packet logging is asynchronous and off unless a log file is given
+    if (log_path != NULL && echolog_start(log_path, (unsigned int)log_sample) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Capture segments are opened by each thread on its first datagram
+    if (capture_prefix != NULL &&
+        capture_start(capture_prefix, (uint64_t)capture_mb << 20, (unsigned int)capture_keep) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Shared-memory clients are local and bypass admission control
+    if (admission_on && admission_start(admission_by_port, admission_deprioritize) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (shm_name != NULL && shm_start(shm_name) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (num_workers > 0) {
+        if (run_sharded() < 0) {
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
 
     // Initialize semaphore
     sem_init(&thread_semaphore, 0, MAX_THREADS);
@@ -86,6 +1527,11 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
+    if (configure_socket(sockfd) < 0) {
+        close(sockfd);
+        exit(EXIT_FAILURE);
+    }
+
     // Configure server address
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(PORT);
@@ -100,18 +1546,21 @@ int main() {
 
     printf("Server is running on port %d...\n", PORT);
 
+    // A single ring serves the shared socket; it replaces the blocking thread pool
+    if (backend == BACKEND_URING) {
+        echo_loop(sockfd);
+        close(sockfd);
+        return 0;
+    }
+
     while (1) {
         // Wait for an available thread slot
         sem_wait(&thread_semaphore);
 
-        int *client_socket = malloc(sizeof(int));
-        *client_socket = sockfd;
-
-        // Create a new thread for each client
+        // Create a new thread for each client; the descriptor travels in the argument itself
         pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, handle_client, client_socket) != 0) {
+        if (pthread_create(&thread_id, NULL, handle_client, (void *)(intptr_t)sockfd) != 0) {
             perror("pthread_create failed");
-            free(client_socket);
             sem_post(&thread_semaphore);  // Release semaphore if thread creation fails
         }
 
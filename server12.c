@@ -1,109 +1,694 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "bufpool.h"
+#include "calc.h"
+#include "metrics.h"
+#include "wire.h"
 
 
 #define PORT 10020
-#define REQUEST_SIZE 9   // Size of the request message
-#define RESPONSE_SIZE 14  // Size of the response message
+#define REQUEST_SIZE WIRE_CALC_REQUEST_SIZE
+#define RESPONSE_SIZE WIRE_CALC_RESPONSE_SIZE
+#define DEFAULT_BACKLOG 5     // listen() backlog unless -B is given
+#define MAX_REACTORS 256      // Maximum number of epoll event loops
+#define MAX_EVENTS 256        // epoll_wait batch size
+#define PIPELINE_DEPTH 455    // Requests parsed per read in keep-alive mode
+#define IN_BUFFER_SIZE (PIPELINE_DEPTH * REQUEST_SIZE)
+#define OUT_BUFFER_SIZE (PIPELINE_DEPTH * RESPONSE_SIZE)
 
 
-void handle_client(int client_sock) {
-   unsigned char request[REQUEST_SIZE];
-   unsigned char response[RESPONSE_SIZE];
+// Batch message: 'B', operator, 4-byte count, then count (A, B) pairs, or for the
+// mixed operator 'M' count (operator, A, B) triples. The response echoes the
+// 6-byte header, then count 4-byte results, then count validity bytes. Like
+// single requests, every multi-byte field is in network byte order (wire.h).
+#define BATCH_OPCODE 'B'
+#define BATCH_MIXED 'M'
+#define BATCH_HEADER_SIZE WIRE_BATCH_HEADER_SIZE
+#define BATCH_MAX 65536       // Maximum operations in one batch message
+#define DEFAULT_METRICS_NAME "server12"
+#define DEFAULT_POOL_CONNS 256  // Connections per reactor served from its buffer pools
+#define ACCEPT_ERROR_INTERVAL_NS 1000000000ull  // At most one accept failure message per reactor per second
 
 
-   // Receive the request message
-   ssize_t bytes_received = recv(client_sock, request, REQUEST_SIZE, 0);
-   if (bytes_received < 0) {
-       perror("recv failed");
-       close(client_sock);
-       return;
-   }
+// UDP transport (-u): one request per datagram, optionally followed by a
+// WIRE_CALC_ID_SIZE request ID that is copied after the response unchanged
+#define UDP_MAX_BATCH 1024    // Maximum datagrams per recvmmsg/sendmmsg call
+#define UDP_DEFAULT_BATCH 64
+#define UDP_BUFFER_SIZE 64    // Larger than any valid request, so oversized ones show up as such
 
 
-   // Extract the operator and operands
-   char operator = request[0];               // Operator (1 byte)
-   unsigned int operandA, operandB, result = 0;
-   memcpy(&operandA, &request[1], 4);        // Operand A (4 bytes)
-   memcpy(&operandB, &request[5], 4);        // Operand B (4 bytes)
+// Growable byte buffer; it only grows past its initial size for batch messages
+struct buffer {
+   unsigned char *data;
+   size_t len;
+   size_t cap;
+   struct bufpool *pool;  // Pool the data came from, or NULL if it was malloc'd
+};
+
+
+// Per-connection state for the reactor. A connection alternates between
+// reading requests and flushing the responses they produced; it does not
+// read more while responses are still pending, which bounds both buffers.
+struct conn {
+   int fd;
+   int closing;           // Close once the pending responses are flushed
+   struct buffer in;      // Buffered request bytes, possibly ending in a partial message
+   struct buffer out;     // Response bytes waiting to be written
+   size_t out_sent;       // Response bytes already written
+   struct bufpool *pool;  // Pool this structure came from, or NULL if it was calloc'd
+};
+
+
+// One event loop: its own SO_REUSEPORT listening socket, epoll instance and core
+struct reactor {
+   pthread_t thread_id;
+   int id;
+   int cpu;
+   int listen_fd;
+   int epoll_fd;
+   int spare_fd;              // Held in reserve so a connection can be accepted and shed on EMFILE
+   uint64_t accept_error_ns;  // When an accept failure was last reported
+};
+
+
+static int num_reactors = 0;  // 0 selects the serial accept loop
+static int backlog = DEFAULT_BACKLOG;
+static int keep_alive = 0;  // Serve any number of pipelined requests per connection
+static calc_kernel_fn batch_kernel = calc_kernel_scalar;  // Chosen at startup for the running CPU
+static int pool_conns = DEFAULT_POOL_CONNS;
+static int pool_flags = 0;  // -H: back the pools with huge pages
 
 
-   unsigned char is_valid = 1;               // Validity of the answer
+// Each serving thread owns pools of connection structures and of initial
+// request and response buffers, so accepting and closing a connection does
+// not call the allocator; connections beyond the pools fall back to malloc
+static __thread struct bufpool *conn_pool;
+static __thread struct bufpool *in_pool;
+static __thread struct bufpool *out_pool;
+static int udp = 0;  // Serve datagrams instead of TCP connections
+static int udp_batch = UDP_DEFAULT_BATCH;
 
 
-   // Perform the operation with overflow detection
-   switch (operator) {
+// One UDP worker: its own SO_REUSEPORT socket, thread and core
+struct udp_worker {
+   pthread_t thread_id;
+   int id;
+   int cpu;
+   int sockfd;
+};
+
+
+// Preallocated per-worker datagram slots for recvmmsg and sendmmsg
+struct udp_batch {
+   struct mmsghdr in[UDP_MAX_BATCH];
+   struct mmsghdr out[UDP_MAX_BATCH];
+   struct iovec in_iovs[UDP_MAX_BATCH];
+   struct iovec out_iovs[UDP_MAX_BATCH];
+   struct sockaddr_in addrs[UDP_MAX_BATCH];
+   unsigned char requests[UDP_MAX_BATCH][UDP_BUFFER_SIZE];
+   unsigned char responses[UDP_MAX_BATCH][RESPONSE_SIZE + WIRE_CALC_ID_SIZE];
+};
+
+
+// Decode one 9-byte request and encode its 14-byte response.
+// Returns -1 if the operator is unknown.
+static int process_request(const unsigned char *request, unsigned char *response) {
+   // Extract the operator and operands
+   struct wire_calc m = wire_calc_decode_request(request);
+   unsigned int result = 0;
+
+
+   unsigned char is_valid = calc_one(m.op, m.a, m.b, &result);
+   switch (m.op) {
        case '+':
-           if (operandA > (UINT_MAX - operandB)) {
-               result = 0;  // Overflow occurred
-               is_valid = 2;  // Set answer as invalid
-           } else {
-               result = operandA + operandB;
-           }
+           metrics_add(METRIC_OPS_ADD, 1);
            break;
        case '-':
-           result = operandA - operandB;
+           metrics_add(METRIC_OPS_SUB, 1);
            break;
        case 'x':
-           if (operandA > 0 && operandB > 0 && operandA > (UINT_MAX / operandB)) {
-               result = 0;  // Overflow occurred
-               is_valid = 2;  // Set answer as invalid
-           } else {
-               result = operandA * operandB;
-           }
+           metrics_add(METRIC_OPS_MUL, 1);
            break;
        case '/':
-           if (operandB == 0) {
-               result = 0;  // Set result to 0 in case of invalid operation
-               is_valid = 2;  // Invalid result
-           } else {
-               result = operandA / operandB;
-           }
+           metrics_add(METRIC_OPS_DIV, 1);
            break;
        default:
-           fprintf(stderr, "Unknown operator\n");
-           close(client_sock);
-           return;
+           return -1;
    }
+   if (is_valid == CALC_INVALID) {
+       metrics_add(METRIC_INVALID_RESULTS, 1);
+   }
+
+
+   // Create the response message: operator, operands, result, validity byte
+   wire_calc_encode_response(response, m.op, m.a, m.b, result, is_valid);
+   return 0;
+}
+
+
+// Give the calling thread its pools; they hold 'conns' connections
+static void pools_create(uint32_t conns) {
+   conn_pool = bufpool_create(conns, sizeof(struct conn), pool_flags);
+   in_pool = bufpool_create(conns, IN_BUFFER_SIZE, pool_flags);
+   out_pool = bufpool_create(conns, OUT_BUFFER_SIZE, pool_flags);
+   if (conn_pool == NULL || in_pool == NULL || out_pool == NULL) {
+       fprintf(stderr, "Buffer pool creation failed; connections use malloc\n");
+   }
+}
+
+
+static int buffer_init(struct buffer *b, size_t cap, struct bufpool *pool) {
+   b->len = 0;
+   b->pool = NULL;
+   b->data = cap <= (pool != NULL ? pool->slot_size : 0) ? metrics_pool_get(pool) : NULL;
+   if (b->data != NULL) {
+       b->pool = pool;
+       b->cap = pool->slot_size;
+       return 0;
+   }
+   b->data = malloc(cap);
+   b->cap = cap;
+   return b->data == NULL ? -1 : 0;
+}
 
 
-   // Create the response message
-   response[0] = operator;                   // 1-byte operator
-   memcpy(&response[1], &operandA, 4);       // 4-byte operand A
-   memcpy(&response[5], &operandB, 4);       // 4-byte operand B
-   memcpy(&response[9], &result, 4);         // 4-byte result
-   response[13] = is_valid;                  // 1-byte validity indicator
+static void buffer_free(struct buffer *b) {
+   if (b->pool != NULL) {
+       bufpool_put(b->pool, b->data);
+   } else {
+       free(b->data);
+   }
+   b->data = NULL;
+}
 
 
-   // Send the response message
-   if (send(client_sock, response, RESPONSE_SIZE, 0) < 0) {
-       perror("send failed");
+// Make room for at least 'cap' bytes in total. A pooled buffer that has to
+// grow moves to the heap for the rest of its connection.
+static int buffer_reserve(struct buffer *b, size_t cap) {
+   if (cap <= b->cap) {
+       return 0;
    }
+   size_t new_cap = b->cap * 2 > cap ? b->cap * 2 : cap;
+   unsigned char *data;
+   if (b->pool != NULL) {
+       data = malloc(new_cap);
+       if (data == NULL) {
+           return -1;
+       }
+       memcpy(data, b->data, b->len);
+       bufpool_put(b->pool, b->data);
+       b->pool = NULL;
+   } else {
+       data = realloc(b->data, new_cap);
+       if (data == NULL) {
+           return -1;
+       }
+   }
+   b->data = data;
+   b->cap = new_cap;
+   return 0;
+}
+
+
+// Drop the first 'n' bytes, keeping any partial message that follows
+static void buffer_consume(struct buffer *b, size_t n) {
+   memmove(b->data, b->data + n, b->len - n);
+   b->len -= n;
+}
+
+
+// Size of the message at the start of 'in' and of its response. Returns 0 if
+// 'avail' bytes are not enough to tell, or SIZE_MAX for a malformed batch header.
+static size_t message_length(const unsigned char *in, size_t avail, size_t *response_len) {
+   if (avail < 1) {
+       return 0;
+   }
+   if (in[0] != BATCH_OPCODE) {
+       *response_len = RESPONSE_SIZE;
+       return REQUEST_SIZE;
+   }
+   if (avail < BATCH_HEADER_SIZE) {
+       return 0;
+   }
+
+
+   char operator = in[1];
+   uint32_t count = wire_batch_count(in);
+   if (count == 0 || count > BATCH_MAX) {
+       return SIZE_MAX;
+   }
+   if (operator != '+' && operator != '-' && operator != 'x' && operator != '/' && operator != BATCH_MIXED) {
+       return SIZE_MAX;
+   }
+
+
+   *response_len = BATCH_HEADER_SIZE + (size_t)count * 5;
+   return BATCH_HEADER_SIZE + (size_t)count * (operator == BATCH_MIXED ? REQUEST_SIZE : 8);
+}
+
+
+// Evaluate a complete batch message with the vector kernel, chunk by chunk
+static void process_batch(const unsigned char *request, unsigned char *response) {
+   char operator = request[1];
+   uint32_t count = wire_batch_count(request);
+
+
+   const unsigned char *in = request + BATCH_HEADER_SIZE;
+   unsigned char *results = response + BATCH_HEADER_SIZE;
+   uint8_t *valid = results + (size_t)count * 4;
+   int mixed = operator == BATCH_MIXED;
+   size_t stride = mixed ? REQUEST_SIZE : 8;
+
+
+   memcpy(response, request, BATCH_HEADER_SIZE);
+   metrics_add(METRIC_BATCHES, 1);
+   metrics_add(METRIC_BATCH_OPS, count);
+
+
+   uint8_t ops[CALC_CHUNK];
+   uint32_t a[CALC_CHUNK], b[CALC_CHUNK], r[CALC_CHUNK];
+   for (size_t base = 0; base < count; base += CALC_CHUNK) {
+       size_t n = count - base < CALC_CHUNK ? count - base : CALC_CHUNK;
+       const unsigned char *p = in + base * stride;
+
+
+       // Deinterleave the wire records into host-order operand arrays
+       const unsigned char *operands = p + mixed;
+       for (size_t i = 0; i < n; i++) {
+           ops[i] = p[i * stride];
+           a[i] = wire_decode_u32(operands + i * stride);
+           b[i] = wire_decode_u32(operands + i * stride + 4);
+       }
+       batch_kernel(mixed ? 0 : operator, ops, a, b, (unsigned char *)r, valid + base, n);
+       wire_encode_u32_array(results + base * 4, r, n);
+   }
+}
+
+
+// Answer every complete message in 'in', appending responses to 'out' in order.
+// At most 'max' messages are handled. Returns the request bytes consumed, and
+// sets *malformed if parsing stopped at an unknown operator or bad batch header.
+static size_t process_requests(const struct buffer *in, struct buffer *out, size_t max, int *malformed) {
+   size_t consumed = 0;
+   size_t count = 0;
+   uint64_t start_ns = metrics_now_ns();
+
+
+   *malformed = 0;
+   while (count < max) {
+       size_t response_len;
+       size_t len = message_length(in->data + consumed, in->len - consumed, &response_len);
+       if (len == SIZE_MAX) {
+           *malformed = 1;
+           break;
+       }
+       if (len == 0 || in->len - consumed < len) {
+           break;  // Wait for the rest of the message
+       }
+       if (buffer_reserve(out, out->len + response_len) < 0) {
+           *malformed = 1;
+           break;
+       }
+
+
+       if (in->data[consumed] == BATCH_OPCODE) {
+           process_batch(in->data + consumed, out->data + out->len);
+       } else if (process_request(in->data + consumed, out->data + out->len) < 0) {
+           *malformed = 1;
+           break;
+       }
+       consumed += len;
+       out->len += response_len;
+       count++;
+   }
+
+   // Handler latency covers every message answered from one read
+   metrics_add(METRIC_REQUESTS, count);
+   metrics_add(METRIC_MALFORMED, *malformed);
+   if (count > 0) {
+       metrics_latency_since(start_ns);
+   }
+   return consumed;
+}
 
 
+// Grow 'in' if the message at its head is larger than the buffer
+static int reserve_next_message(struct buffer *in) {
+   size_t response_len;
+   size_t len = message_length(in->data, in->len, &response_len);
+   if (len != 0 && len != SIZE_MAX) {
+       return buffer_reserve(in, len);
+   }
+   return 0;
+}
+
+
+// Write all of buf, retrying after partial sends
+static int send_all(int sock, const unsigned char *buf, size_t len) {
+   while (len > 0) {
+       ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+       if (n < 0) {
+           if (errno == EINTR) {
+               continue;
+           }
+           metrics_add(METRIC_TX_ERRORS, 1);
+           return -1;
+       }
+       metrics_add(METRIC_TX_BYTES, n);
+       buf += n;
+       len -= n;
+   }
+   return 0;
+}
+
+
+void handle_client(int client_sock) {
+   struct buffer request, response;
+
+
+   if (buffer_init(&request, IN_BUFFER_SIZE, in_pool) < 0 || buffer_init(&response, OUT_BUFFER_SIZE, out_pool) < 0) {
+       perror("malloc failed");
+       buffer_free(&request);
+       close(client_sock);
+       return;
+   }
+
+
+   // Receive the request message(s); keep-alive connections carry many back to back
+   while (1) {
+       ssize_t bytes_received = recv(client_sock, request.data + request.len, request.cap - request.len, 0);
+       if (bytes_received < 0) {
+           metrics_add(METRIC_RX_ERRORS, 1);
+           perror("recv failed");
+           break;
+       }
+       if (bytes_received == 0) {
+           break;  // Client closed the connection
+       }
+       metrics_add(METRIC_RX_CALLS, 1);
+       metrics_add(METRIC_RX_BYTES, bytes_received);
+       request.len += bytes_received;
+
+
+       // Answer everything complete before reading again: a buffer grown for a
+       // batch can hold more than the PIPELINE_DEPTH requests one pass answers
+       int malformed;
+       int finished = 0;
+       size_t consumed;
+       do {
+           response.len = 0;
+           consumed = process_requests(&request, &response, keep_alive ? PIPELINE_DEPTH : 1, &malformed);
+
+
+           // One write carries every response produced by this pass
+           if (response.len > 0 && send_all(client_sock, response.data, response.len) < 0) {
+               perror("send failed");
+               finished = 1;
+           } else if (malformed) {
+               fprintf(stderr, "Unknown operator or malformed batch\n");
+               finished = 1;
+           } else if (!keep_alive && consumed > 0) {
+               finished = 1;  // One request per connection
+           }
+           buffer_consume(&request, consumed);
+       } while (!finished && consumed > 0);
+       if (finished) {
+           break;
+       }
+
+
+       if (reserve_next_message(&request) < 0) {
+           perror("realloc failed");
+           break;
+       }
+   }
+
+
+   buffer_free(&request);
+   buffer_free(&response);
    close(client_sock);  // Close the client socket after handling
+   metrics_add(METRIC_CLOSED, 1);
 }
 
 
-int main() {
-   int sockfd, client_sock;
-   struct sockaddr_in server_addr, client_addr;
-   socklen_t client_addr_len = sizeof(client_addr);
+// A connection with its initial buffers, from the thread's pools where possible
+static struct conn *conn_alloc(int fd) {
+   struct conn *c = metrics_pool_get(conn_pool);
+   if (c != NULL) {
+       memset(c, 0, sizeof(*c));
+       c->pool = conn_pool;
+   } else if ((c = calloc(1, sizeof(*c))) == NULL) {
+       return NULL;
+   }
+   c->fd = fd;
+   if (buffer_init(&c->in, IN_BUFFER_SIZE, in_pool) < 0 || buffer_init(&c->out, OUT_BUFFER_SIZE, out_pool) < 0) {
+       buffer_free(&c->in);
+       if (c->pool != NULL) {
+           bufpool_put(c->pool, c);
+       } else {
+           free(c);
+       }
+       return NULL;
+   }
+   return c;
+}
+
+
+static void conn_free(struct conn *c) {
+   buffer_free(&c->in);
+   buffer_free(&c->out);
+   if (c->pool != NULL) {
+       bufpool_put(c->pool, c);
+   } else {
+       free(c);
+   }
+}
+
+
+static void conn_close(struct reactor *r, struct conn *c) {
+   epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+   close(c->fd);
+   conn_free(c);
+   metrics_add(METRIC_CLOSED, 1);
+}
+
+
+// Advance a connection's state machine as far as the socket allows.
+// Returns 1 if the connection is finished and should be closed.
+static int conn_drive(struct conn *c) {
+   while (1) {
+       // Flush pending responses before reading further requests
+       while (c->out_sent < c->out.len) {
+           ssize_t n = send(c->fd, c->out.data + c->out_sent, c->out.len - c->out_sent, MSG_NOSIGNAL);
+           if (n < 0) {
+               if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                   return 0;  // Socket buffer full; EPOLLOUT resumes the write
+               }
+               if (errno == EINTR) {
+                   continue;
+               }
+               metrics_add(METRIC_TX_ERRORS, 1);
+               perror("send failed");
+               return 1;
+           }
+           metrics_add(METRIC_TX_BYTES, n);
+           c->out_sent += n;
+       }
+       c->out.len = c->out_sent = 0;
+       if (c->closing) {
+           return 1;
+       }
 
 
-   // Create TCP socket
-   sockfd = socket(AF_INET, SOCK_STREAM, 0);
+       // Answer every complete message already buffered with one coalesced write
+       int malformed;
+       size_t consumed = process_requests(&c->in, &c->out, keep_alive ? PIPELINE_DEPTH : 1, &malformed);
+       if (malformed) {
+           fprintf(stderr, "Unknown operator or malformed batch\n");
+           c->closing = 1;
+       } else if (!keep_alive && consumed > 0) {
+           c->closing = 1;  // One request per connection, as in handle_client
+       }
+       buffer_consume(&c->in, consumed);
+       if (reserve_next_message(&c->in) < 0) {
+           perror("realloc failed");
+           return 1;
+       }
+       if (c->out.len > 0 || c->closing) {
+           continue;
+       }
+
+
+       ssize_t n = recv(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len, 0);
+       if (n < 0) {
+           if (errno == EAGAIN || errno == EWOULDBLOCK) {
+               return 0;  // Wait for the rest of the request
+           }
+           if (errno == EINTR) {
+               continue;
+           }
+           metrics_add(METRIC_RX_ERRORS, 1);
+           return 1;
+       }
+       if (n == 0) {
+           return 1;  // Peer closed the connection
+       }
+       metrics_add(METRIC_RX_CALLS, 1);
+       metrics_add(METRIC_RX_BYTES, n);
+       c->in.len += n;
+   }
+}
+
+
+// Accept every pending connection on this reactor's listening socket
+static void reactor_accept(struct reactor *r) {
+   if (r->spare_fd < 0) {
+       r->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);  // Lost to a race at the last shed
+   }
+   while (1) {
+       int fd = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+       if (fd < 0) {
+           if (errno == EAGAIN || errno == EWOULDBLOCK) {
+               return;
+           }
+           if (errno == EINTR || errno == ECONNABORTED) {
+               continue;
+           }
+           int err = errno;
+           uint64_t now_ns = metrics_now_ns();
+           if (now_ns - r->accept_error_ns >= ACCEPT_ERROR_INTERVAL_NS) {
+               r->accept_error_ns = now_ns;
+               fprintf(stderr, "accept failed: %s%s\n", strerror(err),
+                       (err == EMFILE || err == ENFILE) && r->spare_fd >= 0 ? " (shedding connections)" : "");
+           }
+
+
+           // Out of descriptors: the listener is edge-triggered, so connections left
+           // queued would get no new edge. Free the spare, accept and close each one.
+           if ((err == EMFILE || err == ENFILE) && r->spare_fd >= 0) {
+               close(r->spare_fd);
+               fd = accept4(r->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+               if (fd >= 0) {
+                   close(fd);
+                   metrics_add(METRIC_CONNECTIONS, 1);
+                   metrics_add(METRIC_CLOSED, 1);
+               }
+               r->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+               if (fd >= 0) {
+                   continue;
+               }
+           }
+           return;
+       }
+
+
+       metrics_add(METRIC_CONNECTIONS, 1);
+       struct conn *c = conn_alloc(fd);
+       if (c == NULL) {
+           perror("malloc failed");
+           close(fd);
+           metrics_add(METRIC_CLOSED, 1);
+           continue;
+       }
+
+
+       struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+       if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+           perror("epoll_ctl failed");
+           close(fd);
+           conn_free(c);
+           metrics_add(METRIC_CLOSED, 1);
+           continue;
+       }
+
+
+       // Data often arrives with the handshake; try the request right away
+       if (conn_drive(c)) {
+           conn_close(r, c);
+       }
+   }
+}
+
+
+void *reactor_main(void *arg) {
+   struct reactor *r = (struct reactor *)arg;
+   struct epoll_event events[MAX_EVENTS];
+
+
+   cpu_set_t cpuset;
+   CPU_ZERO(&cpuset);
+   CPU_SET(r->cpu, &cpuset);
+   int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+   if (err != 0) {
+       fprintf(stderr, "Reactor %d: failed to pin to CPU %d: %s\n", r->id, r->cpu, strerror(err));
+   }
+   pools_create(pool_conns);  // After pinning, so the pages are on this core's node
+
+
+   while (1) {
+       int n = epoll_wait(r->epoll_fd, events, MAX_EVENTS, -1);
+       if (n < 0) {
+           if (errno == EINTR) {
+               continue;
+           }
+           perror("epoll_wait failed");
+           break;
+       }
+
+
+       for (int i = 0; i < n; i++) {
+           struct conn *c = events[i].data.ptr;
+           if (c == NULL) {
+               reactor_accept(r);  // The listening socket is registered with a NULL pointer
+           } else if (conn_drive(c)) {
+               conn_close(r, c);
+           }
+       }
+   }
+   return NULL;
+}
+
+
+// Create a non-blocking listening socket that joins the SO_REUSEPORT group on PORT
+static int open_listen_socket(int reuseport) {
+   struct sockaddr_in server_addr;
+   int optval = 1;
+
+
+   int sockfd = socket(AF_INET, SOCK_STREAM | (reuseport ? SOCK_NONBLOCK : 0), 0);
    if (sockfd < 0) {
        perror("socket failed");
-       exit(EXIT_FAILURE);
+       return -1;
+   }
+
+
+   if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
+       perror("setsockopt(SO_REUSEADDR) failed");
+       close(sockfd);
+       return -1;
+   }
+
+
+   if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+       perror("setsockopt(SO_REUSEPORT) failed");
+       close(sockfd);
+       return -1;
    }
 
 
    // Configure server address
+   memset(&server_addr, 0, sizeof(server_addr));
    server_addr.sin_family = AF_INET;
    server_addr.sin_port = htons(PORT);
    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");  // Localhost
@@ -113,19 +698,399 @@ int main() {
    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
        perror("bind failed");
        close(sockfd);
-       exit(EXIT_FAILURE);
+       return -1;
    }
 
 
    // Listen for incoming connections
-   if (listen(sockfd, 5) < 0) {
+   if (listen(sockfd, backlog) < 0) {
        perror("listen failed");
        close(sockfd);
+       return -1;
+   }
+
+
+   return sockfd;
+}
+
+
+// List the CPUs this process may run on; returns how many, or -1
+static int allowed_cpus(int *cpus) {
+   cpu_set_t allowed;
+   int num_cpus = 0;
+
+
+   if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+       perror("sched_getaffinity failed");
+       return -1;
+   }
+   for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+       if (CPU_ISSET(cpu, &allowed)) {
+           cpus[num_cpus++] = cpu;
+       }
+   }
+   return num_cpus;
+}
+
+
+// Multi-reactor model: one pinned epoll loop and listening socket per core
+static int run_reactors(void) {
+   static struct reactor reactors[MAX_REACTORS];
+   int cpus[CPU_SETSIZE];
+
+
+   // Each connection needs a descriptor; lift the soft limit to the hard limit
+   struct rlimit rl;
+   if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+       rl.rlim_cur = rl.rlim_max;
+       setrlimit(RLIMIT_NOFILE, &rl);
+   }
+
+
+   int num_cpus = allowed_cpus(cpus);
+   if (num_cpus < 0) {
+       return -1;
+   }
+
+
+   for (int i = 0; i < num_reactors; i++) {
+       struct reactor *r = &reactors[i];
+       r->id = i;
+       r->cpu = cpus[i % num_cpus];
+       r->listen_fd = open_listen_socket(1);
+       if (r->listen_fd < 0) {
+           return -1;
+       }
+       r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+       if (r->epoll_fd < 0) {
+           perror("epoll_create1 failed");
+           return -1;
+       }
+       r->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+       if (r->spare_fd < 0) {
+           perror("open /dev/null failed");
+           return -1;
+       }
+       struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+       if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->listen_fd, &ev) < 0) {
+           perror("epoll_ctl failed");
+           return -1;
+       }
+   }
+
+
+   printf("Server is running on port %d with %d reactors (backlog %d)...\n", PORT, num_reactors, backlog);
+
+
+   for (int i = 0; i < num_reactors; i++) {
+       if (pthread_create(&reactors[i].thread_id, NULL, reactor_main, &reactors[i]) != 0) {
+           perror("pthread_create failed");
+           return -1;
+       }
+   }
+   for (int i = 0; i < num_reactors; i++) {
+       pthread_join(reactors[i].thread_id, NULL);
+   }
+   return 0;
+}
+
+
+// Answer every datagram of one recvmmsg call with one sendmmsg. A request is
+// 9 bytes, or 13 with a request ID; anything else is counted and dropped.
+static void udp_loop(int sockfd) {
+   struct udp_batch *b = calloc(1, sizeof(*b));
+   if (b == NULL) {
+       perror("calloc failed");
+       return;
+   }
+   for (int i = 0; i < udp_batch; i++) {
+       b->in_iovs[i].iov_base = b->requests[i];
+       b->in_iovs[i].iov_len = UDP_BUFFER_SIZE;
+       b->out_iovs[i].iov_base = b->responses[i];
+   }
+
+
+   while (1) {
+       // Re-arm the slots: the kernel overwrites msg_namelen on every call
+       for (int i = 0; i < udp_batch; i++) {
+           b->in[i].msg_hdr.msg_name = &b->addrs[i];
+           b->in[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+           b->in[i].msg_hdr.msg_iov = &b->in_iovs[i];
+           b->in[i].msg_hdr.msg_iovlen = 1;
+       }
+       int received = recvmmsg(sockfd, b->in, udp_batch, MSG_WAITFORONE, NULL);
+       if (received < 0) {
+           if (errno == EINTR) {
+               continue;
+           }
+           metrics_add(METRIC_RX_ERRORS, 1);
+           perror("recvmmsg failed");
+           break;
+       }
+       uint64_t start_ns = metrics_now_ns();
+
+
+       int replies = 0;
+       int malformed = 0;
+       uint64_t rx_bytes = 0, tx_bytes = 0;
+       for (int i = 0; i < received; i++) {
+           unsigned int len = b->in[i].msg_len;
+           rx_bytes += len;
+           if ((len != REQUEST_SIZE && len != REQUEST_SIZE + WIRE_CALC_ID_SIZE) ||
+               process_request(b->requests[i], b->responses[replies]) < 0) {
+               malformed++;
+               continue;
+           }
+           memcpy(b->responses[replies] + RESPONSE_SIZE, b->requests[i] + REQUEST_SIZE, len - REQUEST_SIZE);
+           b->out_iovs[replies].iov_len = RESPONSE_SIZE + (len - REQUEST_SIZE);
+           b->out[replies].msg_hdr.msg_name = &b->addrs[i];
+           b->out[replies].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+           b->out[replies].msg_hdr.msg_iov = &b->out_iovs[replies];
+           b->out[replies].msg_hdr.msg_iovlen = 1;
+           tx_bytes += b->out_iovs[replies].iov_len;
+           replies++;
+       }
+
+
+       // sendmmsg may stop early; a failed reply is dropped like a lost datagram
+       int sent = 0;
+       int failed = 0;
+       while (sent < replies) {
+           int n = sendmmsg(sockfd, b->out + sent, replies - sent, 0);
+           if (n < 0) {
+               if (errno != EINTR) {
+                   tx_bytes -= b->out_iovs[sent].iov_len;
+                   failed++;
+                   sent++;
+               }
+               continue;
+           }
+           sent += n;
+       }
+
+
+       metrics_add(METRIC_RX_CALLS, 1);
+       metrics_add(METRIC_RX_PACKETS, received);
+       metrics_add(METRIC_RX_BYTES, rx_bytes);
+       metrics_add(METRIC_REQUESTS, replies);
+       metrics_add(METRIC_MALFORMED, malformed);
+       metrics_add(METRIC_TX_PACKETS, replies - failed);
+       metrics_add(METRIC_TX_BYTES, tx_bytes);
+       metrics_add(METRIC_TX_ERRORS, failed);
+       metrics_latency_since(start_ns);
+   }
+   free(b);
+}
+
+
+void *udp_worker_main(void *arg) {
+   struct udp_worker *w = (struct udp_worker *)arg;
+
+
+   cpu_set_t cpuset;
+   CPU_ZERO(&cpuset);
+   CPU_SET(w->cpu, &cpuset);
+   int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+   if (err != 0) {
+       fprintf(stderr, "UDP worker %d: failed to pin to CPU %d: %s\n", w->id, w->cpu, strerror(err));
+   }
+
+
+   udp_loop(w->sockfd);
+   return NULL;
+}
+
+
+// Create a UDP socket bound to PORT as a member of the SO_REUSEPORT group
+static int open_udp_socket(void) {
+   struct sockaddr_in server_addr;
+   int optval = 1;
+
+
+   int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+   if (sockfd < 0) {
+       perror("socket failed");
+       return -1;
+   }
+
+
+   if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+       perror("setsockopt(SO_REUSEPORT) failed");
+       close(sockfd);
+       return -1;
+   }
+
+
+   memset(&server_addr, 0, sizeof(server_addr));
+   server_addr.sin_family = AF_INET;
+   server_addr.sin_port = htons(PORT);
+   server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");  // Localhost
+
+
+   if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+       perror("bind failed");
+       close(sockfd);
+       return -1;
+   }
+   return sockfd;
+}
+
+
+// UDP model: the same scaling as the reactors, one pinned worker and
+// SO_REUSEPORT socket per core; the kernel spreads peers over the group
+static int run_udp(int num_workers) {
+   static struct udp_worker workers[MAX_REACTORS];
+   int cpus[CPU_SETSIZE];
+
+
+   int num_cpus = allowed_cpus(cpus);
+   if (num_cpus < 0) {
+       return -1;
+   }
+   for (int i = 0; i < num_workers; i++) {
+       workers[i].id = i;
+       workers[i].cpu = cpus[i % num_cpus];
+       workers[i].sockfd = open_udp_socket();
+       if (workers[i].sockfd < 0) {
+           return -1;
+       }
+   }
+
+
+   printf("Server is running on UDP port %d with %d workers (batch %d)...\n", PORT, num_workers, udp_batch);
+
+
+   for (int i = 0; i < num_workers; i++) {
+       if (pthread_create(&workers[i].thread_id, NULL, udp_worker_main, &workers[i]) != 0) {
+           perror("pthread_create failed");
+           return -1;
+       }
+   }
+   for (int i = 0; i < num_workers; i++) {
+       pthread_join(workers[i].thread_id, NULL);
+       close(workers[i].sockfd);
+   }
+   return 0;
+}
+
+
+static void usage(const char *prog) {
+   fprintf(stderr, "Usage: %s [-w reactors] [-B backlog] [-k] [-u] [-b batch] [-V scalar|sse2|avx2] [-P conns] [-H] [-m metrics]\n", prog);
+   fprintf(stderr, "  -w reactors  Edge-triggered epoll loops, one per core, each with its own SO_REUSEPORT socket (1-%d)\n", MAX_REACTORS);
+   fprintf(stderr, "  -B backlog   listen() backlog (default %d)\n", DEFAULT_BACKLOG);
+   fprintf(stderr, "  -k           Keep-alive: serve pipelined requests until the client closes\n");
+   fprintf(stderr, "  -u           Serve UDP instead: one request per datagram, optionally followed by a 4-byte\n");
+   fprintf(stderr, "               request ID echoed after the response; -w sets the worker count (default 1)\n");
+   fprintf(stderr, "  -b batch     UDP datagrams per recvmmsg/sendmmsg call (1-%d, default %d)\n", UDP_MAX_BATCH, UDP_DEFAULT_BATCH);
+   fprintf(stderr, "  -V kernel    Batch kernel (default: widest the CPU supports)\n");
+   fprintf(stderr, "  -P conns     Connections per reactor served from preallocated buffers (default %d)\n", DEFAULT_POOL_CONNS);
+   fprintf(stderr, "  -H           Back the buffer pools with huge pages\n");
+   fprintf(stderr, "  -m name      Export metrics in shared memory /dev/shm/'name' (default %s; read with metrics_stat)\n", DEFAULT_METRICS_NAME);
+}
+
+
+int main(int argc, char *argv[]) {
+   int sockfd, client_sock;
+   struct sockaddr_in client_addr;
+   socklen_t client_addr_len = sizeof(client_addr);
+   int opt;
+   const char *kernel_name = NULL;
+   const char *metrics_name = DEFAULT_METRICS_NAME;
+
+
+   batch_kernel = calc_kernel_select(&kernel_name);
+   while ((opt = getopt(argc, argv, "w:B:kub:V:P:Hm:h")) != -1) {
+       switch (opt) {
+           case 'w':
+               num_reactors = atoi(optarg);
+               if (num_reactors < 1 || num_reactors > MAX_REACTORS) {
+                   fprintf(stderr, "Invalid reactor count: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               break;
+           case 'B':
+               backlog = atoi(optarg);
+               if (backlog < 1) {
+                   fprintf(stderr, "Invalid backlog: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               break;
+           case 'k':
+               keep_alive = 1;
+               break;
+           case 'u':
+               udp = 1;
+               break;
+           case 'b':
+               udp_batch = atoi(optarg);
+               if (udp_batch < 1 || udp_batch > UDP_MAX_BATCH) {
+                   fprintf(stderr, "Invalid UDP batch size: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               break;
+           case 'V':
+               batch_kernel = calc_kernel_by_name(optarg);
+               if (batch_kernel == NULL) {
+                   fprintf(stderr, "Batch kernel unavailable: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               kernel_name = optarg;
+               break;
+           case 'P':
+               pool_conns = atoi(optarg);
+               if (pool_conns < 1) {
+                   fprintf(stderr, "Invalid pool size: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               break;
+           case 'H':
+               pool_flags |= BUFPOOL_HUGEPAGES;
+               break;
+           case 'm':
+               if (optarg[0] == '\0' || strlen(optarg) > METRICS_NAME_MAX || strchr(optarg, '/') != NULL) {
+                   fprintf(stderr, "Invalid metrics name: %s\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               metrics_name = optarg;
+               break;
+           default:
+               usage(argv[0]);
+               exit(EXIT_FAILURE);
+       }
+   }
+
+
+   printf("Batch operations use the %s kernel\n", kernel_name);
+   if (metrics_start("server12", metrics_name) < 0) {
+       exit(EXIT_FAILURE);
+   }
+
+
+   if (udp) {
+       if (run_udp(num_reactors > 0 ? num_reactors : 1) < 0) {
+           exit(EXIT_FAILURE);
+       }
+       return 0;
+   }
+
+
+   if (num_reactors > 0) {
+       if (run_reactors() < 0) {
+           exit(EXIT_FAILURE);
+       }
+       return 0;
+   }
+
+
+   // Serial model: accept and handle one client at a time
+   sockfd = open_listen_socket(0);
+   if (sockfd < 0) {
        exit(EXIT_FAILURE);
    }
 
 
    printf("Server is running on port %d...\n", PORT);
+   pools_create(1);  // One client at a time
 
 
    while (1) {
@@ -135,6 +1100,7 @@ int main() {
            perror("accept failed");
            continue;
        }
+       metrics_add(METRIC_CONNECTIONS, 1);
 
 
        // Handle the client request
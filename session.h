@@ -0,0 +1,330 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+// Per-peer session table for the echo server.
+//
+// Every datagram updates the session of its source (IPv4 address, UDP port):
+// packet and byte counts, the highest sequence number seen, and how many
+// sequence numbers are missing, arrived late (reordered) or arrived twice.
+// A 64-entry bitmap behind the highest sequence number tells duplicates from
+// late arrivals, in the same way as an anti-replay window.
+//
+// The table is split into shards by the peer's hash. Each shard is a small
+// open-addressing array with linear probing, guarded by its own spinlock, so
+// workers only contend when they handle peers in the same shard. An update is
+// one uncontended lock, a probe over 64-byte entries and an unlock.
+// A maintenance thread evicts idle peers, deleting them with backward shift so
+// that no tombstones build up. It also prints the table when the process
+// receives SIGUSR1.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+
+#define SESSION_SHARD_BITS 8
+#define SESSION_SLOT_BITS 8
+#define SESSION_SHARDS (1u << SESSION_SHARD_BITS)
+#define SESSION_SLOTS (1u << SESSION_SLOT_BITS)     // Entries per shard
+#define SESSION_MAX_FILL (SESSION_SLOTS * 7 / 8)    // Keep probe chains short
+#define SESSION_WINDOW 64                           // Sequence numbers tracked behind the highest
+#define SESSION_SCAN_INTERVAL 1                     // Seconds between idle scans
+
+// One peer; exactly one cache line
+struct session {
+    uint64_t key;           // Peer address << 16 | port, both in network byte order; 0 = free
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t window;        // Bit i set: sequence (highest - i) was seen; 0 = no sequence yet
+    uint64_t last_seen_ns;  // CLOCK_MONOTONIC_COARSE
+    uint32_t highest;       // Highest sequence number seen
+    uint32_t missing;       // Sequence numbers skipped and not yet filled in
+    uint32_t reorders;      // Datagrams older than the highest sequence number
+    uint32_t duplicates;    // Datagrams whose sequence number was already seen
+    uint32_t malformed;     // Datagrams without a valid header
+    uint32_t reserved;
+};
+static_assert(sizeof(struct session) == 64, "a session must fill one cache line");
+
+struct session_shard {
+    _Alignas(64) atomic_uint lock;
+    unsigned int count;
+    struct session slots[SESSION_SLOTS];
+};
+
+static struct {
+    struct session_shard *shards;  // NULL when tracking is off
+    uint64_t idle_ns;              // Sessions idle this long are evicted
+    pthread_t thread;
+    _Atomic unsigned long evicted;
+    _Atomic unsigned long untracked;  // Datagrams from new peers that found their shard full
+} sessions;
+
+static inline uint64_t session_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t session_hash(uint64_t key) {
+    return key * 0x9E3779B97F4A7C15ull;
+}
+
+static inline struct session_shard *session_shard_of(uint64_t hash) {
+    return &sessions.shards[hash >> (64 - SESSION_SHARD_BITS)];
+}
+
+static inline unsigned int session_home(uint64_t hash) {
+    return (unsigned int)(hash >> (64 - SESSION_SHARD_BITS - SESSION_SLOT_BITS)) & (SESSION_SLOTS - 1);
+}
+
+static inline void session_lock(struct session_shard *shard) {
+    while (atomic_exchange_explicit(&shard->lock, 1, memory_order_acquire)) {
+        while (atomic_load_explicit(&shard->lock, memory_order_relaxed)) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+    }
+}
+
+static inline void session_unlock(struct session_shard *shard) {
+    atomic_store_explicit(&shard->lock, 0, memory_order_release);
+}
+
+// Find the peer's entry, inserting it if 'insert' is set. Shard lock held.
+static inline struct session *session_find(struct session_shard *shard, uint64_t key, uint64_t hash, int insert) {
+    unsigned int i = session_home(hash);
+    while (1) {
+        struct session *s = &shard->slots[i];
+        if (s->key == key) {
+            return s;
+        }
+        if (s->key == 0) {
+            if (!insert || shard->count >= SESSION_MAX_FILL) {
+                return NULL;
+            }
+            memset(s, 0, sizeof(*s));
+            s->key = key;
+            shard->count++;
+            return s;
+        }
+        i = (i + 1) & (SESSION_SLOTS - 1);
+    }
+}
+
+// Remove slot i, moving later members of its probe chain back. Shard lock held.
+static inline void session_delete(struct session_shard *shard, unsigned int i) {
+    unsigned int j = i;
+    shard->slots[i].key = 0;
+    shard->count--;
+    while (1) {
+        j = (j + 1) & (SESSION_SLOTS - 1);
+        if (shard->slots[j].key == 0) {
+            return;
+        }
+        // An entry may fill the hole only if its home is not cyclically in (i, j]
+        unsigned int home = session_home(session_hash(shard->slots[j].key));
+        if (((j - home) & (SESSION_SLOTS - 1)) >= ((j - i) & (SESSION_SLOTS - 1))) {
+            shard->slots[i] = shard->slots[j];
+            shard->slots[j].key = 0;
+            i = j;
+        }
+    }
+}
+
+// Account one datagram from peer_addr:peer_port (network byte order). 'valid'
+// and 'end' come from wire_echo_decode(); END closes the sequence, so a new run
+// from a reused port starts afresh.
+static inline void session_record(uint32_t peer_addr, uint16_t peer_port, uint32_t sequence,
+                                  unsigned int length, int valid, int end) {
+    if (sessions.shards == NULL) {
+        return;
+    }
+
+    uint64_t key = (uint64_t)peer_addr << 16 | peer_port;
+    uint64_t hash = session_hash(key);
+    struct session_shard *shard = session_shard_of(hash);
+    uint64_t now = session_now_ns();
+
+    session_lock(shard);
+    struct session *s = session_find(shard, key, hash, 1);
+    if (s == NULL) {
+        session_unlock(shard);
+        atomic_fetch_add_explicit(&sessions.untracked, 1, memory_order_relaxed);
+        return;
+    }
+    s->packets++;
+    s->bytes += length;
+    s->last_seen_ns = now;
+
+    if (!valid) {
+        s->malformed++;
+    } else if (s->window == 0) {
+        s->highest = sequence;
+        s->window = 1;
+    } else {
+        int32_t ahead = (int32_t)(sequence - s->highest);
+        if (s->highest == UINT32_MAX && sequence == 1) {
+            ahead = 1;  // Senders wrap from 2^32 - 1 to 1, skipping 0
+        }
+        if (ahead > 0) {
+            s->missing += (uint32_t)ahead - 1;
+            s->window = ahead >= SESSION_WINDOW ? 1 : (s->window << ahead) | 1;
+            s->highest = sequence;
+        } else {
+            uint32_t behind = 0u - (uint32_t)ahead;
+            if (behind >= SESSION_WINDOW) {
+                s->reorders++;  // Too old to tell a duplicate from a late arrival
+            } else if (s->window & (1ull << behind)) {
+                s->duplicates++;
+            } else {
+                s->window |= 1ull << behind;
+                s->reorders++;
+                s->missing -= s->missing > 0;  // A gap counted earlier has been filled
+            }
+        }
+    }
+    if (end) {
+        s->window = 0;
+    }
+    session_unlock(shard);
+}
+
+static inline void session_print(FILE *out, const struct session *s, uint64_t now) {
+    struct in_addr addr = { .s_addr = (uint32_t)(s->key >> 16) };
+    char peer[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr, peer, sizeof(peer));
+    fprintf(out, "%15s:%-5u %10lu packets %12lu bytes  highest %10u  missing %u  reordered %u  duplicates %u  malformed %u  idle %.1f s\n",
+            peer, ntohs((uint16_t)s->key), (unsigned long)s->packets, (unsigned long)s->bytes, s->highest,
+            s->missing, s->reorders, s->duplicates, s->malformed, (now - s->last_seen_ns) / 1e9);
+}
+
+// Print one peer's session, e.g. when it sends END
+static inline void session_print_peer(FILE *out, uint32_t peer_addr, uint16_t peer_port) {
+    if (sessions.shards == NULL) {
+        return;
+    }
+    uint64_t key = (uint64_t)peer_addr << 16 | peer_port;
+    uint64_t hash = session_hash(key);
+    struct session_shard *shard = session_shard_of(hash);
+    struct session copy;
+
+    session_lock(shard);
+    struct session *s = session_find(shard, key, hash, 0);
+    if (s != NULL) {
+        copy = *s;
+    }
+    session_unlock(shard);
+    if (s != NULL) {
+        fprintf(out, "Session ");
+        session_print(out, &copy, session_now_ns());
+    }
+}
+
+// Print every live session and the table totals
+static inline void session_dump(FILE *out) {
+    static struct session copy[SESSION_SLOTS];
+    uint64_t now = session_now_ns();
+    unsigned long live = 0;
+
+    fprintf(out, "Sessions:\n");
+    for (unsigned int i = 0; i < SESSION_SHARDS; i++) {
+        struct session_shard *shard = &sessions.shards[i];
+        unsigned int n = 0;
+        session_lock(shard);
+        for (unsigned int j = 0; j < SESSION_SLOTS; j++) {
+            if (shard->slots[j].key != 0) {
+                copy[n++] = shard->slots[j];
+            }
+        }
+        session_unlock(shard);
+
+        for (unsigned int j = 0; j < n; j++) {
+            session_print(out, &copy[j], now);
+        }
+        live += n;
+    }
+    fprintf(out, "%lu live sessions, %lu evicted, %lu datagrams untracked (table full)\n",
+            live, atomic_load(&sessions.evicted), atomic_load(&sessions.untracked));
+    fflush(out);
+}
+
+static inline void session_evict_idle(void) {
+    uint64_t now = session_now_ns();
+    for (unsigned int i = 0; i < SESSION_SHARDS; i++) {
+        struct session_shard *shard = &sessions.shards[i];
+        if (shard->count == 0) {
+            continue;
+        }
+        session_lock(shard);
+        for (unsigned int j = 0; j < SESSION_SLOTS; j++) {
+            // Deleting may shift another entry into slot j; check it too
+            while (shard->slots[j].key != 0 && now - shard->slots[j].last_seen_ns > sessions.idle_ns) {
+                session_delete(shard, j);
+                atomic_fetch_add_explicit(&sessions.evicted, 1, memory_order_relaxed);
+            }
+        }
+        session_unlock(shard);
+    }
+}
+
+// Evict idle sessions periodically and dump the table on SIGUSR1
+static inline void *session_main(void *arg) {
+    sigset_t *set = arg;
+    struct timespec timeout = { SESSION_SCAN_INTERVAL, 0 };
+    uint64_t next_scan = session_now_ns() + SESSION_SCAN_INTERVAL * 1000000000ull;
+
+    while (1) {
+        if (sigtimedwait(set, NULL, &timeout) == SIGUSR1) {
+            session_dump(stdout);
+        }
+        if (session_now_ns() >= next_scan) {
+            session_evict_idle();
+            next_scan = session_now_ns() + SESSION_SCAN_INTERVAL * 1000000000ull;
+        }
+    }
+    return NULL;
+}
+
+// Allocate the table and start the maintenance thread. Call before any other
+// thread exists: SIGUSR1 is blocked here so that only the maintenance thread
+// takes it. idle_seconds = 0 turns session tracking off.
+static inline int session_start(unsigned int idle_seconds) {
+    static sigset_t set;
+
+    if (idle_seconds == 0) {
+        return 0;
+    }
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    // Anonymous pages are zeroed, so every slot starts free
+    void *mem = mmap(NULL, SESSION_SHARDS * sizeof(struct session_shard), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap(session table) failed");
+        return -1;
+    }
+    sessions.idle_ns = (uint64_t)idle_seconds * 1000000000ull;
+    sessions.shards = mem;
+
+    if (pthread_create(&sessions.thread, NULL, session_main, &set) != 0) {
+        perror("pthread_create failed");
+        sessions.shards = NULL;
+        munmap(mem, SESSION_SHARDS * sizeof(struct session_shard));
+        return -1;
+    }
+    pthread_detach(sessions.thread);
+    return 0;
+}
+
+#endif // SESSION_H
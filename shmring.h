@@ -0,0 +1,338 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+// Same-host shared-memory transport for the echo protocol (server11 -Z,
+// client11b/client11c -Z).
+//
+// The server creates one POSIX shared-memory segment holding a fixed table of
+// client slots. A client registers by claiming a free slot, which gives it a
+// pair of single-producer/single-consumer rings: requests to the server and
+// echoes back. Each ring slot carries one message frame in the same format as
+// a datagram (14-byte header and payload), so both ends reuse the wire.h codec.
+//
+// A ring's head is written only by its producer and its tail only by its
+// consumer, each on its own cache line, so a transfer costs one release store
+// and one acquire load per side and no system call. Waiting is optional: a
+// consumer that finds its ring empty (or a producer that finds it full) may
+// sleep on a futex in the segment, and the other side wakes it only if it
+// announced that it sleeps. The server sleeps on one doorbell for all slots.
+// With spinning on both ends no futex call is made at all.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "wire.h"
+
+#define SHM_MAGIC "ECHOSHM1"
+#define SHM_VERSION 1
+#define SHM_MAX_CLIENTS 64    // Slots in a segment
+#define SHM_RING_SLOTS 256    // Frames per ring (power of two)
+#define SHM_FRAME_MAX 1038    // Largest message: 14-byte header + 1024-byte payload
+#define SHM_CACHE_LINE 64
+#define SHM_NAME_MAX 64
+
+// Client slot states
+#define SHM_SLOT_FREE 0
+#define SHM_SLOT_CLAIMING 1  // A client is resetting the rings
+#define SHM_SLOT_ACTIVE 2
+#define SHM_SLOT_CLOSING 3   // The client detached; the server frees the slot
+
+struct shm_frame {
+    uint32_t len;
+    unsigned char data[SHM_FRAME_MAX];
+} __attribute__((aligned(SHM_CACHE_LINE)));
+
+struct shm_ring {
+    // Producer's line: the next frame to fill; consumers wait on it
+    _Alignas(SHM_CACHE_LINE) _Atomic uint32_t head;
+    _Atomic uint32_t space_waiters;  // Producer sleeps until the ring has room
+    // Consumer's line: the next frame to read; producers wait on it
+    _Alignas(SHM_CACHE_LINE) _Atomic uint32_t tail;
+    _Atomic uint32_t data_waiters;   // Consumer sleeps until a frame arrives
+    struct shm_frame frames[SHM_RING_SLOTS];
+};
+
+struct shm_slot {
+    _Alignas(SHM_CACHE_LINE) _Atomic uint32_t state;
+    _Atomic int32_t pid;  // Client process, for detecting clients that died attached
+    struct shm_ring requests;  // Client to server
+    struct shm_ring echoes;    // Server to client
+};
+
+struct shm_segment {
+    char magic[8];        // Written last, once the header is complete
+    uint32_t version;
+    uint32_t max_clients;
+    uint32_t ring_slots;
+    uint32_t frame_max;
+    int32_t pid;          // Server process
+    // The server sleeps on the doorbell once it has set server_waiting;
+    // clients ring it after making work for the server
+    _Alignas(SHM_CACHE_LINE) _Atomic uint32_t doorbell;
+    _Atomic uint32_t server_waiting;
+    struct shm_slot slots[SHM_MAX_CLIENTS];
+};
+
+// A client's registration
+struct shm_client {
+    struct shm_segment *seg;
+    struct shm_slot *slot;
+    unsigned int index;
+};
+
+static inline long shm_futex(_Atomic uint32_t *word, int op, uint32_t value, const struct timespec *timeout) {
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+// Sleep while *word still holds 'seen', at most timeout_ns (0 = no limit);
+// returns early on a wake-up, a signal or a changed value
+static inline void shm_futex_wait(_Atomic uint32_t *word, uint32_t seen, uint64_t timeout_ns) {
+    struct timespec ts = { .tv_sec = timeout_ns / 1000000000ull, .tv_nsec = timeout_ns % 1000000000ull };
+    shm_futex(word, FUTEX_WAIT, seen, timeout_ns ? &ts : NULL);
+}
+
+static inline void shm_futex_wake(_Atomic uint32_t *word) {
+    shm_futex(word, FUTEX_WAKE, 1, NULL);
+}
+
+// Producer: the frame to fill next, or NULL if the ring is full
+static inline struct shm_frame *shm_ring_reserve(struct shm_ring *r) {
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == SHM_RING_SLOTS) {
+        return NULL;
+    }
+    return &r->frames[head & (SHM_RING_SLOTS - 1)];
+}
+
+// Producer: hand the reserved frame, now holding 'len' bytes, to the consumer
+static inline void shm_ring_publish(struct shm_ring *r, uint32_t len) {
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    r->frames[head & (SHM_RING_SLOTS - 1)].len = len;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);  // Pairs with the consumer's in shm_ring_wait_data
+    if (atomic_load_explicit(&r->data_waiters, memory_order_relaxed)) {
+        shm_futex_wake(&r->head);
+    }
+}
+
+// Consumer: the oldest frame, or NULL if the ring is empty
+static inline struct shm_frame *shm_ring_peek(struct shm_ring *r) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&r->head, memory_order_acquire)) {
+        return NULL;
+    }
+    return &r->frames[tail & (SHM_RING_SLOTS - 1)];
+}
+
+// Consumer: give the peeked frame back to the producer
+static inline void shm_ring_consume(struct shm_ring *r) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);  // Pairs with the producer's in shm_ring_wait_space
+    if (atomic_load_explicit(&r->space_waiters, memory_order_relaxed)) {
+        shm_futex_wake(&r->tail);
+    }
+}
+
+// Consumer: sleep until a frame arrives, for at most timeout_ns (0 = no limit)
+static inline void shm_ring_wait_data(struct shm_ring *r, uint64_t timeout_ns) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    atomic_store_explicit(&r->data_waiters, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&r->head, memory_order_relaxed) == tail) {
+        shm_futex_wait(&r->head, tail, timeout_ns);
+    }
+    atomic_store_explicit(&r->data_waiters, 0, memory_order_relaxed);
+}
+
+// Producer: sleep until the ring has room, for at most timeout_ns (0 = no limit)
+static inline void shm_ring_wait_space(struct shm_ring *r, uint64_t timeout_ns) {
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    atomic_store_explicit(&r->space_waiters, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (head - tail == SHM_RING_SLOTS) {
+        shm_futex_wait(&r->tail, tail, timeout_ns);
+    }
+    atomic_store_explicit(&r->space_waiters, 0, memory_order_relaxed);
+}
+
+// Client: wake the server if it is asleep. Called after publishing a request
+// and after consuming an echo (the server holds requests back while the
+// client's echo ring is full).
+static inline void shm_notify_server(struct shm_segment *seg) {
+    atomic_thread_fence(memory_order_seq_cst);  // Pairs with the server's in shm_server_wait
+    if (atomic_load_explicit(&seg->server_waiting, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&seg->doorbell, 1, memory_order_relaxed);
+        shm_futex_wake(&seg->doorbell);
+    }
+}
+
+// Server: whether any attached client has a request the server can answer now
+static inline int shm_server_pending(struct shm_segment *seg) {
+    for (unsigned int i = 0; i < SHM_MAX_CLIENTS; i++) {
+        struct shm_slot *s = &seg->slots[i];
+        uint32_t state = atomic_load_explicit(&s->state, memory_order_acquire);
+        if (state == SHM_SLOT_CLOSING ||
+            (state == SHM_SLOT_ACTIVE && shm_ring_peek(&s->requests) != NULL && shm_ring_reserve(&s->echoes) != NULL)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Server: sleep until a client rings the doorbell, for at most timeout_ns
+static inline void shm_server_wait(struct shm_segment *seg, uint64_t timeout_ns) {
+    uint32_t bell = atomic_load_explicit(&seg->doorbell, memory_order_relaxed);
+    atomic_store_explicit(&seg->server_waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!shm_server_pending(seg)) {
+        shm_futex_wait(&seg->doorbell, bell, timeout_ns);
+    }
+    atomic_store_explicit(&seg->server_waiting, 0, memory_order_relaxed);
+}
+
+// Server: free the slots of clients that died without detaching
+static inline void shm_server_reap(struct shm_segment *seg) {
+    for (unsigned int i = 0; i < SHM_MAX_CLIENTS; i++) {
+        struct shm_slot *s = &seg->slots[i];
+        uint32_t state = atomic_load_explicit(&s->state, memory_order_acquire);
+        pid_t pid = atomic_load_explicit(&s->pid, memory_order_relaxed);
+        if ((state == SHM_SLOT_ACTIVE || state == SHM_SLOT_CLAIMING) && pid > 0 && kill(pid, 0) < 0 &&
+            errno == ESRCH) {
+            atomic_store_explicit(&s->state, SHM_SLOT_CLOSING, memory_order_release);
+        }
+    }
+}
+
+// Create the segment /dev/shm/<name>, replacing any left by an earlier server;
+// clients still attached to that one time out rather than share the new one
+static inline struct shm_segment *shm_server_create(const char *name) {
+    char path[SHM_NAME_MAX + 2];
+    size_t size = sizeof(struct shm_segment);
+
+    snprintf(path, sizeof(path), "/%s", name);
+    shm_unlink(path);
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 || ftruncate(fd, (off_t)size) < 0) {
+        perror("shm_open(shared-memory transport) failed");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    struct shm_segment *seg = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) {
+        perror("mmap(shared-memory transport) failed");
+        return NULL;
+    }
+
+    seg->version = SHM_VERSION;
+    seg->max_clients = SHM_MAX_CLIENTS;
+    seg->ring_slots = SHM_RING_SLOTS;
+    seg->frame_max = SHM_FRAME_MAX;
+    seg->pid = getpid();
+    atomic_thread_fence(memory_order_release);
+    memcpy(seg->magic, SHM_MAGIC, sizeof(seg->magic));
+    return seg;
+}
+
+// Register with the server that created /dev/shm/<name>: claim a free slot
+// and reset its rings
+static inline int shm_client_attach(const char *name, struct shm_client *c) {
+    char path[SHM_NAME_MAX + 2];
+    snprintf(path, sizeof(path), "/%s", name);
+
+    int fd = shm_open(path, O_RDWR, 0);
+    if (fd < 0) {
+        perror("shm_open failed (is server11 running with -Z?)");
+        return -1;
+    }
+    struct shm_segment *seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) {
+        perror("mmap failed");
+        return -1;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (memcmp(seg->magic, SHM_MAGIC, sizeof(seg->magic)) != 0 || seg->version != SHM_VERSION ||
+        seg->max_clients != SHM_MAX_CLIENTS || seg->ring_slots != SHM_RING_SLOTS || seg->frame_max != SHM_FRAME_MAX) {
+        fprintf(stderr, "%s is not a compatible shared-memory transport segment\n", path);
+        munmap(seg, sizeof(*seg));
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < SHM_MAX_CLIENTS; i++) {
+        struct shm_slot *s = &seg->slots[i];
+        uint32_t expected = SHM_SLOT_FREE;
+        if (!atomic_compare_exchange_strong(&s->state, &expected, SHM_SLOT_CLAIMING)) {
+            continue;
+        }
+        atomic_store_explicit(&s->pid, getpid(), memory_order_relaxed);
+        struct shm_ring *rings[2] = { &s->requests, &s->echoes };
+        for (int r = 0; r < 2; r++) {
+            atomic_store_explicit(&rings[r]->head, 0, memory_order_relaxed);
+            atomic_store_explicit(&rings[r]->tail, 0, memory_order_relaxed);
+            atomic_store_explicit(&rings[r]->space_waiters, 0, memory_order_relaxed);
+            atomic_store_explicit(&rings[r]->data_waiters, 0, memory_order_relaxed);
+        }
+        atomic_store_explicit(&s->state, SHM_SLOT_ACTIVE, memory_order_release);
+        c->seg = seg;
+        c->slot = s;
+        c->index = i;
+        shm_notify_server(seg);
+        return 0;
+    }
+    fprintf(stderr, "%s: all %d client slots are taken\n", path, SHM_MAX_CLIENTS);
+    munmap(seg, sizeof(*seg));
+    return -1;
+}
+
+static inline void shm_client_detach(struct shm_client *c) {
+    atomic_store_explicit(&c->slot->state, SHM_SLOT_CLOSING, memory_order_release);
+    shm_notify_server(c->seg);
+    munmap(c->seg, sizeof(*c->seg));
+    c->seg = NULL;
+    c->slot = NULL;
+}
+
+// Client: send one message, waiting (spinning or asleep) while the request ring is full
+static inline int shm_client_send(struct shm_client *c, const void *buf, size_t len, int spin) {
+    struct shm_ring *r = &c->slot->requests;
+    struct shm_frame *f;
+    if (len > SHM_FRAME_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    while ((f = shm_ring_reserve(r)) == NULL) {
+        if (spin) {
+            sched_yield();  // The server may share this core
+        } else {
+            shm_ring_wait_space(r, 0);
+        }
+    }
+    memcpy(f->data, buf, len);
+    shm_ring_publish(r, (uint32_t)len);
+    shm_notify_server(c->seg);
+    return 0;
+}
+
+// Client: give the echo last peeked from shm_ring_peek(&c->slot->echoes) back.
+// The server is told only if it sleeps.
+static inline void shm_client_consume(struct shm_client *c) {
+    shm_ring_consume(&c->slot->echoes);
+    shm_notify_server(c->seg);
+}
+
+#endif // SHMRING_H
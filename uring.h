@@ -0,0 +1,251 @@
+#ifndef URING_H
+#define URING_H
+
+// Minimal raw-syscall io_uring wrapper: one ring per thread, identity SQ index
+// array, provided-buffer rings and registered (fixed) buffers. Only what the
+// servers need; no dependency on liburing.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    unsigned int features;
+
+    // Submission queue
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned int sqe_tail;       // Next SQE handed out by uring_get_sqe
+    unsigned int sqe_submitted;  // SQEs already passed to the kernel
+
+    // Completion queue
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    unsigned long enter_calls;  // io_uring_enter syscalls issued
+};
+
+// Provided-buffer ring registered with IORING_REGISTER_PBUF_RING
+struct uring_buf_ring {
+    struct io_uring_buf_ring *br;
+    unsigned int entries;
+    uint16_t tail;  // Local tail; published by uring_buf_ring_advance
+    uint16_t bgid;
+};
+
+static inline int uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static inline int uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Create a ring. Setup flags the kernel rejects are dropped one at a time.
+static inline int uring_init(struct uring *r, unsigned int entries, unsigned int flags) {
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    while (1) {
+        memset(&p, 0, sizeof(p));
+        p.flags = flags;
+        r->fd = uring_setup(entries, &p);
+        if (r->fd >= 0) {
+            break;
+        }
+        if (errno != EINVAL || flags == 0) {
+            perror("io_uring_setup failed");
+            return -1;
+        }
+        flags &= flags - 1;  // Retry without the lowest requested flag
+    }
+    r->features = p.features;
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        perror("mmap(IORING_OFF_SQ_RING) failed");
+        close(r->fd);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            perror("mmap(IORING_OFF_CQ_RING) failed");
+            munmap(r->sq_ring, r->sq_ring_size);
+            close(r->fd);
+            return -1;
+        }
+    }
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        perror("mmap(IORING_OFF_SQES) failed");
+        if (r->cq_ring != r->sq_ring) {
+            munmap(r->cq_ring, r->cq_ring_size);
+        }
+        munmap(r->sq_ring, r->sq_ring_size);
+        close(r->fd);
+        return -1;
+    }
+
+    char *sq = r->sq_ring;
+    char *cq = r->cq_ring;
+    r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // SQ slot i always points at SQE i
+    unsigned int *array = (unsigned int *)(sq + p.sq_off.array);
+    for (unsigned int i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+    r->sqe_tail = r->sqe_submitted = *r->sq_tail;
+    return 0;
+}
+
+static inline void uring_exit(struct uring *r) {
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+}
+
+// Next free SQE, zeroed, or NULL when the submission queue is full
+static inline struct io_uring_sqe *uring_get_sqe(struct uring *r) {
+    unsigned int head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sqe_tail - head >= r->sq_entries) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+    r->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Publish pending SQEs and, if wait_nr > 0, block until that many CQEs exist
+static inline int uring_submit_and_wait(struct uring *r, unsigned int wait_nr) {
+    unsigned int to_submit = r->sqe_tail - r->sqe_submitted;
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+    int ret;
+    do {
+        r->enter_calls++;
+        ret = uring_enter(r->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        return -1;
+    }
+    r->sqe_submitted += (unsigned int)ret < to_submit ? (unsigned int)ret : to_submit;
+    return ret;
+}
+
+// Oldest unconsumed CQE, or NULL if the completion queue is empty
+static inline struct io_uring_cqe *uring_peek_cqe(struct uring *r) {
+    unsigned int head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &r->cqes[head & r->cq_mask];
+}
+
+static inline void uring_cqe_seen(struct uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Register one or more fixed buffers (IORING_REGISTER_BUFFERS)
+static inline int uring_register_buffers(struct uring *r, const struct iovec *iovs, unsigned int nr) {
+    return uring_register(r->fd, IORING_REGISTER_BUFFERS, (void *)iovs, nr);
+}
+
+// Allocate and register a provided-buffer ring; entries must be a power of two
+static inline int uring_buf_ring_init(struct uring *r, struct uring_buf_ring *b, unsigned int entries, uint16_t bgid) {
+    size_t size = entries * sizeof(struct io_uring_buf);
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap(buffer ring) failed");
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)mem;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register(IORING_REGISTER_PBUF_RING) failed");
+        munmap(mem, size);
+        return -1;
+    }
+
+    b->br = mem;
+    b->entries = entries;
+    b->tail = 0;
+    b->bgid = bgid;
+    return 0;
+}
+
+// Unmap a provided-buffer ring; closing the io_uring fd unregisters it
+static inline void uring_buf_ring_exit(struct uring_buf_ring *b) {
+    if (b->br != NULL) {
+        munmap(b->br, b->entries * sizeof(struct io_uring_buf));
+        b->br = NULL;
+    }
+}
+
+// Queue a buffer for the kernel; 'offset' counts buffers added since the last advance
+static inline void uring_buf_ring_add(struct uring_buf_ring *b, void *addr, unsigned int len, uint16_t bid, unsigned int offset) {
+    struct io_uring_buf *buf = &b->br->bufs[(b->tail + offset) & (b->entries - 1)];
+    buf->addr = (uint64_t)(uintptr_t)addr;
+    buf->len = len;
+    buf->bid = bid;
+}
+
+// Make 'count' newly added buffers visible to the kernel
+static inline void uring_buf_ring_advance(struct uring_buf_ring *b, unsigned int count) {
+    b->tail += count;
+    __atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+#endif // URING_H
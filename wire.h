@@ -0,0 +1,204 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+// Wire formats shared by the echo programs (server11, client11b, client11c) and
+// the calculator programs (server12, client12).
+//
+// Messages are read and written in place through packed views, so no payload
+// is copied or rescanned. Every multi-byte field is big-endian on the wire.
+// Encoders and decoders contain no branches: validity is computed from the
+// received length rather than tested field by field.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <endian.h>
+
+#define WIRE_ECHO_HEADER_SIZE 14
+#define WIRE_ECHO_END_SIZE 17        // Header followed by "END"
+#define WIRE_ECHO_MIN_BUFFER WIRE_ECHO_END_SIZE  // Readable bytes wire_echo_decode() may touch
+#define WIRE_CALC_REQUEST_SIZE 9
+#define WIRE_CALC_RESPONSE_SIZE 14
+#define WIRE_CALC_ID_SIZE 4          // Optional request ID after a UDP request, echoed after its response
+#define WIRE_BATCH_HEADER_SIZE 6
+#define WIRE_BATCH_PAIR_SIZE 8
+
+// Echo datagram header; the payload follows immediately
+struct wire_echo_header {
+    uint16_t length;     // Total datagram length, header included
+    uint32_t sequence;
+    uint64_t timestamp;  // Opaque to the server, echoed unchanged
+} __attribute__((packed));
+
+// Single calculator request and its response
+struct wire_calc_request {
+    uint8_t op;
+    uint32_t a;
+    uint32_t b;
+} __attribute__((packed));
+
+struct wire_calc_response {
+    uint8_t op;
+    uint32_t a;
+    uint32_t b;
+    uint32_t result;
+    uint8_t valid;
+} __attribute__((packed));
+
+// Batch message header. It is followed by 'count' operand pairs, or for the
+// mixed operator by 'count' wire_calc_request records.
+struct wire_batch_header {
+    uint8_t opcode;
+    uint8_t op;
+    uint32_t count;
+} __attribute__((packed));
+
+struct wire_batch_pair {
+    uint32_t a;
+    uint32_t b;
+} __attribute__((packed));
+
+static_assert(sizeof(struct wire_echo_header) == WIRE_ECHO_HEADER_SIZE, "echo header must be 14 bytes");
+static_assert(offsetof(struct wire_echo_header, sequence) == 2, "echo sequence at byte 2");
+static_assert(offsetof(struct wire_echo_header, timestamp) == 6, "echo timestamp at byte 6");
+static_assert(sizeof(struct wire_calc_request) == WIRE_CALC_REQUEST_SIZE, "calc request must be 9 bytes");
+static_assert(offsetof(struct wire_calc_request, a) == 1, "calc operand A at byte 1");
+static_assert(offsetof(struct wire_calc_request, b) == 5, "calc operand B at byte 5");
+static_assert(sizeof(struct wire_calc_response) == WIRE_CALC_RESPONSE_SIZE, "calc response must be 14 bytes");
+static_assert(offsetof(struct wire_calc_response, result) == 9, "calc result at byte 9");
+static_assert(offsetof(struct wire_calc_response, valid) == 13, "calc validity at byte 13");
+static_assert(sizeof(struct wire_batch_header) == WIRE_BATCH_HEADER_SIZE, "batch header must be 6 bytes");
+static_assert(offsetof(struct wire_batch_header, count) == 2, "batch count at byte 2");
+static_assert(sizeof(struct wire_batch_pair) == WIRE_BATCH_PAIR_SIZE, "batch pair must be 8 bytes");
+
+// Decoded echo header in host byte order
+struct wire_echo {
+    uint64_t timestamp;
+    uint32_t sequence;
+    uint16_t length;
+    uint8_t valid;  // Whole header present and its length field matches the datagram
+    uint8_t end;    // Valid END marker
+};
+
+// Decoded calculator message in host byte order
+struct wire_calc {
+    uint32_t a;
+    uint32_t b;
+    uint32_t result;  // Responses only
+    uint8_t valid;    // Responses only
+    char op;
+};
+
+// Write the header in front of 'payload_len' bytes already at buf + WIRE_ECHO_HEADER_SIZE.
+// Returns the datagram length.
+static inline size_t wire_echo_encode(void *buf, uint32_t sequence, uint64_t timestamp, size_t payload_len) {
+    struct wire_echo_header *h = buf;
+    size_t len = WIRE_ECHO_HEADER_SIZE + payload_len;
+    h->length = htobe16((uint16_t)len);
+    h->sequence = htobe32(sequence);
+    h->timestamp = htobe64(timestamp);
+    return len;
+}
+
+static inline size_t wire_echo_encode_end(void *buf, uint32_t sequence, uint64_t timestamp) {
+    unsigned char *p = buf;
+    p[WIRE_ECHO_HEADER_SIZE] = 'E';
+    p[WIRE_ECHO_HEADER_SIZE + 1] = 'N';
+    p[WIRE_ECHO_HEADER_SIZE + 2] = 'D';
+    return wire_echo_encode(buf, sequence, timestamp, 3);
+}
+
+// Decode a received datagram of 'len' bytes. 'buf' must have WIRE_ECHO_MIN_BUFFER
+// readable bytes even when len is shorter, which every receive buffer does; the
+// fields of an invalid datagram are unspecified.
+static inline struct wire_echo wire_echo_decode(const void *buf, size_t len) {
+    static const unsigned char end_bytes[4] = { 0, 'E', 'N', 'D' };
+    static const unsigned char end_mask_bytes[4] = { 0, 0xFF, 0xFF, 0xFF };
+    const struct wire_echo_header *h = buf;
+    uint32_t tail, end_word, end_mask;
+    struct wire_echo m;
+    m.length = be16toh(h->length);
+    m.sequence = be32toh(h->sequence);
+    m.timestamp = be64toh(h->timestamp);
+    m.valid = (len >= WIRE_ECHO_HEADER_SIZE) & (m.length == len);
+
+    // Compare bytes 14-16 with "END" as one word load ending at the last header byte
+    memcpy(&tail, (const unsigned char *)buf + WIRE_ECHO_HEADER_SIZE - 1, 4);
+    memcpy(&end_word, end_bytes, 4);
+    memcpy(&end_mask, end_mask_bytes, 4);
+    m.end = m.valid & (len == WIRE_ECHO_END_SIZE) & ((tail & end_mask) == end_word);
+    return m;
+}
+
+static inline void wire_calc_encode_request(void *buf, char op, uint32_t a, uint32_t b) {
+    struct wire_calc_request *r = buf;
+    r->op = (uint8_t)op;
+    r->a = htobe32(a);
+    r->b = htobe32(b);
+}
+
+static inline struct wire_calc wire_calc_decode_request(const void *buf) {
+    const struct wire_calc_request *r = buf;
+    struct wire_calc m;
+    m.op = (char)r->op;
+    m.a = be32toh(r->a);
+    m.b = be32toh(r->b);
+    m.result = 0;
+    m.valid = 0;
+    return m;
+}
+
+static inline void wire_calc_encode_response(void *buf, char op, uint32_t a, uint32_t b, uint32_t result, uint8_t valid) {
+    struct wire_calc_response *r = buf;
+    r->op = (uint8_t)op;
+    r->a = htobe32(a);
+    r->b = htobe32(b);
+    r->result = htobe32(result);
+    r->valid = valid;
+}
+
+static inline struct wire_calc wire_calc_decode_response(const void *buf) {
+    const struct wire_calc_response *r = buf;
+    struct wire_calc m;
+    m.op = (char)r->op;
+    m.a = be32toh(r->a);
+    m.b = be32toh(r->b);
+    m.result = be32toh(r->result);
+    m.valid = r->valid;
+    return m;
+}
+
+static inline void wire_batch_encode_header(void *buf, uint8_t opcode, char op, uint32_t count) {
+    struct wire_batch_header *h = buf;
+    h->opcode = opcode;
+    h->op = (uint8_t)op;
+    h->count = htobe32(count);
+}
+
+static inline uint32_t wire_batch_count(const void *buf) {
+    return be32toh(((const struct wire_batch_header *)buf)->count);
+}
+
+static inline void wire_batch_encode_pair(void *buf, uint32_t a, uint32_t b) {
+    struct wire_batch_pair *p = buf;
+    p->a = htobe32(a);
+    p->b = htobe32(b);
+}
+
+// Store 'n' batch results big-endian into an unaligned buffer
+static inline void wire_encode_u32_array(void *dst, const uint32_t *src, size_t n) {
+    unsigned char *out = dst;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t v = htobe32(src[i]);
+        memcpy(out + i * 4, &v, 4);
+    }
+}
+
+static inline uint32_t wire_decode_u32(const void *src) {
+    uint32_t v;
+    memcpy(&v, src, 4);
+    return be32toh(v);
+}
+
+#endif // WIRE_H
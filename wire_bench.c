@@ -0,0 +1,129 @@
+// Microbenchmark for wire.h: nanoseconds per encode and decode of each message
+// type, next to the hand-written memcpy/strlen packing the programs used before.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "wire.h"
+
+#define BENCH_MESSAGES 1024      // Distinct buffers cycled through, all resident in L1/L2
+#define BENCH_ITERATIONS 100000000L
+#define BENCH_SLOT 64            // Bytes per buffer
+
+static unsigned char buffers[BENCH_MESSAGES][BENCH_SLOT];
+static volatile uint64_t sink;   // Keeps results alive
+
+static uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void report(const char *name, uint64_t start, long iterations) {
+    printf("%-28s %6.2f ns/op\n", name, (bench_now_ns() - start) / (double)iterations);
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : BENCH_ITERATIONS;
+    uint64_t acc = 0;
+    uint64_t start;
+
+    if (iterations < BENCH_MESSAGES) {
+        fprintf(stderr, "Usage: %s [iterations >= %d]\n", argv[0], BENCH_MESSAGES);
+        return EXIT_FAILURE;
+    }
+
+    // Echo header with an 8-byte decimal payload
+    start = bench_now_ns();
+    for (long i = 0; i < iterations; i++) {
+        unsigned char *b = buffers[i & (BENCH_MESSAGES - 1)];
+        memcpy(b + WIRE_ECHO_HEADER_SIZE, "12345678", 8);
+        acc += wire_echo_encode(b, (uint32_t)i, (uint64_t)i * 1000, 8);
+    }
+    report("echo encode", start, iterations);
+
+    start = bench_now_ns();
+    for (long i = 0; i < iterations; i++) {
+        struct wire_echo m = wire_echo_decode(buffers[i & (BENCH_MESSAGES - 1)], 17 + (i & 7));
+        acc += m.sequence + m.timestamp + m.valid + m.end;
+    }
+    report("echo decode", start, iterations);
+
+    start = bench_now_ns();
+    for (long i = 0; i < iterations; i++) {
+        unsigned char *b = buffers[i & (BENCH_MESSAGES - 1)];
+        char text[16];
+        memcpy(text, "12345678", 9);
+        uint16_t length = htons(14 + strlen(text));
+        uint32_t sequence = htonl((uint32_t)i);
+        uint64_t timestamp = htobe64((uint64_t)i * 1000);
+        memcpy(b, &length, 2);
+        memcpy(b + 2, &sequence, 4);
+        memcpy(b + 6, &timestamp, 8);
+        memcpy(b + 14, text, strlen(text));
+        acc += 14 + strlen(text);
+    }
+    report("echo encode (memcpy+strlen)", start, iterations);
+
+    start = bench_now_ns();
+    for (long i = 0; i < iterations; i++) {
+        unsigned char *b = buffers[i & (BENCH_MESSAGES - 1)];
+        size_t len = 17 + (i & 7);
+        uint32_t sequence;
+        uint64_t timestamp;
+        memcpy(&sequence, b + 2, 4);
+        memcpy(&timestamp, b + 6, 8);
+        acc += ntohl(sequence) + be64toh(timestamp);
+        if (len == 17 && memcmp(b + 14, "END", 3) == 0) {
+            acc++;
+        }
+    }
+    report("echo decode (memcpy)", start, iterations);
+
+    // Calculator request and response
+    start = bench_now_ns();
+    for (long i = 0; i < iterations; i++) {
+        wire_calc_encode_request(buffers[i & (BENCH_MESSAGES - 1)], "+-x/"[i & 3], (uint32_t)i, (uint32_t)(i >> 3));
+    }
+    report("calc request encode", start, iterations);
+
+    start = bench_now_ns();
+    for (long i = 0; i < iterations; i++) {
+        struct wire_calc m = wire_calc_decode_request(buffers[i & (BENCH_MESSAGES - 1)]);
+        acc += m.a + m.b + (unsigned char)m.op;
+    }
+    report("calc request decode", start, iterations);
+
+    start = bench_now_ns();
+    for (long i = 0; i < iterations; i++) {
+        wire_calc_encode_response(buffers[i & (BENCH_MESSAGES - 1)], 'x', (uint32_t)i, 3, (uint32_t)i * 3, 1);
+    }
+    report("calc response encode", start, iterations);
+
+    start = bench_now_ns();
+    for (long i = 0; i < iterations; i++) {
+        struct wire_calc m = wire_calc_decode_response(buffers[i & (BENCH_MESSAGES - 1)]);
+        acc += m.a + m.b + m.result + m.valid;
+    }
+    report("calc response decode", start, iterations);
+
+    // Batch results, 256 per call as process_batch converts them
+    uint32_t results[256];
+    for (int i = 0; i < 256; i++) {
+        results[i] = (uint32_t)i * 2654435761u;
+    }
+    static unsigned char out[256 * 4 + 1];
+    long chunks = iterations / 256;
+    start = bench_now_ns();
+    for (long i = 0; i < chunks; i++) {
+        wire_encode_u32_array(out + (i & 1), results, 256);
+        acc += out[i & 255];
+    }
+    report("batch result encode (per op)", start, chunks * 256);
+
+    sink = acc;
+    return 0;
+}
@@ -0,0 +1,138 @@
+// Fuzz target for wire.h.
+//
+// Built with clang -fsanitize=fuzzer,address -DWIRE_FUZZ_LIBFUZZER it is a
+// libFuzzer target. Otherwise it is a standalone program that replays the files
+// named on the command line, or with no arguments runs random inputs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "wire.h"
+
+#define FUZZ_MAX_INPUT 2048
+#define FUZZ_ITERATIONS 10000000
+
+static void check(int ok, const char *what, const uint8_t *data, size_t size) {
+    if (ok) {
+        return;
+    }
+    fprintf(stderr, "wire_fuzz: %s failed on a %zu-byte input:", what, size);
+    for (size_t i = 0; i < size && i < 32; i++) {
+        fprintf(stderr, " %02x", data[i]);
+    }
+    fprintf(stderr, "\n");
+    abort();
+}
+
+// Straightforward reference for the branch-free echo validation
+static void reference_echo(const uint8_t *data, size_t size, int *valid, int *end) {
+    *valid = 0;
+    *end = 0;
+    if (size < WIRE_ECHO_HEADER_SIZE) {
+        return;
+    }
+    if (((size_t)data[0] << 8 | data[1]) != size) {
+        return;
+    }
+    *valid = 1;
+    *end = size == WIRE_ECHO_END_SIZE && memcmp(data + WIRE_ECHO_HEADER_SIZE, "END", 3) == 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size > FUZZ_MAX_INPUT) {
+        return 0;
+    }
+
+    // Decoders may read WIRE_ECHO_MIN_BUFFER bytes; pad short inputs the way a receive buffer would
+    uint8_t buf[FUZZ_MAX_INPUT + WIRE_ECHO_MIN_BUFFER];
+    memset(buf, 0xA5, sizeof(buf));
+    memcpy(buf, data, size);
+
+    // Echo: validity matches the reference, and a valid header re-encodes to the same bytes
+    int valid, end;
+    reference_echo(data, size, &valid, &end);
+    struct wire_echo m = wire_echo_decode(buf, size);
+    check(m.valid == valid, "echo validity", data, size);
+    check(m.end == end, "echo END detection", data, size);
+    if (m.valid) {
+        uint8_t out[FUZZ_MAX_INPUT + WIRE_ECHO_MIN_BUFFER];
+        memcpy(out, buf, sizeof(out));
+        size_t len = m.end ? wire_echo_encode_end(out, m.sequence, m.timestamp)
+                           : wire_echo_encode(out, m.sequence, m.timestamp, size - WIRE_ECHO_HEADER_SIZE);
+        check(len == size && memcmp(out, data, size) == 0, "echo round trip", data, size);
+    }
+
+    // Calculator messages: decode then encode reproduces the input
+    if (size >= WIRE_CALC_REQUEST_SIZE) {
+        uint8_t out[WIRE_CALC_REQUEST_SIZE];
+        struct wire_calc c = wire_calc_decode_request(data);
+        wire_calc_encode_request(out, c.op, c.a, c.b);
+        check(memcmp(out, data, WIRE_CALC_REQUEST_SIZE) == 0, "calc request round trip", data, size);
+    }
+    if (size >= WIRE_CALC_RESPONSE_SIZE) {
+        uint8_t out[WIRE_CALC_RESPONSE_SIZE];
+        struct wire_calc c = wire_calc_decode_response(data);
+        wire_calc_encode_response(out, c.op, c.a, c.b, c.result, c.valid);
+        check(memcmp(out, data, WIRE_CALC_RESPONSE_SIZE) == 0, "calc response round trip", data, size);
+    }
+    if (size >= WIRE_BATCH_HEADER_SIZE) {
+        uint8_t out[WIRE_BATCH_HEADER_SIZE];
+        wire_batch_encode_header(out, data[0], (char)data[1], wire_batch_count(data));
+        check(memcmp(out, data, WIRE_BATCH_HEADER_SIZE) == 0, "batch header round trip", data, size);
+        check(wire_batch_count(data) == ((uint32_t)data[2] << 24 | (uint32_t)data[3] << 16 | (uint32_t)data[4] << 8 | data[5]),
+              "batch count byte order", data, size);
+    }
+    return 0;
+}
+
+#ifndef WIRE_FUZZ_LIBFUZZER
+static uint64_t fuzz_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+int main(int argc, char *argv[]) {
+    static uint8_t data[FUZZ_MAX_INPUT];
+
+    // Replay inputs saved by libFuzzer
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            FILE *f = fopen(argv[i], "rb");
+            if (f == NULL) {
+                perror(argv[i]);
+                return EXIT_FAILURE;
+            }
+            size_t size = fread(data, 1, sizeof(data), f);
+            fclose(f);
+            LLVMFuzzerTestOneInput(data, size);
+        }
+        printf("%d inputs passed\n", argc - 1);
+        return 0;
+    }
+
+    // Random inputs, half of them given a consistent length field so valid paths are exercised
+    uint64_t state = 0x2545F4914F6CDD1Dull;
+    for (long i = 0; i < FUZZ_ITERATIONS; i++) {
+        size_t size = fuzz_random(&state) % 64;
+        if (i % 16 == 0) {
+            size = fuzz_random(&state) % FUZZ_MAX_INPUT;
+        }
+        for (size_t j = 0; j < size; j++) {
+            data[j] = (uint8_t)fuzz_random(&state);
+        }
+        if ((i & 1) && size >= 2) {
+            data[0] = (uint8_t)(size >> 8);
+            data[1] = (uint8_t)size;
+            if (size == WIRE_ECHO_END_SIZE && (i & 2)) {
+                memcpy(data + WIRE_ECHO_HEADER_SIZE, "END", 3);
+            }
+        }
+        LLVMFuzzerTestOneInput(data, size);
+    }
+    printf("%d random inputs passed\n", FUZZ_ITERATIONS);
+    return 0;
+}
+#endif